@@ -0,0 +1,479 @@
+/* align.c: SDcard allocation unit (erase block) alignment
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+
+ SDcards are written internally in "allocation units" (AU, erase blocks)
+ of typically 4MB. A partition which does not start on an AU boundary
+ forces the card to read-modify-write two AUs for every write crossing it.
+
+ - align_probe_au_size(): get AU size of a card from sysfs
+ - align_check_targets(): report misaligned "sdSectorStart" of targets
+ - align_plan_layout(): repack targets to AU boundaries
+ - align_write(): write a range as unaligned head, AU aligned middle and
+   unaligned tail. Head and tail can be merged with the card data
+   around them, so the card sees only whole AU writes.
+   Optionally each chunk is read back from the card and compared,
+   some chunks behind the write cursor.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <linux/limits.h>
+
+#include "error.h"
+#include "utils.h"
+#include "config.h"
+#include "bufpool.h"
+#include "cache.h"
+#include "wbehind.h"
+#include "align.h"	// own
+
+// read a single decimal number from a sysfs attribute file
+// result: value, or 0 if not available
+static int64_t read_sysfs_value(char *dir, char *attr) {
+	char path[PATH_MAX];
+	FILE *f;
+	long long val = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	if (fscanf(f, "%lld", &val) != 1)
+		val = 0;
+	fclose(f);
+	return val;
+}
+
+/* determine AU size of SDcard "device_filename", like "/dev/mmcblk0"
+ * SD readers on the MMC bus publish it as "preferred_erase_size",
+ * USB readers give at most a discard granularity.
+ * result: AU size in bytes, 0 if unknown
+ */
+int64_t align_probe_au_size(char *device_filename) {
+	char realdev[PATH_MAX];
+	char sysdir[PATH_MAX];
+	char path[PATH_MAX];
+	char *name;
+	int64_t au_size;
+
+	if (!realpath(device_filename, realdev))
+		return 0;
+	name = basename(realdev);
+	snprintf(path, sizeof(path), "/sys/class/block/%s", name);
+	if (!realpath(path, sysdir))
+		return 0; // not a block device
+	// a partition: settings are in the parent disk
+	if (snprintf(path, sizeof(path), "%s/partition", sysdir)
+			>= (int) sizeof(path))
+		return 0;
+	if (access(path, F_OK) == 0)
+		strcpy(sysdir, dirname(sysdir));
+
+	au_size = read_sysfs_value(sysdir, "device/preferred_erase_size");
+	if (au_size <= SD_SECTOR_SIZE)
+		au_size = read_sysfs_value(sysdir, "queue/discard_granularity");
+	if (au_size <= SD_SECTOR_SIZE)
+		return 0;
+	return au_size;
+}
+
+// enabled targets, sorted by position on SDcard
+static int get_targets_by_offset(config_scsitarget_t *list[]) {
+	int i, j, n = 0;
+	for (i = 0; i < MAX_SCSITARGETS; i++) {
+		config_scsitarget_t *st = &config_scsitargets[i];
+		if (!st->enabled)
+			continue;
+		// insertion sort
+		for (j = n; j > 0 && list[j - 1]->sectorStart > st->sectorStart; j--)
+			list[j] = list[j - 1];
+		list[j] = st;
+		n++;
+	}
+	return n;
+}
+
+/* print alignment of all enabled targets in the loaded config
+ * result: count of targets not starting on an AU boundary
+ */
+int align_check_targets(FILE *fout, int64_t au_size) {
+	config_scsitarget_t *list[MAX_SCSITARGETS];
+	int i, n;
+	int misaligned = 0;
+
+	n = get_targets_by_offset(list);
+	fprintf(fout, "Alignment of SCSI targets to AU size %ld bytes = %ld sectors:\n",
+			au_size, au_size / SD_SECTOR_SIZE);
+	for (i = 0; i < n; i++) {
+		config_scsitarget_t *st = list[i];
+		int64_t offset = config_scsitarget_offset(st);
+		int64_t end = offset + config_scsitarget_size(st);
+		int64_t start_err = offset % au_size;
+
+		fprintf(fout, "  SCSI ID %d: sectorStart=%d, offset = %ld bytes",
+				st->targetId, st->sectorStart, offset);
+		if (start_err) {
+			misaligned++;
+			fprintf(fout, ", MISALIGNED by %ld bytes (next AU at sector %ld)\n",
+					start_err, (offset - start_err + au_size) / SD_SECTOR_SIZE);
+		} else
+			fprintf(fout, ", aligned\n");
+		if (i + 1 < n && end > config_scsitarget_offset(list[i + 1]))
+			fprintf(fout, "    OVERLAPS SCSI ID %d!\n", list[i + 1]->targetId);
+	}
+	fprintf(fout, "%d of %d targets misaligned.\n", misaligned, n);
+	return misaligned;
+}
+
+/* repack all enabled targets onto AU boundaries, keeping their order.
+ * planned_size[target_id]: new size in bytes, or 0 to keep the current size.
+ * card_size: if > 0, layout must fit.
+ * config_scsitargets[] are updated, save them with config_save().
+ * result: 0 = OK, else error
+ */
+int align_plan_layout(int64_t au_size, int64_t planned_size[], int64_t card_size) {
+	config_scsitarget_t *list[MAX_SCSITARGETS];
+	int i, n;
+	int64_t cursor = 0; // next free byte on SDcard
+
+	if (au_size <= 0 || au_size % SD_SECTOR_SIZE)
+		return error_set(ERROR_ILLPARAMVAL,
+				"AU size %ld is not a multiple of %d", au_size, SD_SECTOR_SIZE);
+
+	n = get_targets_by_offset(list);
+	for (i = 0; i < n; i++) {
+		config_scsitarget_t *st = list[i];
+		int64_t size = planned_size[st->targetId];
+		if (size > 0) // round up to whole target sectors
+			st->sectors = (size + st->bytesPerSector - 1) / st->bytesPerSector;
+		cursor = (cursor + au_size - 1) / au_size * au_size;
+		st->sectorStart = cursor / SD_SECTOR_SIZE;
+		cursor += config_scsitarget_size(st);
+	}
+	if (card_size > 0 && cursor > card_size)
+		return error_set(ERROR_ILLPARAMVAL,
+				"Planned layout needs %ld bytes, SDcard has only %ld", cursor,
+				card_size);
+	return 0;
+}
+
+// progress within [0, size]
+static int64_t clip_progress(int64_t done, int64_t size) {
+	if (done < 0)
+		return 0;
+	if (done > size)
+		return size;
+	return done;
+}
+
+/* merge a partial AU with the card data around it, and write the whole AU.
+ * buffer holds the AU, the range [data_start, data_end) is already filled
+ * with image data. Offsets are relative to the AU.
+ */
+static int write_merged_au(int fd_card, int64_t au_offset, int64_t au_size,
+		int64_t card_size, char *buffer, int64_t data_start, int64_t data_end) {
+	int64_t au_len = au_size;
+	if (card_size > 0 && au_offset + au_len > card_size)
+		au_len = card_size - au_offset; // last AU of card is partial
+	if (data_start > 0
+			&& pread_full(fd_card, buffer, data_start, au_offset) < 0)
+		return error_set(ERROR_HOSTFILE, "SDcard read failed at %ld",
+				au_offset);
+	if (data_end < au_len
+			&& pread_full(fd_card, buffer + data_end, au_len - data_end,
+					au_offset + data_end) < 0)
+		return error_set(ERROR_HOSTFILE, "SDcard read failed at %ld",
+				au_offset + data_end);
+	if (pwrite_full(fd_card, buffer, au_len, au_offset) < 0)
+		return error_set(ERROR_HOSTFILE, "SDcard write failed at %ld",
+				au_offset);
+	return 0;
+}
+
+// a written chunk, waiting for read back verify
+typedef struct {
+	char *buffer; // pool buffer
+	char *data; // written data in buffer
+	int64_t offset; // on card
+	int64_t len;
+	char *img_data; // image part of written data, for the tee
+	int64_t img_len;
+	int64_t img_position; // in tee stream
+} pending_verify_t;
+
+/* read back a written chunk from the card and compare.
+ * The chunk is first made durable. "fd_verify" should bypass the page
+ * cache with O_DIRECT; if it was opened without, or O_DIRECT fails,
+ * the cached pages are dropped before reading.
+ */
+static int verify_chunk(int fd_card, align_write_params_t *params,
+		pending_verify_t *pv, char *verify_buffer) {
+	if (sync_file_range(fd_card, pv->offset, pv->len,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+					| SYNC_FILE_RANGE_WAIT_AFTER) < 0)
+		return error_set(ERROR_HOSTFILE, "sync_file_range failed, errno = %d",
+				errno);
+	if (!(fcntl(params->fd_verify, F_GETFL) & O_DIRECT))
+		posix_fadvise(params->fd_verify, pv->offset, pv->len,
+				POSIX_FADV_DONTNEED);
+	if (pread_full(params->fd_verify, verify_buffer, pv->len, pv->offset) < 0) {
+		if (errno != EINVAL)
+			return error_set(ERROR_HOSTFILE,
+					"SDcard read back failed at %ld, errno = %d", pv->offset,
+					errno);
+		// O_DIRECT not possible: drop cached pages, read buffered
+		posix_fadvise(fd_card, pv->offset, pv->len, POSIX_FADV_DONTNEED);
+		if (pread_full(fd_card, verify_buffer, pv->len, pv->offset) < 0)
+			return error_set(ERROR_HOSTFILE,
+					"SDcard read back failed at %ld, errno = %d", pv->offset,
+					errno);
+	}
+	if (memcmp(verify_buffer, pv->data, pv->len) && params->mismatch_offset < 0) {
+		params->mismatch_offset = pv->offset;
+		params->mismatch_size = pv->len;
+	}
+	return 0;
+}
+
+// buffer not needed any more: to the tee, or back to the pool
+static void release_buffer(align_write_params_t *params,
+		pending_verify_t *pv) {
+	if (params->tee)
+		tee_put(params->tee, pv->img_position, pv->buffer, pv->img_data,
+				pv->img_len, 0);
+	else
+		bufpool_put(pv->buffer);
+}
+
+/* read image data. With a transform, "img_offset" is in card layout,
+ * with a disk image container it is a disk offset.
+ * result: 0 = OK, else error
+ */
+static int read_image(align_write_params_t *params, int fd_img, char *buffer,
+		int64_t len, int64_t img_offset, char *scratch) {
+	if (params->read)
+		return params->read(params->read_context, buffer, len, img_offset);
+	if (params->transform)
+		return transform_read(params->transform, fd_img, buffer, len,
+				img_offset, scratch);
+	if (params->vdisk)
+		return vdisk_pread(params->vdisk, fd_img, buffer, len, img_offset);
+	return pread_full(fd_img, buffer, len, img_offset) < 0;
+}
+
+/* write "size" bytes from image file to SDcard.
+ * The range is split into
+ * - an unaligned head up to the first AU boundary,
+ * - AU aligned chunks of several MB,
+ * - an unaligned tail after the last AU boundary.
+ * If "params->merge" is set, head and tail are combined with the existing
+ * card data of their AU, else they are written as they are.
+ * Image data behind end of file is written as zeros.
+ * If "params->transform" is set, the image is converted to card layout.
+ * Page cache hints for the image and write-behind for the card are
+ * controlled by "params". Progress reports data durable on the card.
+ * If "params->fd_verify" is valid, each chunk is read back and compared
+ * "params->verify_lag" chunks behind the write cursor, while later
+ * chunks are still in writeback. A mismatch is no error,
+ * see "params->mismatch_offset".
+ * If "params->tee" is set, the image data goes to its sinks in order,
+ * after write and read back. Not with a transform.
+ *
+ * result: 0 = OK, else error
+ */
+int align_write(int fd_card, int64_t card_offset, int fd_img,
+		int64_t img_offset, int64_t size, align_write_params_t *params,
+		align_progress_func_t progress, void *progress_context) {
+	int64_t au_size = params->au_size;
+	int64_t chunk_size, card_size;
+	int64_t pos = card_offset; // position on card
+	int64_t end = card_offset + size;
+	int verify = params->fd_verify >= 0;
+	unsigned lag = params->verify_lag;
+	unsigned buffer_count = 1;
+	char *buffer = NULL;
+	char *verify_buffer = NULL;
+	char *scratch = NULL; // for the transform
+	unsigned scratch_count = params->transform ? 1 : 0;
+	pending_verify_t pending[ALIGN_MAX_VERIFY_LAG + 1];
+	unsigned pending_count = 0;
+	cache_stream_t img_cache;
+	wbehind_t card_wb;
+	int res = 0;
+
+	if (au_size <= 0 || au_size % SD_SECTOR_SIZE)
+		return error_set(ERROR_ILLPARAMVAL,
+				"AU size %ld is not a multiple of %d", au_size, SD_SECTOR_SIZE);
+	params->mismatch_offset = -1;
+	if (lag > ALIGN_MAX_VERIFY_LAG)
+		lag = ALIGN_MAX_VERIFY_LAG;
+	if (verify) // chunks in flight, one being written, one read back
+		buffer_count = lag + 2;
+	buffer_count += scratch_count;
+	if (params->buffer_share > 1)
+		buffer_count *= params->buffer_share;
+	if (params->tee) // the tee keeps buffers in its ring
+		buffer_count += TEE_RING_SIZE;
+	// several AUs, but at least one, even if above memory cap
+	chunk_size = bufpool_fit(ALIGN_WRITE_CHUNK_SIZE, buffer_count) / au_size
+			* au_size;
+	if (chunk_size < au_size)
+		chunk_size = au_size;
+	if (verify) {
+		// all buffers of the read back window must fit under the memory
+		// cap at the same time, else bufpool_get() waits for ever
+		unsigned fit = bufpool_count(chunk_size);
+		if (params->buffer_share > 1)
+			fit /= params->buffer_share;
+		if (fit < 2 + scratch_count)
+			return error_set(ERROR_ILLPARAMVAL,
+					"Memory cap too small to read back chunks of %ld bytes",
+					chunk_size);
+		if (lag > fit - 2 - scratch_count) {
+			lag = fit - 2 - scratch_count;
+			info("Verify lag reduced to %u chunks by memory cap", lag);
+		}
+	}
+	card_size = device_size(fd_card);
+	if (verify)
+		verify_buffer = bufpool_get(chunk_size);
+	else
+		buffer = bufpool_get(chunk_size);
+	if (params->transform)
+		scratch = bufpool_get(chunk_size);
+	// image offsets of a transform or container are no file positions
+	cache_stream_init(&img_cache, fd_img, img_offset, size,
+			params->transform || params->vdisk ?
+					CACHE_POLICY_KEEP : params->cache_policy);
+	// a merged head starts writing at its AU
+	wbehind_init(&card_wb, fd_card,
+			params->merge ? card_offset - card_offset % au_size : card_offset,
+			params->dirty_window, cache_policy_active(params->cache_policy, size));
+
+	while (!res && pos < end) {
+		int64_t au_offset = pos - pos % au_size;
+		int64_t len;
+		int64_t written_start, written_end; // card written here
+		char *written_data;
+		char *img_data;
+
+		if (verify) // keep written data until read back
+			buffer = bufpool_get(chunk_size);
+		if (pos % au_size || end - pos < au_size) {
+			// unaligned head, or tail: at most up to next AU boundary
+			len = au_offset + au_size - pos;
+			if (len > end - pos)
+				len = end - pos;
+			written_start = pos;
+			written_end = pos + len;
+			written_data = img_data = buffer + (pos - au_offset);
+			if (read_image(params, fd_img, buffer + (pos - au_offset), len,
+					img_offset + (pos - card_offset), scratch))
+				res = error_set(ERROR_HOSTFILE, "Image file read failed");
+			else if (params->merge) {
+				res = write_merged_au(fd_card, au_offset, au_size, card_size,
+						buffer, pos - au_offset, pos - au_offset + len);
+				written_start = au_offset;
+				written_end = au_offset + au_size;
+				if (card_size > 0 && written_end > card_size)
+					written_end = card_size;
+				written_data = buffer;
+			} else if (pwrite_full(fd_card, buffer + (pos - au_offset), len,
+					pos) < 0)
+				res = error_set(ERROR_HOSTFILE, "SDcard write failed at %ld",
+						pos);
+		} else {
+			// aligned middle: whole AUs
+			len = (end - pos) / au_size * au_size;
+			if (len > chunk_size)
+				len = chunk_size;
+			written_start = pos;
+			written_end = pos + len;
+			written_data = img_data = buffer;
+			if (read_image(params, fd_img, buffer, len,
+					img_offset + (pos - card_offset), scratch))
+				res = error_set(ERROR_HOSTFILE, "Image file read failed");
+			else if (pwrite_full(fd_card, buffer, len, pos) < 0)
+				res = error_set(ERROR_HOSTFILE, "SDcard write failed at %ld",
+						pos);
+		}
+		if (!res)
+			res = wbehind_advance(&card_wb, written_end);
+		if (verify) {
+			pending_verify_t *pv = &pending[pending_count++];
+			pv->buffer = buffer;
+			pv->data = written_data;
+			pv->offset = written_start;
+			pv->len = written_end - written_start;
+			pv->img_data = img_data;
+			pv->img_len = len;
+			pv->img_position = params->tee_position + (pos - card_offset);
+			// read back the oldest chunk, when enough are in flight
+			if (!res && pending_count > lag) {
+				res = verify_chunk(fd_card, params, &pending[0], verify_buffer);
+				release_buffer(params, &pending[0]);
+				memmove(&pending[0], &pending[1],
+						--pending_count * sizeof(pending[0]));
+			}
+		} else if (!res && params->tee)
+			buffer = tee_put(params->tee,
+					params->tee_position + (pos - card_offset), buffer,
+					img_data, len, chunk_size);
+		pos += len;
+		cache_stream_advance(&img_cache, img_offset + (pos - card_offset));
+		if (progress && !res
+				&& progress(progress_context,
+						clip_progress(wbehind_durable(&card_wb) - card_offset,
+								size), size))
+			res = error_set(ERROR_CANCELED, "Write canceled");
+	}
+	if (!res)
+		res = wbehind_finish(&card_wb);
+	// read back the rest
+	while (pending_count > 0) {
+		if (!res)
+			res = verify_chunk(fd_card, params, &pending[0], verify_buffer);
+		if (res) // data may be incomplete
+			bufpool_put(pending[0].buffer);
+		else
+			release_buffer(params, &pending[0]);
+		memmove(&pending[0], &pending[1], --pending_count * sizeof(pending[0]));
+	}
+	if (progress && !res)
+		progress(progress_context, size, size);
+	cache_stream_finish(&img_cache);
+	if (verify)
+		bufpool_put(verify_buffer);
+	else
+		bufpool_put(buffer);
+	bufpool_put(scratch);
+	return res;
+}
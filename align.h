@@ -0,0 +1,82 @@
+/* align.h: SDcard allocation unit (erase block) alignment
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+ */
+
+#ifndef ALIGN_H_
+#define ALIGN_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "transform.h"
+#include "tee.h"
+#include "vdisk.h"
+
+// used if the AU size can not be determined from the card.
+// 4MB is the largest AU of SDHC cards, so any smaller AU divides it.
+#define ALIGN_DEFAULT_AU_SIZE	(4 * 1024 * 1024)
+
+// AU aligned writes are done in chunks of at least this size
+#define ALIGN_WRITE_CHUNK_SIZE	(8 * 1024 * 1024)
+// max chunks written before their read back verify
+#define ALIGN_MAX_VERIFY_LAG	16
+
+// reads image data instead of "fd_img".
+// result: 0 = OK, else error
+typedef int (*align_read_func_t)(void *context, char *buffer, int64_t len,
+		int64_t img_offset);
+
+// how align_write() works
+typedef struct {
+	int64_t au_size;
+	int merge; // merge unaligned head and tail with card data
+	int cache_policy; // page cache hints for image, CACHE_POLICY_*
+	int64_t dirty_window; // write-behind window for card, 0 = off
+	unsigned buffer_share; // count of parallel align_write() users
+	transform_t *transform; // image layout, NULL = as card
+	vdisk_t *vdisk; // image is a disk image container, NULL = raw file
+	align_read_func_t read; // image from this function, NULL = "fd_img"
+	void *read_context;
+	tee_t *tee; // image data also to these sinks, NULL = none
+	int64_t tee_position; // stream position of card_offset
+
+	// read back verify, interleaved with writing
+	int fd_verify; // card opened with O_DIRECT, < 0 = no verify
+	unsigned verify_lag; // chunks written before read back
+	int64_t mismatch_offset; // result: card offset of bad chunk, -1 = OK
+	int64_t mismatch_size;
+} align_write_params_t;
+
+// called after each written chunk. result: 0 = continue, else cancel
+typedef int (*align_progress_func_t)(void *context, int64_t done,
+		int64_t total);
+
+int64_t align_probe_au_size(char *device_filename);
+int align_check_targets(FILE *fout, int64_t au_size);
+int align_plan_layout(int64_t au_size, int64_t planned_size[], int64_t card_size);
+int align_write(int fd_card, int64_t card_offset, int fd_img,
+		int64_t img_offset, int64_t size, align_write_params_t *params,
+		align_progress_func_t progress, void *progress_context);
+
+#endif /* ALIGN_H_ */
@@ -0,0 +1,226 @@
+/* bufpool.c: pool of aligned transfer buffers
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+
+ All transfer engines get their buffers here, instead of using the stack.
+ Buffers are page aligned (usable for O_DIRECT) and are kept for reuse
+ after bufpool_put().
+ The sum of all buffers is limited by a memory cap: bufpool_get() waits
+ until other threads return buffers. bufpool_fit() sizes buffers so that
+ a single user can get all it needs, bufpool_count() tells how many it
+ can hold.
+ Optionally, buffers are backed by huge pages.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "error.h"
+#include "bufpool.h"	// own
+
+typedef struct {
+	char *data;
+	size_t size; // allocated size
+	int in_use;
+	unsigned last_use; // for LRU release
+} bufpool_entry_t;
+
+static bufpool_entry_t entries[BUFPOOL_MAX_BUFFERS];
+static int entry_count = 0;
+static int64_t mem_cap = BUFPOOL_DEFAULT_MEM_CAP;
+static unsigned users = 1; // operations sharing the cap
+static int hugepages = BUFPOOL_HUGEPAGES_OFF;
+static int64_t mem_allocated = 0; // sum of all entries
+static int64_t mem_in_use = 0; // sum of entries in use
+static unsigned use_counter = 0;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t buffer_returned = PTHREAD_COND_INITIALIZER;
+
+// set memory cap and hugepage mode. Call before first bufpool_get()
+void bufpool_init(int64_t _mem_cap, int _hugepages) {
+	pthread_mutex_lock(&mutex);
+	mem_cap = _mem_cap;
+	hugepages = _hugepages;
+	pthread_mutex_unlock(&mutex);
+}
+
+/* "count" operations run in parallel, each with own buffers.
+ * bufpool_fit() and bufpool_count() give each its part of the cap,
+ * so none waits for buffers held by another one.
+ * Operations already running keep their sizes.
+ */
+void bufpool_share(unsigned count) {
+	pthread_mutex_lock(&mutex);
+	users = count < 1 ? 1 : count;
+	pthread_mutex_unlock(&mutex);
+}
+
+// memory cap of one operation
+static int64_t user_cap(void) {
+	return mem_cap / __atomic_load_n(&users, __ATOMIC_RELAXED);
+}
+
+/* reduce a buffer size, so "count" buffers fit under the memory cap
+ * of one operation. result is a multiple of BUFPOOL_ALIGNMENT.
+ */
+size_t bufpool_fit(size_t size, unsigned count) {
+	size_t max_size = user_cap() / count;
+	if (size > max_size)
+		size = max_size;
+	size -= size % BUFPOOL_ALIGNMENT;
+	if (size < BUFPOOL_MIN_BUFFER_SIZE)
+		size = BUFPOOL_MIN_BUFFER_SIZE;
+	return size;
+}
+
+// round up to pages, or huge pages, as allocated
+static size_t round_size(size_t size) {
+	if (hugepages != BUFPOOL_HUGEPAGES_OFF && size >= BUFPOOL_HUGEPAGE_SIZE)
+		return (size + BUFPOOL_HUGEPAGE_SIZE - 1) / BUFPOOL_HUGEPAGE_SIZE
+				* BUFPOOL_HUGEPAGE_SIZE;
+	return (size + BUFPOOL_ALIGNMENT - 1) / BUFPOOL_ALIGNMENT
+			* BUFPOOL_ALIGNMENT;
+}
+
+/* how many buffers of "size" bytes one operation can hold at the same
+ * time. At least 1, a single buffer is always allowed.
+ */
+unsigned bufpool_count(size_t size) {
+	int64_t count = user_cap() / (int64_t) round_size(size);
+	return count < 1 ? 1 : (unsigned) count;
+}
+
+static char *alloc_memory(size_t size) {
+	char *data;
+	if (hugepages == BUFPOOL_HUGEPAGES_HUGETLB) {
+		data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (data != MAP_FAILED)
+			return data;
+		// no hugetlbfs pages reserved: try transparent huge pages
+	}
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED)
+		return NULL;
+	if (hugepages != BUFPOOL_HUGEPAGES_OFF)
+		madvise(data, size, MADV_HUGEPAGE);
+	return data;
+}
+
+// unmap the least recently used free buffer. result: 0 if none free
+static int release_lru_entry(void) {
+	int i, lru = -1;
+	for (i = 0; i < entry_count; i++)
+		if (!entries[i].in_use
+				&& (lru < 0 || entries[i].last_use < entries[lru].last_use))
+			lru = i;
+	if (lru < 0)
+		return 0;
+	munmap(entries[lru].data, entries[lru].size);
+	mem_allocated -= entries[lru].size;
+	entries[lru] = entries[--entry_count];
+	return 1;
+}
+
+/* get a buffer of at least "size" bytes.
+ * Waits while the memory cap is exhausted, or all table entries are
+ * held, by buffers of other threads.
+ */
+void *bufpool_get(size_t size) {
+	int i, best;
+	bufpool_entry_t *entry;
+
+	size = round_size(size);
+	pthread_mutex_lock(&mutex);
+	for (;;) {
+		// reuse the smallest free buffer which is big enough,
+		// but do not waste memory on much bigger ones
+		best = -1;
+		for (i = 0; i < entry_count; i++)
+			if (!entries[i].in_use && entries[i].size >= size
+					&& entries[i].size <= 2 * size
+					&& (best < 0 || entries[i].size < entries[best].size))
+				best = i;
+		if (best >= 0) {
+			entry = &entries[best];
+			break;
+		}
+		// make room for a new buffer by dropping unused ones
+		while (mem_allocated + (int64_t) size > mem_cap
+				&& release_lru_entry())
+			;
+		// table full of unused buffers with other sizes
+		if (entry_count == BUFPOOL_MAX_BUFFERS)
+			release_lru_entry();
+		// always allow a single buffer, even if bigger than the cap
+		if ((mem_allocated + (int64_t) size <= mem_cap || mem_in_use == 0)
+				&& entry_count < BUFPOOL_MAX_BUFFERS) {
+			entry = &entries[entry_count];
+			entry->data = alloc_memory(size);
+			if (!entry->data) {
+				pthread_mutex_unlock(&mutex);
+				fatal("Can not allocate buffer of %lu bytes", size);
+			}
+			entry->size = size;
+			entry_count++;
+			mem_allocated += size;
+			break;
+		}
+		pthread_cond_wait(&buffer_returned, &mutex);
+	}
+	entry->in_use = 1;
+	entry->last_use = ++use_counter;
+	mem_in_use += entry->size;
+	pthread_mutex_unlock(&mutex);
+	return entry->data;
+}
+
+// give a buffer back to the pool
+void bufpool_put(void *buffer) {
+	int i;
+	if (!buffer)
+		return;
+	pthread_mutex_lock(&mutex);
+	for (i = 0; i < entry_count; i++)
+		if (entries[i].data == buffer) {
+			entries[i].in_use = 0;
+			mem_in_use -= entries[i].size;
+			break;
+		}
+	pthread_cond_broadcast(&buffer_returned);
+	pthread_mutex_unlock(&mutex);
+}
+
+// unmap all free buffers
+void bufpool_release(void) {
+	pthread_mutex_lock(&mutex);
+	while (release_lru_entry())
+		;
+	pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,51 @@
+/* bufpool.h: pool of aligned transfer buffers
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+ */
+
+#ifndef BUFPOOL_H_
+#define BUFPOOL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BUFPOOL_ALIGNMENT	4096	// for O_DIRECT
+#define BUFPOOL_HUGEPAGE_SIZE	(2 * 1024 * 1024)
+#define BUFPOOL_MAX_BUFFERS	64
+#define BUFPOOL_DEFAULT_MEM_CAP	(256 * 1024 * 1024)
+#define BUFPOOL_MIN_BUFFER_SIZE	(64 * 1024)
+
+// hugepage backing
+#define BUFPOOL_HUGEPAGES_OFF	0
+#define BUFPOOL_HUGEPAGES_THP	1	// transparent huge pages, madvise()
+#define BUFPOOL_HUGEPAGES_HUGETLB	2	// MAP_HUGETLB, falls back to THP
+
+void bufpool_init(int64_t mem_cap, int hugepages);
+void bufpool_share(unsigned count);
+size_t bufpool_fit(size_t size, unsigned count);
+unsigned bufpool_count(size_t size);
+void *bufpool_get(size_t size);
+void bufpool_put(void *buffer);
+void bufpool_release(void);
+
+#endif /* BUFPOOL_H_ */
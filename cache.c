@@ -0,0 +1,117 @@
+/* cache.c: page cache hints for streamed data
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+
+ Data of a card partition or a multi GB image is read exactly once.
+ Without hints, it fills the page cache and pushes out the working set
+ of other services on the host.
+ A cache stream follows the read cursor of a transfer:
+ - POSIX_FADV_SEQUENTIAL for the whole range,
+ - POSIX_FADV_WILLNEED for a window in front of the cursor,
+ - POSIX_FADV_DONTNEED for the consumed range behind it.
+ */
+#define CACHE_C_
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "cache.h"	// own
+
+// pages released with DONTNEED, all streams
+int64_t cache_pages_dropped = 0;
+
+static char *policy_names[] = { "keep", "drop", "auto", NULL };
+
+// result: CACHE_POLICY_*, or -1 if unknown
+int cache_parse_policy(char *name) {
+	int i;
+	for (i = 0; policy_names[i]; i++)
+		if (!strcasecmp(name, policy_names[i]))
+			return i;
+	return -1;
+}
+
+// does "policy" drop pages for a transfer of "size" bytes?
+int cache_policy_active(int policy, int64_t size) {
+	if (policy == CACHE_POLICY_AUTO)
+		return size >= CACHE_AUTO_MIN_SIZE;
+	return policy == CACHE_POLICY_DROP;
+}
+
+// start hinting for reading [offset, offset+size) of "fd"
+void cache_stream_init(cache_stream_t *cs, int fd, int64_t offset,
+		int64_t size, int policy) {
+	cs->fd = -1;
+	if (!cache_policy_active(policy, size))
+		return;
+	cs->fd = fd;
+	cs->end = offset + size;
+	cs->hinted_until = offset;
+	cs->dropped_until = offset;
+	posix_fadvise(fd, offset, size, POSIX_FADV_SEQUENTIAL);
+	cache_stream_advance(cs, offset);
+}
+
+/* data up to "pos" has been consumed.
+ * Hints are given in steps of half the read ahead window,
+ * to keep the syscall count low.
+ */
+void cache_stream_advance(cache_stream_t *cs, int64_t pos) {
+	int64_t step = CACHE_READAHEAD_SIZE / 2;
+	long page_size;
+
+	if (cs->fd < 0)
+		return;
+	if (pos + step > cs->hinted_until && cs->hinted_until < cs->end) {
+		int64_t until = pos + CACHE_READAHEAD_SIZE;
+		if (until > cs->end)
+			until = cs->end;
+		posix_fadvise(cs->fd, cs->hinted_until, until - cs->hinted_until,
+				POSIX_FADV_WILLNEED);
+		cs->hinted_until = until;
+	}
+	// length 0 would mean "up to end of file"
+	if (pos > cs->dropped_until
+			&& (pos - cs->dropped_until >= step || pos >= cs->end)) {
+		page_size = sysconf(_SC_PAGESIZE);
+		posix_fadvise(cs->fd, cs->dropped_until, pos - cs->dropped_until,
+				POSIX_FADV_DONTNEED);
+		__atomic_add_fetch(&cache_pages_dropped,
+				(pos - cs->dropped_until + page_size - 1) / page_size,
+				__ATOMIC_RELAXED);
+		cs->dropped_until = pos;
+	}
+}
+
+// range completely consumed: drop the rest
+void cache_stream_finish(cache_stream_t *cs) {
+	if (cs->fd < 0)
+		return;
+	cache_stream_advance(cs, cs->end);
+	cs->fd = -1;
+}
@@ -0,0 +1,59 @@
+/* cache.h: page cache hints for streamed data
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+ */
+
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <stdint.h>
+
+#define CACHE_POLICY_KEEP	0	// normal page cache use
+#define CACHE_POLICY_DROP	1	// read ahead, drop consumed pages
+#define CACHE_POLICY_AUTO	2	// DROP for large transfers
+
+// "auto" drops for transfers at least this big
+#define CACHE_AUTO_MIN_SIZE	(64 * 1024 * 1024)
+// read ahead window in front of the cursor
+#define CACHE_READAHEAD_SIZE	(16 * 1024 * 1024)
+
+// hint state for reading one file range sequentially
+typedef struct {
+	int fd; // < 0: disabled
+	int64_t end; // absolute end of range
+	int64_t hinted_until; // WILLNEED issued up to here
+	int64_t dropped_until; // DONTNEED issued up to here
+} cache_stream_t;
+
+#ifndef CACHE_C_
+extern int64_t cache_pages_dropped;
+#endif
+
+int cache_parse_policy(char *name);
+int cache_policy_active(int policy, int64_t size);
+void cache_stream_init(cache_stream_t *cs, int fd, int64_t offset,
+		int64_t size, int policy);
+void cache_stream_advance(cache_stream_t *cs, int64_t pos);
+void cache_stream_finish(cache_stream_t *cs);
+
+#endif /* CACHE_H_ */
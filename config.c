@@ -41,8 +41,9 @@
 /// result list. unsorted
 config_scsitarget_t config_scsitargets[MAX_SCSITARGETS];
 
-// code to parse one drive entry
-config_scsitarget_t *parseScsiTarget(xmlDocPtr doc, xmlNodePtr cur) {
+// code to parse one drive entry into "targets"
+config_scsitarget_t *parseScsiTarget(xmlDocPtr doc, xmlNodePtr cur,
+		config_scsitarget_t *targets) {
 	xmlAttrPtr attr;
 	config_scsitarget_t *result = NULL;
 
@@ -56,7 +57,7 @@ config_scsitarget_t *parseScsiTarget(xmlDocPtr doc, xmlNodePtr cur) {
 		id = strtol(prop_id, NULL, 0);
 		if (id < 0 || id >= MAX_SCSITARGETS)
 			return NULL; // error
-		result = &(config_scsitargets[id]);
+		result = &(targets[id]);
 		result->targetId = id;
 	}
 
@@ -110,19 +111,28 @@ config_scsitarget_t *parseScsiTarget(xmlDocPtr doc, xmlNodePtr cur) {
 	return result;
 }
 
-/* load list of scsitargets from XML
+/* load list of scsitargets from XML into global config_scsitargets[]
+ *
+ * result= 0 = OK, else error
+ */
+int config_load(char *docname) {
+	return config_load_targets(docname, config_scsitargets);
+}
+
+/* load list of scsitargets from XML into "targets[MAX_SCSITARGETS]"
+ * Used if more than one layout is needed, like for card to card clones.
  *
  * see http://xmlsoft.org/tutorial/apc.html
  *
  * result= 0 = OK, else error
  */
-int config_load(char *docname) {
+int config_load_targets(char *docname, config_scsitarget_t *targets) {
 
 	xmlDocPtr doc;
 	xmlNodePtr cur;
 
 	// clear all members of all records
-	memset(config_scsitargets, 0, sizeof(config_scsitargets));
+	memset(targets, 0, MAX_SCSITARGETS * sizeof(config_scsitarget_t));
 
 	doc = xmlParseFile(docname);
 
@@ -152,7 +162,7 @@ int config_load(char *docname) {
 	cur = cur->xmlChildrenNode;
 	while (cur != NULL) {
 		if ((!xmlStrcmp(cur->name, (const xmlChar *) "SCSITarget"))) {
-			parseScsiTarget(doc, cur);
+			parseScsiTarget(doc, cur, targets);
 		}
 		cur = cur->next;
 	}
@@ -162,6 +172,76 @@ int config_load(char *docname) {
 
 }
 
+/* write the current list of scsitargets back into XML.
+ * "template_docname" is the XML the targets were loaded from:
+ * all other settings and comments are taken over unchanged,
+ * only "sdSectorStart" and "scsiSectors" are updated.
+ *
+ * result= 0 = OK, else error
+ */
+int config_save(char *template_docname, char *docname) {
+	xmlDocPtr doc;
+	xmlNodePtr cur, child;
+	char buffer[40];
+
+	doc = xmlParseFile(template_docname);
+	if (doc == NULL) {
+		error("XML Document %s not parsed successfully.", template_docname);
+		return 1;
+	}
+	cur = xmlDocGetRootElement(doc);
+	if (cur == NULL || xmlStrcmp(cur->name, (const xmlChar *) "SCSI2SD")) {
+		error("XML document %s of the wrong type, root node != SCSI2SD",
+				template_docname);
+		xmlFreeDoc(doc);
+		return 3;
+	}
+
+	for (cur = cur->xmlChildrenNode; cur != NULL; cur = cur->next) {
+		xmlChar *prop_id;
+		config_scsitarget_t *st;
+		int id;
+		if (xmlStrcmp(cur->name, (const xmlChar *) "SCSITarget"))
+			continue;
+		prop_id = xmlGetProp(cur, "id");
+		if (!prop_id)
+			continue;
+		id = strtol(prop_id, NULL, 0);
+		xmlFree(prop_id);
+		if (id < 0 || id >= MAX_SCSITARGETS)
+			continue;
+		st = &config_scsitargets[id];
+		for (child = cur->xmlChildrenNode; child != NULL; child = child->next) {
+			if (!strcmp(child->name, "sdSectorStart")) {
+				sprintf(buffer, "%d", st->sectorStart);
+				xmlNodeSetContent(child, buffer);
+			}
+			if (!strcmp(child->name, "scsiSectors")) {
+				sprintf(buffer, "%d", st->sectors);
+				xmlNodeSetContent(child, buffer);
+			}
+		}
+	}
+
+	if (xmlSaveFile(docname, doc) < 0) {
+		error("Can not write XML document %s", docname);
+		xmlFreeDoc(doc);
+		return 4;
+	}
+	xmlFreeDoc(doc);
+	return 0;
+}
+
+// byte offset of the target partition on the SDcard
+int64_t config_scsitarget_offset(config_scsitarget_t *st) {
+	return (int64_t) st->sectorStart * SD_SECTOR_SIZE;
+}
+
+// byte size of the target partition
+int64_t config_scsitarget_size(config_scsitarget_t *st) {
+	return (int64_t) st->sectors * st->bytesPerSector;
+}
+
 void config_print_scsitarget(FILE *fout, config_scsitarget_t *st) {
 	fprintf(fout, "targetId=%d, ", st->targetId);
 	fprintf(fout, "enabled=%d, ", st->enabled);
@@ -28,9 +28,14 @@
 #define CONFIG_H_
 
 #include <stdio.h>
+#include <stdint.h>
 
 #define MAX_SCSITARGETS	8
 
+// "sdSectorStart" is always counted in SDcard sectors, independent of
+// the "bytesPerSector" of the emulated SCSI drive.
+#define SD_SECTOR_SIZE	512
+
 // entry for one SCSI target id
 // reduced data set
 typedef struct {
@@ -59,6 +64,11 @@ extern config_scsitarget_t config_scsitargets[MAX_SCSITARGETS];
 #endif
 
 int config_load(char *docname);
+int config_load_targets(char *docname, config_scsitarget_t *targets);
+int config_save(char *template_docname, char *docname);
 void config_print_scsitarget(FILE *fout, config_scsitarget_t *st) ;
 
+int64_t config_scsitarget_offset(config_scsitarget_t *st);
+int64_t config_scsitarget_size(config_scsitarget_t *st);
+
 #endif /* CONFIG_H_ */
@@ -0,0 +1,588 @@
+/* daemon.c: job queue server on a UNIX socket
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+
+ "img2sd --daemon" keeps running and executes jobs sent by clients over a
+ UNIX stream socket. Config XML files stay parsed (reloaded when changed),
+ devices stay open. Each device has a queue and a worker thread: jobs on
+ one device run one after another, jobs on different devices in
+ parallel.
+ Requests and events are text lines, words separated by blanks:
+   read|write|compare|writecompare <device> <config> <target_id> <image>
+		[<option>=<value> ...]
+   wipe <device> <config> <target_id> [<option>=<value> ...]
+	 -> "ok <job>" or "error <text>"
+	 options: stripes, fill, filesystem, pagecache, digest, update
+   cancel <job>	-> "ok" or "error <text>"
+   status	-> "job <job> running|queued <op> <device> <target_id>" lines,
+		then "ok"
+   shutdown	-> "ok", running jobs are canceled
+ Events of a job go to the client which submitted it:
+   job <job> started
+   job <job> progress <done> <total>	(on each percent)
+   job <job> done [<algorithm>=<digest> ...]
+   job <job> failed <text>
+   job <job> canceled
+ Jobs run with the options given on the command line before --daemon.
+ */
+
+#define _GNU_SOURCE // accept4()
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/limits.h>
+
+#include "error.h"
+#include "utils.h"
+#include "config.h"
+#include "bufpool.h"
+#include "img2sd.h"
+#include "daemon.h"	// own
+
+typedef struct {
+	int fd; // -1 = disconnected
+	unsigned refs; // connection and its jobs
+	char line[DAEMON_MAX_LINE]; // partial request
+	unsigned line_len;
+	pthread_mutex_t send_mutex;
+} client_t;
+
+struct device_struct;
+
+typedef struct job_struct {
+	unsigned id;
+	client_t *client;
+	struct device_struct *device;
+	config_scsitarget_t targets[MAX_SCSITARGETS];
+	int percent; // of last progress event
+	struct job_struct *next; // in queue
+	img2sd_op_t op;
+} job_t;
+
+typedef struct device_struct {
+	char path[PATH_MAX];
+	int fd; // open while the daemon runs
+	job_t *queue; // waiting jobs, in order
+	job_t *running;
+	pthread_t thread;
+	pthread_cond_t queued;
+} device_t;
+
+typedef struct {
+	char filename[PATH_MAX];
+	struct timespec mtime;
+	config_scsitarget_t targets[MAX_SCSITARGETS];
+} layout_t;
+
+static img2sd_options_t *job_defaults;
+static client_t *clients[DAEMON_MAX_CLIENTS];
+static unsigned client_count = 0;
+static device_t devices[DAEMON_MAX_DEVICES];
+static unsigned device_count = 0;
+static layout_t layouts[DAEMON_MAX_LAYOUTS];
+static unsigned layout_count = 0;
+static unsigned job_count = 0;
+static int shutting_down = 0;
+static volatile sig_atomic_t signaled = 0;
+
+// queues, running jobs and client references
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void on_signal(int sig) {
+	(void) sig;
+	signaled = 1;
+}
+
+/* send a line to a client, from any thread.
+ * Lost if the client has disconnected.
+ */
+static void client_send(client_t *client, char *fmt, ...) {
+	char line[DAEMON_MAX_LINE];
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(line, sizeof(line) - 1, fmt, args);
+	va_end(args);
+	if (len > (int) sizeof(line) - 2)
+		len = sizeof(line) - 2;
+	line[len++] = '\n';
+	pthread_mutex_lock(&client->send_mutex);
+	if (client->fd >= 0 && send(client->fd, line, len, MSG_NOSIGNAL) < len)
+		shutdown(client->fd, SHUT_RDWR); // gone, closed by daemon_run()
+	pthread_mutex_unlock(&client->send_mutex);
+}
+
+// drop a reference, under "mutex"
+static void client_release(client_t *client) {
+	if (--client->refs)
+		return;
+	pthread_mutex_destroy(&client->send_mutex);
+	free(client);
+}
+
+static int job_progress(img2sd_op_t *op, int64_t done, int64_t total) {
+	job_t *job = op->context;
+	int percent = total ? (int) ((done * 100) / total) : 100;
+	if (percent != job->percent) {
+		job->percent = percent;
+		client_send(job->client, "job %u progress %ld %ld", job->id, done,
+				total);
+	}
+	return 0;
+}
+
+// report the end of a job, then free it
+static void job_finish(job_t *job, img2sd_state_t state) {
+	char text[DAEMON_MAX_LINE];
+	int len = 0;
+	unsigned i;
+
+	switch (state) {
+	case IMG2SD_STATE_DONE:
+		for (i = 0; i < job->op.digest_count; i++)
+			len += snprintf(text + len, sizeof(text) - len, " %s=%s",
+					job->op.digests[i].algorithm, job->op.digests[i].text);
+		text[len] = 0;
+		client_send(job->client, "job %u done%s", job->id, text);
+		info("Job %u done.", job->id);
+		break;
+	case IMG2SD_STATE_CANCELED:
+		client_send(job->client, "job %u canceled", job->id);
+		info("Job %u canceled.", job->id);
+		break;
+	default:
+		client_send(job->client, "job %u failed %s", job->id,
+				job->op.error_text);
+		info("Job %u failed: %s", job->id, job->op.error_text);
+	}
+	pthread_mutex_lock(&mutex);
+	client_release(job->client);
+	pthread_mutex_unlock(&mutex);
+	free(job);
+}
+
+// executes the queue of one device
+static void *device_thread(void *arg) {
+	device_t *device = arg;
+	job_t *job;
+
+	pthread_mutex_lock(&mutex);
+	for (;;) {
+		while (!device->queue && !shutting_down)
+			pthread_cond_wait(&device->queued, &mutex);
+		if (shutting_down)
+			break;
+		job = device->queue;
+		device->queue = job->next;
+		device->running = job;
+		pthread_mutex_unlock(&mutex);
+
+		client_send(job->client, "job %u started", job->id);
+		img2sd_run(&job->op);
+
+		pthread_mutex_lock(&mutex);
+		device->running = NULL;
+		pthread_mutex_unlock(&mutex);
+		job_finish(job, job->op.state);
+		pthread_mutex_lock(&mutex);
+	}
+	// not started before shutdown
+	while ((job = device->queue)) {
+		device->queue = job->next;
+		pthread_mutex_unlock(&mutex);
+		job_finish(job, IMG2SD_STATE_CANCELED);
+		pthread_mutex_lock(&mutex);
+	}
+	pthread_mutex_unlock(&mutex);
+	return NULL;
+}
+
+/* device by path, opened and with its worker started on first use.
+ * result: NULL on error, text in "error_text"
+ */
+static device_t *get_device(char *path, char *error_text) {
+	device_t *device;
+	unsigned i;
+
+	for (i = 0; i < device_count; i++)
+		if (!strcmp(devices[i].path, path))
+			return &devices[i];
+	if (device_count >= DAEMON_MAX_DEVICES) {
+		snprintf(error_text, ERROR_MAX_TEXT, "More than %d devices",
+				DAEMON_MAX_DEVICES);
+		return NULL;
+	}
+	device = &devices[device_count];
+	strcpy(device->path, path);
+	device->fd = open(path, O_RDWR); // must exist
+	if (device->fd < 0) {
+		snprintf(error_text, ERROR_MAX_TEXT,
+				"Can not open sdcard file \"%.*s\", errno = %d",
+				IMG2SD_MAX_ECHO, path, errno);
+		return NULL;
+	}
+	device->queue = NULL;
+	device->running = NULL;
+	pthread_cond_init(&device->queued, NULL);
+	if (pthread_create(&device->thread, NULL, device_thread, device)) {
+		close(device->fd);
+		snprintf(error_text, ERROR_MAX_TEXT,
+				"Can not start thread for \"%.*s\"", IMG2SD_MAX_ECHO, path);
+		return NULL;
+	}
+	device_count++;
+	// devices run jobs in parallel: each gets its part of --memcap.
+	// A job already running keeps its buffer sizes.
+	bufpool_share(device_count);
+	return device;
+}
+
+/* targets of a config XML, parsed again only if the file has changed.
+ * result: 0 = OK, else error with text in "error_text"
+ */
+static int get_layout(char *filename, config_scsitarget_t *targets,
+		char *error_text) {
+	struct stat statbuf;
+	layout_t *layout = NULL;
+	unsigned i;
+
+	if (stat(filename, &statbuf) < 0) {
+		snprintf(error_text, ERROR_MAX_TEXT,
+				"Can not open config file \"%.*s\"", IMG2SD_MAX_ECHO, filename);
+		return ERROR_HOSTFILE;
+	}
+	for (i = 0; i < layout_count && !layout; i++)
+		if (!strcmp(layouts[i].filename, filename))
+			layout = &layouts[i];
+	if (!layout) {
+		if (layout_count < DAEMON_MAX_LAYOUTS)
+			layout = &layouts[layout_count++];
+		else
+			layout = &layouts[job_count % DAEMON_MAX_LAYOUTS]; // replace one
+		layout->filename[0] = 0;
+	}
+	if (!layout->filename[0]
+			|| layout->mtime.tv_sec != statbuf.st_mtim.tv_sec
+			|| layout->mtime.tv_nsec != statbuf.st_mtim.tv_nsec) {
+		layout->filename[0] = 0;
+		if (img2sd_load_targets(filename, layout->targets, error_text))
+			return ERROR_ILLPARAMVAL;
+		strcpy(layout->filename, filename);
+		layout->mtime = statbuf.st_mtim;
+		info("Config \"%s\" loaded.", filename);
+	}
+	memcpy(targets, layout->targets, sizeof(layout->targets));
+	return ERROR_OK;
+}
+
+/* queue a job request, already split into words.
+ * result: 0 = OK, else error with text in "error_text"
+ */
+static int submit_job(client_t *client, char **words, int word_count,
+		char *error_text) {
+	job_t *job;
+	job_t **tail;
+	device_t *device;
+	char *config;
+
+	job = malloc(sizeof(job_t));
+	if (!job)
+		fatal("Out of memory");
+	img2sd_op_init(&job->op);
+	job->op.options = *job_defaults;
+	job->op.options.tee_sink_count = 0;
+	if (img2sd_parse_job(&job->op, words, word_count, &config, error_text))
+		goto failed;
+	if (get_layout(config, job->targets, error_text))
+		goto failed;
+	if (!job->targets[job->op.target_id].enabled) {
+		snprintf(error_text, ERROR_MAX_TEXT, "Target id %d not enabled",
+				job->op.target_id);
+		goto failed;
+	}
+	if (!(device = get_device(job->op.device, error_text)))
+		goto failed;
+	job->op.fd_device = device->fd;
+	job->op.targets = job->targets;
+	job->op.progress = job_progress;
+	job->op.context = job;
+	job->percent = -1;
+	job->device = device;
+	job->client = client;
+	job->next = NULL;
+
+	// "ok" before the worker can send "started"
+	pthread_mutex_lock(&mutex);
+	job->id = ++job_count;
+	client->refs++;
+	pthread_mutex_unlock(&mutex);
+	client_send(client, "ok %u", job->id);
+	pthread_mutex_lock(&mutex);
+	for (tail = &device->queue; *tail; tail = &(*tail)->next)
+		;
+	*tail = job;
+	pthread_cond_signal(&device->queued);
+	pthread_mutex_unlock(&mutex);
+	info("Job %u: %s SCSI ID %d on \"%s\" queued.", job->id, words[0],
+			job->op.target_id, device->path);
+	return ERROR_OK;
+failed:
+	free(job);
+	return ERROR_ILLPARAMVAL;
+}
+
+/* stop a queued or running job.
+ * result: 0 = OK, else error with text in "error_text"
+ */
+static int cancel_job(unsigned id, char *error_text) {
+	job_t *job = NULL;
+	job_t **prev;
+	unsigned i;
+
+	pthread_mutex_lock(&mutex);
+	for (i = 0; i < device_count; i++) {
+		device_t *device = &devices[i];
+		if (device->running && device->running->id == id) {
+			img2sd_cancel(&device->running->op); // reported by the worker
+			pthread_mutex_unlock(&mutex);
+			return ERROR_OK;
+		}
+		for (prev = &device->queue; *prev && !job; prev = &(*prev)->next)
+			if ((*prev)->id == id) {
+				job = *prev;
+				*prev = job->next;
+				break;
+			}
+	}
+	pthread_mutex_unlock(&mutex);
+	if (!job) {
+		snprintf(error_text, ERROR_MAX_TEXT, "No job %u", id);
+		return ERROR_ILLPARAMVAL;
+	}
+	job_finish(job, IMG2SD_STATE_CANCELED);
+	return ERROR_OK;
+}
+
+static void list_jobs(client_t *client) {
+	job_t *job;
+	unsigned i;
+
+	pthread_mutex_lock(&mutex);
+	for (i = 0; i < device_count; i++) {
+		if ((job = devices[i].running))
+			client_send(client, "job %u running %s %s %d", job->id,
+					img2sd_op_name(job->op.type), devices[i].path,
+					job->op.target_id);
+		for (job = devices[i].queue; job; job = job->next)
+			client_send(client, "job %u queued %s %s %d", job->id,
+					img2sd_op_name(job->op.type), devices[i].path,
+					job->op.target_id);
+	}
+	pthread_mutex_unlock(&mutex);
+	client_send(client, "ok");
+}
+
+// execute one request line of a client
+static void do_request(client_t *client, char *line) {
+	char error_text[ERROR_MAX_TEXT];
+	char *words[DAEMON_MAX_LINE / 2];
+	int word_count = 0;
+	char *word;
+
+	for (word = strtok(line, " \t\r"); word; word = strtok(NULL, " \t\r"))
+		words[word_count++] = word;
+	if (word_count == 0)
+		return;
+	error_text[0] = 0;
+	if (!strcmp(words[0], "cancel") && word_count == 2) {
+		if (cancel_job(strtoul(words[1], NULL, 10), error_text))
+			client_send(client, "error %s", error_text);
+		else
+			client_send(client, "ok");
+	} else if (!strcmp(words[0], "status")) {
+		list_jobs(client);
+	} else if (!strcmp(words[0], "shutdown")) {
+		client_send(client, "ok");
+		shutting_down = 1;
+	} else if (img2sd_parse_op_type(words[0]) < 0) {
+		client_send(client, "error Unknown request \"%s\"", words[0]);
+	} else if (submit_job(client, words, word_count, error_text))
+		client_send(client, "error %s", error_text);
+}
+
+/* input from a client: execute complete lines.
+ * result: 0 = OK, else client has disconnected
+ */
+static int client_input(client_t *client) {
+	char *line, *end;
+	ssize_t n;
+
+	n = recv(client->fd, client->line + client->line_len,
+			sizeof(client->line) - 1 - client->line_len, 0);
+	if (n <= 0)
+		return -1;
+	client->line_len += n;
+	client->line[client->line_len] = 0;
+	line = client->line;
+	while ((end = strchr(line, '\n'))) {
+		*end = 0;
+		do_request(client, line);
+		line = end + 1;
+	}
+	client->line_len -= line - client->line;
+	memmove(client->line, line, client->line_len);
+	if (client->line_len >= sizeof(client->line) - 1) {
+		client_send(client, "error Request too long");
+		client->line_len = 0;
+	}
+	return 0;
+}
+
+static void client_close(unsigned i) {
+	client_t *client = clients[i];
+	pthread_mutex_lock(&client->send_mutex);
+	if (client->fd >= 0)
+		close(client->fd);
+	client->fd = -1;
+	pthread_mutex_unlock(&client->send_mutex);
+	pthread_mutex_lock(&mutex);
+	client_release(client); // jobs may still hold it
+	pthread_mutex_unlock(&mutex);
+	clients[i] = clients[--client_count];
+}
+
+static void accept_client(int fd_listen) {
+	client_t *client;
+	int fd;
+
+	fd = accept4(fd_listen, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (client_count >= DAEMON_MAX_CLIENTS) {
+		warning("More than %d clients, connection refused",
+				DAEMON_MAX_CLIENTS);
+		close(fd);
+		return;
+	}
+	client = malloc(sizeof(client_t));
+	if (!client)
+		fatal("Out of memory");
+	client->fd = fd;
+	client->refs = 1;
+	client->line_len = 0;
+	pthread_mutex_init(&client->send_mutex, NULL);
+	clients[client_count++] = client;
+}
+
+// cancel running jobs, stop workers and close devices
+static void stop_devices(void) {
+	unsigned i;
+
+	pthread_mutex_lock(&mutex);
+	shutting_down = 1;
+	for (i = 0; i < device_count; i++) {
+		if (devices[i].running)
+			img2sd_cancel(&devices[i].running->op);
+		pthread_cond_signal(&devices[i].queued);
+	}
+	pthread_mutex_unlock(&mutex);
+	for (i = 0; i < device_count; i++) {
+		pthread_join(devices[i].thread, NULL);
+		pthread_cond_destroy(&devices[i].queued);
+		close(devices[i].fd);
+	}
+	device_count = 0;
+}
+
+/* serve clients on "socket_path" until a "shutdown" request, SIGINT or
+ * SIGTERM. Jobs start with "defaults".
+ */
+void daemon_run(char *socket_path, img2sd_options_t *defaults) {
+	struct sockaddr_un addr;
+	struct pollfd fds[DAEMON_MAX_CLIENTS + 1];
+	struct sigaction action;
+	struct stat statbuf;
+	int fd_listen;
+	unsigned i;
+
+	job_defaults = defaults;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+		error("Socket path \"%s\" too long", socket_path);
+	strcpy(addr.sun_path, socket_path);
+	// left over by a killed daemon
+	if (stat(socket_path, &statbuf) == 0 && S_ISSOCK(statbuf.st_mode))
+		unlink(socket_path);
+	fd_listen = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd_listen < 0
+			|| bind(fd_listen, (struct sockaddr *) &addr, sizeof(addr)) < 0
+			|| listen(fd_listen, DAEMON_MAX_CLIENTS) < 0)
+		error("Can not listen on socket \"%s\", errno = %d", socket_path,
+				errno);
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = on_signal; // no SA_RESTART: poll() returns
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	info("Waiting for jobs on socket \"%s\".", socket_path);
+
+	while (!shutting_down && !signaled) {
+		fds[0].fd = fd_listen;
+		fds[0].events = POLLIN;
+		for (i = 0; i < client_count; i++) {
+			fds[i + 1].fd = clients[i]->fd;
+			fds[i + 1].events = POLLIN;
+		}
+		if (poll(fds, client_count + 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			error("poll() failed, errno = %d", errno);
+		}
+		// backwards, client_close() moves the last one
+		for (i = client_count; i > 0; i--)
+			if (fds[i].revents && client_input(clients[i - 1]))
+				client_close(i - 1);
+		if (fds[0].revents & POLLIN)
+			accept_client(fd_listen);
+	}
+	info("Shutting down.");
+	stop_devices();
+	while (client_count)
+		client_close(client_count - 1);
+	close(fd_listen);
+	unlink(socket_path);
+}
@@ -0,0 +1,38 @@
+/* daemon.h: job queue server on a UNIX socket
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+ */
+
+#ifndef DAEMON_H_
+#define DAEMON_H_
+
+#include "img2sd.h"
+
+#define DAEMON_MAX_CLIENTS	32
+#define DAEMON_MAX_DEVICES	16 // with one worker thread each
+#define DAEMON_MAX_LAYOUTS	32 // parsed config XML files
+#define DAEMON_MAX_LINE	4096 // of requests and events
+
+void daemon_run(char *socket_path, img2sd_options_t *defaults);
+
+#endif /* DAEMON_H_ */
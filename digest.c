@@ -0,0 +1,211 @@
+/* digest.c: checksums of transferred data
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+
+ Hash algorithms for --digest and digest files of --tee.
+ - OpenSSL digests by name. OpenSSL selects SHA-NI and AVX2 code paths
+   on its own.
+ - crc32c: with the SSE 4.2 "crc32" instruction if the CPU has it,
+   else by table.
+ - xxh3: libxxhash is loaded at run time, so img2sd builds and runs
+   without it, as long as xxh3 is not requested.
+ Results are hex text, most significant byte first, as printed by
+ sha256sum, "xxhsum -H3" and "rhash --crc32c".
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
+
+#include "error.h"
+#include "digest.h"	// own
+
+#define DIGEST_CRC32C_POLY	0x82f63b78	// reflected
+
+#define DIGEST_XXH3_LIBRARY	"libxxhash.so.0"
+
+// libxxhash entry points, XXH3 streaming API of xxHash 0.8
+static struct {
+	void *(*create_state)(void);
+	int (*free_state)(void *state);
+	int (*reset)(void *state);
+	int (*update)(void *state, const void *data, size_t len);
+	uint64_t (*digest)(const void *state);
+} xxh3;
+static int xxh3_loaded = 0; // 1 = OK, -1 = not available
+static pthread_once_t xxh3_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static int crc32c_hardware;
+
+static void xxh3_load(void) {
+	void *lib = dlopen(DIGEST_XXH3_LIBRARY, RTLD_NOW);
+	xxh3_loaded = -1;
+	if (!lib)
+		return;
+	xxh3.create_state = (void *(*)(void)) dlsym(lib, "XXH3_createState");
+	xxh3.free_state = (int (*)(void *)) dlsym(lib, "XXH3_freeState");
+	xxh3.reset = (int (*)(void *)) dlsym(lib, "XXH3_64bits_reset");
+	xxh3.update = (int (*)(void *, const void *, size_t)) dlsym(lib,
+			"XXH3_64bits_update");
+	xxh3.digest = (uint64_t (*)(const void *)) dlsym(lib,
+			"XXH3_64bits_digest");
+	if (xxh3.create_state && xxh3.free_state && xxh3.reset && xxh3.update
+			&& xxh3.digest)
+		xxh3_loaded = 1;
+}
+
+static void crc32c_setup(void) {
+	uint32_t i, j, crc;
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? DIGEST_CRC32C_POLY : 0);
+		crc32c_table[i] = crc;
+	}
+#ifdef __x86_64__
+	crc32c_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#ifdef __x86_64__
+// 8 bytes per instruction, 3 cycles latency
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, unsigned char *data, size_t len) {
+	uint64_t crc64 = crc;
+	while (len > 0 && ((uintptr_t) data & 7)) {
+		crc64 = _mm_crc32_u8(crc64, *data++);
+		len--;
+	}
+	for (; len >= 8; data += 8, len -= 8)
+		crc64 = _mm_crc32_u64(crc64, *(uint64_t *) data);
+	while (len-- > 0)
+		crc64 = _mm_crc32_u8(crc64, *data++);
+	return crc64;
+}
+#endif
+
+static uint32_t crc32c_update(uint32_t crc, unsigned char *data, size_t len) {
+#ifdef __x86_64__
+	if (crc32c_hardware)
+		return crc32c_sse42(crc, data, len);
+#endif
+	while (len-- > 0)
+		crc = (crc >> 8) ^ crc32c_table[(crc ^ *data++) & 0xff];
+	return crc;
+}
+
+// name usable for digest_init() ?
+int digest_is_known(char *name) {
+	if (!strcasecmp(name, "crc32c") || !strcasecmp(name, "xxh3"))
+		return 1;
+	return EVP_get_digestbyname(name) != NULL;
+}
+
+/* start a digest by algorithm name.
+ * result: 0 = OK, else error
+ */
+int digest_init(digest_t *digest, char *name) {
+	memset(digest, 0, sizeof(*digest));
+	strncpy(digest->name, name, sizeof(digest->name) - 1);
+	if (!strcasecmp(name, "crc32c")) {
+		pthread_once(&crc32c_once, crc32c_setup);
+		digest->type = DIGEST_CRC32C;
+		digest->crc = 0xffffffff;
+	} else if (!strcasecmp(name, "xxh3")) {
+		pthread_once(&xxh3_once, xxh3_load);
+		if (xxh3_loaded < 0)
+			return error_set(ERROR_ILLPARAMVAL,
+					"xxh3 needs %s (package libxxhash0)", DIGEST_XXH3_LIBRARY);
+		digest->type = DIGEST_XXH3;
+		digest->xxh3_state = xxh3.create_state();
+		if (!digest->xxh3_state || xxh3.reset(digest->xxh3_state)) {
+			digest_free(digest);
+			return error_set(ERROR_ILLPARAMVAL, "Can not initialize xxh3");
+		}
+	} else {
+		digest->type = DIGEST_EVP;
+		digest->md = EVP_get_digestbyname(name);
+		if (!digest->md)
+			return error_set(ERROR_ILLPARAMVAL, "Unknown digest \"%s\"", name);
+		digest->md_ctx = EVP_MD_CTX_new();
+		if (!digest->md_ctx
+				|| !EVP_DigestInit_ex(digest->md_ctx, digest->md, NULL)) {
+			digest_free(digest);
+			return error_set(ERROR_ILLPARAMVAL,
+					"Can not initialize digest \"%s\"", name);
+		}
+	}
+	return 0;
+}
+
+void digest_update(digest_t *digest, void *data, size_t len) {
+	switch (digest->type) {
+	case DIGEST_CRC32C:
+		digest->crc = crc32c_update(digest->crc, data, len);
+		break;
+	case DIGEST_XXH3:
+		xxh3.update(digest->xxh3_state, data, len);
+		break;
+	default:
+		EVP_DigestUpdate(digest->md_ctx, data, len);
+	}
+}
+
+// finish digest, result as hex into "text" of DIGEST_MAX_TEXT
+void digest_final(digest_t *digest, char *text) {
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned md_len, i;
+
+	switch (digest->type) {
+	case DIGEST_CRC32C:
+		sprintf(text, "%08x", digest->crc ^ 0xffffffff);
+		break;
+	case DIGEST_XXH3:
+		sprintf(text, "%016lx", xxh3.digest(digest->xxh3_state));
+		break;
+	default:
+		EVP_DigestFinal_ex(digest->md_ctx, md, &md_len);
+		for (i = 0; i < md_len; i++)
+			sprintf(text + 2 * i, "%02x", md[i]);
+	}
+	digest_free(digest);
+}
+
+// release state without result, also after a failed digest_init()
+void digest_free(digest_t *digest) {
+	if (digest->xxh3_state)
+		xxh3.free_state(digest->xxh3_state);
+	digest->xxh3_state = NULL;
+	EVP_MD_CTX_free(digest->md_ctx); // NULL is OK
+	digest->md_ctx = NULL;
+}
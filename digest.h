@@ -0,0 +1,59 @@
+/* digest.h: checksums of transferred data
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+ */
+
+#ifndef DIGEST_H_
+#define DIGEST_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <openssl/evp.h>
+
+#define DIGEST_MAX_NAME	16
+// longest result as hex text, with terminating \0
+#define DIGEST_MAX_TEXT	(2 * EVP_MAX_MD_SIZE + 1)
+
+// algorithms
+#define DIGEST_EVP	0	// all of OpenSSL: "sha256", "md5", ...
+#define DIGEST_CRC32C	1	// "crc32c": Castagnoli, as iSCSI and ext4
+#define DIGEST_XXH3	2	// "xxh3": 64 bit XXH3, from libxxhash
+
+typedef struct {
+	int type;
+	char name[DIGEST_MAX_NAME];
+
+	// private
+	const EVP_MD *md;
+	EVP_MD_CTX *md_ctx;
+	uint32_t crc;
+	void *xxh3_state;
+} digest_t;
+
+int digest_is_known(char *name);
+int digest_init(digest_t *digest, char *name);
+void digest_update(digest_t *digest, void *data, size_t len);
+void digest_final(digest_t *digest, char *text);
+void digest_free(digest_t *digest);
+
+#endif /* DIGEST_H_ */
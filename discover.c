@@ -0,0 +1,332 @@
+/* discover.c: find and identify SDcards in attached readers
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+
+ Removable block devices are taken from /sys/block. All of them are
+ sampled in parallel: a few KB are read at the start of each target of
+ all known layouts. The samples give a fingerprint of the card, and
+ are matched against the start of known image files.
+ */
+
+#define _GNU_SOURCE // O_DIRECT
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <linux/limits.h>
+
+#include "error.h"
+#include "utils.h"
+#include "config.h"
+#include "discover.h"	// own
+
+#define MAX_SAMPLES	(MAX_SCSITARGETS * (DISCOVER_MAX_REFERENCES + 1) + 1)
+
+// a layout or an image file, cards are matched against
+typedef struct {
+	char *filename;
+	config_scsitarget_t targets[MAX_SCSITARGETS]; // if layout
+	char *head; // if image: start of file, NULL = layout
+	int64_t head_len;
+} reference_t;
+
+typedef struct {
+	char filename[PATH_MAX];
+	pthread_t thread;
+	int64_t size; // 0 = no card in reader
+	uint64_t fingerprint;
+	int result; // 0 = OK, else errno
+
+	// samples[i] at sample_offsets[i], if inside card
+	char *samples;
+} device_t;
+
+// card offsets sampled on every device, ascending
+static int64_t sample_offsets[MAX_SAMPLES];
+static int sample_count;
+
+/* list removable block devices, and "extra_device".
+ * result: count
+ */
+static int enum_devices(device_t *devices, char *extra_device) {
+	DIR *dir;
+	struct dirent *entry;
+	int count = 0;
+
+	dir = opendir("/sys/block");
+	while (dir && (entry = readdir(dir)) && count < DISCOVER_MAX_DEVICES) {
+		char path[PATH_MAX];
+		char removable = 0;
+		FILE *f;
+		if (entry->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/sys/block/%s/removable",
+				entry->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fread(&removable, 1, 1, f) == 1 && removable == '1')
+			snprintf(devices[count++].filename, PATH_MAX, "/dev/%s",
+					entry->d_name);
+		fclose(f);
+	}
+	if (dir)
+		closedir(dir);
+	if (extra_device && extra_device[0] && count < DISCOVER_MAX_DEVICES) {
+		int i;
+		for (i = 0; i < count && strcmp(devices[i].filename, extra_device); i++)
+			;
+		if (i == count)
+			strcpy(devices[count++].filename, extra_device);
+	}
+	return count;
+}
+
+// FNV-1a, 64 bit
+static uint64_t hash_update(uint64_t hash, void *data, size_t len) {
+	unsigned char *p = data;
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+// read all sample offsets of one device
+static void *sample_thread(void *arg) {
+	device_t *device = arg;
+	char *buffer;
+	int fd, i;
+
+	device->fingerprint = 0xcbf29ce484222325ULL;
+	// bypass cache, card may have been changed in the reader
+	fd = open(device->filename, O_RDONLY | O_DIRECT);
+	if (fd < 0)
+		fd = open(device->filename, O_RDONLY);
+	if (fd < 0) {
+		device->result = errno;
+		return NULL;
+	}
+	device->size = device_size(fd);
+	device->samples = calloc(sample_count, DISCOVER_SAMPLE_SIZE);
+	if (!device->samples
+			|| posix_memalign((void **) &buffer, 4096, DISCOVER_SAMPLE_SIZE)) {
+		free(device->samples);
+		device->samples = NULL;
+		close(fd);
+		device->result = ENOMEM;
+		return NULL;
+	}
+	device->fingerprint = hash_update(device->fingerprint, &device->size,
+			sizeof(device->size));
+	for (i = 0; i < sample_count; i++) {
+		int64_t offset = sample_offsets[i];
+		if (offset + DISCOVER_SAMPLE_SIZE > device->size)
+			break;
+		if (pread_full(fd, buffer, DISCOVER_SAMPLE_SIZE, offset) < 0) {
+			device->result = errno;
+			break;
+		}
+		memcpy(device->samples + i * DISCOVER_SAMPLE_SIZE, buffer,
+				DISCOVER_SAMPLE_SIZE);
+		device->fingerprint = hash_update(device->fingerprint, buffer,
+				DISCOVER_SAMPLE_SIZE);
+	}
+	free(buffer);
+	close(fd);
+	return NULL;
+}
+
+// sample read at a card offset, NULL if not available
+static char *get_sample(device_t *device, int64_t offset) {
+	int i;
+	if (offset + DISCOVER_SAMPLE_SIZE > device->size)
+		return NULL;
+	for (i = 0; i < sample_count; i++)
+		if (sample_offsets[i] == offset)
+			return device->samples + i * DISCOVER_SAMPLE_SIZE;
+	return NULL;
+}
+
+static void add_sample_offset(int64_t offset) {
+	int i, j;
+	for (i = 0; i < sample_count && sample_offsets[i] < offset; i++)
+		;
+	if (i < sample_count && sample_offsets[i] == offset)
+		return;
+	for (j = sample_count; j > i; j--)
+		sample_offsets[j] = sample_offsets[j - 1];
+	sample_offsets[i] = offset;
+	sample_count++;
+}
+
+/* best match of a device, printed to "text".
+ * An image at the start of a target wins, else the layout which fits
+ * on the card and has the most targets with data.
+ */
+static void match_device(device_t *device, reference_t *refs, int ref_count,
+		char *text, size_t text_size) {
+	int best_score = 0, best_total = 0;
+	reference_t *best = NULL;
+	int i, j, id;
+
+	for (i = 0; i < ref_count; i++) {
+		reference_t *layout = &refs[i];
+		int score = 0, total = 0, fits = 1;
+		if (layout->head)
+			continue;
+		for (id = 0; id < MAX_SCSITARGETS; id++) {
+			config_scsitarget_t *st = &layout->targets[id];
+			char *sample;
+			int k;
+			if (!st->enabled)
+				continue;
+			total++;
+			if (config_scsitarget_offset(st) + config_scsitarget_size(st)
+					> device->size)
+				fits = 0;
+			sample = get_sample(device, config_scsitarget_offset(st));
+			if (!sample)
+				continue;
+			// image on this target?
+			for (j = 0; j < ref_count; j++)
+				if (refs[j].head
+						&& !memcmp(refs[j].head, sample, refs[j].head_len)) {
+					snprintf(text, text_size, "%s on SCSI ID %d of %s",
+							refs[j].filename, id, layout->filename);
+					return;
+				}
+			for (k = 0; k < DISCOVER_SAMPLE_SIZE && !sample[k]; k++)
+				;
+			if (k < DISCOVER_SAMPLE_SIZE)
+				score++; // target holds data
+		}
+		if (fits && (!best || score > best_score)) {
+			best = layout;
+			best_score = score;
+			best_total = total;
+		}
+	}
+	if (best)
+		snprintf(text, text_size, "%s, %d of %d targets with data",
+				best->filename, best_score, best_total);
+	else
+		snprintf(text, text_size, "-");
+}
+
+/* list all cards with size, fingerprint and best matching reference.
+ * layout: currently loaded XML, may be NULL
+ * reference_filenames: more layouts (*.xml) and image files
+ * result: 0 = OK, else error
+ */
+int discover_run(FILE *fout, char *extra_device, char *layout_filename,
+		config_scsitarget_t *layout, char **reference_filenames,
+		int reference_count) {
+	static reference_t refs[DISCOVER_MAX_REFERENCES + 1];
+	static device_t devices[DISCOVER_MAX_DEVICES];
+	int ref_count = 0, device_count;
+	int i, id;
+
+	memset(devices, 0, sizeof(devices));
+	sample_count = 0;
+	add_sample_offset(0);
+	if (layout) {
+		refs[ref_count].filename = layout_filename;
+		refs[ref_count].head = NULL;
+		memcpy(refs[ref_count++].targets, layout, sizeof(refs[0].targets));
+	}
+	for (i = 0; i < reference_count && i < DISCOVER_MAX_REFERENCES; i++) {
+		reference_t *ref = &refs[ref_count++];
+		char *ext = strrchr(reference_filenames[i], '.');
+		ref->filename = reference_filenames[i];
+		ref->head = NULL;
+		if (ext && !strcasecmp(ext, ".xml")) {
+			if (config_load_targets(ref->filename, ref->targets))
+				return error_set(ERROR_HOSTFILE, "XML file error in \"%s\"",
+						ref->filename);
+		} else {
+			int fd = open(ref->filename, O_RDONLY);
+			if (fd < 0)
+				return error_set(ERROR_HOSTFILE, "Can not open \"%s\"",
+						ref->filename);
+			ref->head = calloc(1, DISCOVER_SAMPLE_SIZE);
+			if (!ref->head) {
+				close(fd);
+				return error_set(ERROR_HOSTFILE, "Out of memory");
+			}
+			ref->head_len = device_size(fd);
+			if (ref->head_len > DISCOVER_SAMPLE_SIZE)
+				ref->head_len = DISCOVER_SAMPLE_SIZE;
+			if (pread_full(fd, ref->head, ref->head_len, 0) < 0)
+				ref->head_len = 0;
+			close(fd);
+			if (ref->head_len == 0) {
+				free(ref->head);
+				ref_count--; // nothing to match
+			}
+		}
+	}
+	for (i = 0; i < ref_count; i++)
+		if (!refs[i].head)
+			for (id = 0; id < MAX_SCSITARGETS; id++)
+				if (refs[i].targets[id].enabled)
+					add_sample_offset(
+							config_scsitarget_offset(&refs[i].targets[id]));
+
+	device_count = enum_devices(devices, extra_device);
+	if (device_count == 0)
+		fprintf(fout, "No removable devices found.\n");
+	for (i = 0; i < device_count; i++)
+		if (pthread_create(&devices[i].thread, NULL, sample_thread,
+				&devices[i]))
+			return error_set(ERROR_HOSTFILE, "Can not create thread");
+	for (i = 0; i < device_count; i++)
+		pthread_join(devices[i].thread, NULL);
+
+	if (device_count)
+		fprintf(fout, "%-16s %14s  %-16s  %s\n", "Device", "Size",
+				"Fingerprint", "Best match");
+	for (i = 0; i < device_count; i++) {
+		device_t *device = &devices[i];
+		char match[2 * PATH_MAX];
+		if (device->result)
+			fprintf(fout, "%-16s error %d\n", device->filename, device->result);
+		else if (device->size == 0)
+			fprintf(fout, "%-16s no card\n", device->filename);
+		else {
+			match_device(device, refs, ref_count, match, sizeof(match));
+			fprintf(fout, "%-16s %14ld  %016lx  %s\n", device->filename,
+					device->size, device->fingerprint, match);
+		}
+		free(device->samples);
+	}
+	for (i = 0; i < ref_count; i++)
+		free(refs[i].head);
+	return 0;
+}
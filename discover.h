@@ -0,0 +1,42 @@
+/* discover.h: find and identify SDcards in attached readers
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+ */
+
+#ifndef DISCOVER_H_
+#define DISCOVER_H_
+
+#include <stdio.h>
+
+#include "config.h"
+
+#define DISCOVER_MAX_DEVICES	64
+#define DISCOVER_MAX_REFERENCES	16
+// bytes read at the start of each target
+#define DISCOVER_SAMPLE_SIZE	4096
+
+int discover_run(FILE *fout, char *extra_device, char *layout_filename,
+		config_scsitarget_t *layout, char **reference_filenames,
+		int reference_count);
+
+#endif /* DISCOVER_H_ */
@@ -0,0 +1,700 @@
+/* dump.c: whole SDcard in one container file, for backup and restore
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+
+ --dumpcard saves the XML layout and all enabled partitions of a card in
+ one file. The card is read in one pass in offset order, each partition
+ is cut into chunks of DUMP_CHUNK_SIZE: chunks of zeros are only listed
+ in the index, others are stored as zlib stream if that is smaller.
+ The index (targets and chunks) is written behind the data, so a dump
+ can go to a pipe. It ends with a trailer, which points to the index.
+ Each partition has digests of its data, checked on --restorecard and
+ --extract. One partition is extracted by reading only its chunks.
+ */
+
+#define _GNU_SOURCE // posix_fadvise
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "error.h"
+#include "utils.h"
+#include "config.h"
+#include "offload.h"
+#include "stream.h"
+#include "digest.h"
+#include "throttle.h"
+#include "xfer.h"
+#include "dump.h"	// own
+
+#define MAX_CHUNK_SIZE	(64 * 1024 * 1024) // sanity check of a header
+
+/* host <-> little endian of file structures. The swap is the same in
+ * both directions.
+ */
+static void byteorder_header(dump_header_t *header) {
+	header->version = htole32(header->version);
+	header->chunk_size = htole32(header->chunk_size);
+	header->xml_size = htole64(header->xml_size);
+}
+
+static void byteorder_chunk(dump_chunk_t *chunk) {
+	chunk->offset = htole64(chunk->offset);
+	chunk->size = htole32(chunk->size);
+	chunk->storage = htole32(chunk->storage);
+}
+
+static void byteorder_target(dump_target_t *target) {
+	target->target_id = htole32(target->target_id);
+	target->bytes_per_sector = htole32(target->bytes_per_sector);
+	target->card_offset = htole64(target->card_offset);
+	target->size = htole64(target->size);
+	target->first_chunk = htole32(target->first_chunk);
+	target->chunk_count = htole32(target->chunk_count);
+	target->digest_count = htole32(target->digest_count);
+}
+
+static void byteorder_trailer(dump_trailer_t *trailer) {
+	trailer->index_offset = htole64(trailer->index_offset);
+	trailer->target_count = htole32(trailer->target_count);
+	trailer->chunk_count = htole32(trailer->chunk_count);
+	trailer->index_crc = htole32(trailer->index_crc);
+}
+
+static void byteorder_tables(dump_t *dump) {
+	unsigned i;
+	for (i = 0; i < dump->target_count; i++)
+		byteorder_target(&dump->targets[i]);
+	for (i = 0; i < dump->chunk_count; i++)
+		byteorder_chunk(&dump->chunks[i]);
+}
+
+static int is_zero(char *data, int64_t len) {
+	return !data[0] && !memcmp(data, data + 1, len - 1);
+}
+
+static void alloc_buffers(dump_t *dump) {
+	dump->data = malloc(DUMP_CHUNK_SIZE);
+	dump->packed = malloc(compressBound(DUMP_CHUNK_SIZE));
+	dump->zeros = calloc(1, DUMP_CHUNK_SIZE);
+	if (!dump->data || !dump->packed || !dump->zeros)
+		fatal("Out of memory");
+}
+
+// to "offset" of a file or card, or appended to a pipe. result: 0 = OK
+static int write_out(int fd, int sequential, void *data, int64_t len,
+		int64_t offset) {
+	char *p = data;
+	ssize_t n;
+	if (!sequential) {
+		if (pwrite_full(fd, data, len, offset) != len)
+			return error_set(ERROR_HOSTFILE, "Write failed at %ld, errno = %d",
+					offset, errno);
+		return 0;
+	}
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return error_set(ERROR_HOSTFILE, "Write failed at %ld, errno = %d",
+					offset, errno);
+		p += n;
+		len -= n;
+		offset += n;
+		throttle(THROTTLE_WRITE, n);
+	}
+	return 0;
+}
+
+// append to the container
+static int put(dump_t *dump, void *data, int64_t len) {
+	int res = write_out(dump->fd, 1, data, len, dump->position);
+	dump->position += len;
+	return res;
+}
+
+static int read_xml(dump_t *dump, char *config_filename) {
+	struct stat statbuf;
+	int fd = open(config_filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &statbuf) < 0)
+		return error_set(ERROR_HOSTFILE, "Can not read \"%s\"",
+				config_filename);
+	dump->xml = malloc(statbuf.st_size + 1);
+	if (!dump->xml)
+		fatal("Out of memory");
+	if (pread_full(fd, dump->xml, statbuf.st_size, 0) != statbuf.st_size) {
+		close(fd);
+		return error_set(ERROR_HOSTFILE, "Can not read \"%s\"",
+				config_filename);
+	}
+	close(fd);
+	dump->xml[statbuf.st_size] = 0;
+	dump->header.xml_size = statbuf.st_size;
+	return 0;
+}
+
+// tables in file byte order, with crc, then the trailer
+static int put_index(dump_t *dump) {
+	dump_trailer_t trailer;
+	uLong crc = crc32(0L, Z_NULL, 0);
+	int res;
+
+	memset(&trailer, 0, sizeof(trailer));
+	memcpy(trailer.magic, DUMP_INDEX_MAGIC, sizeof(trailer.magic));
+	trailer.index_offset = dump->position;
+	trailer.target_count = dump->target_count;
+	trailer.chunk_count = dump->chunk_count;
+	byteorder_tables(dump);
+	crc = crc32(crc, (Bytef *) dump->targets,
+			dump->target_count * sizeof(dump_target_t));
+	crc = crc32(crc, (Bytef *) dump->chunks,
+			dump->chunk_count * sizeof(dump_chunk_t));
+	res = put(dump, dump->targets, dump->target_count * sizeof(dump_target_t));
+	if (!res)
+		res = put(dump, dump->chunks,
+				dump->chunk_count * sizeof(dump_chunk_t));
+	byteorder_tables(dump);
+	if (res)
+		return res;
+	trailer.index_crc = crc;
+	byteorder_trailer(&trailer);
+	return put(dump, &trailer, sizeof(trailer));
+}
+
+/* enabled "targets" of the card to a new container on "fd_out".
+ * "compression": DUMP_COMPRESS_*, "digests": algorithms for each target.
+ * "dump" has the index afterwards, release with dump_close().
+ * result: 0 = OK, else error
+ */
+int dump_card(dump_t *dump, int fd_out, int fd_card, char *config_filename,
+		config_scsitarget_t *targets, int compression,
+		char digests[][DIGEST_MAX_NAME], unsigned digest_count,
+		dump_progress_func_t progress) {
+	digest_t digest[DUMP_MAX_DIGESTS];
+	dump_header_t header;
+	int64_t total = 0, done = 0;
+	unsigned i, d;
+	int id, res;
+
+	memset(dump, 0, sizeof(*dump));
+	dump->fd = fd_out;
+	if (digest_count > DUMP_MAX_DIGESTS)
+		return error_set(ERROR_ILLPARAMVAL, "At most %d digests in a dump",
+				DUMP_MAX_DIGESTS);
+	res = read_xml(dump, config_filename);
+	if (res)
+		return res;
+
+	// enabled targets sorted by card offset: one pass over the card
+	for (id = 0; id < MAX_SCSITARGETS; id++) {
+		config_scsitarget_t *scsitarget = &targets[id];
+		dump_target_t *target;
+		int64_t offset = config_scsitarget_offset(scsitarget);
+		if (!scsitarget->enabled)
+			continue;
+		for (i = dump->target_count;
+				i > 0 && dump->targets[i - 1].card_offset > (uint64_t) offset;
+				i--)
+			dump->targets[i] = dump->targets[i - 1];
+		target = &dump->targets[i];
+		memset(target, 0, sizeof(*target));
+		target->target_id = id;
+		target->bytes_per_sector = scsitarget->bytesPerSector;
+		target->card_offset = offset;
+		target->size = config_scsitarget_size(scsitarget);
+		target->digest_count = digest_count;
+		for (d = 0; d < digest_count; d++)
+			strcpy(target->digests[d].algorithm, digests[d]);
+		dump->target_count++;
+		total += target->size;
+	}
+	if (dump->target_count == 0)
+		return error_set(ERROR_ILLPARAMVAL, "No SCSI ID enabled in \"%s\"",
+				config_filename);
+	dump->chunks = calloc(total / DUMP_CHUNK_SIZE + dump->target_count,
+			sizeof(dump_chunk_t));
+	if (!dump->chunks)
+		fatal("Out of memory");
+	alloc_buffers(dump);
+
+	memcpy(dump->header.magic, DUMP_MAGIC, sizeof(dump->header.magic));
+	dump->header.version = DUMP_VERSION;
+	dump->header.chunk_size = DUMP_CHUNK_SIZE;
+	header = dump->header;
+	byteorder_header(&header);
+	res = put(dump, &header, sizeof(header));
+	if (!res)
+		res = put(dump, dump->xml, dump->header.xml_size);
+	if (res)
+		return res;
+
+	posix_fadvise(fd_card, 0, 0, POSIX_FADV_SEQUENTIAL);
+	for (i = 0; i < dump->target_count; i++) {
+		dump_target_t *target = &dump->targets[i];
+		uint64_t position;
+		target->first_chunk = dump->chunk_count;
+		for (d = 0; d < digest_count; d++) {
+			res = digest_init(&digest[d], digests[d]);
+			if (res)
+				return res;
+		}
+		for (position = 0; position < target->size;
+				position += DUMP_CHUNK_SIZE) {
+			dump_chunk_t *chunk = &dump->chunks[dump->chunk_count++];
+			int64_t len = target->size - position;
+			uLongf packed_size = compressBound(DUMP_CHUNK_SIZE);
+			if (len > DUMP_CHUNK_SIZE)
+				len = DUMP_CHUNK_SIZE;
+			if (pread_full(fd_card, dump->data, len,
+					target->card_offset + position) != len)
+				return error_set(ERROR_HOSTFILE, "SDcard read failed at %ld",
+						target->card_offset + position);
+			// card reads ahead while this chunk is compressed
+			posix_fadvise(fd_card, target->card_offset + position + len,
+					DUMP_CHUNK_SIZE, POSIX_FADV_WILLNEED);
+			for (d = 0; d < digest_count; d++)
+				digest_update(&digest[d], dump->data, len);
+			chunk->offset = dump->position;
+			if (is_zero(dump->data, len)) {
+				chunk->storage = DUMP_CHUNK_ZERO;
+				chunk->size = 0;
+			} else if (compression != DUMP_COMPRESS_NONE
+					&& compress2((Bytef *) dump->packed, &packed_size,
+							(Bytef *) dump->data, len,
+							compression == DUMP_COMPRESS_BEST ? 9 : 1) == Z_OK
+					&& (int64_t) packed_size < len) {
+				chunk->storage = DUMP_CHUNK_ZLIB;
+				chunk->size = packed_size;
+				res = put(dump, dump->packed, packed_size);
+			} else {
+				chunk->storage = DUMP_CHUNK_RAW;
+				chunk->size = len;
+				res = put(dump, dump->data, len);
+			}
+			if (res)
+				return res;
+			done += len;
+			if (progress)
+				progress(done, total);
+		}
+		target->chunk_count = dump->chunk_count - target->first_chunk;
+		for (d = 0; d < digest_count; d++) {
+			char text[DIGEST_MAX_TEXT];
+			digest_final(&digest[d], text);
+			snprintf(target->digests[d].text, DUMP_DIGEST_TEXT, "%s", text);
+		}
+	}
+	res = put_index(dump);
+	dump->fd = -1; // of the caller
+	return res;
+}
+
+/* open a container and load its index. result: 0 = OK, else error
+ */
+int dump_open(dump_t *dump, char *filename) {
+	dump_trailer_t trailer;
+	struct stat statbuf;
+	uLong crc = crc32(0L, Z_NULL, 0);
+	int64_t tables_size;
+	unsigned i;
+
+	memset(dump, 0, sizeof(*dump));
+	dump->fd = open(filename, O_RDONLY);
+	if (dump->fd < 0)
+		return error_set(ERROR_HOSTFILE, "Can not open container \"%s\"",
+				filename);
+	if (fstat(dump->fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode))
+		return error_set(ERROR_HOSTFILE,
+				"Container \"%s\" must be a regular file", filename);
+	if (pread_full(dump->fd, &dump->header, sizeof(dump->header), 0)
+			!= sizeof(dump->header)
+			|| memcmp(dump->header.magic, DUMP_MAGIC,
+					sizeof(dump->header.magic)))
+		return error_set(ERROR_HOSTFILE, "\"%s\" is not a card container",
+				filename);
+	byteorder_header(&dump->header);
+	if (dump->header.version != DUMP_VERSION)
+		return error_set(ERROR_HOSTFILE,
+				"Container \"%s\" has version %u, not supported", filename,
+				dump->header.version);
+	// incomplete dump: no trailer
+	if (statbuf.st_size < (off_t) (sizeof(dump->header) + sizeof(trailer))
+			|| pread_full(dump->fd, &trailer, sizeof(trailer),
+					statbuf.st_size - sizeof(trailer)) != sizeof(trailer)
+			|| memcmp(trailer.magic, DUMP_INDEX_MAGIC, sizeof(trailer.magic)))
+		return error_set(ERROR_HOSTFILE, "Container \"%s\" is incomplete",
+				filename);
+	byteorder_trailer(&trailer);
+	tables_size = trailer.target_count * sizeof(dump_target_t)
+			+ (int64_t) trailer.chunk_count * sizeof(dump_chunk_t);
+	if (dump->header.chunk_size != DUMP_CHUNK_SIZE
+			|| trailer.target_count > MAX_SCSITARGETS
+			|| sizeof(dump->header) + dump->header.xml_size
+					> trailer.index_offset
+			|| trailer.index_offset + tables_size + sizeof(trailer)
+					!= (uint64_t) statbuf.st_size)
+		return error_set(ERROR_HOSTFILE, "Container \"%s\" is corrupt",
+				filename);
+
+	dump->target_count = trailer.target_count;
+	dump->chunk_count = trailer.chunk_count;
+	dump->xml = malloc(dump->header.xml_size + 1);
+	dump->chunks = malloc(dump->chunk_count * sizeof(dump_chunk_t) + 1);
+	if (!dump->xml || !dump->chunks)
+		fatal("Out of memory");
+	alloc_buffers(dump);
+	if (pread_full(dump->fd, dump->xml, dump->header.xml_size,
+			sizeof(dump->header)) != (int64_t) dump->header.xml_size
+			|| pread_full(dump->fd, dump->targets,
+					dump->target_count * sizeof(dump_target_t),
+					trailer.index_offset)
+					!= (int64_t) (dump->target_count * sizeof(dump_target_t))
+			|| pread_full(dump->fd, dump->chunks,
+					dump->chunk_count * sizeof(dump_chunk_t),
+					trailer.index_offset
+							+ dump->target_count * sizeof(dump_target_t))
+					!= (int64_t) (dump->chunk_count * sizeof(dump_chunk_t)))
+		return error_set(ERROR_HOSTFILE, "Can not read container \"%s\"",
+				filename);
+	dump->xml[dump->header.xml_size] = 0;
+	crc = crc32(crc, (Bytef *) dump->targets,
+			dump->target_count * sizeof(dump_target_t));
+	crc = crc32(crc, (Bytef *) dump->chunks,
+			dump->chunk_count * sizeof(dump_chunk_t));
+	if (crc != trailer.index_crc)
+		return error_set(ERROR_HOSTFILE, "Index of container \"%s\" is corrupt",
+				filename);
+	byteorder_tables(dump);
+
+	// index entries must stay inside the file
+	for (i = 0; i < dump->target_count; i++) {
+		dump_target_t *target = &dump->targets[i];
+		if (target->target_id >= MAX_SCSITARGETS
+				|| target->digest_count > DUMP_MAX_DIGESTS
+				|| (uint64_t) target->first_chunk + target->chunk_count
+						> dump->chunk_count
+				|| target->chunk_count
+						!= (target->size + DUMP_CHUNK_SIZE - 1) / DUMP_CHUNK_SIZE)
+			return error_set(ERROR_HOSTFILE, "Container \"%s\" is corrupt",
+					filename);
+	}
+	for (i = 0; i < dump->chunk_count; i++) {
+		dump_chunk_t *chunk = &dump->chunks[i];
+		if (chunk->storage > DUMP_CHUNK_ZLIB
+				|| chunk->size > compressBound(DUMP_CHUNK_SIZE)
+				|| chunk->offset + chunk->size > trailer.index_offset)
+			return error_set(ERROR_HOSTFILE, "Container \"%s\" is corrupt",
+					filename);
+	}
+	return 0;
+}
+
+void dump_close(dump_t *dump) {
+	if (dump->fd >= 0)
+		close(dump->fd);
+	free(dump->xml);
+	free(dump->chunks);
+	free(dump->data);
+	free(dump->packed);
+	free(dump->zeros);
+	memset(dump, 0, sizeof(*dump));
+	dump->fd = -1;
+}
+
+// result: entry of a SCSI ID, NULL if not in the container
+dump_target_t *dump_find_target(dump_t *dump, int target_id) {
+	unsigned i;
+	for (i = 0; i < dump->target_count; i++)
+		if (dump->targets[i].target_id == (uint32_t) target_id)
+			return &dump->targets[i];
+	return NULL;
+}
+
+// "len" bytes of a chunk into dump->data
+static int read_chunk(dump_t *dump, dump_chunk_t *chunk, int64_t len) {
+	uLongf data_size = len;
+	switch (chunk->storage) {
+	case DUMP_CHUNK_ZERO:
+		memset(dump->data, 0, len);
+		return 0;
+	case DUMP_CHUNK_RAW:
+		if (chunk->size == len
+				&& pread_full(dump->fd, dump->data, len, chunk->offset) == len)
+			return 0;
+		break;
+	case DUMP_CHUNK_ZLIB:
+		if (pread_full(dump->fd, dump->packed, chunk->size, chunk->offset)
+				== chunk->size
+				&& uncompress((Bytef *) dump->data, &data_size,
+						(Bytef *) dump->packed, chunk->size) == Z_OK
+				&& (int64_t) data_size == len)
+			return 0;
+		break;
+	}
+	return error_set(ERROR_HOSTFILE, "Container chunk at %ld is corrupt",
+			chunk->offset);
+}
+
+// zero chunks: "fill_policy" on a card or file, written to a pipe
+static int fill_zeros(dump_t *dump, int fd, int sequential, int64_t offset,
+		int64_t size, int fill_policy) {
+	int res = 0;
+	if (!sequential)
+		return offload_fill(fd, offset, size, fill_policy);
+	while (size > 0 && !res) {
+		int64_t len = size < DUMP_CHUNK_SIZE ? size : DUMP_CHUNK_SIZE;
+		res = write_out(fd, 1, dump->zeros, len, offset);
+		offset += len;
+		size -= len;
+	}
+	return res;
+}
+
+/* data of a target to "offset" of "fd", checked against its digests.
+ * Runs of zero chunks are filled at once. "fd" < 0: only check.
+ */
+static int copy_target(dump_t *dump, dump_target_t *target, int fd,
+		int sequential, int64_t offset, int fill_policy, int64_t *done,
+		int64_t total, dump_progress_func_t progress) {
+	digest_t digest[DUMP_MAX_DIGESTS];
+	char text[DIGEST_MAX_TEXT];
+	int64_t zero_start = -1;
+	unsigned i, d;
+	int res = 0, digest_res = 0;
+
+	for (d = 0; d < target->digest_count; d++) {
+		res = digest_init(&digest[d], target->digests[d].algorithm);
+		if (res)
+			return res;
+	}
+	for (i = 0; i < target->chunk_count && !res; i++) {
+		dump_chunk_t *chunk = &dump->chunks[target->first_chunk + i];
+		int64_t position = (int64_t) i * DUMP_CHUNK_SIZE;
+		int64_t len = target->size - position;
+		if (len > DUMP_CHUNK_SIZE)
+			len = DUMP_CHUNK_SIZE;
+		if (chunk->storage == DUMP_CHUNK_ZERO) {
+			for (d = 0; d < target->digest_count; d++)
+				digest_update(&digest[d], dump->zeros, len);
+			if (zero_start < 0)
+				zero_start = position;
+		} else {
+			if (zero_start >= 0 && fd >= 0)
+				res = fill_zeros(dump, fd, sequential, offset + zero_start,
+						position - zero_start, fill_policy);
+			zero_start = -1;
+			if (!res)
+				res = read_chunk(dump, chunk, len);
+			if (!res) {
+				for (d = 0; d < target->digest_count; d++)
+					digest_update(&digest[d], dump->data, len);
+				if (fd >= 0)
+					res = write_out(fd, sequential, dump->data, len,
+							offset + position);
+			}
+		}
+		*done += len;
+		if (progress)
+			progress(*done, total);
+	}
+	if (!res && zero_start >= 0 && fd >= 0)
+		res = fill_zeros(dump, fd, sequential, offset + zero_start,
+				target->size - zero_start, fill_policy);
+	for (d = 0; d < target->digest_count; d++) {
+		digest_final(&digest[d], text);
+		if (!res && !digest_res && strcmp(text, target->digests[d].text))
+			digest_res = error_set(ERROR_HOSTFILE,
+					"SCSI ID %u: %s differs from container, data corrupt",
+					target->target_id, target->digests[d].algorithm);
+	}
+	return res ? res : digest_res;
+}
+
+// image source of align_write(): a target's data, unpacked chunk by chunk
+typedef struct {
+	dump_t *dump;
+	dump_target_t *target;
+	int64_t chunk_index; // in dump->data, -1 = none
+} restore_source_t;
+
+static int read_target(void *context, char *buffer, int64_t len,
+		int64_t offset) {
+	restore_source_t *source = context;
+	dump_target_t *target = source->target;
+
+	if (offset < 0 || offset + len > (int64_t) target->size)
+		return error_set(ERROR_HOSTFILE, "Container read beyond SCSI ID %u",
+				target->target_id);
+	while (len > 0) {
+		int64_t index = offset / DUMP_CHUNK_SIZE;
+		int64_t start = offset - index * DUMP_CHUNK_SIZE;
+		int64_t chunk_len = target->size - index * DUMP_CHUNK_SIZE;
+		int64_t n;
+		if (chunk_len > DUMP_CHUNK_SIZE)
+			chunk_len = DUMP_CHUNK_SIZE;
+		if (index != source->chunk_index) {
+			source->chunk_index = -1;
+			if (read_chunk(source->dump,
+					&source->dump->chunks[target->first_chunk + index],
+					chunk_len))
+				return ERROR_HOSTFILE;
+			source->chunk_index = index;
+		}
+		n = chunk_len - start < len ? chunk_len - start : len;
+		memcpy(buffer, source->dump->data + start, n);
+		buffer += n;
+		offset += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// xfer progress is per job, dump progress over all targets
+static __thread struct {
+	dump_progress_func_t func;
+	int64_t base;
+	int64_t total;
+} restore_progress;
+
+static int report_restore(int64_t done, int64_t total) {
+	(void) total;
+	if (restore_progress.func)
+		restore_progress.func(restore_progress.base + done,
+				restore_progress.total);
+	return 0;
+}
+
+/* a checked target to the card. Runs of data chunks go through
+ * align_write() in AU sized writes, runs of zero chunks are filled
+ * by "fill_policy".
+ */
+static int write_target(dump_t *dump, dump_target_t *target, int fd_card,
+		int64_t au_size, int64_t dirty_window, int fill_policy) {
+	restore_source_t source = { dump, target, -1 };
+	dump_chunk_t *chunks = &dump->chunks[target->first_chunk];
+	unsigned i = 0, run;
+	int res = 0;
+
+	while (i < target->chunk_count && !res) {
+		int zero = chunks[i].storage == DUMP_CHUNK_ZERO;
+		int64_t start = (int64_t) i * DUMP_CHUNK_SIZE, end;
+		for (run = i; run < target->chunk_count
+				&& (chunks[run].storage == DUMP_CHUNK_ZERO) == zero; run++)
+			;
+		end = (int64_t) run * DUMP_CHUNK_SIZE;
+		if (end > (int64_t) target->size)
+			end = target->size;
+		if (zero)
+			res = offload_fill(fd_card, target->card_offset + start,
+					end - start, fill_policy);
+		else {
+			xfer_job_t job;
+			xfer_job_init(&job, XFER_MODE_WRITE, -1, start, fd_card,
+					target->card_offset + start, end - start);
+			job.au_size = au_size;
+			job.au_merge = 1;
+			job.dirty_window = dirty_window;
+			job.read = read_target;
+			job.read_context = &source;
+			res = xfer_run(&job, report_restore);
+		}
+		restore_progress.base += end - start;
+		report_restore(0, 0);
+		i = run;
+	}
+	return res;
+}
+
+/* write all targets of the container to the card, at their dumped
+ * offsets, aligned to "au_size", with write-behind of "dirty_window".
+ * Zero chunks are handled by "fill_policy".
+ * All digests are checked before the card is touched, so a corrupt
+ * container leaves the card as it was. An I/O error during the write
+ * pass leaves the card undefined.
+ * result: 0 = OK, else error
+ */
+int dump_restore(dump_t *dump, int fd_card, int64_t au_size,
+		int64_t dirty_window, int fill_policy, dump_progress_func_t progress) {
+	int64_t total = 0, done = 0, end = 0;
+	unsigned i;
+	int res;
+
+	for (i = 0; i < dump->target_count; i++) {
+		dump_target_t *target = &dump->targets[i];
+		total += target->size;
+		if ((int64_t) (target->card_offset + target->size) > end)
+			end = target->card_offset + target->size;
+	}
+	if (device_size(fd_card) < end)
+		return error_set(ERROR_ILLPARAMVAL,
+				"SDcard too small: %ld bytes, container needs %ld",
+				device_size(fd_card), end);
+	// progress over check and write pass
+	for (i = 0; i < dump->target_count; i++) {
+		res = copy_target(dump, &dump->targets[i], -1, 0, 0, fill_policy,
+				&done, 2 * total, progress);
+		if (res)
+			return res;
+	}
+	restore_progress.func = progress;
+	restore_progress.base = done;
+	restore_progress.total = 2 * total;
+	// targets are stored in card offset order
+	for (i = 0; i < dump->target_count; i++) {
+		res = write_target(dump, &dump->targets[i], fd_card, au_size,
+				dirty_window, fill_policy);
+		if (res)
+			return res;
+	}
+	if (fsync(fd_card) < 0)
+		return error_set(ERROR_HOSTFILE, "SDcard sync failed, errno = %d",
+				errno);
+	return 0;
+}
+
+/* one target as raw image to "fd_img": a file gets holes for zero
+ * chunks, a pipe gets all data. result: 0 = OK, else error
+ */
+int dump_extract(dump_t *dump, dump_target_t *target, int fd_img,
+		dump_progress_func_t progress) {
+	struct stat statbuf;
+	int64_t done = 0;
+	int is_file = fstat(fd_img, &statbuf) == 0 && S_ISREG(statbuf.st_mode);
+	int res;
+
+	res = copy_target(dump, target, fd_img, stream_is_sequential(fd_img), 0,
+			is_file ? OFFLOAD_FILL_NONE : OFFLOAD_FILL_ZERO, &done,
+			target->size, progress);
+	if (!res && is_file && ftruncate(fd_img, target->size) < 0)
+		res = error_set(ERROR_HOSTFILE, "Can not set image size, errno = %d",
+				errno);
+	return res;
+}
@@ -0,0 +1,126 @@
+/* dump.h: whole SDcard in one container file
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+ */
+
+#ifndef DUMP_H_
+#define DUMP_H_
+
+#include <stdint.h>
+
+#include "config.h"
+#include "digest.h"
+
+#define DUMP_MAGIC	"IMG2SDCF" // start of file
+#define DUMP_INDEX_MAGIC	"IMG2SDIX" // trailer at end of file
+#define DUMP_VERSION	1
+// unit of compression, sparseness and random access
+#define DUMP_CHUNK_SIZE	(1024 * 1024)
+#define DUMP_MAX_DIGESTS	4
+#define DUMP_DIGEST_TEXT	132 // hex of up to 512 bits
+
+// compression of dumped chunks
+#define DUMP_COMPRESS_NONE	0 // plain data, zero chunks left out
+#define DUMP_COMPRESS_FAST	1 // zlib level 1
+#define DUMP_COMPRESS_BEST	2 // zlib level 9
+
+// how a chunk is stored
+#define DUMP_CHUNK_ZERO	0 // all zero, no data in file
+#define DUMP_CHUNK_RAW	1
+#define DUMP_CHUNK_ZLIB	2
+
+// file layout, all numbers little endian:
+// header, layout XML, chunk data, target table, chunk table, trailer
+typedef struct {
+	char magic[8]; // DUMP_MAGIC
+	uint32_t version;
+	uint32_t chunk_size;
+	uint64_t xml_size; // layout XML follows the header
+	char reserved[40];
+} dump_header_t;
+
+typedef struct {
+	uint64_t offset; // in container
+	uint32_t size; // stored bytes
+	uint32_t storage; // DUMP_CHUNK_*
+} dump_chunk_t;
+
+typedef struct {
+	char algorithm[DIGEST_MAX_NAME];
+	char text[DUMP_DIGEST_TEXT];
+} dump_digest_t;
+
+// one partition, in card offset order
+typedef struct {
+	uint32_t target_id;
+	uint32_t bytes_per_sector;
+	uint64_t card_offset;
+	uint64_t size;
+	uint32_t first_chunk; // index in chunk table
+	uint32_t chunk_count;
+	uint32_t digest_count;
+	uint32_t reserved;
+	dump_digest_t digests[DUMP_MAX_DIGESTS]; // of the partition data
+} dump_target_t;
+
+typedef struct {
+	char magic[8]; // DUMP_INDEX_MAGIC
+	uint64_t index_offset; // of the target table
+	uint32_t target_count;
+	uint32_t chunk_count;
+	uint32_t index_crc; // crc32 of both tables
+	uint32_t reserved;
+} dump_trailer_t;
+
+// an open container
+typedef struct {
+	int fd;
+	int64_t position; // dump: bytes written
+	dump_header_t header;
+	char *xml; // layout, terminated by \0
+	dump_target_t targets[MAX_SCSITARGETS];
+	unsigned target_count;
+	dump_chunk_t *chunks;
+	unsigned chunk_count;
+
+	// private: buffers of one chunk
+	char *data;
+	char *packed; // compressed
+	char *zeros;
+} dump_t;
+
+typedef void (*dump_progress_func_t)(int64_t done, int64_t total);
+
+int dump_card(dump_t *dump, int fd_out, int fd_card, char *config_filename,
+		config_scsitarget_t *targets, int compression,
+		char digests[][DIGEST_MAX_NAME], unsigned digest_count,
+		dump_progress_func_t progress);
+int dump_open(dump_t *dump, char *filename);
+void dump_close(dump_t *dump);
+dump_target_t *dump_find_target(dump_t *dump, int target_id);
+int dump_restore(dump_t *dump, int fd_card, int64_t au_size,
+		int64_t dirty_window, int fill_policy, dump_progress_func_t progress);
+int dump_extract(dump_t *dump, dump_target_t *target, int fd_img,
+		dump_progress_func_t progress);
+
+#endif /* DUMP_H_ */
@@ -41,6 +41,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <setjmp.h>
 
 #include "utils.h"
 #include "error.h"  // own
@@ -49,22 +50,34 @@ extern int opt_verbose; //main
 
 FILE *ferr = NULL; // variable error stream
 
-// global last raised error
-int error_code;
+// last raised error of this thread
+__thread int error_code;
+
+// catch points of this thread
+static __thread error_catch_t *error_catcher = NULL;
+
+// resources to release when error() jumps to a catch point
+static __thread struct {
+	error_cleanup_func_t func;
+	void *arg;
+} error_cleanups[ERROR_MAX_CLEANUPS];
+static __thread unsigned error_cleanup_count = 0;
 // a stack of messages, for several caller infos
 //int error_trace_level;
 //char error_message[ERROR_MAX_TRACE_LEVEL + 1][1024];
 
 void error_clear() {
 	error_code = 0;
+	if (error_catcher)
+		error_catcher->text[0] = 0;
 //	error_trace_level = 0;  //
 }
 
 // raise an error.
 // can be used as "return error_set(...);"
-//  text is pushed onto an message stack
+// Without catch point: print and exit. With one: text is kept for error()
 int error_set(int code, char *fmt, ...) {
-	char buffer[1024];
+	char buffer[ERROR_MAX_TEXT];
 	va_list args;
 //	assert(error_trace_level < ERROR_MAX_TRACE_LEVEL) ;
 	error_code = code;
@@ -72,14 +85,58 @@ int error_set(int code, char *fmt, ...) {
 		error_clear();
 	else if (fmt && strlen(fmt)) {
 		va_start(args, fmt);
-		vsprintf(buffer, fmt, args);
+		vsnprintf(buffer, sizeof(buffer), fmt, args);
 		va_end(args);
 		// strcpy(error_message[error_trace_level++], buffer);
-		error(buffer);
+		if (error_catcher) {
+			// library operation: caller cleans up and passes it up
+			strcpy(error_catcher->text, buffer);
+			return code;
+		}
+		error("%s", buffer);
 	}
 	return error_code;
 }
 
+// set a catch point for this thread, then call setjmp(catch->env)
+void error_catch_begin(error_catch_t *catch) {
+	catch->code = ERROR_OK;
+	catch->text[0] = 0;
+	catch->cleanup_level = error_cleanup_count;
+	catch->prev = error_catcher;
+	error_catcher = catch;
+}
+
+void error_catch_end(error_catch_t *catch) {
+	error_catcher = catch->prev;
+}
+
+// result: 1 if errors in this thread return to a catch point
+int error_catching(void) {
+	return error_catcher != NULL;
+}
+
+/* register a resource, as pthread_cleanup_push().
+ * Without catch point, cleanups are only executed by error_cleanup_pop().
+ */
+void error_cleanup_push(error_cleanup_func_t func, void *arg) {
+	if (error_cleanup_count >= ERROR_MAX_CLEANUPS)
+		fatal("Too many cleanups");
+	error_cleanups[error_cleanup_count].func = func;
+	error_cleanups[error_cleanup_count].arg = arg;
+	error_cleanup_count++;
+}
+
+// remove the last registered resource, and release it if "execute"
+void error_cleanup_pop(int execute) {
+	if (error_cleanup_count == 0)
+		fatal("Cleanup stack empty");
+	error_cleanup_count--;
+	if (execute)
+		error_cleanups[error_cleanup_count].func(
+				error_cleanups[error_cleanup_count].arg);
+}
+
 // print an info message and return
 void info(char *fmt, ...) {
 	va_list args;
@@ -103,9 +160,29 @@ void warning(char *fmt, ...) {
 		va_end(args);
 }
 
-// print an error message and return
+/* print an error message and exit.
+ * With a catch point in this thread: release resources and jump there.
+ * The text of a pending error_set() is appended.
+ */
 void error(char *fmt, ...) {
 	va_list args;
+	error_catch_t *catch = error_catcher;
+	if (catch) {
+		char cause[ERROR_MAX_TEXT];
+		int n;
+		strcpy(cause, error_code ? catch->text : "");
+		va_start(args, fmt);
+		n = vsnprintf(catch->text, sizeof(catch->text), fmt, args);
+		va_end(args);
+		if (cause[0] && strcmp(cause, catch->text)
+				&& n < (int) sizeof(catch->text))
+			snprintf(catch->text + n, sizeof(catch->text) - n, ": %s", cause);
+		catch->code = error_code ? error_code : ERROR_ILLPARAMVAL;
+		error_code = ERROR_OK;
+		while (error_cleanup_count > catch->cleanup_level)
+			error_cleanup_pop(1);
+		longjmp(catch->env, 1);
+	}
 	va_start(args, fmt);
 //	fprintf(ferr, "[%s ERROR]  ", cur_time_text());
 	fprintf(ferr, "ERROR: ");
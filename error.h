@@ -40,6 +40,7 @@
 #define _ERROR_H_
 
 #include <stdio.h>
+#include <setjmp.h>
 
 // possible errors
 #define ERROR_OK	0
@@ -54,6 +55,7 @@
 #define ERROR_IMAGE_EOF -9 // file pointer moved outside tape image
 #define ERROR_MONITOR -10 // response from PDP-11 monitor not understood
 #define ERROR_TTY -12 //  I/O error in teletype emulation
+#define ERROR_CANCELED -13 // operation stopped by caller
 
 // expected error messages
 #define STATUS_MONITOR_NOPROMPT 1
@@ -62,15 +64,44 @@
 
 //#define	ERROR_MAX_TRACE_LEVEL	10
 
+#define ERROR_MAX_TEXT	1024
+#define ERROR_MAX_CLEANUPS	16
+
+/* recovery point for library use. error() in the thread of the catch
+ * point runs the cleanups pushed since, and returns to setjmp(env)
+ * instead of exiting. error_set() there only records code and text,
+ * and returns the code: the caller releases its resources and passes
+ * the error up, until someone calls error().
+ * Catch points and the error code are per thread. Worker threads of a
+ * library operation set their own.
+ */
+typedef struct error_catch_struct {
+	jmp_buf env;
+	int code; // caught error, ERROR_*
+	char text[ERROR_MAX_TEXT];
+
+	// private
+	unsigned cleanup_level; // cleanups pushed before
+	struct error_catch_struct *prev; // nested catch point
+} error_catch_t;
+
+typedef void (*error_cleanup_func_t)(void *arg);
+
 #ifndef _ERROR_C_
 extern FILE *ferr; // variable error stream
-extern int error_code ;
+extern __thread int error_code ; // of this thread
 //extern char  error_message[ERROR_MAX_TRACE_LEVEL+1][1024] ;
 #endif
 
 void error_clear(void) ;
 int error_set(int code, char *fmt, ...) ;
 
+void error_catch_begin(error_catch_t *catch);
+void error_catch_end(error_catch_t *catch);
+int error_catching(void);
+void error_cleanup_push(error_cleanup_func_t func, void *arg);
+void error_cleanup_pop(int execute);
+
 void fatal(char *, ...);
 void error(char *, ...);
 void warning(char *, ...);
@@ -0,0 +1,461 @@
+/* fsfile.c: single files on PDP-11 file systems
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+
+ A file is located by reading only the directory from the volume,
+ then its blocks are read or overwritten in place:
+ - RT-11: "NAME.EXT", contiguous, found in the directory segments.
+ - Files-11 ODS-1: "[g,m]NAME.EXT;v", directory [g,m] is searched in
+   the MFD, the file header is read through the index file.
+   Without version the highest is used.
+ Files are never created, moved or resized: a new content must fit into
+ the blocks already allocated.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#include "utils.h"
+#include "fsmap.h"
+#include "fsfile.h"	// own
+
+#define FSFILE_BUFFER_SIZE	(64 * 1024)
+
+#define F11_HOME_BLOCK	1
+#define F11_HOME_IBSZ	000 // index file bitmap size
+#define F11_HOME_IBLB	002 // index file bitmap LBN, high word first
+#define F11_HOME_INDN	0760 // "DECFILE11A  "
+#define F11_INDEX_FILE	1
+#define F11_MFD_FILE	4
+#define F11_H_FNUM	002
+#define F11_H_UFAT	016 // user attributes: FCS record block
+#define F11_F_EFBK	010 // end of file block, high word first
+#define F11_F_FFBY	014 // first free byte in end of file block
+#define F11_H_CKSM	0776 // checksum of words 0..254
+#define F11_M_EFNU	002 // extension header file number
+#define F11_MAX_EXTENSIONS	32
+#define F11_DIR_ENTRY_SIZE	16
+
+static char rad50_chars[] = " ABCDEFGHIJKLMNOPQRSTUVWXYZ$.%0123456789";
+
+// parsed "[g,m]NAME.EXT;v"
+typedef struct {
+	int has_ufd;
+	unsigned group, member;
+	char name[14]; // "NAME.EXT", upper case, always with "."
+	unsigned version; // 0 = highest
+} file_name_t;
+
+// Files-11 volume, for one fsfile_open()
+typedef struct {
+	fsmap_volume_t *volume;
+	unsigned ibsz;
+	fsfile_t index; // INDEXF.SYS
+	fsfile_t dir; // directory being searched
+} files11_t;
+
+// 3 chars of a RAD50 word, trailing blanks removed
+static void rad50_decode(unsigned word, char *text) {
+	char *s = text + strlen(text);
+	s[0] = word / 1600 < 40 ? rad50_chars[word / 1600] : '?';
+	s[1] = rad50_chars[(word / 40) % 40];
+	s[2] = rad50_chars[word % 40];
+	s[3] = 0;
+	while (s > text && text[strlen(text) - 1] == ' ')
+		text[strlen(text) - 1] = 0;
+}
+
+// "NAME.EXT" from "name_words" RAD50 words and an extension word
+static void rad50_file_name(unsigned *words, int name_words, char *text) {
+	int i;
+	text[0] = 0;
+	for (i = 0; i < name_words; i++)
+		rad50_decode(words[i], text);
+	strcat(text, ".");
+	rad50_decode(words[name_words], text);
+}
+
+// result: 0 = OK
+static int parse_name(char *text, file_name_t *name) {
+	char *s = text, *semicolon, *dot;
+	int n = 0, len, name_len;
+
+	memset(name, 0, sizeof(*name));
+	if (*s == '[') {
+		if (sscanf(s, "[%o,%o]%n", &name->group, &name->member, &n) < 2 || !n
+				|| name->group > 0377 || name->member > 0377)
+			return -1;
+		name->has_ufd = 1;
+		s += n;
+	}
+	semicolon = strchr(s, ';');
+	len = semicolon ? semicolon - s : (int) strlen(s);
+	// at most 9 chars name, 3 chars extension
+	dot = memchr(s, '.', len);
+	name_len = dot ? dot - s : len;
+	if (name_len < 1 || name_len > 9 || (dot && (len - name_len - 1 > 3
+			|| memchr(dot + 1, '.', len - name_len - 1))))
+		return -1;
+	if (semicolon) {
+		char *end;
+		name->version = strtoul(semicolon + 1, &end, 8);
+		if (*end || end == semicolon + 1 || name->version < 1
+				|| name->version > 077777)
+			return -1;
+	}
+	for (n = 0; n < len; n++) {
+		name->name[n] = toupper((unsigned char) s[n]);
+		if (!strchr(rad50_chars + 1, name->name[n]))
+			return -1;
+	}
+	if (!strchr(name->name, '.'))
+		strcat(name->name, ".");
+	return 0;
+}
+
+// partition byte offset of virtual block "vbn" (1 = first), < 0 = outside
+static int64_t vbn_offset(fsfile_t *file, int64_t vbn) {
+	int64_t pos = (vbn - 1) * FSMAP_BLOCK_SIZE;
+	int i;
+	for (i = 0; i < file->count && pos >= 0; i++) {
+		if (pos < file->extents[i].size)
+			return file->extents[i].offset + pos;
+		pos -= file->extents[i].size;
+	}
+	return -1;
+}
+
+/*** RT-11 ***/
+
+typedef struct {
+	file_name_t *name;
+	fsfile_t *file;
+} rt11_find_t;
+
+static int rt11_match(void *context, fsmap_rt11_entry_t *entry) {
+	rt11_find_t *find = context;
+	char text[16];
+	if (!(entry->status & FSMAP_RT11_PERM))
+		return 0;
+	rad50_file_name(entry->name, 2, text);
+	if (strcmp(text, find->name->name))
+		return 0;
+	strcpy(find->file->name, text);
+	find->file->count = 1;
+	find->file->extents[0].offset = entry->start * FSMAP_BLOCK_SIZE;
+	find->file->extents[0].size = (int64_t) entry->length * FSMAP_BLOCK_SIZE;
+	return 1;
+}
+
+/*** Files-11 ODS-1 ***/
+
+// read header of file "fnum", result: 0 = OK, else FSFILE_CORRUPT
+static int files11_header(files11_t *f11, unsigned fnum, unsigned char *header,
+		int64_t *block) {
+	int64_t offset = vbn_offset(&f11->index, 2 + f11->ibsz + fnum);
+	unsigned sum = 0;
+	int i;
+
+	if (offset < 0
+			|| fsmap_read_blocks(f11->volume, offset / FSMAP_BLOCK_SIZE, 1,
+					header) || fsmap_word(header, F11_H_FNUM) != fnum)
+		return FSFILE_CORRUPT;
+	for (i = 0; i < F11_H_CKSM; i += 2)
+		sum += fsmap_word(header, i);
+	if ((sum & 0xffff) != fsmap_word(header, F11_H_CKSM))
+		return FSFILE_CORRUPT;
+	*block = offset / FSMAP_BLOCK_SIZE;
+	return 0;
+}
+
+/* map all blocks of a file, with extension headers.
+ * Extents must lie on the volume: fsfile_read() and fsfile_write() access
+ * them directly, a bad one would reach into the next partition.
+ */
+static int files11_map_file(files11_t *f11, unsigned fnum, fsfile_t *file) {
+	unsigned char header[FSMAP_BLOCK_SIZE];
+	unsigned char *ufat = header + F11_H_UFAT;
+	int64_t volume_size = f11->volume->blocks * FSMAP_BLOCK_SIZE;
+	int64_t efbk, block;
+	int extensions = 0, i, n;
+
+	file->type = FSMAP_FILES11;
+	file->count = 0;
+	if (files11_header(f11, fnum, header, &file->header_block))
+		return FSFILE_CORRUPT;
+	efbk = ((int64_t) fsmap_word(ufat, F11_F_EFBK) << 16)
+			| fsmap_word(ufat, F11_F_EFBK + 2);
+	file->size = efbk ? (efbk - 1) * FSMAP_BLOCK_SIZE
+					+ fsmap_word(ufat, F11_F_FFBY) : -1;
+	for (;;) {
+		n = fsmap_files11_map(header, file->extents + file->count,
+				FSFILE_MAX_EXTENTS - file->count);
+		if (n < 0)
+			return FSFILE_CORRUPT;
+		for (i = file->count; i < file->count + n; i++)
+			if (file->extents[i].offset < 0 || file->extents[i].size < 0
+					|| file->extents[i].offset + file->extents[i].size
+							> volume_size)
+				return FSFILE_CORRUPT;
+		file->count += n;
+		fnum = fsmap_word(header + 2 * header[1], F11_M_EFNU);
+		if (!fnum)
+			break;
+		if (++extensions > F11_MAX_EXTENSIONS
+				|| files11_header(f11, fnum, header, &block))
+			return FSFILE_CORRUPT;
+	}
+	file->allocated = 0;
+	for (i = 0; i < file->count; i++)
+		file->allocated += file->extents[i].size;
+	if (file->size < 0 || file->size > file->allocated)
+		file->size = file->allocated;
+	return 0;
+}
+
+/* search "name" in a directory file.
+ * result: file number, 0 = not found, < 0 = error
+ */
+static int files11_find(files11_t *f11, unsigned dir_fnum, char *name,
+		unsigned version, unsigned *found_version) {
+	fsfile_t *dir = &f11->dir;
+	unsigned char block[FSMAP_BLOCK_SIZE];
+	int64_t vbn, pos;
+	int fnum = 0;
+
+	if (files11_map_file(f11, dir_fnum, dir))
+		return -1;
+	*found_version = 0;
+	for (vbn = 1; (vbn - 1) * FSMAP_BLOCK_SIZE < dir->size; vbn++) {
+		int64_t offset = vbn_offset(dir, vbn);
+		if (offset < 0
+				|| fsmap_read_blocks(f11->volume, offset / FSMAP_BLOCK_SIZE, 1,
+						block))
+			return -1;
+		for (pos = 0; pos < FSMAP_BLOCK_SIZE
+						&& (vbn - 1) * FSMAP_BLOCK_SIZE + pos < dir->size;
+				pos += F11_DIR_ENTRY_SIZE) {
+			unsigned char *entry = block + pos;
+			unsigned words[4], entry_version;
+			char text[16];
+			int i;
+			if (!fsmap_word(entry, 0))
+				continue; // empty
+			for (i = 0; i < 4; i++)
+				words[i] = fsmap_word(entry, 6 + 2 * i);
+			rad50_file_name(words, 3, text);
+			entry_version = fsmap_word(entry, 14);
+			if (strcmp(text, name))
+				continue;
+			if (version ? entry_version == version
+					: entry_version > *found_version) {
+				fnum = fsmap_word(entry, 0);
+				*found_version = entry_version;
+			}
+		}
+	}
+	return fnum;
+}
+
+// result: FSFILE_*
+static int files11_locate(files11_t *f11, fsmap_volume_t *volume,
+		file_name_t *name, fsfile_t *file) {
+	unsigned char home[FSMAP_BLOCK_SIZE];
+	unsigned char header[FSMAP_BLOCK_SIZE];
+	char ufd_name[16];
+	unsigned version;
+	int64_t index_lbn;
+	int fnum, n;
+
+	if (fsmap_read_blocks(volume, F11_HOME_BLOCK, 1, home)
+			|| memcmp(home + F11_HOME_INDN, "DECFILE11A", 10))
+		return FSFILE_NO_FILESYSTEM;
+	if (!name->has_ufd)
+		return FSFILE_BAD_NAME;
+	f11->volume = volume;
+	f11->ibsz = fsmap_word(home, F11_HOME_IBSZ);
+	index_lbn = ((int64_t) fsmap_word(home, F11_HOME_IBLB) << 16)
+			| fsmap_word(home, F11_HOME_IBLB + 2);
+	// header of INDEXF.SYS itself follows the index bitmap
+	if (fsmap_read_blocks(volume, index_lbn + f11->ibsz, 1, header)
+			|| fsmap_word(header, F11_H_FNUM) != F11_INDEX_FILE)
+		return FSFILE_CORRUPT;
+	n = fsmap_files11_map(header, f11->index.extents, FSFILE_MAX_EXTENTS);
+	if (n < 1)
+		return FSFILE_CORRUPT;
+	f11->index.count = n;
+
+	// UFD "gggmmm.DIR" in the MFD
+	sprintf(ufd_name, "%03o%03o.DIR", name->group, name->member);
+	fnum = files11_find(f11, F11_MFD_FILE, ufd_name, 0, &version);
+	if (fnum <= 0)
+		return fnum < 0 ? FSFILE_CORRUPT : FSFILE_NOT_FOUND;
+	fnum = files11_find(f11, fnum, name->name, name->version, &version);
+	if (fnum <= 0)
+		return fnum < 0 ? FSFILE_CORRUPT : FSFILE_NOT_FOUND;
+	if (files11_map_file(f11, fnum, file))
+		return FSFILE_CORRUPT;
+	snprintf(file->name, sizeof(file->name), "[%o,%o]%s;%o", name->group,
+			name->member, name->name, version);
+	return FSFILE_OK;
+}
+
+// state of the search is allocated per call, several threads may open files
+static int files11_open(fsmap_volume_t *volume, file_name_t *name,
+		fsfile_t *file) {
+	files11_t *f11 = calloc(1, sizeof(*f11));
+	int res;
+
+	if (!f11)
+		return FSFILE_CORRUPT;
+	res = files11_locate(f11, volume, name, file);
+	free(f11);
+	return res;
+}
+
+/* locate file "name" on "volume", the file system is detected.
+ * result: FSFILE_*
+ */
+int fsfile_open(fsfile_t *file, fsmap_volume_t *volume, char *name) {
+	file_name_t parsed;
+	rt11_find_t find;
+
+	memset(file, 0, sizeof(*file));
+	file->header_block = -1;
+	if (parse_name(name, &parsed))
+		return FSFILE_BAD_NAME;
+	find.name = &parsed;
+	find.file = file;
+	if (fsmap_rt11_walk(volume, rt11_match, &find, NULL) == 0) {
+		file->type = FSMAP_RT11;
+		if (parsed.has_ufd || parsed.version)
+			return FSFILE_BAD_NAME;
+		if (!file->count)
+			return FSFILE_NOT_FOUND;
+		// length is counted in blocks only
+		file->allocated = file->size = file->extents[0].size;
+		if (file->extents[0].offset + file->allocated
+				> volume->blocks * FSMAP_BLOCK_SIZE)
+			return FSFILE_CORRUPT;
+		return FSFILE_OK;
+	}
+	return files11_open(volume, &parsed, file);
+}
+
+/* copy file content to "fd_out", from offset 0.
+ * result: 0 = OK, else I/O error
+ */
+int fsfile_read(fsfile_t *file, fsmap_volume_t *volume, int fd_out) {
+	unsigned char buffer[FSFILE_BUFFER_SIZE];
+	int64_t done = 0;
+	int i;
+
+	for (i = 0; i < file->count && done < file->size; i++) {
+		int64_t pos;
+		for (pos = 0; pos < file->extents[i].size && done < file->size;) {
+			int64_t n = file->extents[i].size - pos;
+			if (n > FSFILE_BUFFER_SIZE)
+				n = FSFILE_BUFFER_SIZE;
+			if (n > file->size - done)
+				n = file->size - done;
+			if (pread_full(volume->fd, buffer, n,
+					volume->offset + file->extents[i].offset + pos) != n
+					|| pwrite_full(fd_out, buffer, n, done) != n)
+				return -1;
+			pos += n;
+			done += n;
+		}
+	}
+	return 0;
+}
+
+/* overwrite file content with "size" bytes from "fd_in".
+ * RT-11: all allocated blocks are written, zeros behind the data.
+ * Files-11: the last block is zero padded, end of file is set to "size".
+ * result: 0 = OK, else I/O error or "size" too large
+ */
+int fsfile_write(fsfile_t *file, fsmap_volume_t *volume, int fd_in,
+		int64_t size) {
+	unsigned char buffer[FSFILE_BUFFER_SIZE];
+	int64_t done = 0, end;
+	int i;
+
+	if (size > file->allocated)
+		return -1;
+	if (file->type == FSMAP_RT11)
+		end = file->allocated;
+	else
+		end = (size + FSMAP_BLOCK_SIZE - 1) / FSMAP_BLOCK_SIZE * FSMAP_BLOCK_SIZE;
+	for (i = 0; i < file->count && done < end; i++) {
+		int64_t pos;
+		for (pos = 0; pos < file->extents[i].size && done < end;) {
+			int64_t n = file->extents[i].size - pos;
+			if (n > FSFILE_BUFFER_SIZE)
+				n = FSFILE_BUFFER_SIZE;
+			if (n > end - done)
+				n = end - done;
+			// reads zeros behind end of input
+			if (done >= size)
+				memset(buffer, 0, n);
+			else if (pread_full(fd_in, buffer,
+					n < size - done ? n : size - done, done) < 0)
+				return -1;
+			if (done < size && size - done < n)
+				memset(buffer + (size - done), 0, n - (size - done));
+			if (pwrite_full(volume->fd, buffer, n,
+					volume->offset + file->extents[i].offset + pos) != n)
+				return -1;
+			pos += n;
+			done += n;
+		}
+	}
+
+	if (file->header_block >= 0) {
+		unsigned char header[FSMAP_BLOCK_SIZE];
+		unsigned char *ufat = header + F11_H_UFAT;
+		int64_t efbk = size / FSMAP_BLOCK_SIZE + 1;
+		unsigned sum = 0;
+		if (fsmap_read_blocks(volume, file->header_block, 1, header))
+			return -1;
+		ufat[F11_F_EFBK] = (efbk >> 16) & 0xff;
+		ufat[F11_F_EFBK + 1] = (efbk >> 24) & 0xff;
+		ufat[F11_F_EFBK + 2] = efbk & 0xff;
+		ufat[F11_F_EFBK + 3] = (efbk >> 8) & 0xff;
+		ufat[F11_F_FFBY] = (size % FSMAP_BLOCK_SIZE) & 0xff;
+		ufat[F11_F_FFBY + 1] = (size % FSMAP_BLOCK_SIZE) >> 8;
+		for (i = 0; i < F11_H_CKSM; i += 2)
+			sum += fsmap_word(header, i);
+		header[F11_H_CKSM] = sum & 0xff;
+		header[F11_H_CKSM + 1] = (sum >> 8) & 0xff;
+		if (pwrite_full(volume->fd, header, FSMAP_BLOCK_SIZE,
+				volume->offset + file->header_block * FSMAP_BLOCK_SIZE)
+				!= FSMAP_BLOCK_SIZE)
+			return -1;
+	}
+	file->size = size;
+	return 0;
+}
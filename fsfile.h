@@ -0,0 +1,61 @@
+/* fsfile.h: single files on PDP-11 file systems
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+ */
+
+#ifndef FSFILE_H_
+#define FSFILE_H_
+
+#include <stdint.h>
+
+#include "fsmap.h"
+
+// file fragments, more are rejected
+#define FSFILE_MAX_EXTENTS	1024
+// name syntax "[g,m]NAME.EXT;v"
+#define FSFILE_MAX_NAME	40
+
+// result codes of fsfile_open()
+#define FSFILE_OK	0
+#define FSFILE_NOT_FOUND	1
+#define FSFILE_NO_FILESYSTEM	2
+#define FSFILE_BAD_NAME	3
+#define FSFILE_CORRUPT	4
+
+// a file located on a volume
+typedef struct {
+	int type; // FSMAP_RT11 or FSMAP_FILES11
+	char name[FSFILE_MAX_NAME]; // as found in directory
+	int count;
+	fsmap_extent_t extents[FSFILE_MAX_EXTENTS]; // virtual block order
+	int64_t allocated; // sum of extent sizes
+	int64_t size; // bytes up to end of file
+	int64_t header_block; // Files-11 file header, else -1
+} fsfile_t;
+
+int fsfile_open(fsfile_t *file, fsmap_volume_t *volume, char *name);
+int fsfile_read(fsfile_t *file, fsmap_volume_t *volume, int fd_out);
+int fsfile_write(fsfile_t *file, fsmap_volume_t *volume, int fd_in,
+		int64_t size);
+
+#endif /* FSFILE_H_ */
@@ -0,0 +1,502 @@
+/* fsmap.c: allocated blocks of PDP-11 file systems
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+
+ The allocation of a partition is read from its file system:
+ - RT-11: files are contiguous, the directory segments list all of them.
+ - Files-11 ODS-1 (RSX, IAS): storage bitmap file BITMAP.SYS,
+   located through the home block and the index file header.
+ - RSTS/E RDS 1.x: SATT.SYS in account [0,1], located through
+   pack label, MFD, GFD and UFD.
+ Each parser marks used blocks in a bit array, which is converted into
+ an extent list. Any inconsistency makes the parser fail, then the whole
+ partition has to be transferred.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "utils.h"
+#include "fsmap.h"	// own
+
+static char *type_names[] = { "none", "auto", "rt11", "files11", "rsts",
+NULL };
+
+// bit array of used blocks
+typedef struct {
+	fsmap_volume_t *volume;
+	unsigned char *bits;
+} usage_t;
+
+// result: FSMAP_*, or -1 if unknown
+int fsmap_parse_type(char *name) {
+	int i;
+	for (i = 0; type_names[i]; i++)
+		if (!strcasecmp(name, type_names[i]))
+			return i;
+	return -1;
+}
+
+char *fsmap_type_name(int type) {
+	if (type < 0 || type > FSMAP_RSTS)
+		return "?";
+	return type_names[type];
+}
+
+/* read "count" blocks, starting at partition block "block".
+ * result: 0 = OK, else error
+ */
+int fsmap_read_blocks(fsmap_volume_t *volume, int64_t block, int count,
+		void *buffer) {
+	if (block < 0 || block + count > volume->blocks)
+		return -1;
+	return pread_full(volume->fd, buffer, (size_t) count * FSMAP_BLOCK_SIZE,
+			volume->offset + block * FSMAP_BLOCK_SIZE) < 0;
+}
+
+// PDP-11 word, little endian
+unsigned fsmap_word(unsigned char *data, unsigned offset) {
+	return data[offset] | (data[offset + 1] << 8);
+}
+
+// result: 0 = OK, else range outside volume
+static int mark_used(usage_t *usage, int64_t block, int64_t count) {
+	if (block < 0 || count < 0 || block + count > usage->volume->blocks)
+		return -1;
+	for (; count > 0; block++, count--)
+		usage->bits[block / 8] |= 1 << (block % 8);
+	return 0;
+}
+
+/*** RT-11 ***/
+
+#define RT11_HOME_BLOCK	1
+#define RT11_HOME_DIRSTART	0724 // first directory segment
+#define RT11_HOME_SYSID	0760 // "DECRT11A    "
+#define RT11_SEGMENT_BLOCKS	2
+#define RT11_MAX_SEGMENTS	31
+#define RT11_E_EOS	0004000 // end of segment
+
+/* call "func" for each entry of an RT-11 directory, until it returns != 0.
+ * dir_end: first block behind the directory segments
+ * result: 0 = OK, else no valid RT-11 directory
+ */
+int fsmap_rt11_walk(fsmap_volume_t *volume, fsmap_rt11_func_t func,
+		void *context, int64_t *dir_end) {
+	unsigned char home[FSMAP_BLOCK_SIZE];
+	unsigned char segment[RT11_SEGMENT_BLOCKS * FSMAP_BLOCK_SIZE];
+	unsigned first_block, total, segment_nr, visited = 0;
+
+	if (fsmap_read_blocks(volume, RT11_HOME_BLOCK, 1, home))
+		return -1;
+	first_block = fsmap_word(home, RT11_HOME_DIRSTART);
+	if (memcmp(home + RT11_HOME_SYSID, "DECRT11A", 8) && first_block != 6)
+		return -1;
+	if (fsmap_read_blocks(volume, first_block, RT11_SEGMENT_BLOCKS, segment))
+		return -1;
+	total = fsmap_word(segment, 0);
+	if (total < 1 || total > RT11_MAX_SEGMENTS)
+		return -1;
+	if (dir_end)
+		*dir_end = first_block + total * RT11_SEGMENT_BLOCKS;
+
+	for (segment_nr = 1; segment_nr; segment_nr = fsmap_word(segment, 2)) {
+		unsigned extra, entry_size, pos;
+		int64_t block;
+		if (segment_nr > total || ++visited > total
+				|| fsmap_read_blocks(volume,
+						first_block + (segment_nr - 1) * RT11_SEGMENT_BLOCKS,
+						RT11_SEGMENT_BLOCKS, segment))
+			return -1;
+		extra = fsmap_word(segment, 6);
+		block = fsmap_word(segment, 8);
+		if (extra % 2 || extra > 100)
+			return -1;
+		entry_size = 14 + extra;
+		for (pos = 10; pos + entry_size <= sizeof(segment); pos += entry_size) {
+			fsmap_rt11_entry_t entry;
+			entry.status = fsmap_word(segment, pos);
+			entry.name[0] = fsmap_word(segment, pos + 2);
+			entry.name[1] = fsmap_word(segment, pos + 4);
+			entry.name[2] = fsmap_word(segment, pos + 6);
+			entry.length = fsmap_word(segment, pos + 8);
+			entry.start = block;
+			if (entry.status & RT11_E_EOS)
+				break;
+			if (!(entry.status & (FSMAP_RT11_TENT | FSMAP_RT11_MPTY | FSMAP_RT11_PERM)))
+				return -1; // no valid entry
+			if (func(context, &entry))
+				return 0;
+			block += entry.length;
+		}
+	}
+	return 0;
+}
+
+typedef struct {
+	usage_t *usage;
+	int error;
+} rt11_mark_t;
+
+// result: != 0 stops walk, if entry is outside the volume
+static int rt11_mark_entry(void *context, fsmap_rt11_entry_t *entry) {
+	rt11_mark_t *mark = context;
+	if (!(entry->status & (FSMAP_RT11_TENT | FSMAP_RT11_PERM)))
+		return 0;
+	mark->error = mark_used(mark->usage, entry->start, entry->length);
+	return mark->error;
+}
+
+static int parse_rt11(usage_t *usage) {
+	rt11_mark_t mark = { usage, 0 };
+	int64_t dir_end;
+
+	if (fsmap_rt11_walk(usage->volume, rt11_mark_entry, &mark, &dir_end)
+			|| mark.error)
+		return -1;
+	// boot, home block and directory
+	return mark_used(usage, 0, dir_end);
+}
+
+/*** Files-11 ODS-1 ***/
+
+#define F11_HOME_BLOCK	1
+#define F11_HOME_IBSZ	000 // index file bitmap size
+#define F11_HOME_IBLB	002 // index file bitmap LBN, high word first
+#define F11_HOME_SBCL	010 // storage bitmap cluster factor
+#define F11_HOME_INDN	0760 // "DECFILE11A  "
+#define F11_BITMAP_FILE	2 // file number of BITMAP.SYS
+#define F11_MAX_RETRIEVAL	256
+
+/* retrieval pointers of a file header, format 1: 8 bit high LBN,
+ * 8 bit count-1, 16 bit low LBN.
+ * runs[]: byte ranges of the file in virtual block order, adjacent
+ * pointers are joined.
+ * result: count of runs, < 0 = error or more than "max_runs"
+ */
+int fsmap_files11_map(unsigned char *header, fsmap_extent_t *runs,
+		int max_runs) {
+	unsigned char *map = header + 2 * header[1];
+	unsigned use, i;
+	int count = 0;
+
+	if (header[1] < header[0] || map + 10 > header + FSMAP_BLOCK_SIZE)
+		return -1;
+	if (map[6] != 1 || map[7] != 3) // M.CTSZ, M.LBSZ
+		return -1;
+	use = map[8]; // words
+	if (map + 10 + 2 * use > header + FSMAP_BLOCK_SIZE)
+		return -1;
+	for (i = 0; i + 2 <= use; i += 2) {
+		unsigned char *ptr = map + 10 + 2 * i;
+		int64_t start = ((int64_t) ptr[0] << 16) | fsmap_word(ptr, 2);
+		int64_t size = (int64_t) (ptr[1] + 1) * FSMAP_BLOCK_SIZE;
+		start *= FSMAP_BLOCK_SIZE;
+		if (count > 0
+				&& runs[count - 1].offset + runs[count - 1].size == start)
+			runs[count - 1].size += size;
+		else if (count < max_runs) {
+			runs[count].offset = start;
+			runs[count].size = size;
+			count++;
+		} else
+			return -1;
+	}
+	return count;
+}
+
+// lbn[]: LBN of each virtual block, result: count of blocks, < 0 = error
+static int files11_map(unsigned char *header, int64_t *lbn, int max_blocks) {
+	fsmap_extent_t runs[F11_MAX_RETRIEVAL];
+	int run_count, i, count = 0;
+
+	run_count = fsmap_files11_map(header, runs, F11_MAX_RETRIEVAL);
+	for (i = 0; i < run_count; i++) {
+		int64_t block = runs[i].offset / FSMAP_BLOCK_SIZE;
+		int64_t n = runs[i].size / FSMAP_BLOCK_SIZE;
+		while (n-- > 0 && count < max_blocks)
+			lbn[count++] = block++;
+	}
+	return run_count < 0 ? -1 : count;
+}
+
+static int parse_files11(usage_t *usage) {
+	fsmap_volume_t *volume = usage->volume;
+	unsigned char home[FSMAP_BLOCK_SIZE];
+	unsigned char header[FSMAP_BLOCK_SIZE];
+	unsigned char bitmap[FSMAP_BLOCK_SIZE];
+	int64_t lbn[F11_MAX_RETRIEVAL];
+	int64_t index_lbn, clusters, cluster;
+	unsigned cluster_factor;
+	int map_blocks, vbn;
+
+	if (fsmap_read_blocks(volume, F11_HOME_BLOCK, 1, home)
+			|| memcmp(home + F11_HOME_INDN, "DECFILE11A", 10))
+		return -1;
+	index_lbn = ((int64_t) fsmap_word(home, F11_HOME_IBLB) << 16)
+			| fsmap_word(home, F11_HOME_IBLB + 2);
+	cluster_factor = fsmap_word(home, F11_HOME_SBCL);
+	if (cluster_factor == 0)
+		cluster_factor = 1;
+	// index file: bitmap, then headers of file 1, 2, ...
+	if (fsmap_read_blocks(volume,
+			index_lbn + fsmap_word(home, F11_HOME_IBSZ) + F11_BITMAP_FILE - 1, 1,
+			header) || fsmap_word(header, 2) != F11_BITMAP_FILE)
+		return -1;
+	map_blocks = files11_map(header, lbn, F11_MAX_RETRIEVAL);
+	// VBN 1 is the storage control block, then 4096 clusters per block
+	clusters = (volume->blocks + cluster_factor - 1) / cluster_factor;
+	if (map_blocks < 1 + (clusters + 4095) / 4096)
+		return -1;
+	for (cluster = 0, vbn = 1; cluster < clusters; cluster++) {
+		int bit = cluster % 4096;
+		if (bit == 0 && fsmap_read_blocks(volume, lbn[vbn++], 1, bitmap))
+			return -1;
+		// set = free
+		if (!(bitmap[bit / 8] & (1 << (bit % 8)))) {
+			int64_t count = cluster_factor;
+			if ((cluster + 1) * cluster_factor > volume->blocks)
+				count = volume->blocks - cluster * cluster_factor;
+			mark_used(usage, cluster * cluster_factor, count);
+		}
+	}
+	// home block must be in use, else this is no storage bitmap
+	if (!(usage->bits[F11_HOME_BLOCK / 8] & (1 << (F11_HOME_BLOCK % 8))))
+		return -1;
+	return 0;
+}
+
+/*** RSTS/E ***/
+
+#define RSTS_LABEL_DCN	1
+#define RSTS_LABEL_MFD	006 // DCN of MFD
+#define RSTS_LABEL_PLVL	010 // pack revision level
+#define RSTS_LABEL_PCS	012 // pack cluster size
+#define RSTS_RDS11	0x0101
+#define RSTS_MAP_OFFSET	0760 // cluster map in each directory block
+#define RSTS_MAX_DIR_CLUSTERS	7
+#define RSTS_MAX_ENTRIES	4096
+// "SATT  SYS" in RAD50
+#define RSTS_SATT_NAME1	073374 // "SAT"
+#define RSTS_SATT_NAME2	076400 // "T  "
+#define RSTS_SATT_EXT	075273 // "SYS"
+
+// directory, addressed by link words
+typedef struct {
+	fsmap_volume_t *volume;
+	unsigned dcs; // device cluster size
+	unsigned map[1 + RSTS_MAX_DIR_CLUSTERS]; // cluster size, DCNs
+	unsigned char block[FSMAP_BLOCK_SIZE];
+} rsts_dir_t;
+
+// read cluster map of directory, starting at "dcn"
+static int rsts_dir_open(rsts_dir_t *dir, unsigned dcn) {
+	int i;
+	if (fsmap_read_blocks(dir->volume, (int64_t) dcn * dir->dcs, 1,
+			dir->block))
+		return -1;
+	for (i = 0; i <= RSTS_MAX_DIR_CLUSTERS; i++)
+		dir->map[i] = fsmap_word(dir->block, RSTS_MAP_OFFSET + 2 * i);
+	return dir->map[0] == 0 || dir->map[1] != dcn;
+}
+
+/* read 16-byte entry addressed by link word:
+ * bits 15..12 block in cluster, 11..9 cluster, 8..4 entry in block
+ * result: pointer to entry, NULL on error
+ */
+static unsigned char *rsts_dir_entry(rsts_dir_t *dir, unsigned link) {
+	unsigned block = (link >> 12) & 017;
+	unsigned cluster = (link >> 9) & 07;
+	unsigned dcn;
+	if (cluster >= RSTS_MAX_DIR_CLUSTERS || block >= dir->map[0])
+		return NULL;
+	dcn = dir->map[1 + cluster];
+	if (dcn == 0 || fsmap_read_blocks(dir->volume,
+			(int64_t) dcn * dir->dcs + block, 1, dir->block))
+		return NULL;
+	return dir->block + (link & 0760);
+}
+
+// word "index" of block "block" in a directory
+static int rsts_dir_word(rsts_dir_t *dir, unsigned block, unsigned index,
+		unsigned *val) {
+	if (block >= dir->map[0] || fsmap_read_blocks(dir->volume,
+			(int64_t) dir->map[1] * dir->dcs + block, 1, dir->block))
+		return -1;
+	*val = fsmap_word(dir->block, 2 * index);
+	return 0;
+}
+
+static int parse_rsts(usage_t *usage) {
+	fsmap_volume_t *volume = usage->volume;
+	unsigned char label[FSMAP_BLOCK_SIZE];
+	unsigned char *entry, *satt;
+	rsts_dir_t dir;
+	unsigned dcs, pcs, dcn, fcs, link, retrieval_link;
+	int64_t clusters, satt_size, pos, cluster;
+	int entries = 0, i;
+
+	// device cluster: smallest power of 2, which addresses all blocks
+	for (dcs = 1; volume->blocks / dcs > 65535; dcs *= 2)
+		;
+	if (fsmap_read_blocks(volume, RSTS_LABEL_DCN * dcs, 1, label)
+			|| fsmap_word(label, 2) != 0177777
+			|| fsmap_word(label, RSTS_LABEL_PLVL) < RSTS_RDS11)
+		return -1;
+	pcs = fsmap_word(label, RSTS_LABEL_PCS);
+	if (pcs < dcs || pcs > 64 || (pcs & (pcs - 1)))
+		return -1;
+
+	// [0,1]: GFD of group 0 from MFD, UFD of user 1 from GFD
+	dir.volume = volume;
+	dir.dcs = dcs;
+	if (rsts_dir_open(&dir, fsmap_word(label, RSTS_LABEL_MFD))
+			|| rsts_dir_word(&dir, 1, 0, &dcn) || rsts_dir_open(&dir, dcn)
+			|| rsts_dir_word(&dir, 1, 1, &dcn) || rsts_dir_open(&dir, dcn)
+			|| !(entry = rsts_dir_entry(&dir, 0)))
+		return -1;
+
+	// name entries: link, name, ext, status, access count,
+	// link to accounting entry, link to retrieval entries
+	for (link = fsmap_word(entry, 0);; link = fsmap_word(entry, 0)) {
+		if (!(link & ~017) || ++entries > RSTS_MAX_ENTRIES
+				|| !(entry = rsts_dir_entry(&dir, link)))
+			return -1; // end of list, no SATT.SYS
+		if (fsmap_word(entry, 2) == RSTS_SATT_NAME1
+				&& fsmap_word(entry, 4) == RSTS_SATT_NAME2
+				&& fsmap_word(entry, 6) == RSTS_SATT_EXT)
+			break;
+	}
+	retrieval_link = fsmap_word(entry, 016);
+	// file cluster size in accounting entry
+	if (!(entry = rsts_dir_entry(&dir, fsmap_word(entry, 014))))
+		return -1;
+	fcs = fsmap_word(entry, 016);
+	if (fcs < pcs || fcs > 256 || (fcs & (fcs - 1)))
+		return -1;
+
+	// one bit per pack cluster, set = in use
+	clusters = volume->blocks / pcs;
+	satt_size = (clusters + 7) / 8;
+	satt = malloc(satt_size + fcs * FSMAP_BLOCK_SIZE);
+	if (!satt)
+		return -1;
+	for (link = retrieval_link, pos = 0; pos < satt_size;
+			link = fsmap_word(entry, 0)) {
+		if (!(link & ~017) || !(entry = rsts_dir_entry(&dir, link)))
+			break;
+		for (i = 1; i <= 7 && pos < satt_size; i++) {
+			dcn = fsmap_word(entry, 2 * i);
+			if (dcn == 0 || fsmap_read_blocks(volume, (int64_t) dcn * dcs,
+					fcs, satt + pos))
+				break;
+			pos += fcs * FSMAP_BLOCK_SIZE;
+		}
+		if (i <= 7 && pos < satt_size)
+			break;
+	}
+	if (pos < satt_size || !(satt[0] & 1)) { // cluster 0 holds the label
+		free(satt);
+		return -1;
+	}
+	for (cluster = 0; cluster < clusters; cluster++)
+		if (satt[cluster / 8] & (1 << (cluster % 8)))
+			mark_used(usage, cluster * pcs, pcs);
+	free(satt);
+	return 0;
+}
+
+// convert used blocks to extents, joining small gaps
+static int make_extents(fsmap_t *map, usage_t *usage) {
+	int64_t blocks = usage->volume->blocks;
+	int64_t min_gap = FSMAP_MIN_GAP / FSMAP_BLOCK_SIZE;
+	int64_t block = 0, capacity = 0;
+
+	map->count = 0;
+	map->allocated = 0;
+	map->extents = NULL;
+	while (block < blocks) {
+		int64_t start, end;
+		while (block < blocks && !(usage->bits[block / 8] & (1 << (block % 8))))
+			block++;
+		if (block >= blocks)
+			break;
+		start = block;
+		// extent ends at a gap of at least min_gap blocks
+		for (end = block; block < blocks && block - end < min_gap; block++)
+			if (usage->bits[block / 8] & (1 << (block % 8)))
+				end = block + 1;
+		if (map->count == capacity) {
+			capacity = capacity ? 2 * capacity : 64;
+			map->extents = realloc(map->extents,
+					capacity * sizeof(fsmap_extent_t));
+			if (!map->extents)
+				return error_set(ERROR_HOSTFILE, "Out of memory");
+		}
+		map->extents[map->count].offset = start * FSMAP_BLOCK_SIZE;
+		map->extents[map->count].size = (end - start) * FSMAP_BLOCK_SIZE;
+		map->allocated += map->extents[map->count].size;
+		map->count++;
+		block = end;
+	}
+	return 0;
+}
+
+/* find file system of "type" on volume, and list its allocated extents.
+ * FSMAP_AUTO tries all types.
+ * result: 0 = OK, 1 = file system not found, < 0 = error
+ */
+int fsmap_build(fsmap_t *map, int type, fsmap_volume_t *volume) {
+	usage_t usage;
+	int res = 1;
+
+	memset(map, 0, sizeof(*map));
+	usage.volume = volume;
+	usage.bits = calloc((volume->blocks + 7) / 8, 1);
+	if (!usage.bits)
+		return error_set(ERROR_HOSTFILE, "Out of memory");
+	if ((type == FSMAP_AUTO || type == FSMAP_RT11) && parse_rt11(&usage) == 0)
+		map->type = FSMAP_RT11;
+	else if ((type == FSMAP_AUTO || type == FSMAP_FILES11)
+			&& (memset(usage.bits, 0, (volume->blocks + 7) / 8),
+					parse_files11(&usage) == 0))
+		map->type = FSMAP_FILES11;
+	else if ((type == FSMAP_AUTO || type == FSMAP_RSTS)
+			&& (memset(usage.bits, 0, (volume->blocks + 7) / 8),
+					parse_rsts(&usage) == 0))
+		map->type = FSMAP_RSTS;
+	if (map->type != FSMAP_NONE)
+		res = make_extents(map, &usage);
+	free(usage.bits);
+	return res;
+}
+
+void fsmap_free(fsmap_t *map) {
+	free(map->extents);
+	map->extents = NULL;
+	map->count = 0;
+}
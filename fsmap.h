@@ -0,0 +1,91 @@
+/* fsmap.h: allocated blocks of PDP-11 file systems
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+ */
+
+#ifndef FSMAP_H_
+#define FSMAP_H_
+
+#include <stdint.h>
+
+// block size of all supported file systems
+#define FSMAP_BLOCK_SIZE	512
+// free gaps smaller than this are transferred, saves I/O calls
+#define FSMAP_MIN_GAP	(64 * 1024)
+
+// file system types
+#define FSMAP_NONE	0	// whole partition
+#define FSMAP_AUTO	1	// try all
+#define FSMAP_RT11	2	// RT-11 directory
+#define FSMAP_FILES11	3	// Files-11 ODS-1 storage bitmap
+#define FSMAP_RSTS	4	// RSTS/E RDS 1.x SATT.SYS
+
+// partition, opened on card or as image file
+typedef struct {
+	int fd;
+	int64_t offset; // byte offset of partition in file
+	int64_t blocks; // size in FSMAP_BLOCK_SIZE
+} fsmap_volume_t;
+
+// allocated byte range, relative to partition
+typedef struct {
+	int64_t offset;
+	int64_t size;
+} fsmap_extent_t;
+
+typedef struct {
+	int type; // found file system
+	int count;
+	fsmap_extent_t *extents; // ascending
+	int64_t allocated; // sum of extent sizes
+} fsmap_t;
+
+// RT-11 directory entry status
+#define FSMAP_RT11_TENT	0000400 // tentative file
+#define FSMAP_RT11_MPTY	0001000 // empty area
+#define FSMAP_RT11_PERM	0002000 // permanent file
+
+typedef struct {
+	unsigned status;
+	unsigned name[3]; // RAD50: name, name, extension
+	int64_t start; // block
+	unsigned length; // blocks
+} fsmap_rt11_entry_t;
+
+// result: != 0 stops the walk
+typedef int (*fsmap_rt11_func_t)(void *context, fsmap_rt11_entry_t *entry);
+
+int fsmap_parse_type(char *name);
+char *fsmap_type_name(int type);
+int fsmap_build(fsmap_t *map, int type, fsmap_volume_t *volume);
+void fsmap_free(fsmap_t *map);
+
+int fsmap_read_blocks(fsmap_volume_t *volume, int64_t block, int count,
+		void *buffer);
+unsigned fsmap_word(unsigned char *data, unsigned offset);
+int fsmap_rt11_walk(fsmap_volume_t *volume, fsmap_rt11_func_t func,
+		void *context, int64_t *dir_end);
+int fsmap_files11_map(unsigned char *header, fsmap_extent_t *runs,
+		int max_runs);
+
+#endif /* FSMAP_H_ */
@@ -275,7 +275,9 @@ int getopt_isoption(getopt_t *_this, char *name)
  // if clinearg is -name or --name or /name: return name, else NULL
 static char *get_dashed_option_name(char *clinearg) {
 	char *res = NULL;
-	if (!strncmp(clinearg, "--", 2))
+	if (!strcmp(clinearg, "-"))
+		res = NULL; // lone "-" is an argument: stdin/stdout
+	else if (!strncmp(clinearg, "--", 2))
 		res = clinearg + 2;
 	else if (!strncmp(clinearg, "-", 1))
 		res = clinearg + 1;
@@ -0,0 +1,311 @@
+/* goldcache.c: shared RAM cache of image files
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+
+ Images written again and again are kept in a RAM file system
+ (tmpfs /dev/shm, or a tmpfs mounted with "huge=always" for huge pages).
+ All img2sd processes read from the same cached copy, its pages are
+ shared, the image file on disk is read once.
+ - The content is stored as "<sha256>.img", identical images are held
+   only once.
+ - A symlink "id-<device>-<inode>-<size>-<mtime>" maps an image file to
+   its content. A changed image file gets a new id, the old link
+   dangles and is removed.
+ - The modification time of a content file is its last use. Under the
+   memory budget the least recently used files are evicted. Processes
+   still reading an evicted file keep it until they close it.
+ A lock file serializes all processes on the cache directory, while
+ they evict, reserve space and publish a loaded file. The copy itself
+ is done without the lock into "tmp-<pid>-XXXXXX", which counts against
+ the budget. Copies left behind by dead processes are removed.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <linux/limits.h>
+#include <openssl/evp.h>
+
+#include "error.h"
+#include "utils.h"
+#include "bufpool.h"
+#include "goldcache.h"	// own
+
+#define GOLDCACHE_MAX_FILES	1024
+
+typedef struct {
+	char name[NAME_MAX + 1];
+	int64_t size;
+	struct timespec mtime;
+} content_file_t;
+
+static int compare_mtime(const void *a, const void *b) {
+	const content_file_t *fa = a, *fb = b;
+	if (fa->mtime.tv_sec != fb->mtime.tv_sec)
+		return fa->mtime.tv_sec < fb->mtime.tv_sec ? -1 : 1;
+	if (fa->mtime.tv_nsec != fb->mtime.tv_nsec)
+		return fa->mtime.tv_nsec < fb->mtime.tv_nsec ? -1 : 1;
+	return 0;
+}
+
+/* remove least recently used content until "needed" bytes fit into
+ * "budget", then drop links to removed content and copies of dead
+ * processes. Copies in progress count as used. Called with the lock.
+ */
+static void evict(char *dir, int64_t budget, int64_t needed) {
+	static content_file_t files[GOLDCACHE_MAX_FILES];
+	char path[PATH_MAX];
+	struct dirent *entry;
+	struct stat st;
+	int64_t used = 0;
+	int count = 0, i, pid;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d)
+		return;
+	while ((entry = readdir(d))) {
+		size_t len = strlen(entry->d_name);
+		if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name)
+				>= (int) sizeof(path))
+			continue;
+		if (sscanf(entry->d_name, "tmp-%d-", &pid) == 1) {
+			if (kill(pid, 0) < 0 && errno == ESRCH) {
+				unlink(path);
+				info("Golden image cache: removed stale %s.", entry->d_name);
+			} else if (lstat(path, &st) == 0)
+				used += st.st_size;
+			continue;
+		}
+		if (count >= GOLDCACHE_MAX_FILES || len < 5
+				|| strcmp(entry->d_name + len - 4, ".img") || lstat(path, &st))
+			continue;
+		strcpy(files[count].name, entry->d_name);
+		files[count].size = st.st_size;
+		files[count].mtime = st.st_mtim;
+		used += st.st_size;
+		count++;
+	}
+	qsort(files, count, sizeof(files[0]), compare_mtime);
+	for (i = 0; i < count && used + needed > budget; i++) {
+		if (snprintf(path, sizeof(path), "%s/%s", dir, files[i].name)
+				>= (int) sizeof(path))
+			continue;
+		if (unlink(path) == 0) {
+			info("Golden image cache: evicted %s, %ld bytes.", files[i].name,
+					files[i].size);
+			used -= files[i].size;
+		}
+	}
+
+	rewinddir(d);
+	while ((entry = readdir(d))) {
+		if (strncmp(entry->d_name, "id-", 3))
+			continue;
+		if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name)
+				>= (int) sizeof(path))
+			continue;
+		if (stat(path, &st) && errno == ENOENT)
+			unlink(path);
+	}
+	closedir(d);
+}
+
+/* create the copy "tmp_path" with "size" bytes reserved. Called with
+ * the lock, so other processes see the reserved space.
+ * result: fd, < 0 = no space
+ */
+static int reserve_content(char *dir, int64_t size, char *tmp_path) {
+	int fd;
+
+	snprintf(tmp_path, PATH_MAX, "%s/tmp-%d-XXXXXX", dir, (int) getpid());
+	fd = mkstemp(tmp_path);
+	if (fd < 0)
+		return -1;
+	fchmod(fd, 0644); // read by all processes
+	// fail early, if the RAM file system is too small
+	if (posix_fallocate(fd, 0, size)) {
+		close(fd);
+		unlink(tmp_path);
+		return -1;
+	}
+	return fd;
+}
+
+/* copy "fd_src" into "fd", the SHA-256 of the data gives the name of
+ * the content file "<sha256>.img". Done without the lock.
+ * result: file name in "content_name", 0 = OK, else warned, not cached
+ */
+static int copy_content(int fd_src, int fd, int64_t size, char *content_name) {
+	size_t buffer_size = bufpool_fit(GOLDCACHE_CHUNK_SIZE, 1);
+	char *buffer = bufpool_get(buffer_size);
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned md_len = 0, i;
+	EVP_MD_CTX *md_ctx;
+	int64_t pos;
+	int res = 0;
+
+	md_ctx = EVP_MD_CTX_new();
+	if (!md_ctx || !EVP_DigestInit_ex(md_ctx, EVP_sha256(), NULL)) {
+		warning("Can not initialize SHA-256");
+		res = -1;
+	}
+	for (pos = 0; !res && pos < size; pos += buffer_size) {
+		int64_t len = size - pos < (int64_t) buffer_size ?
+				size - pos : (int64_t) buffer_size;
+		if (pread_full(fd_src, buffer, len, pos) < 0
+				|| pwrite_full(fd, buffer, len, pos) < 0) {
+			warning("Copy into golden image cache failed, errno = %d", errno);
+			res = -1;
+		} else
+			EVP_DigestUpdate(md_ctx, buffer, len);
+	}
+	if (!res)
+		EVP_DigestFinal_ex(md_ctx, md, &md_len);
+	EVP_MD_CTX_free(md_ctx);
+	bufpool_put(buffer);
+	if (res)
+		return res;
+
+	for (i = 0; i < md_len; i++)
+		sprintf(content_name + 2 * i, "%02x", md[i]);
+	strcat(content_name, ".img");
+	return 0;
+}
+
+// result: fd of the lock file, < 0 = error
+static int lock_cache(char *dir) {
+	char lock_path[PATH_MAX];
+	int fd_lock;
+
+	snprintf(lock_path, sizeof(lock_path), "%s/lock", dir);
+	fd_lock = open(lock_path, O_CREAT | O_RDWR, 0644);
+	if (fd_lock >= 0 && flock(fd_lock, LOCK_EX)) {
+		close(fd_lock);
+		fd_lock = -1;
+	}
+	if (fd_lock < 0)
+		warning("Can not lock golden image cache \"%s\"", dir);
+	return fd_lock;
+}
+
+static void unlock_cache(int fd_lock) {
+	flock(fd_lock, LOCK_UN);
+	close(fd_lock);
+}
+
+/* open "filename" through the cache in "dir", which holds at most
+ * "budget" bytes. Loads the file on first use. If the cache can not
+ * be used, the image is read from "filename" by the caller.
+ * result: fd of cached copy, read only. < 0 = not cached, use "filename".
+ */
+int goldcache_open(char *dir, int64_t budget, char *filename) {
+	char id_path[PATH_MAX], tmp_path[PATH_MAX], content_path[PATH_MAX];
+	char content_name[2 * EVP_MAX_MD_SIZE + 8];
+	struct stat st;
+	int fd_lock, fd_src, fd_tmp, fd;
+
+	if (stat(filename, &st))
+		return -1; // the caller reports it
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		warning("Can not create golden image cache \"%s\"", dir);
+		return -1;
+	}
+	snprintf(id_path, sizeof(id_path), "%s/id-%lx-%lx-%ld-%ld.%09ld", dir,
+			(unsigned long) st.st_dev, (unsigned long) st.st_ino,
+			(long) st.st_size, (long) st.st_mtim.tv_sec,
+			(long) st.st_mtim.tv_nsec);
+
+	// a hit needs no lock: an evicted file stays readable while open
+	fd = open(id_path, O_RDONLY);
+	if (fd >= 0) {
+		futimens(fd, NULL); // mark as recently used
+		info("Golden image cache: \"%s\" found in \"%s\".", filename, dir);
+		return fd;
+	}
+	if (st.st_size > budget) {
+		info("Golden image cache: \"%s\" larger than budget.", filename);
+		return -1;
+	}
+	fd_src = open(filename, O_RDONLY);
+	if (fd_src < 0)
+		return -1;
+
+	// make room and reserve it
+	fd_lock = lock_cache(dir);
+	if (fd_lock < 0) {
+		close(fd_src);
+		return -1;
+	}
+	evict(dir, budget, st.st_size);
+	fd_tmp = reserve_content(dir, st.st_size, tmp_path);
+	unlock_cache(fd_lock);
+	if (fd_tmp < 0) {
+		info("Golden image cache: no space for \"%s\" in \"%s\".", filename,
+				dir);
+		close(fd_src);
+		return -1;
+	}
+
+	// another process may load the same image meanwhile: the content
+	// name is the same, the second copy is dropped
+	if (copy_content(fd_src, fd_tmp, st.st_size, content_name)) {
+		close(fd_tmp);
+		close(fd_src);
+		unlink(tmp_path);
+		return -1;
+	}
+	close(fd_tmp);
+	close(fd_src);
+
+	// publish
+	fd_lock = lock_cache(dir);
+	if (fd_lock < 0) {
+		unlink(tmp_path);
+		return -1;
+	}
+	snprintf(content_path, sizeof(content_path), "%s/%s", dir, content_name);
+	if (access(content_path, F_OK) == 0)
+		unlink(tmp_path); // same content from another image file
+	else if (rename(tmp_path, content_path))
+		unlink(tmp_path);
+	unlink(id_path);
+	if (symlink(content_name, id_path) == 0)
+		fd = open(id_path, O_RDONLY);
+	unlock_cache(fd_lock);
+	if (fd >= 0)
+		info("Golden image cache: \"%s\" loaded as %s.", filename,
+				content_name);
+	else
+		warning("Can not add \"%s\" to golden image cache \"%s\"", filename,
+				dir);
+	return fd;
+}
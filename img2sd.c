@@ -0,0 +1,1211 @@
+/* img2sd.c: transfers between images and SDcard targets, as a library
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+
+ The operations of the command line, for use in other programs.
+ Errors do not exit: each operation sets a catch point (error.h), error()
+ releases the resources registered with error_cleanup_push() and returns
+ there. The operation ends with state "failed" and the error text.
+ Operations run in the caller's thread (img2sd_run()), or in an own thread
+ (img2sd_start()) with state, progress and cancel from other threads, and
+ an eventfd for poll()/select() loops.
+ Several operations may run in parallel on different devices.
+ */
+
+#define _GNU_SOURCE // O_DIRECT
+#define IMG2SD_C_
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <linux/limits.h>
+
+#include "error.h"
+#include "utils.h"
+#include "config.h"
+#include "align.h"
+#include "offload.h"
+#include "xfer.h"
+#include "cache.h"
+#include "wbehind.h"
+#include "transform.h"
+#include "fsmap.h"
+#include "tee.h"
+#include "goldcache.h"
+#include "vdisk.h"
+#include "stream.h"
+#include "digest.h"
+#include "img2sd.h" // own
+
+int opt_verbose = 0; // info() and progress output
+
+// operation of this thread, for the progress callbacks of transfers
+static __thread img2sd_op_t *op_current = NULL;
+
+// cleanups for error_cleanup_push()
+static void cleanup_close(void *arg) {
+	int fd = (int) (intptr_t) arg;
+	if (fd >= 0)
+		close(fd);
+}
+
+static void cleanup_fsmap(void *arg) {
+	fsmap_free(arg);
+}
+
+static void cleanup_vdisk(void *arg) {
+	vdisk_free(arg);
+}
+
+static void push_close(int fd) {
+	error_cleanup_push(cleanup_close, (void *) (intptr_t) fd);
+}
+
+/* AU size of "device": "au_size" if set, else probed from the device.
+ * result: AU size in bytes, ALIGN_DEFAULT_AU_SIZE if unknown
+ */
+int64_t img2sd_au_size(char *device, int64_t au_size) {
+	if (au_size == 0 && device && device[0])
+		au_size = align_probe_au_size(device);
+	if (au_size == 0) {
+		au_size = ALIGN_DEFAULT_AU_SIZE;
+		info("AU size of SDcard unknown, using %ld bytes.", au_size);
+	}
+	return au_size;
+}
+
+/* layout conversion between image files and a target,
+ * from --imagesector, --interleave and --byteswap.
+ * result: NULL if image and card layout are the same
+ */
+static transform_t *get_transform(img2sd_op_t *op,
+		config_scsitarget_t *scsitarget) {
+	img2sd_options_t *options = &op->options;
+	int sectors_per_track = 0;
+
+	if (options->interleave > 1 || options->skew) {
+		sectors_per_track = scsitarget->sectorsPerTrack;
+		if (sectors_per_track <= 0)
+			error("SCSI ID %d has no sectorsPerTrack for interleave",
+					scsitarget->targetId);
+	}
+	if (transform_init(&op->transform, scsitarget->bytesPerSector,
+			options->image_sector_size, sectors_per_track,
+			options->interleave, options->skew, options->byteswap))
+		error("Illegal image layout for SCSI ID %d", scsitarget->targetId);
+	if (!transform_active(&op->transform))
+		return NULL;
+	return &op->transform;
+}
+
+/* progress of the operation of this thread: for img2sd_poll(), the
+ * callback, and with -v moving percent indicators, no \n.
+ * result: 0 = continue, else cancel
+ */
+static int progress_print(char *what, int64_t done, int64_t total) {
+	img2sd_op_t *op = op_current;
+	if (op->progress_ranges_total > 0) {
+		done += op->progress_ranges_done;
+		total = op->progress_ranges_total;
+	}
+	__atomic_store_n(&op->progress_done, done, __ATOMIC_RELAXED);
+	__atomic_store_n(&op->progress_total, total, __ATOMIC_RELAXED);
+	if (opt_verbose) {
+		printf("\r%s completed %3ld%% ", what, (done * 100) / total);
+		fflush(stdout);
+	}
+	if (op->progress && op->progress(op, done, total))
+		__atomic_store_n(&op->cancel, 1, __ATOMIC_RELAXED);
+	return __atomic_load_n(&op->cancel, __ATOMIC_RELAXED);
+}
+
+static int progress_read(int64_t done, int64_t total) {
+	return progress_print("Read", done, total);
+}
+
+static int progress_write(int64_t done, int64_t total) {
+	return progress_print("Write", done, total);
+}
+
+static int progress_verify(int64_t done, int64_t total) {
+	return progress_print("Verify", done, total);
+}
+
+/* ranges of a partition to transfer: with --filesystem the allocated
+ * blocks, else all. The file system is read from "fd" at "offset".
+ * Free with fsmap_free().
+ */
+static void get_ranges(img2sd_op_t *op, fsmap_t *map, int fd, int64_t offset,
+		int64_t size) {
+	if (op->options.filesystem != FSMAP_NONE) {
+		fsmap_volume_t volume;
+		int res;
+		volume.fd = fd;
+		volume.offset = offset;
+		volume.blocks = size / FSMAP_BLOCK_SIZE;
+		res = fsmap_build(map, op->options.filesystem, &volume);
+		if (res < 0)
+			error("File system scan failed");
+		if (res == 0) {
+			info("%s file system: %ld of %ld bytes allocated in %d ranges.",
+					fsmap_type_name(map->type), map->allocated, size,
+					map->count);
+			return;
+		}
+		if (op->options.filesystem != FSMAP_AUTO)
+			error("No %s file system found",
+					fsmap_type_name(op->options.filesystem));
+		info("No file system found, transferring all data.");
+	}
+	map->type = FSMAP_NONE;
+	map->count = 1;
+	map->extents = malloc(sizeof(fsmap_extent_t));
+	map->extents[0].offset = 0;
+	map->extents[0].size = size;
+	map->allocated = size;
+}
+
+/* fill free space between allocated ranges and up to "size".
+ * result: 0 = OK, else error
+ */
+static int fill_gaps(int fd, int64_t offset, fsmap_t *map, int64_t size,
+		int policy) {
+	int64_t pos = 0;
+	int i;
+	for (i = 0; i <= map->count; i++) {
+		int64_t end = i < map->count ? map->extents[i].offset : size;
+		if (end > pos && offload_fill(fd, offset + pos, end - pos, policy))
+			return error_code;
+		if (i < map->count)
+			pos = map->extents[i].offset + map->extents[i].size;
+	}
+	return 0;
+}
+
+/* core function: read and write sdcard
+ * only the partiiton of card file is read, which is defined
+ * by the SCSI target id and geometry data in "config"
+ */
+
+// image file to write or compare, through the golden image cache
+static int open_image(img2sd_op_t *op, char *image_filename) {
+	int fd = -1;
+	if (stream_is_stdio(image_filename))
+		return dup(STDIN_FILENO);
+	if (op->options.goldcache_budget > 0)
+		fd = goldcache_open(op->options.goldcache_dir,
+				op->options.goldcache_budget, image_filename);
+	if (fd < 0)
+		fd = open(image_filename, O_RDWR);
+	return fd;
+}
+
+// card for read and write: a handle kept open by the caller, or by name
+static int open_card(img2sd_op_t *op, char *sdcard_filename) {
+	if (op->fd_device >= 0)
+		return dup(op->fd_device);
+	return open(sdcard_filename, O_RDWR);
+}
+
+/* tee sinks for the --digest algorithms of "image_filename",
+ * appended to "sinks". result: new count
+ */
+static unsigned add_digest_sinks(img2sd_op_t *op, tee_sink_t *sinks,
+		unsigned count, char *image_filename) {
+	char filename[PATH_MAX + DIGEST_MAX_NAME + 1];
+	unsigned i;
+	for (i = 0; i < op->options.digest_count; i++) {
+		if (count >= TEE_MAX_SINKS)
+			error("Too many --tee files and digests");
+		snprintf(filename, sizeof(filename), "%s.%s", image_filename,
+				op->options.digests[i]);
+		tee_sink_init_digest(&sinks[count++], op->options.digests[i],
+				op->options.digest_files ? filename : NULL);
+	}
+	return count;
+}
+
+/* start the tee on the first "count" of op->sinks, aborted on error.
+ * The sinks need the data in order: transfers run as one stripe.
+ */
+static void open_tee(img2sd_op_t *op, unsigned count, char *image_filename) {
+	if (op->options.stripes > 1)
+		warning("--stripes %d not used for \"%s\": --tee, --digest and qcow2 "
+				"need the data in order", op->options.stripes, image_filename);
+	error_cleanup_push(tee_abort, &op->tee); // also for a partial start
+	tee_open(&op->tee, op->sinks, count, image_filename);
+}
+
+// digests of a closed tee, as results of the operation
+static void save_digests(img2sd_op_t *op, tee_t *tee) {
+	unsigned i;
+	op->digest_count = 0;
+	for (i = 0; i < tee->sink_count; i++)
+		if (tee->sinks[i].type == TEE_SINK_DIGEST) {
+			img2sd_digest_t *digest = &op->digests[op->digest_count++];
+			strcpy(digest->algorithm, tee->sinks[i].algorithm);
+			strcpy(digest->text, tee->sinks[i].digest_text);
+		}
+}
+
+/* image file for --write or --compare: format and allocated ranges.
+ * Containers like qcow2 can not be combined with other layout options.
+ * The vdisk is on the cleanup stack.
+ */
+static void open_vdisk(img2sd_op_t *op, vdisk_t *vdisk, int fd_img,
+		transform_t *transform) {
+	vdisk_open(vdisk, fd_img);
+	error_cleanup_push(cleanup_vdisk, vdisk);
+	if (vdisk->format == VDISK_RAW)
+		return;
+	info("%s disk image: %ld bytes, %ld allocated in %d ranges.",
+			vdisk_format_name(vdisk->format), vdisk->size,
+			vdisk->map.allocated, vdisk->map.count);
+	if (transform)
+		error("Image layout conversion is not possible with %s images",
+				vdisk_format_name(vdisk->format));
+	if (op->options.filesystem != FSMAP_NONE)
+		error("--filesystem is not possible with %s images",
+				vdisk_format_name(vdisk->format));
+}
+
+/* compare "len" bytes of the card at "card_offset" + "pos" with the image
+ * file at "image_offset". "pos" is relative to the partition.
+ * With "fd_img" < 0 the card is compared against zeros.
+ * The image data also goes to "tee", if not NULL.
+ */
+static void verify_range(img2sd_op_t *op, int target_id, int fd_img,
+		int64_t image_offset, int fd_card, int64_t card_offset, int64_t pos,
+		int64_t len, transform_t *transform, vdisk_t *vdisk, tee_t *tee) {
+	xfer_job_t job;
+
+	if (len <= 0)
+		return;
+	xfer_job_init(&job, XFER_MODE_VERIFY, fd_img, image_offset, fd_card,
+			card_offset + pos, len);
+	job.stripe_count = op->options.stripes;
+	job.cache_policy = op->options.cache;
+	job.dirty_window = op->options.dirty_window;
+	job.transform = transform;
+	if (vdisk && vdisk->format != VDISK_RAW)
+		job.vdisk = vdisk;
+	job.tee = tee;
+	job.tee_position = pos;
+	if (xfer_run(&job, progress_verify))
+		error("Verify of SCSI ID %d failed", target_id);
+	if (job.mismatch_offset >= 0)
+		error("Data mismatch between bytes %ld and %ld",
+				pos + job.mismatch_offset,
+				pos + job.mismatch_offset + job.mismatch_size);
+	op->progress_ranges_done += len;
+}
+
+/* read partition to a pipe on stdout, in one sequential pass.
+ * Free space of the file system is sent as zeros.
+ */
+static void sdcard_read_stream(img2sd_op_t *op, int target_id, int fd_card,
+		int64_t offset, int64_t size) {
+	int fd_out = op->options.fd_stdout;
+	fsmap_t map;
+	int64_t pos = 0;
+	int i;
+
+	if (op->options.update || op->options.tee_sink_count
+			|| op->options.digest_count)
+		error("--update, --tee and --digest are not possible with output "
+				"to stdout");
+	get_ranges(op, &map, fd_card, offset, size);
+	error_cleanup_push(cleanup_fsmap, &map);
+	op->progress_ranges_done = 0;
+	op->progress_ranges_total = map.allocated;
+	for (i = 0; i <= map.count; i++) {
+		int64_t end = i < map.count ? map.extents[i].offset : size;
+		if (end > pos && stream_out_zeros(fd_out, end - pos))
+			error("Read of SCSI ID %d failed", target_id);
+		if (i == map.count)
+			break;
+		if (stream_out(fd_out, fd_card, offset + end, map.extents[i].size,
+				progress_read))
+			error("Read of SCSI ID %d failed", target_id);
+		op->progress_ranges_done += map.extents[i].size;
+		pos = end + map.extents[i].size;
+	}
+	op->progress_ranges_total = 0;
+	error_cleanup_pop(1); // map
+}
+
+/* write partition from a pipe on stdin, in one sequential pass.
+ * The stream ends at end of input, or after --streamsize bytes.
+ * result: bytes written, rounded up to full sectors
+ */
+static int64_t sdcard_write_stream(img2sd_op_t *op, int target_id,
+		int fd_card, int fd_in, int64_t offset, int64_t size,
+		int sector_size) {
+	int64_t stream_size = op->options.stream_size;
+	int64_t max_size = stream_size ? stream_size : size;
+	int64_t bytesWritten, padding;
+
+	if (max_size > size)
+		error("Stream size %ld is larger than size of SCSI ID %d (%ld)",
+				max_size, target_id, size);
+	bytesWritten = stream_in(fd_in, fd_card, offset, max_size,
+			op->options.dirty_window, progress_write);
+	if (bytesWritten < 0)
+		error("Write of SCSI ID %d failed", target_id);
+	if (stream_size && bytesWritten < stream_size)
+		error("Input ended after %ld of %ld bytes", bytesWritten,
+				stream_size);
+	padding = (sector_size - bytesWritten % sector_size) % sector_size;
+	if (padding) {
+		warning("Input size %ld is not a multiple of sector size %d, "
+				"last sector padded with zeros", bytesWritten, sector_size);
+		if (offload_fill(fd_card, offset + bytesWritten, padding,
+				OFFLOAD_FILL_ZERO))
+			error("Write of SCSI ID %d failed", target_id);
+	}
+	if (fsync(fd_card) < 0)
+		error("Write of SCSI ID %d failed, errno = %d", target_id, errno);
+	return bytesWritten + padding;
+}
+
+/* compare partition with a pipe on stdin. With "compare_tail", the rest
+ * of the partition is compared against zeros.
+ */
+static void sdcard_verify_stream(img2sd_op_t *op, int target_id, int fd_card,
+		int fd_in, int64_t offset, int64_t size) {
+	int64_t stream_size = op->options.stream_size;
+	int64_t max_size = stream_size ? stream_size : size;
+	int64_t bytesCompared, mismatch_offset;
+
+	if (max_size > size)
+		error("Stream size %ld is larger than size of SCSI ID %d (%ld)",
+				max_size, target_id, size);
+	bytesCompared = stream_compare(fd_in, fd_card, offset, max_size,
+			&mismatch_offset, progress_verify);
+	if (bytesCompared < 0)
+		error("Verify of SCSI ID %d failed", target_id);
+	if (mismatch_offset >= 0)
+		error("Data mismatch at byte %ld", mismatch_offset);
+	if (stream_size && bytesCompared < stream_size)
+		error("Input ended after %ld of %ld bytes", bytesCompared,
+				stream_size);
+	if (op->options.compare_tail)
+		verify_range(op, target_id, -1, 0, fd_card, offset, bytesCompared,
+				size - bytesCompared, NULL, NULL, NULL);
+}
+
+static void sdcard_read(img2sd_op_t *op, int target_id, char *sdcard_filename,
+		char *image_filename) {
+	int fd_card, fd_img;
+	int update;
+	config_scsitarget_t *scsitarget;
+	int64_t offset, size;
+	transform_t *transform;
+	fsmap_t map;
+	xfer_job_t job;
+	unsigned sink_count;
+	int qcow2;
+	int i;
+
+	if (target_id < 0 || target_id >= MAX_SCSITARGETS)
+		error("Invalid target id %d", target_id);
+	scsitarget = &op->targets[target_id];
+	if (!scsitarget->enabled)
+		error("Target id %d not enabled", target_id);
+
+	offset = config_scsitarget_offset(scsitarget);
+	size = config_scsitarget_size(scsitarget);
+	transform = get_transform(op, scsitarget);
+
+	if (opt_verbose) {
+		info("Reading SCSI ID %d on SDcard \"%s\" to file \"%s\".", target_id,
+				sdcard_filename, image_filename);
+		info(
+				"SDcard offset = %ld bytes = %ld sectors, size = %ld bytes = %ld sectors.",
+				offset, offset / scsitarget->bytesPerSector, size,
+				size / scsitarget->bytesPerSector);
+	}
+
+	fd_card = open_card(op, sdcard_filename); // must exist
+	if (fd_card < 0)
+		error("Can not open SDcard file \"%s\" for read (sudo?)",
+				sdcard_filename);
+	push_close(fd_card);
+	if (stream_is_stdio(image_filename)
+			&& stream_is_sequential(op->options.fd_stdout)) {
+		if (transform)
+			error("Image layout conversion is not possible with output to stdout");
+		sdcard_read_stream(op, target_id, fd_card, offset, size);
+		error_cleanup_pop(1); // fd_card
+		if (opt_verbose)
+			printf("\n");
+		return;
+	}
+	update = op->options.update && !stream_is_stdio(image_filename)
+			&& access(image_filename, F_OK) == 0;
+	if (update && transform)
+		error("--update is not possible with image layout conversion");
+	if (transform && op->options.filesystem != FSMAP_NONE)
+		error("--filesystem is not possible with image layout conversion");
+	// --tee files, then qcow2 which is written by a tee sink only,
+	// then digests
+	sink_count = op->options.tee_sink_count;
+	memcpy(op->sinks, op->options.tee_sinks, sink_count * sizeof(tee_sink_t));
+	qcow2 = strlen(image_filename) > 6
+			&& !strcasecmp(image_filename + strlen(image_filename) - 6, ".qcow2");
+	if (qcow2) {
+		if (update)
+			error("--update is not possible for qcow2 images");
+		if (sink_count >= TEE_MAX_SINKS)
+			error("Too many --tee files");
+		tee_sink_init(&op->sinks[sink_count++], image_filename);
+	}
+	sink_count = add_digest_sinks(op, op->sinks, sink_count, image_filename);
+	if (sink_count && transform)
+		error("--tee, --digest and qcow2 are not possible with image layout "
+				"conversion");
+	if (update && op->options.snapshot) {
+		char snapshot_filename[PATH_MAX + 8];
+		snprintf(snapshot_filename, sizeof(snapshot_filename), "%s.prev",
+				image_filename);
+		if (reflink_file(image_filename, snapshot_filename))
+			error("Can not reflink \"%s\" to \"%s\", errno = %d",
+					image_filename, snapshot_filename, errno);
+		info("Previous image saved as reflink \"%s\".", snapshot_filename);
+	}
+	if (qcow2)
+		fd_img = -1;
+	else if (stream_is_stdio(image_filename)) // stdout redirected to a file
+		fd_img = dup(op->options.fd_stdout);
+	else if (update) // keep unchanged data, and its extents
+		fd_img = open(image_filename, O_RDWR);
+	else
+		fd_img = open(image_filename, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+	if (fd_img < 0 && !qcow2)
+		error("Can not open image file \"%s\" for write", image_filename);
+	push_close(fd_img);
+
+	// copy loop, over allocated ranges of the file system on the card
+	get_ranges(op, &map, fd_card, offset, size);
+	error_cleanup_push(cleanup_fsmap, &map);
+	if (sink_count) {
+		open_tee(op, sink_count, image_filename);
+	}
+	op->changed = 0;
+	op->progress_ranges_done = 0;
+	op->progress_ranges_total = map.allocated;
+	for (i = 0; i < map.count; i++) {
+		fsmap_extent_t *range = &map.extents[i];
+		xfer_job_init(&job, update ? XFER_MODE_UPDATE : XFER_MODE_COPY,
+				fd_card, offset + range->offset, fd_img, range->offset,
+				range->size);
+		job.stripe_count = op->options.stripes;
+		job.cache_policy = op->options.cache;
+		job.dirty_window = op->options.dirty_window;
+		job.transform = transform;
+		job.tee = sink_count ? &op->tee : NULL;
+		job.tee_position = range->offset;
+		if (xfer_run(&job, progress_read))
+			error("Read of SCSI ID %d failed", target_id);
+		op->changed += job.changed;
+		op->progress_ranges_done += range->size;
+	}
+	op->progress_ranges_total = 0;
+	// sinks get the whole image, free space as zeros
+	if (sink_count) {
+		error_cleanup_pop(0); // tee, closed now
+		tee_close(&op->tee, size);
+		for (i = 0; i < (int) sink_count; i++)
+			if (op->sinks[i].filename[0])
+				info("\nAlso written to \"%s\".", op->sinks[i].filename);
+		save_digests(op, &op->tee);
+	}
+	// free space of the file system: zeros in image
+	if (update && map.type != FSMAP_NONE
+			&& fill_gaps(fd_img, 0, &map, size, OFFLOAD_FILL_ZERO))
+		error("Zero fill of image file \"%s\" failed", image_filename);
+	error_cleanup_pop(1); // map
+	if (fd_img >= 0
+			&& ftruncate(fd_img,
+					transform ? transform_image_size(transform, size) : size) < 0)
+		error("Can not set size of image file \"%s\"", image_filename);
+	if (update)
+		info("\nUpdate: %ld of %ld bytes changed.", op->changed, size);
+	error_cleanup_pop(1); // fd_img
+	error_cleanup_pop(1); // fd_card
+	if (opt_verbose)
+		printf("\n");
+}
+
+/* write image into partition.
+ * readback: compare each chunk with the card, shortly after it was written.
+ */
+static void sdcard_write(img2sd_op_t *op, int target_id, char *sdcard_filename,
+		char *image_filename, int readback) {
+	int fd_card, fd_img, fd_verify = -1;
+	struct stat statbuf;
+	config_scsitarget_t *scsitarget;
+	int64_t offset, size;
+	int64_t bytesToWrite; // on card
+	int64_t au_size;
+	transform_t *transform;
+	fsmap_t map;
+	vdisk_t vdisk;
+	xfer_job_t job;
+	unsigned digest_count;
+	int i;
+
+	if (target_id < 0 || target_id >= MAX_SCSITARGETS)
+		error("Invalid target id %d", target_id);
+	scsitarget = &op->targets[target_id];
+	if (!scsitarget->enabled)
+		error("Target id %d not enabled", target_id);
+
+	offset = config_scsitarget_offset(scsitarget);
+	size = config_scsitarget_size(scsitarget);
+	transform = get_transform(op, scsitarget);
+
+	// pipe on stdin: one pass, size known at end of input
+	if (stream_is_stdio(image_filename)
+			&& stream_is_sequential(STDIN_FILENO)) {
+		if (transform || op->options.filesystem != FSMAP_NONE || readback
+				|| op->options.digest_count)
+			error("Layout conversion, --filesystem, --writecompare and "
+					"--digest are not possible with input from stdin");
+		info("Writing SCSI ID %d on SDcard \"%s\" from stdin.", target_id,
+				sdcard_filename);
+		fd_card = open_card(op, sdcard_filename); // must exist
+		if (fd_card < 0)
+			error("Can not open sdcard file \"%s\" for write (sudo?)",
+					sdcard_filename);
+		push_close(fd_card);
+		bytesToWrite = sdcard_write_stream(op, target_id, fd_card,
+				STDIN_FILENO, offset, size, scsitarget->bytesPerSector);
+		if (bytesToWrite < size) {
+			info("\nFilling rest of partition: %s",
+					offload_policy_name(op->options.fill));
+			if (offload_fill(fd_card, offset + bytesToWrite,
+					size - bytesToWrite, op->options.fill))
+				error("Fill of SCSI ID %d failed", target_id);
+		}
+		error_cleanup_pop(1); // fd_card
+		if (opt_verbose)
+			printf("\n");
+		return;
+	}
+
+	// image file and its format
+	fd_img = open_image(op, image_filename);
+	if (fd_img >= 0)
+		push_close(fd_img);
+	if (fd_img < 0 || fstat(fd_img, &statbuf) < 0)
+		error("Can not open image file \"%s\" for read", image_filename);
+	open_vdisk(op, &vdisk, fd_img, transform);
+	bytesToWrite = vdisk.size;
+	if (transform) {
+		if (vdisk.size % transform->image_sector_size)
+			error(
+					"Size of file \"%s\" is %ld, not a multiple of image sector size %d",
+					image_filename, vdisk.size, transform->image_sector_size);
+		bytesToWrite = transform_card_size(transform, vdisk.size);
+		// completed last track may end behind the partition
+		if (bytesToWrite > size
+				&& vdisk.size <= transform_image_size(transform, size))
+			bytesToWrite = size;
+	}
+
+	if (opt_verbose) {
+		info("Writing SCSI ID %d on SDcard \"%s\" from file \"%s\".", target_id,
+				sdcard_filename, image_filename);
+		info(
+				"SDcard offset = %ld bytes = %ld sectors, size = %ld bytes = %ld sectors.",
+				offset, offset / scsitarget->bytesPerSector, size,
+				size / scsitarget->bytesPerSector);
+	}
+
+	if (bytesToWrite % scsitarget->bytesPerSector)
+		error("Size of file \"%s\" is %ld, not a multiple of sector size %d",
+				image_filename, bytesToWrite, scsitarget->bytesPerSector);
+	if (bytesToWrite > size)
+		error(
+				"Image file too large: Size of file \"%s\" is %ld, size of SCSI ID %d is %ld",
+				image_filename, bytesToWrite, target_id, size);
+	if (bytesToWrite < size)
+		warning(
+				"Image file too small: Size of file \"%s\" is %ld, size of SCSI ID %d is %ld",
+				image_filename, bytesToWrite, target_id, size);
+
+	// read access for merging unaligned head and tail with card data
+	fd_card = open_card(op, sdcard_filename); // must exist
+	if (fd_card < 0)
+		error("Can not open sdcard file \"%s\" for write (sudo?)",
+				sdcard_filename);
+	push_close(fd_card);
+	if (readback) {
+		// read back from the card, not from the page cache. Without
+		// O_DIRECT, align_write() drops the cached pages before reading.
+		fd_verify = open(sdcard_filename, O_RDONLY | O_DIRECT);
+		if (fd_verify < 0)
+			fd_verify = open(sdcard_filename, O_RDONLY);
+		if (fd_verify < 0)
+			error("Can not open sdcard file \"%s\" for read (sudo?)",
+					sdcard_filename);
+	}
+	push_close(fd_verify);
+
+	// copy loop, in AU aligned chunks, over allocated ranges of the
+	// file system in the image. A disk image container is one stream
+	// in card order, its unallocated ranges are read as zeros.
+	if (transform && op->options.filesystem != FSMAP_NONE)
+		error("--filesystem is not possible with image layout conversion");
+	get_ranges(op, &map, fd_img, 0, bytesToWrite);
+	error_cleanup_push(cleanup_fsmap, &map);
+	digest_count = add_digest_sinks(op, op->sinks, 0, image_filename);
+	if (digest_count) {
+		if (transform)
+			error("--digest is not possible with image layout conversion");
+		open_tee(op, digest_count, image_filename);
+	}
+	au_size = img2sd_au_size(op->device, op->options.au_size);
+	op->progress_ranges_done = 0;
+	op->progress_ranges_total = map.allocated;
+	for (i = 0; i < map.count; i++) {
+		fsmap_extent_t *range = &map.extents[i];
+		xfer_job_init(&job,
+				readback ? XFER_MODE_WRITE_VERIFY : XFER_MODE_WRITE, fd_img,
+				range->offset, fd_card, offset + range->offset, range->size);
+		job.au_size = au_size;
+		job.au_merge = op->options.au_merge;
+		job.stripe_count = op->options.stripes;
+		job.cache_policy = op->options.cache;
+		job.dirty_window = op->options.dirty_window;
+		job.fd_verify = fd_verify;
+		job.verify_lag = op->options.verify_lag;
+		job.transform = transform;
+		job.vdisk = vdisk.format == VDISK_RAW ? NULL : &vdisk;
+		job.tee = digest_count ? &op->tee : NULL;
+		job.tee_position = range->offset;
+		if (xfer_run(&job, progress_write))
+			error("Write of SCSI ID %d failed", target_id);
+		if (job.mismatch_offset >= 0)
+			error("Data mismatch between bytes %ld and %ld",
+					range->offset + job.mismatch_offset,
+					range->offset + job.mismatch_offset + job.mismatch_size);
+		op->progress_ranges_done += range->size;
+	}
+	op->progress_ranges_total = 0;
+	if (digest_count) {
+		error_cleanup_pop(0); // tee, closed now
+		tee_close(&op->tee, bytesToWrite);
+		save_digests(op, &op->tee);
+	}
+	// free space of the file system
+	if (map.type != FSMAP_NONE
+			&& fill_gaps(fd_card, offset, &map, bytesToWrite, op->options.fill))
+		error("Fill of SCSI ID %d failed", target_id);
+	error_cleanup_pop(1); // map
+	// partition space behind image
+	if (bytesToWrite < size) {
+		info("\nFilling rest of partition: %s",
+				offload_policy_name(op->options.fill));
+		if (offload_fill(fd_card, offset + bytesToWrite, size - bytesToWrite,
+				op->options.fill))
+			error("Fill of SCSI ID %d failed", target_id);
+		if (readback && op->options.fill == OFFLOAD_FILL_ZERO) {
+			// compare against zeros, no image source
+			xfer_job_init(&job, XFER_MODE_VERIFY, -1, 0, fd_verify,
+					offset + bytesToWrite, size - bytesToWrite);
+			job.stripe_count = op->options.stripes;
+			job.cache_policy = op->options.cache;
+			if (xfer_run(&job, NULL))
+				error("Verify of SCSI ID %d failed", target_id);
+			if (job.mismatch_offset >= 0)
+				error("Data mismatch between bytes %ld and %ld",
+						bytesToWrite + job.mismatch_offset,
+						bytesToWrite + job.mismatch_offset + job.mismatch_size);
+		}
+	}
+	error_cleanup_pop(1); // fd_verify
+	error_cleanup_pop(1); // fd_card
+	error_cleanup_pop(1); // vdisk
+	error_cleanup_pop(1); // fd_img
+	if (opt_verbose)
+		printf("\n");
+}
+
+static void sdcard_verify(img2sd_op_t *op, int target_id, char *sdcard_filename,
+		char *image_filename, int shortinfo) {
+	int fd_card, fd_img;
+	struct stat statbuf;
+	config_scsitarget_t *scsitarget;
+	int64_t offset, size;
+	int64_t bytesToRead; // on card
+	transform_t *transform;
+	fsmap_t map;
+	vdisk_t vdisk;
+	unsigned digest_count;
+	int i;
+
+	if (target_id < 0 || target_id >= MAX_SCSITARGETS)
+		error("Invalid target id %d", target_id);
+	scsitarget = &op->targets[target_id];
+	if (!scsitarget->enabled)
+		error("Target id %d not enabled", target_id);
+
+	offset = config_scsitarget_offset(scsitarget);
+	size = config_scsitarget_size(scsitarget);
+	transform = get_transform(op, scsitarget);
+
+	// pipe on stdin: one pass, size known at end of input
+	if (stream_is_stdio(image_filename)
+			&& stream_is_sequential(STDIN_FILENO)) {
+		if (transform || op->options.filesystem != FSMAP_NONE
+				|| op->options.digest_count)
+			error("Layout conversion, --filesystem and --digest are not "
+					"possible with input from stdin");
+		if (!shortinfo)
+			info("Verifying SCSI ID %d on SDcard \"%s\" with stdin.",
+					target_id, sdcard_filename);
+		fd_card = open_card(op, sdcard_filename);
+		if (fd_card < 0)
+			error("Can not open sdcard file \"%s\" for read (sudo?)",
+					sdcard_filename);
+		push_close(fd_card);
+		sdcard_verify_stream(op, target_id, fd_card, STDIN_FILENO, offset,
+				size);
+		error_cleanup_pop(1); // fd_card
+		if (opt_verbose)
+			printf("\n");
+		return;
+	}
+
+	// image file and its format
+	fd_img = open_image(op, image_filename);
+	if (fd_img >= 0)
+		push_close(fd_img);
+	if (fd_img < 0 || fstat(fd_img, &statbuf) < 0)
+		error("Cannot open image file \"%s\"", image_filename);
+	open_vdisk(op, &vdisk, fd_img, transform);
+	bytesToRead = vdisk.size;
+	if (transform) {
+		bytesToRead = transform_card_size(transform, vdisk.size);
+		if (bytesToRead > size
+				&& vdisk.size <= transform_image_size(transform, size))
+			bytesToRead = size;
+	}
+
+	if (opt_verbose && !shortinfo) {
+		info("Verifying SCSI ID %d on SDcard \"%s\" with file \"%s\".",
+				target_id, sdcard_filename, image_filename);
+		info(
+				"SDcard offset = %ld bytes = %ld sectors, size = %ld bytes = %ld sectors.",
+				offset, offset / scsitarget->bytesPerSector, size,
+				size / scsitarget->bytesPerSector);
+	}
+
+	if (bytesToRead % scsitarget->bytesPerSector)
+		error("Size of file \"%s\" is %ld, not a multiple of sector size %d",
+				image_filename, bytesToRead, scsitarget->bytesPerSector);
+	if (bytesToRead > size)
+		error(
+				"Image file too large: Size of file \"%s\" is %ld, size of SCSI ID %d is %ld",
+				image_filename, bytesToRead, target_id, size);
+	if (bytesToRead < size && !shortinfo)
+		warning(
+				"Image file is smaller: Size of file \"%s\" is %ld, size of SCSI ID %d is %ld",
+				image_filename, bytesToRead, target_id, size);
+
+	fd_card = open_card(op, sdcard_filename);
+	if (fd_card < 0)
+		error("Can not open sdcard file \"%s\" for read (sudo?)",
+				sdcard_filename);
+	push_close(fd_card);
+
+	// verify loop. bytesToRead minimum of file and SDcard size.
+	// Only with "compare_tail", the rest of the partition is compared
+	// against zeros.
+	// With --filesystem, only allocated ranges are compared.
+	// A disk image container is compared as one stream, its unallocated
+	// ranges are zeros.
+	if (!op->options.compare_tail)
+		size = bytesToRead;
+	if (transform && op->options.filesystem != FSMAP_NONE)
+		error("--filesystem is not possible with image layout conversion");
+	get_ranges(op, &map, fd_img, 0, bytesToRead);
+	error_cleanup_push(cleanup_fsmap, &map);
+	digest_count = add_digest_sinks(op, op->sinks, 0, image_filename);
+	if (digest_count) {
+		if (transform)
+			error("--digest is not possible with image layout conversion");
+		open_tee(op, digest_count, image_filename);
+	}
+	op->progress_ranges_done = 0;
+	op->progress_ranges_total = map.type == FSMAP_NONE ? 0 : map.allocated;
+	for (i = 0; i < map.count; i++) {
+		fsmap_extent_t *range = &map.extents[i];
+		verify_range(op, target_id, fd_img, range->offset, fd_card, offset,
+				range->offset, range->size, transform, &vdisk,
+				digest_count ? &op->tee : NULL);
+	}
+	// behind the image: compared against zeros, not part of digests
+	verify_range(op, target_id, -1, 0, fd_card, offset, bytesToRead,
+			size - bytesToRead, NULL, NULL, NULL);
+	op->progress_ranges_total = 0;
+	if (digest_count) {
+		error_cleanup_pop(0); // tee, closed now
+		tee_close(&op->tee, bytesToRead);
+		save_digests(op, &op->tee);
+	}
+	error_cleanup_pop(1); // map
+	error_cleanup_pop(1); // fd_card
+	error_cleanup_pop(1); // vdisk
+	error_cleanup_pop(1); // fd_img
+	if (opt_verbose)
+		printf("\n");
+}
+
+// clear a whole partition with the --fill policy
+static void sdcard_wipe(img2sd_op_t *op, int target_id, char *sdcard_filename) {
+	int fd_card;
+	config_scsitarget_t *scsitarget;
+	int64_t offset, size;
+
+	if (target_id < 0 || target_id >= MAX_SCSITARGETS)
+		error("Invalid target id %d", target_id);
+	scsitarget = &op->targets[target_id];
+	if (!scsitarget->enabled)
+		error("Target id %d not enabled", target_id);
+	if (op->options.fill == OFFLOAD_FILL_NONE)
+		error("Wipe with fill policy \"none\" does nothing");
+
+	offset = config_scsitarget_offset(scsitarget);
+	size = config_scsitarget_size(scsitarget);
+	info("Wiping SCSI ID %d on SDcard \"%s\" with \"%s\".", target_id,
+			sdcard_filename, offload_policy_name(op->options.fill));
+
+	fd_card = open_card(op, sdcard_filename); // must exist
+	if (fd_card < 0)
+		error("Can not open sdcard file \"%s\" for write (sudo?)",
+				sdcard_filename);
+	push_close(fd_card);
+	if (offload_fill(fd_card, offset, size, op->options.fill))
+		error("Wipe of SCSI ID %d failed", target_id);
+	error_cleanup_pop(1); // fd_card
+}
+
+static char *op_names[] = { "read", "write", "compare", "writecompare",
+		"wipe", NULL };
+
+// result: IMG2SD_OP_*, -1 if unknown
+int img2sd_parse_op_type(char *name) {
+	int type;
+	for (type = 0; op_names[type]; type++)
+		if (!strcmp(op_names[type], name))
+			return type;
+	return -1;
+}
+
+char *img2sd_op_name(img2sd_op_type_t type) {
+	return op_names[type];
+}
+
+/* a "<option>=<value>" word of a job into "options": stripes, fill,
+ * filesystem, pagecache, digest, update or comparetail.
+ * result: 0 = OK, else error with text in "error_text"
+ */
+int img2sd_parse_option(img2sd_options_t *options, char *word,
+		char *error_text) {
+	char *value = strchr(word, '=');
+	char *name, *rest;
+
+	if (!value) {
+		snprintf(error_text, ERROR_MAX_TEXT, "Option \"%.*s\" without value",
+				IMG2SD_MAX_ECHO, word);
+		return ERROR_ILLPARAMVAL;
+	}
+	*value++ = 0;
+	if (!strcmp(word, "stripes")) {
+		options->stripes = atoi(value);
+		if (options->stripes < 1 || options->stripes > XFER_MAX_STRIPES)
+			goto invalid;
+	} else if (!strcmp(word, "fill")) {
+		if ((options->fill = offload_parse_policy(value)) < 0)
+			goto invalid;
+	} else if (!strcmp(word, "filesystem")) {
+		if ((options->filesystem = fsmap_parse_type(value)) < 0)
+			goto invalid;
+	} else if (!strcmp(word, "pagecache")) {
+		if ((options->cache = cache_parse_policy(value)) < 0)
+			goto invalid;
+	} else if (!strcmp(word, "update")) {
+		options->update = atoi(value) != 0;
+	} else if (!strcmp(word, "comparetail")) {
+		options->compare_tail = atoi(value) != 0;
+	} else if (!strcmp(word, "digest")) {
+		options->digest_count = 0;
+		for (name = strtok_r(value, ",", &rest); name;
+				name = strtok_r(NULL, ",", &rest)) {
+			if (!strcasecmp(name, "none"))
+				continue;
+			if (!digest_is_known(name) || strlen(name) >= DIGEST_MAX_NAME
+					|| options->digest_count >= TEE_MAX_SINKS)
+				goto invalid;
+			strcpy(options->digests[options->digest_count++], name);
+		}
+	} else {
+		snprintf(error_text, ERROR_MAX_TEXT, "Unknown option \"%.*s\"",
+				IMG2SD_MAX_ECHO, word);
+		return ERROR_ILLPARAMVAL;
+	}
+	return ERROR_OK;
+invalid:
+	snprintf(error_text, ERROR_MAX_TEXT, "Invalid value for option \"%.*s\"",
+			IMG2SD_MAX_ECHO, word);
+	return ERROR_ILLPARAMVAL;
+}
+
+/* a job as text, split into words, as in --jobs manifests and --daemon
+ * requests:
+ *   read|write|compare|writecompare <device> <config> <target_id> <image>
+ *   wipe <device> <config> <target_id>
+ * each followed by optional "<option>=<value>" words.
+ * Sets type, device, target_id, image and options of "op". The config
+ * file is returned in "config", for the caller to load.
+ * result: 0 = OK, else error with text in "error_text"
+ */
+int img2sd_parse_job(img2sd_op_t *op, char **words, int word_count,
+		char **config, char *error_text) {
+	int type, fixed, i;
+	char *end;
+
+	type = word_count ? img2sd_parse_op_type(words[0]) : -1;
+	if (type < 0) {
+		snprintf(error_text, ERROR_MAX_TEXT, "Unknown operation \"%.*s\"",
+				IMG2SD_MAX_ECHO, word_count ? words[0] : "");
+		return ERROR_ILLPARAMVAL;
+	}
+	fixed = type == IMG2SD_OP_WIPE ? 4 : 5;
+	if (word_count < fixed) {
+		snprintf(error_text, ERROR_MAX_TEXT, "Missing arguments for \"%.*s\"",
+				IMG2SD_MAX_ECHO, words[0]);
+		return ERROR_ILLPARAMVAL;
+	}
+	for (i = 1; i < fixed; i++)
+		if (strlen(words[i]) >= PATH_MAX) {
+			strcpy(error_text, "File name too long");
+			return ERROR_ILLPARAMVAL;
+		}
+	op->type = type;
+	strcpy(op->device, words[1]);
+	*config = words[2];
+	op->target_id = strtol(words[3], &end, 10);
+	if (*end || op->target_id < 0 || op->target_id >= MAX_SCSITARGETS) {
+		snprintf(error_text, ERROR_MAX_TEXT, "Invalid target id \"%.*s\"",
+				IMG2SD_MAX_ECHO, words[3]);
+		return ERROR_ILLPARAMVAL;
+	}
+	op->image[0] = 0;
+	if (type != IMG2SD_OP_WIPE) {
+		if (stream_is_stdio(words[4])) {
+			strcpy(error_text, "No stdin and stdout for jobs");
+			return ERROR_ILLPARAMVAL;
+		}
+		strcpy(op->image, words[4]);
+	}
+	for (i = fixed; i < word_count; i++)
+		if (img2sd_parse_option(&op->options, words[i], error_text))
+			return ERROR_ILLPARAMVAL;
+	return ERROR_OK;
+}
+
+// options as without command line options
+void img2sd_options_init(img2sd_options_t *options) {
+	memset(options, 0, sizeof(*options));
+	options->au_merge = 1;
+	options->fill = OFFLOAD_FILL_ZERO;
+	options->stripes = 1;
+	options->cache = CACHE_POLICY_AUTO;
+	options->dirty_window = WBEHIND_DEFAULT_WINDOW;
+	options->verify_lag = 4;
+	options->interleave = 1;
+	options->filesystem = FSMAP_NONE;
+	strcpy(options->goldcache_dir, GOLDCACHE_DEFAULT_DIR);
+	options->fd_stdout = STDOUT_FILENO;
+}
+
+/* load the SCSI targets of a SCSI2SD config XML into "targets",
+ * MAX_SCSITARGETS entries. The XML parser is used by one thread at a time.
+ * result: 0 = OK, else error code, text in "error_text" if not NULL
+ */
+int img2sd_load_targets(char *filename, config_scsitarget_t *targets,
+		char *error_text) {
+	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	error_catch_t catch;
+
+	pthread_mutex_lock(&mutex);
+	error_catch_begin(&catch);
+	if (!setjmp(catch.env) && config_load_targets(filename, targets))
+		error("Can not load SCSI2SD config \"%s\"", filename);
+	error_catch_end(&catch);
+	pthread_mutex_unlock(&mutex);
+	if (error_text)
+		strcpy(error_text, catch.text);
+	return catch.code;
+}
+
+void img2sd_op_init(img2sd_op_t *op) {
+	memset(op, 0, sizeof(*op));
+	img2sd_options_init(&op->options);
+	op->fd_device = -1;
+	op->targets = config_scsitargets;
+	op->state = IMG2SD_STATE_IDLE;
+	op->event_fd = -1;
+}
+
+static void dispatch(img2sd_op_t *op) {
+	switch (op->type) {
+	case IMG2SD_OP_READ:
+		sdcard_read(op, op->target_id, op->device, op->image);
+		break;
+	case IMG2SD_OP_WRITE:
+		sdcard_write(op, op->target_id, op->device, op->image, 0);
+		break;
+	case IMG2SD_OP_COMPARE:
+		sdcard_verify(op, op->target_id, op->device, op->image,
+				op->shortinfo);
+		break;
+	case IMG2SD_OP_WRITECOMPARE:
+		sdcard_write(op, op->target_id, op->device, op->image, 1);
+		break;
+	case IMG2SD_OP_WIPE:
+		sdcard_wipe(op, op->target_id, op->device);
+		break;
+	default:
+		error("Illegal operation %d", op->type);
+	}
+}
+
+/* execute an operation in the caller's thread.
+ * result: 0 = OK, else error code, text in op->error_text
+ */
+int img2sd_run(img2sd_op_t *op) {
+	img2sd_op_t *prev_op = op_current;
+	error_catch_t catch;
+	img2sd_state_t state;
+
+	op->error_code = ERROR_OK;
+	op->error_text[0] = 0;
+	op->changed = 0;
+	op->digest_count = 0;
+	op->progress_done = op->progress_total = 0;
+	__atomic_store_n(&op->state, IMG2SD_STATE_RUNNING, __ATOMIC_RELEASE);
+	op_current = op;
+	error_catch_begin(&catch);
+	if (!setjmp(catch.env)) {
+		dispatch(op);
+		state = IMG2SD_STATE_DONE;
+	} else {
+		op->error_code = catch.code;
+		strcpy(op->error_text, catch.text);
+		if (catch.code == ERROR_CANCELED
+				|| __atomic_load_n(&op->cancel, __ATOMIC_RELAXED))
+			state = IMG2SD_STATE_CANCELED;
+		else
+			state = IMG2SD_STATE_FAILED;
+	}
+	error_catch_end(&catch);
+	op_current = prev_op;
+	__atomic_store_n(&op->state, state, __ATOMIC_RELEASE);
+	if (op->done)
+		op->done(op);
+	if (op->event_fd >= 0) {
+		uint64_t one = 1;
+		if (write(op->event_fd, &one, sizeof(one)) < 0)
+			warning("Can not signal end of operation, errno = %d", errno);
+	}
+	return op->error_code;
+}
+
+static void *op_thread(void *arg) {
+	img2sd_run(arg);
+	return NULL;
+}
+
+/* execute an operation in an own thread. End with img2sd_wait().
+ * result: 0 = OK, else error code
+ */
+int img2sd_start(img2sd_op_t *op) {
+	op->cancel = 0;
+	op->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (op->event_fd < 0)
+		return ERROR_HOSTFILE;
+	// RUNNING before the thread exists, for img2sd_poll()
+	__atomic_store_n(&op->state, IMG2SD_STATE_RUNNING, __ATOMIC_RELEASE);
+	if (pthread_create(&op->thread, NULL, op_thread, op)) {
+		close(op->event_fd);
+		op->event_fd = -1;
+		op->state = IMG2SD_STATE_IDLE;
+		return ERROR_ILLPARAMVAL;
+	}
+	return ERROR_OK;
+}
+
+/* state and bytes transferred of a started operation,
+ * "done" and "total" may be NULL
+ */
+img2sd_state_t img2sd_poll(img2sd_op_t *op, int64_t *done, int64_t *total) {
+	if (done)
+		*done = __atomic_load_n(&op->progress_done, __ATOMIC_RELAXED);
+	if (total)
+		*total = __atomic_load_n(&op->progress_total, __ATOMIC_RELAXED);
+	return __atomic_load_n(&op->state, __ATOMIC_ACQUIRE);
+}
+
+// readable when a started operation has ended, for poll() and select()
+int img2sd_event_fd(img2sd_op_t *op) {
+	return op->event_fd;
+}
+
+/* stop an operation at the next progress report, from any thread.
+ * It ends with state IMG2SD_STATE_CANCELED.
+ */
+void img2sd_cancel(img2sd_op_t *op) {
+	__atomic_store_n(&op->cancel, 1, __ATOMIC_RELAXED);
+}
+
+// wait for the end of a started operation, release its thread
+img2sd_state_t img2sd_wait(img2sd_op_t *op) {
+	if (op->event_fd < 0)
+		return op->state; // not started
+	pthread_join(op->thread, NULL);
+	close(op->event_fd);
+	op->event_fd = -1;
+	return op->state;
+}
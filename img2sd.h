@@ -0,0 +1,163 @@
+/* img2sd.h: library interface of img2sd, without exit on errors
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+ */
+
+#ifndef IMG2SD_H_
+#define IMG2SD_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <linux/limits.h>
+
+#include "error.h"
+#include "config.h"
+#include "transform.h"
+#include "tee.h"
+#include "digest.h"
+
+// at most this many characters of a request word in error texts
+#define IMG2SD_MAX_ECHO	200
+
+// what an operation does with a target of the card
+typedef enum {
+	IMG2SD_OP_READ, // card to image
+	IMG2SD_OP_WRITE, // image to card
+	IMG2SD_OP_COMPARE, // image with card
+	IMG2SD_OP_WRITECOMPARE, // write, read back each chunk
+	IMG2SD_OP_WIPE // clear target with "fill" policy, no image
+} img2sd_op_type_t;
+
+typedef enum {
+	IMG2SD_STATE_IDLE,
+	IMG2SD_STATE_RUNNING,
+	IMG2SD_STATE_DONE,
+	IMG2SD_STATE_FAILED,
+	IMG2SD_STATE_CANCELED
+} img2sd_state_t;
+
+// transfer options, as the command line options of the same name
+typedef struct {
+	int64_t au_size; // SDcard allocation unit, 0 = probe from device
+	int au_merge; // merge unaligned head/tail of writes with card data
+	int fill; // partition space behind a written image, OFFLOAD_FILL_*
+	int compare_tail; // compare also partition space behind image to zeros
+	int stripes; // parallel threads per transfer
+	int cache; // page cache use, CACHE_POLICY_*
+	int64_t dirty_window; // write-behind, 0 = off
+	int verify_lag; // writecompare: chunks between write and read back
+	int update; // read rewrites only changed blocks of existing image
+	int snapshot; // update: reflink previous image version
+	int image_sector_size; // sector size of image files, 0 = as target
+	int interleave; // sector order of image files on a track
+	int skew;
+	int byteswap; // swap bytes of 16-bit words in image files
+	int filesystem; // transfer only allocated blocks, FSMAP_*
+	tee_sink_t tee_sinks[TEE_MAX_SINKS]; // extra outputs of a read
+	unsigned tee_sink_count;
+	int64_t goldcache_budget; // RAM cache for images to write, 0 = off
+	char goldcache_dir[PATH_MAX];
+	int64_t stream_size; // bytes on stdin, 0 = up to partition size
+	char digests[TEE_MAX_SINKS][DIGEST_MAX_NAME]; // of transferred images
+	unsigned digest_count;
+	int digest_files; // write digests to "<image>.<algorithm>"
+	int fd_stdout; // image data for "-"
+} img2sd_options_t;
+
+struct img2sd_op_struct;
+
+// called from the thread of the operation. result: 0 = go on, else cancel
+typedef int (*img2sd_progress_func_t)(struct img2sd_op_struct *op,
+		int64_t done, int64_t total);
+// called from the thread of the operation at its end
+typedef void (*img2sd_done_func_t)(struct img2sd_op_struct *op);
+
+typedef struct {
+	char algorithm[DIGEST_MAX_NAME];
+	char text[DIGEST_MAX_TEXT];
+} img2sd_digest_t;
+
+/* one operation on a target. Set up by img2sd_op_init(), then the
+ * inputs are filled in, then it is executed by img2sd_run() or
+ * img2sd_start().
+ */
+typedef struct img2sd_op_struct {
+	// inputs
+	img2sd_op_type_t type;
+	char device[PATH_MAX]; // SDcard device or file
+	int fd_device; // "device" opened read/write by the caller, -1 = not
+	config_scsitarget_t *targets; // layout, MAX_SCSITARGETS entries
+	int target_id;
+	char image[PATH_MAX]; // image file, "-" = stdin/stdout
+	img2sd_options_t options;
+	int shortinfo; // fewer output, for a compare after a write
+	img2sd_progress_func_t progress; // NULL = none
+	img2sd_done_func_t done; // NULL = none
+	void *context; // for the callbacks
+
+	// results
+	img2sd_state_t state;
+	int error_code; // ERROR_*
+	char error_text[ERROR_MAX_TEXT];
+	int64_t changed; // bytes changed by update
+	unsigned digest_count; // of the image
+	img2sd_digest_t digests[TEE_MAX_SINKS];
+
+	// private
+	int64_t progress_done, progress_total; // atomic access
+	int cancel; // atomic access
+	int event_fd; // signaled at end
+	pthread_t thread;
+	int64_t progress_ranges_done; // transfers split into ranges
+	int64_t progress_ranges_total; // 0 = single range
+	char *progress_what;
+	transform_t transform;
+	tee_t tee;
+	tee_sink_t sinks[TEE_MAX_SINKS]; // tee_sinks, qcow2 and digests
+} img2sd_op_t;
+
+#ifndef IMG2SD_C_
+extern int opt_verbose;
+#endif
+
+void img2sd_options_init(img2sd_options_t *options);
+int img2sd_load_targets(char *filename, config_scsitarget_t *targets,
+		char *error_text);
+void img2sd_op_init(img2sd_op_t *op);
+int img2sd_parse_op_type(char *name);
+char *img2sd_op_name(img2sd_op_type_t type);
+int img2sd_parse_option(img2sd_options_t *options, char *word,
+		char *error_text);
+int img2sd_parse_job(img2sd_op_t *op, char **words, int word_count,
+		char **config, char *error_text);
+
+int img2sd_run(img2sd_op_t *op);
+int img2sd_start(img2sd_op_t *op);
+img2sd_state_t img2sd_poll(img2sd_op_t *op, int64_t *done, int64_t *total);
+int img2sd_event_fd(img2sd_op_t *op);
+void img2sd_cancel(img2sd_op_t *op);
+img2sd_state_t img2sd_wait(img2sd_op_t *op);
+
+int64_t img2sd_au_size(char *device, int64_t au_size);
+
+#endif /* IMG2SD_H_ */
@@ -0,0 +1,307 @@
+/* img2sd_test.c: round trip tests of the library interface
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+
+ Runs write, compare, read and digest operations through img2sd.h on a
+ card file in a temporary directory. Failed operations must return to
+ the caller without leaking file handles, and the next one must work.
+ "make test" builds and runs it. Exit code 0 = all passed.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <openssl/evp.h>
+
+#include "error.h"
+#include "utils.h"
+#include "bufpool.h"
+#include "img2sd.h"
+
+#define CARD_SIZE	(16 * 1024 * 1024)
+#define IMAGE_SIZE	(3 * 1024 * 1024)
+#define PARTITION_SECTORS	8192 // 4 MB, image is smaller
+
+static char dir[64]; // short: file names in it fit PATH_MAX
+static char card_filename[PATH_MAX];
+static char image_filename[PATH_MAX];
+static config_scsitarget_t targets[MAX_SCSITARGETS];
+static int failures = 0;
+
+#define CHECK(cond) check(cond, #cond, __LINE__)
+
+static void check(int cond, char *text, int line) {
+	if (cond)
+		return;
+	fprintf(stderr, "FAILED line %d: %s\n", line, text);
+	failures++;
+}
+
+static int open_fd_count(void) {
+	DIR *d = opendir("/proc/self/fd");
+	struct dirent *de;
+	int n = 0;
+	while ((de = readdir(d)))
+		n++;
+	closedir(d);
+	return n;
+}
+
+static void make_file(char *filename, int64_t size, int pattern) {
+	char *data = malloc(size);
+	int64_t i;
+	int fd = open(filename, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	for (i = 0; i < size; i++)
+		data[i] = pattern ? (char) (i * 7 + i / 4096) : 0;
+	if (fd < 0 || pwrite_full(fd, data, size, 0) < 0)
+		fatal("Can not create \"%s\"", filename);
+	close(fd);
+	free(data);
+}
+
+// compare "len" bytes of two files. result: 1 = equal
+static int same_data(char *filename_a, int64_t offset_a, char *filename_b,
+		int64_t offset_b, int64_t len) {
+	char *a = malloc(len), *b = malloc(len);
+	int fd_a = open(filename_a, O_RDONLY), fd_b = open(filename_b, O_RDONLY);
+	int res = fd_a >= 0 && fd_b >= 0 && pread_full(fd_a, a, len, offset_a) >= 0
+			&& pread_full(fd_b, b, len, offset_b) >= 0 && !memcmp(a, b, len);
+	close(fd_a);
+	close(fd_b);
+	free(a);
+	free(b);
+	return res;
+}
+
+static void sha256_file(char *filename, char *text) {
+	unsigned char md[EVP_MAX_MD_SIZE], buffer[65536];
+	unsigned md_len, i;
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	int fd = open(filename, O_RDONLY);
+	ssize_t n;
+
+	EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+	while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+		EVP_DigestUpdate(ctx, buffer, n);
+	EVP_DigestFinal_ex(ctx, md, &md_len);
+	EVP_MD_CTX_free(ctx);
+	close(fd);
+	for (i = 0; i < md_len; i++)
+		sprintf(text + 2 * i, "%02x", md[i]);
+}
+
+static void setup_op(img2sd_op_t *op, img2sd_op_type_t type, int target_id,
+		char *image) {
+	img2sd_op_init(op);
+	op->type = type;
+	op->targets = targets;
+	op->target_id = target_id;
+	strcpy(op->device, card_filename);
+	strcpy(op->image, image);
+	op->options.au_size = 1024 * 1024;
+}
+
+static int cancel_progress(img2sd_op_t *op, int64_t done, int64_t total) {
+	(void) op;
+	(void) done;
+	(void) total;
+	return 1;
+}
+
+static void test_write_compare(void) {
+	img2sd_op_t op;
+	int64_t offset = config_scsitarget_offset(&targets[0]);
+
+	setup_op(&op, IMG2SD_OP_WRITECOMPARE, 0, image_filename);
+	CHECK(img2sd_run(&op) == 0);
+	CHECK(op.state == IMG2SD_STATE_DONE);
+	CHECK(same_data(image_filename, 0, card_filename, offset, IMAGE_SIZE));
+
+	setup_op(&op, IMG2SD_OP_COMPARE, 0, image_filename);
+	CHECK(img2sd_run(&op) == 0);
+}
+
+static void test_read_digest(void) {
+	char read_filename[PATH_MAX], zeros_filename[PATH_MAX];
+	char text[DIGEST_MAX_TEXT];
+	img2sd_op_t op;
+
+	snprintf(read_filename, sizeof(read_filename), "%s/read.img", dir);
+	snprintf(zeros_filename, sizeof(zeros_filename), "%s/zeros.img", dir);
+	setup_op(&op, IMG2SD_OP_READ, 0, read_filename);
+	strcpy(op.options.digests[0], "sha256");
+	op.options.digest_count = 1;
+	CHECK(img2sd_run(&op) == 0);
+	CHECK(same_data(image_filename, 0, read_filename, 0, IMAGE_SIZE));
+	// space behind the image was filled with zeros by the write
+	make_file(zeros_filename, PARTITION_SECTORS * 512 - IMAGE_SIZE, 0);
+	CHECK(same_data(zeros_filename, 0, read_filename, IMAGE_SIZE,
+			PARTITION_SECTORS * 512 - IMAGE_SIZE));
+	sha256_file(read_filename, text);
+	CHECK(op.digest_count == 1);
+	CHECK(!strcmp(op.digests[0].algorithm, "sha256"));
+	CHECK(!strcmp(op.digests[0].text, text));
+}
+
+static void test_mismatch(void) {
+	int64_t offset = config_scsitarget_offset(&targets[0]) + IMAGE_SIZE / 2;
+	img2sd_op_t op;
+	char c = 0x55;
+	int fd = open(card_filename, O_RDWR);
+
+	pwrite_full(fd, &c, 1, offset);
+	close(fd);
+	setup_op(&op, IMG2SD_OP_COMPARE, 0, image_filename);
+	CHECK(img2sd_run(&op) != 0);
+	CHECK(op.state == IMG2SD_STATE_FAILED);
+	CHECK(strstr(op.error_text, "mismatch") != NULL);
+}
+
+static void put_be(unsigned char *data, uint64_t val, int bytes) {
+	while (bytes--) {
+		data[bytes] = val & 0xff;
+		val >>= 8;
+	}
+}
+
+// qcow2 header with a 32G L1 table, in a file of one sector
+static void make_crafted_qcow2(char *filename) {
+	unsigned char header[512];
+	int fd = open(filename, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	memset(header, 0, sizeof(header));
+	memcpy(header, "QFI\xfb", 4);
+	put_be(header + 4, 3, 4); // version
+	put_be(header + 20, 16, 4); // cluster bits
+	put_be(header + 24, (uint64_t) 1 << 60, 8); // disk size
+	put_be(header + 36, 0xffffffff, 4); // L1 entries
+	put_be(header + 40, 0x10000, 8); // L1 offset
+	if (fd < 0 || pwrite_full(fd, header, sizeof(header), 0) < 0)
+		fatal("Can not create \"%s\"", filename);
+	close(fd);
+}
+
+// failures return to the caller, the process goes on
+static void test_errors(void) {
+	char missing[PATH_MAX], crafted[PATH_MAX];
+	int fd_count = open_fd_count();
+	img2sd_op_t op;
+
+	snprintf(missing, sizeof(missing), "%s/missing.img", dir);
+	setup_op(&op, IMG2SD_OP_WRITE, 0, missing);
+	CHECK(img2sd_run(&op) != 0);
+	CHECK(op.error_text[0] != 0);
+
+	setup_op(&op, IMG2SD_OP_WRITE, 5, image_filename);
+	CHECK(img2sd_run(&op) != 0); // target not enabled
+
+	setup_op(&op, IMG2SD_OP_READ, MAX_SCSITARGETS, image_filename);
+	CHECK(img2sd_run(&op) != 0); // behind the layout table
+	CHECK(strstr(op.error_text, "Invalid target id") != NULL);
+
+	snprintf(crafted, sizeof(crafted), "%s/crafted.qcow2", dir);
+	make_crafted_qcow2(crafted);
+	setup_op(&op, IMG2SD_OP_WRITE, 1, crafted);
+	CHECK(img2sd_run(&op) != 0);
+	CHECK(strstr(op.error_text, "L1 table") != NULL);
+
+	snprintf(missing, sizeof(missing), "%s/bad-digest.img", dir);
+	setup_op(&op, IMG2SD_OP_READ, 1, missing);
+	strcpy(op.options.digests[0], "no-such-digest");
+	op.options.digest_count = 1;
+	CHECK(img2sd_run(&op) != 0);
+
+	setup_op(&op, IMG2SD_OP_WRITE, 1, image_filename);
+	op.progress = cancel_progress;
+	CHECK(img2sd_run(&op) == ERROR_CANCELED);
+	CHECK(op.state == IMG2SD_STATE_CANCELED);
+
+	CHECK(open_fd_count() == fd_count);
+}
+
+// after failures, an operation in an own thread still completes
+static void test_async(void) {
+	img2sd_op_t op;
+
+	setup_op(&op, IMG2SD_OP_WRITECOMPARE, 0, image_filename);
+	op.options.stripes = 2;
+	CHECK(img2sd_start(&op) == 0);
+	CHECK(img2sd_wait(&op) == IMG2SD_STATE_DONE);
+	CHECK(op.error_code == 0);
+}
+
+// sizes which never reuse a free buffer fill the table, must not block
+static void test_bufpool_sizes(void) {
+	unsigned i;
+	alarm(10); // a deadlock kills the test
+	for (i = 0; i < 2 * BUFPOOL_MAX_BUFFERS; i++) {
+		char *buffer = bufpool_get(BUFPOOL_MIN_BUFFER_SIZE
+				+ i * BUFPOOL_ALIGNMENT);
+		CHECK(buffer != NULL);
+		bufpool_put(buffer);
+	}
+	alarm(0);
+	bufpool_release();
+}
+
+int main(void) {
+	ferr = stderr;
+	snprintf(dir, sizeof(dir), "/tmp/img2sd_test-XXXXXX");
+	if (!mkdtemp(dir))
+		fatal("Can not create test directory");
+	snprintf(card_filename, sizeof(card_filename), "%s/card.img", dir);
+	snprintf(image_filename, sizeof(image_filename), "%s/image.img", dir);
+	make_file(card_filename, CARD_SIZE, 0);
+	make_file(image_filename, IMAGE_SIZE, 1);
+
+	memset(targets, 0, sizeof(targets));
+	targets[0].targetId = 0;
+	targets[0].enabled = 1;
+	targets[0].sectorStart = 2048;
+	targets[0].sectors = PARTITION_SECTORS;
+	targets[0].bytesPerSector = 512;
+	targets[1] = targets[0];
+	targets[1].targetId = 1;
+	targets[1].sectorStart = 2048 + PARTITION_SECTORS;
+
+	test_write_compare();
+	test_read_digest();
+	test_mismatch();
+	test_errors();
+	test_async();
+	test_bufpool_sizes();
+
+	if (!failures) {
+		char cmd[PATH_MAX + 16];
+		snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+		if (system(cmd))
+			fprintf(stderr, "Can not remove \"%s\"\n", dir);
+		printf("img2sd library tests passed.\n");
+	} else
+		printf("%d img2sd library tests FAILED, files in \"%s\".\n", failures,
+				dir);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,535 @@
+/* jobs.c: batch of transfers from a manifest, planned before execution
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+
+ "img2sd --jobs <manifest>" reads all jobs first, one per line, as the
+ requests of --daemon:
+   read|write|compare|writecompare <device> <config> <target_id> <image>
+		[<option>=<value> ...]
+   wipe <device> <config> <target_id> [<option>=<value> ...]
+ "#" starts a comment. Options on the command line before --jobs are
+ the defaults.
+ The planner
+ - groups jobs into lanes: the jobs of one device, or of several devices
+   if an image read from one is used on another.
+ - orders the jobs of a single device lane by card offset, to reduce
+   seeks. A job never moves across another job on an overlapping card
+   range (unless both only read the card) or on the same image file.
+ - merges reads of the same card range: the second image is written by
+   a tee sink of the first read.
+ - prints the plan with a time estimate, then runs the lanes in parallel.
+ A failed job stops the rest of its lane, later jobs may depend on it.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "error.h"
+#include "config.h"
+#include "offload.h"
+#include "bufpool.h"
+#include "tee.h"
+#include "img2sd.h"
+#include "jobs.h"	// own
+
+typedef struct job_struct {
+	unsigned line; // in manifest
+	int device; // index in devices[]
+	char image_path[PATH_MAX]; // real path, also if not yet existing
+	config_scsitarget_t targets[MAX_SCSITARGETS];
+	int64_t offset, size; // of the partition on the card
+	double seconds; // estimated
+	struct job_struct *merged_into; // read done as tee of another read
+	img2sd_op_t op;
+} job_t;
+
+typedef struct {
+	char path[PATH_MAX]; // real path
+	int lane; // union-find parent while planning, then lane index
+} device_t;
+
+typedef struct {
+	job_t *jobs[JOBS_MAX]; // in execution order
+	unsigned count;
+	unsigned device_count;
+	double seconds;
+	pthread_t thread;
+	unsigned done, failed, skipped;
+} lane_t;
+
+typedef struct {
+	char filename[PATH_MAX];
+	config_scsitarget_t targets[MAX_SCSITARGETS];
+} layout_t;
+
+static job_t *jobs[JOBS_MAX]; // in manifest order
+static unsigned job_count;
+static device_t devices[JOBS_MAX_DEVICES];
+static unsigned device_count;
+static lane_t lanes[JOBS_MAX_DEVICES];
+static unsigned lane_count;
+static layout_t layouts[JOBS_MAX_DEVICES];
+static unsigned layout_count;
+static unsigned merged_count;
+
+// parse each config XML once
+static config_scsitarget_t *get_targets(char *filename, char *error_text) {
+	unsigned i;
+	for (i = 0; i < layout_count; i++)
+		if (!strcmp(layouts[i].filename, filename))
+			return layouts[i].targets;
+	if (layout_count >= JOBS_MAX_DEVICES) {
+		snprintf(error_text, ERROR_MAX_TEXT, "More than %d config files",
+				JOBS_MAX_DEVICES);
+		return NULL;
+	}
+	if (img2sd_load_targets(filename, layouts[layout_count].targets,
+			error_text))
+		return NULL;
+	strcpy(layouts[layout_count].filename, filename);
+	return layouts[layout_count++].targets;
+}
+
+/* real path of an image file, which may be made by a job only:
+ * then from the real path of its directory, so paths of all jobs compare.
+ * Kept as is if the directory does not exist either, or for "-".
+ */
+static void get_image_path(char *filename, char *path) {
+	char dir[PATH_MAX], base[PATH_MAX], real_dir[PATH_MAX];
+
+	if (realpath(filename, path))
+		return;
+	strcpy(path, filename);
+	if (!strcmp(filename, "-"))
+		return;
+	// dirname() and basename() modify their argument
+	strcpy(dir, filename);
+	strcpy(base, filename);
+	if (!realpath(dirname(dir), real_dir))
+		return;
+	if (snprintf(dir, sizeof(dir), "%s/%s", real_dir, basename(base))
+			< (int) sizeof(dir))
+		strcpy(path, dir);
+}
+
+// index of a device by its real path, added on first use. result: -1 error
+static int get_device(char *filename, char *error_text) {
+	char path[PATH_MAX];
+	unsigned i;
+	if (!realpath(filename, path)) {
+		snprintf(error_text, ERROR_MAX_TEXT,
+				"SDcard device \"%.*s\" does not exist", IMG2SD_MAX_ECHO,
+				filename);
+		return -1;
+	}
+	for (i = 0; i < device_count; i++)
+		if (!strcmp(devices[i].path, path))
+			return i;
+	if (device_count >= JOBS_MAX_DEVICES) {
+		snprintf(error_text, ERROR_MAX_TEXT, "More than %d devices",
+				JOBS_MAX_DEVICES);
+		return -1;
+	}
+	strcpy(devices[device_count].path, path);
+	devices[device_count].lane = device_count;
+	return device_count++;
+}
+
+// estimated run time of a job, from its sizes and the fill policy
+static double estimate(job_t *job) {
+	int64_t image = job->size, fill_size;
+	int zero_fill = job->op.options.fill == OFFLOAD_FILL_ZERO;
+	struct stat statbuf;
+	double seconds = 0;
+
+	// images made by earlier jobs do not exist yet: full partition
+	if (job->op.type != IMG2SD_OP_READ && job->op.type != IMG2SD_OP_WIPE
+			&& stat(job->op.image, &statbuf) == 0
+			&& statbuf.st_size < job->size)
+		image = statbuf.st_size;
+	fill_size = zero_fill ? job->size - image : 0;
+	switch (job->op.type) {
+	case IMG2SD_OP_READ:
+		seconds = (double) job->size / JOBS_READ_RATE;
+		break;
+	case IMG2SD_OP_WRITECOMPARE:
+		seconds = (double) (image + fill_size) / JOBS_READ_RATE;
+		// fall through
+	case IMG2SD_OP_WRITE:
+		seconds += (double) (image + fill_size) / JOBS_WRITE_RATE;
+		break;
+	case IMG2SD_OP_COMPARE:
+		seconds = (double) (image + fill_size) / JOBS_READ_RATE;
+		break;
+	case IMG2SD_OP_WIPE:
+		seconds = zero_fill ? (double) job->size / JOBS_WRITE_RATE : 0;
+		break;
+	}
+	return seconds;
+}
+
+// parse all lines of the manifest into jobs[], exit on error
+static void load_manifest(char *manifest_filename,
+		img2sd_options_t *defaults) {
+	char line[JOBS_MAX_LINE];
+	char error_text[ERROR_MAX_TEXT];
+	char *words[JOBS_MAX_LINE / 2];
+	char *word, *config, *rest;
+	config_scsitarget_t *targets = NULL;
+	unsigned line_nr = 0;
+	int word_count;
+	job_t *job;
+	FILE *f;
+
+	f = fopen(manifest_filename, "r");
+	if (!f)
+		error("Can not open job manifest \"%s\"", manifest_filename);
+	while (fgets(line, sizeof(line), f)) {
+		line_nr++;
+		if ((word = strchr(line, '#')))
+			*word = 0;
+		word_count = 0;
+		for (word = strtok_r(line, " \t\r\n", &rest); word;
+				word = strtok_r(NULL, " \t\r\n", &rest))
+			words[word_count++] = word;
+		if (word_count == 0)
+			continue;
+		if (job_count >= JOBS_MAX)
+			error("%s, line %u: More than %d jobs", manifest_filename,
+					line_nr, JOBS_MAX);
+		job = malloc(sizeof(job_t));
+		if (!job)
+			fatal("Out of memory");
+		jobs[job_count++] = job;
+		job->line = line_nr;
+		job->merged_into = NULL;
+		img2sd_op_init(&job->op);
+		job->op.options = *defaults;
+		job->op.options.tee_sink_count = 0;
+		if (img2sd_parse_job(&job->op, words, word_count, &config,
+				error_text)
+				|| !(targets = get_targets(config, error_text))
+				|| (job->device = get_device(job->op.device, error_text)) < 0)
+			error("%s, line %u: %s", manifest_filename, line_nr, error_text);
+		if (!targets[job->op.target_id].enabled)
+			error("%s, line %u: Target id %d not enabled in \"%s\"",
+					manifest_filename, line_nr, job->op.target_id, config);
+		memcpy(job->targets, targets, sizeof(job->targets));
+		job->op.targets = job->targets;
+		job->offset = config_scsitarget_offset(&targets[job->op.target_id]);
+		job->size = config_scsitarget_size(&targets[job->op.target_id]);
+		get_image_path(job->op.image, job->image_path);
+		job->seconds = estimate(job);
+	}
+	fclose(f);
+	if (job_count == 0)
+		error("No jobs in manifest \"%s\"", manifest_filename);
+}
+
+static int changes_card(job_t *job) {
+	return job->op.type == IMG2SD_OP_WRITE
+			|| job->op.type == IMG2SD_OP_WRITECOMPARE
+			|| job->op.type == IMG2SD_OP_WIPE;
+}
+
+// result: 1 if the order of two jobs matters
+static int conflicts(job_t *a, job_t *b) {
+	// overlapping card ranges, changed by one of them
+	if (a->device == b->device && a->offset < b->offset + b->size
+			&& b->offset < a->offset + a->size
+			&& (changes_card(a) || changes_card(b)))
+		return 1;
+	// image file made by a read
+	if (a->op.type != IMG2SD_OP_WIPE && b->op.type != IMG2SD_OP_WIPE
+			&& !strcmp(a->image_path, b->image_path)
+			&& (a->op.type == IMG2SD_OP_READ || b->op.type == IMG2SD_OP_READ))
+		return 1;
+	return 0;
+}
+
+static int lane_root(int device) {
+	while (devices[device].lane != device)
+		device = devices[device].lane;
+	return device;
+}
+
+/* devices with dependent jobs share a lane. Jobs of a single device lane
+ * are sorted by card offset, as far as conflicts allow; lanes with
+ * several devices keep the manifest order.
+ */
+static void plan_lanes(void) {
+	unsigned i, j, k;
+	int root[JOBS_MAX_DEVICES];
+
+	for (i = 0; i < job_count; i++)
+		for (j = i + 1; j < job_count; j++)
+			if (jobs[i]->device != jobs[j]->device
+					&& conflicts(jobs[i], jobs[j]))
+				devices[lane_root(jobs[j]->device)].lane = lane_root(
+						jobs[i]->device);
+	for (i = 0; i < device_count; i++)
+		root[i] = lane_root(i);
+	for (i = 0; i < device_count; i++) {
+		for (j = 0; j < i && root[j] != root[i]; j++)
+			;
+		if (j == i) // first device of a lane
+			lanes[lane_count++].device_count = 0;
+		for (k = 0; k < i && root[k] != root[i]; k++)
+			;
+		devices[i].lane = k == i ? (int) lane_count - 1 : devices[k].lane;
+		lanes[devices[i].lane].device_count++;
+	}
+	for (i = 0; i < job_count; i++) {
+		lane_t *lane = &lanes[devices[jobs[i]->device].lane];
+		job_t *job = jobs[i];
+		k = lane->count++;
+		// insert before later offsets, never across a conflicting job
+		while (lane->device_count == 1 && k > 0
+				&& lane->jobs[k - 1]->offset > job->offset
+				&& !conflicts(lane->jobs[k - 1], job)) {
+			lane->jobs[k] = lane->jobs[k - 1];
+			k--;
+		}
+		lane->jobs[k] = job;
+	}
+}
+
+// result: 1 if "b" reads the same data as "a", with the same options
+static int same_read(job_t *a, job_t *b) {
+	img2sd_options_t *oa = &a->op.options, *ob = &b->op.options;
+	unsigned i;
+
+	if (a->op.type != IMG2SD_OP_READ || b->op.type != IMG2SD_OP_READ
+			|| a->merged_into || a->device != b->device
+			|| a->offset != b->offset || a->size != b->size)
+		return 0;
+	// no layout conversion and --update, no tee for these
+	if (oa->update || ob->update || oa->image_sector_size
+			|| ob->image_sector_size || oa->interleave > 1
+			|| ob->interleave > 1 || oa->skew || ob->skew || oa->byteswap
+			|| ob->byteswap)
+		return 0;
+	if (oa->filesystem != ob->filesystem || oa->digest_files
+			|| ob->digest_files || oa->digest_count != ob->digest_count)
+		return 0;
+	for (i = 0; i < oa->digest_count; i++)
+		if (strcmp(oa->digests[i], ob->digests[i]))
+			return 0;
+	// tee files, digests and a qcow2 sink
+	if (oa->tee_sink_count + oa->digest_count + 2 > TEE_MAX_SINKS)
+		return 0;
+	return 1;
+}
+
+/* a later read of the same data is written by a tee sink of the first,
+ * if no job between them conflicts.
+ */
+static void merge_reads(void) {
+	unsigned l, i, j, k;
+
+	for (l = 0; l < lane_count; l++) {
+		lane_t *lane = &lanes[l];
+		for (j = 0; j < lane->count; j++)
+			for (i = 0; i < j; i++) {
+				job_t *a = lane->jobs[i], *b = lane->jobs[j];
+				if (!same_read(a, b))
+					continue;
+				for (k = i + 1; k < j; k++)
+					if (conflicts(lane->jobs[k], a)
+							|| conflicts(lane->jobs[k], b))
+						break;
+				if (k < j)
+					continue;
+				if (strcmp(a->image_path, b->image_path)) {
+					tee_sink_t *sink =
+							&a->op.options.tee_sinks[a->op.options.tee_sink_count++];
+					// as its own read writes it: only ".qcow2" is no raw
+					// image, ".gz" or ".sha256" are no tee formats here
+					tee_sink_init(sink, b->op.image);
+					if (sink->type != TEE_SINK_QCOW2)
+						sink->type = TEE_SINK_RAW;
+				}
+				b->merged_into = a;
+				merged_count++;
+				memmove(&lane->jobs[j], &lane->jobs[j + 1],
+						(lane->count - j - 1) * sizeof(job_t *));
+				lane->count--;
+				j--;
+				break;
+			}
+	}
+}
+
+static char *time_text(double seconds, char *buffer) {
+	unsigned s = (unsigned) (seconds + 0.5);
+	if (s >= 3600)
+		sprintf(buffer, "%uh%02um%02us", s / 3600, s / 60 % 60, s % 60);
+	else if (s >= 60)
+		sprintf(buffer, "%um%02us", s / 60, s % 60);
+	else
+		sprintf(buffer, "%us", s);
+	return buffer;
+}
+
+static void print_plan(FILE *f) {
+	char buffer[40];
+	double total = 0;
+	unsigned l, i, j, d;
+
+	fprintf(f, "Plan: %u jobs on %u devices in %u parallel lanes", job_count,
+			device_count, lane_count);
+	if (merged_count)
+		fprintf(f, ", %u reads merged into others", merged_count);
+	fprintf(f, ".\n");
+	for (l = 0; l < lane_count; l++) {
+		lane_t *lane = &lanes[l];
+		lane->seconds = 0;
+		for (i = 0; i < lane->count; i++)
+			lane->seconds += lane->jobs[i]->seconds;
+		if (lane->seconds > total)
+			total = lane->seconds;
+		fprintf(f, "Lane %u:", l + 1);
+		for (d = 0; d < device_count; d++)
+			if (devices[d].lane == (int) l)
+				fprintf(f, " \"%s\"", devices[d].path);
+		fprintf(f, ", %u jobs%s, about %s\n", lane->count,
+				lane->device_count > 1 ?
+						" in manifest order (shared images)" : "",
+				time_text(lane->seconds, buffer));
+		for (i = 0; i < lane->count; i++) {
+			job_t *job = lane->jobs[i];
+			fprintf(f, "  line %u: %s SCSI ID %d, offset %ld, %ld bytes",
+					job->line, img2sd_op_name(job->op.type),
+					job->op.target_id, job->offset, job->size);
+			if (lane->device_count > 1)
+				fprintf(f, ", \"%s\"", devices[job->device].path);
+			if (job->op.type != IMG2SD_OP_WIPE)
+				fprintf(f, ", image \"%s\"", job->op.image);
+			for (j = 0; j < job_count; j++)
+				if (jobs[j]->merged_into == job)
+					fprintf(f, ", \"%s\" (line %u)", jobs[j]->op.image,
+							jobs[j]->line);
+			fprintf(f, "\n");
+		}
+	}
+	fprintf(f, "Estimated time: %s, at %d MB/s read and %d MB/s write.\n",
+			time_text(total, buffer), JOBS_READ_RATE / (1024 * 1024),
+			JOBS_WRITE_RATE / (1024 * 1024));
+}
+
+// results of a job and of the reads merged into it
+static void print_result(job_t *job) {
+	unsigned i, j;
+	printf("Line %u: %s SCSI ID %d on \"%s\" done.\n", job->line,
+			img2sd_op_name(job->op.type), job->op.target_id, job->op.device);
+	for (j = 0; j < job_count; j++) {
+		job_t *image_job = jobs[j];
+		if (image_job != job && image_job->merged_into != job)
+			continue;
+		for (i = 0; i < job->op.digest_count; i++)
+			printf("%s (%s) = %s\n", job->op.digests[i].algorithm,
+					image_job->op.image, job->op.digests[i].text);
+	}
+}
+
+// executes the jobs of a lane in order, until one fails
+static void *lane_thread(void *arg) {
+	lane_t *lane = arg;
+	int fds[JOBS_MAX_DEVICES];
+	unsigned i;
+
+	for (i = 0; i < device_count; i++)
+		fds[i] = -1;
+	for (i = 0; i < lane->count; i++) {
+		job_t *job = lane->jobs[i];
+		if (lane->failed) {
+			lane->skipped++;
+			continue;
+		}
+		// device stays open for all jobs of the lane
+		if (fds[job->device] < 0)
+			fds[job->device] = open(devices[job->device].path, O_RDWR);
+		if (fds[job->device] < 0) {
+			fprintf(ferr, "ERROR: Line %u: Can not open sdcard file \"%s\", "
+					"errno = %d\n", job->line, devices[job->device].path,
+					errno);
+			lane->failed++;
+			continue;
+		}
+		job->op.fd_device = fds[job->device];
+		if (img2sd_run(&job->op)) {
+			fprintf(ferr, "ERROR: Line %u: %s\n", job->line,
+					job->op.error_text);
+			lane->failed++;
+		} else {
+			print_result(job);
+			lane->done++;
+		}
+	}
+	for (i = 0; i < device_count; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+	return NULL;
+}
+
+/* plan and execute all jobs of a manifest. "defaults": options of jobs.
+ * Exits if a job failed.
+ */
+void jobs_run(char *manifest_filename, img2sd_options_t *defaults) {
+	unsigned done = 0, failed = 0, skipped = 0;
+	unsigned l;
+
+	job_count = device_count = lane_count = layout_count = merged_count = 0;
+	load_manifest(manifest_filename, defaults);
+	plan_lanes();
+	merge_reads();
+	print_plan(stdout);
+	fflush(stdout);
+
+	// lanes wait for buffers of each other: each gets its part of --memcap
+	bufpool_share(lane_count);
+	for (l = 0; l < lane_count; l++)
+		if (pthread_create(&lanes[l].thread, NULL, lane_thread, &lanes[l]))
+			fatal("Can not start job thread");
+	for (l = 0; l < lane_count; l++) {
+		pthread_join(lanes[l].thread, NULL);
+		done += lanes[l].done;
+		failed += lanes[l].failed;
+		skipped += lanes[l].skipped;
+	}
+	bufpool_share(1);
+	for (l = 0; l < job_count; l++)
+		free(jobs[l]);
+	if (failed)
+		error("%u jobs done, %u failed, %u not run", done, failed, skipped);
+	info("%u jobs done.", done);
+}
@@ -0,0 +1,41 @@
+/* jobs.h: batch of transfers from a manifest, planned before execution
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+ */
+
+#ifndef JOBS_H_
+#define JOBS_H_
+
+#include "img2sd.h"
+
+#define JOBS_MAX	256 // lines of a manifest
+#define JOBS_MAX_DEVICES	16
+#define JOBS_MAX_LINE	4096
+
+// throughput for the time estimate: SD card in a USB 2.0 reader
+#define JOBS_READ_RATE	(20 * 1024 * 1024) // bytes per second
+#define JOBS_WRITE_RATE	(10 * 1024 * 1024)
+
+void jobs_run(char *manifest_filename, img2sd_options_t *defaults);
+
+#endif /* JOBS_H_ */
@@ -26,29 +26,56 @@
 
 #define VERSION	"v1.0"
 
+#define _GNU_SOURCE // O_DIRECT
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdint.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <linux/limits.h>
 
 #include "error.h"
 #include "utils.h"
 #include "getopt2.h"
 #include "config.h"
+#include "align.h"
+#include "offload.h"
+#include "bufpool.h"
+#include "xfer.h"
+#include "cache.h"
+#include "wbehind.h"
+#include "relocate.h"
+#include "transform.h"
+#include "discover.h"
+#include "fsmap.h"
+#include "fsfile.h"
+#include "tee.h"
+#include "goldcache.h"
+#include "vdisk.h"
+#include "stream.h"
+#include "digest.h"
+#include "img2sd.h"
+#include "daemon.h"
+#include "jobs.h"
+#include "dump.h"
+#include "throttle.h"
 
 // command line args
 getopt_t getopt_parser;
 
 int arg_menu_linewidth = 80;
 
-int opt_verbose = 0;
 char opt_device[PATH_MAX]; // path to SDcard device
 char opt_config[PATH_MAX]; // path of SCSI2SD config XML
+int64_t opt_plan_size[MAX_SCSITARGETS]; // new target sizes for --planlayout
+int64_t opt_mem_cap = BUFPOOL_DEFAULT_MEM_CAP; // limit for transfer buffers
+int opt_hugepages = BUFPOOL_HUGEPAGES_OFF;
+img2sd_options_t options; // of reads and writes, "tee_sinks" for next --read
 
 static void banner() {
 	fprintf(stdout,
@@ -92,241 +119,470 @@ static void commandline_option_error(char *errtext, ...) {
 	exit(1);
 }
 
-/* core function: read and write sdcard
- * only the partiiton of card file is read, which is defined
- * by the SCSI target id and geometry data in "config"
+/* AU size of the SDcard: from command line, or probed from the device
  */
-#define BUFFER_SIZE	(1024 *1024) // copy in chunks of 1M
+static int64_t get_au_size() {
+	return img2sd_au_size(opt_device, options.au_size);
+}
+
+static int progress_clone(int64_t done, int64_t total) {
+	printf("\rWrite completed %3ld%% ", (done * 100) / total);
+	fflush(stdout);
+	return 0;
+}
+
+static void progress_relocate(int64_t done, int64_t total) {
+	printf("\rRelocate completed %3ld%% ", (done * 100) / total);
+	fflush(stdout);
+}
+
+// called for each chunk: print only changed percentages
+static void progress_dump(int64_t done, int64_t total) {
+	static int64_t last_percent = -1;
+	int64_t percent = (done * 100) / total;
+	if (percent == last_percent)
+		return;
+	last_percent = percent;
+	printf("\rTransfer completed %3ld%% ", percent);
+	fflush(stdout);
+}
+
+/* read, write, compare or wipe a target of the loaded layout, with the
+ * current options. Digests are printed in the format of "sha256sum --tag".
+ */
+static void run_op(img2sd_op_type_t type, int target_id, char *image_filename,
+		int shortinfo) {
+	static img2sd_op_t op;
+	unsigned i;
 
-static void sdcard_read(int target_id, char *sdcard_filename,
-		char *image_filename) {
-	int fd_card, fd_img;
+	img2sd_op_init(&op);
+	op.type = type;
+	strcpy(op.device, opt_device);
+	op.target_id = target_id;
+	snprintf(op.image, sizeof(op.image), "%s",
+			image_filename ? image_filename : "");
+	op.options = options;
+	op.shortinfo = shortinfo;
+	if (img2sd_run(&op))
+		error("%s", op.error_text);
+	for (i = 0; i < op.digest_count; i++)
+		printf("%s (%s) = %s\n", op.digests[i].algorithm, op.image,
+				op.digests[i].text);
+}
+
+static char *fsfile_error_text(int res) {
+	switch (res) {
+	case FSFILE_NOT_FOUND:
+		return "file not found";
+	case FSFILE_NO_FILESYSTEM:
+		return "no RT-11 or Files-11 file system";
+	case FSFILE_BAD_NAME:
+		return "invalid name, RT-11: NAME.EXT, Files-11: [g,m]NAME.EXT;v";
+	default:
+		return "file system corrupt";
+	}
+}
+
+/* copy one file between a partition and a local file.
+ * Only the directory and the file's own blocks are accessed on the card.
+ * put: overwrite the card file in place, never reallocated.
+ */
+static void sdcard_file(int target_id, char *sdcard_filename, char *file_name,
+		char *local_filename, int put) {
+	fsfile_t file;
+	fsmap_volume_t volume;
 	config_scsitarget_t *scsitarget;
-	int64_t offset, size;
-	int64_t bytesToWrite;
-	int64_t bytesWritten;
+	int fd_card, fd_local, res;
 
-	if (target_id < 0 || target_id > MAX_SCSITARGETS)
+	if (target_id < 0 || target_id >= MAX_SCSITARGETS)
 		error("Invalid target id %d", target_id);
 	scsitarget = &config_scsitargets[target_id];
 	if (!scsitarget->enabled)
 		error("Target id %d not enabled", target_id);
 
-	offset = scsitarget->bytesPerSector * (int64_t) (scsitarget->sectorStart);
-	size = scsitarget->bytesPerSector * (int64_t) (scsitarget->sectors);
+	fd_card = open(sdcard_filename, put ? O_RDWR : O_RDONLY); // must exist
+	if (fd_card < 0)
+		error("Can not open sdcard file \"%s\" (sudo?)", sdcard_filename);
+	volume.fd = fd_card;
+	volume.offset = config_scsitarget_offset(scsitarget);
+	volume.blocks = config_scsitarget_size(scsitarget) / FSMAP_BLOCK_SIZE;
+	res = fsfile_open(&file, &volume, file_name);
+	if (res != FSFILE_OK)
+		error("\"%s\" on SCSI ID %d: %s", file_name, target_id,
+				fsfile_error_text(res));
+	info("%s file %s on SCSI ID %d: %lld bytes, %lld allocated in %d extents.",
+			fsmap_type_name(file.type), file.name, target_id,
+			(long long) file.size, (long long) file.allocated, file.count);
+
+	if (put) {
+		struct stat st;
+		fd_local = open(local_filename, O_RDONLY);
+		if (fd_local < 0 || fstat(fd_local, &st))
+			error("Can not open file \"%s\"", local_filename);
+		if (st.st_size > file.allocated)
+			error("File \"%s\" with %lld bytes does not fit into %s (%lld bytes)",
+					local_filename, (long long) st.st_size, file.name,
+					(long long) file.allocated);
+		if (fsfile_write(&file, &volume, fd_local, st.st_size)
+				|| fdatasync(fd_card))
+			error("Write of %s on SCSI ID %d failed", file.name, target_id);
+		info("%lld bytes written to %s.", (long long) st.st_size, file.name);
+	} else {
+		fd_local = open(local_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fd_local < 0)
+			error("Can not open file \"%s\" for write", local_filename);
+		if (fsfile_read(&file, &volume, fd_local))
+			error("Read of %s on SCSI ID %d failed", file.name, target_id);
+		info("%lld bytes read from %s.", (long long) file.size, file.name);
+	}
+	close(fd_local);
+	close(fd_card);
+}
+
+/* copy all partitions of one SDcard onto another SDcard with a different
+ * layout. Targets are mapped by SCSI ID, the source card is read once in
+ * offset order, no temporary image files.
+ */
+static void sdcard_clone(char *src_filename, char *src_config,
+		char *dst_filename, char *dst_config) {
+	static config_scsitarget_t src_targets[MAX_SCSITARGETS];
+	static config_scsitarget_t dst_targets[MAX_SCSITARGETS];
+	int order[MAX_SCSITARGETS];
+	int count = 0;
+	int fd_src, fd_dst;
+	int i, j, id;
+	char src_path[PATH_MAX], dst_path[PATH_MAX];
+	int64_t total = 0, au_size;
+	xfer_job_t job;
+
+	if (config_load_targets(src_config, src_targets))
+		error("XML file error in \"%s\"!\n", src_config);
+	if (config_load_targets(dst_config, dst_targets))
+		error("XML file error in \"%s\"!\n", dst_config);
+	if (!realpath(src_filename, src_path))
+		error("Can not open source SDcard \"%s\"", src_filename);
+	if (!realpath(dst_filename, dst_path))
+		error("Can not open destination SDcard \"%s\"", dst_filename);
+	if (!strcmp(src_path, dst_path))
+		error("Source and destination are the same SDcard \"%s\"", src_path);
 
-	if (opt_verbose) {
-		info("Reading SCSI ID %d on SDcard \"%s\" to file \"%s\".", target_id,
-				sdcard_filename, image_filename);
-		info(
-				"SDcard offset = %ld bytes = %ld sectors, size = %ld bytes = %ld sectors.",
-				offset, offset / scsitarget->bytesPerSector, size,
-				size / scsitarget->bytesPerSector);
+	// source targets sorted by sectorStart, check all before writing anything
+	for (id = 0; id < MAX_SCSITARGETS; id++) {
+		config_scsitarget_t *src = &src_targets[id];
+		config_scsitarget_t *dst = &dst_targets[id];
+		if (!src->enabled)
+			continue;
+		if (!dst->enabled) {
+			warning("SCSI ID %d not enabled in \"%s\", not cloned.", id,
+					dst_config);
+			continue;
+		}
+		if (src->bytesPerSector != dst->bytesPerSector)
+			error("SCSI ID %d: sector size %d on source, %d on destination", id,
+					src->bytesPerSector, dst->bytesPerSector);
+		if (config_scsitarget_size(src) > config_scsitarget_size(dst))
+			error(
+					"SCSI ID %d: destination partition too small: %ld bytes, source %ld bytes",
+					id, config_scsitarget_size(dst), config_scsitarget_size(src));
+		for (i = count; i > 0 && src_targets[order[i - 1]].sectorStart
+						> src->sectorStart; i--)
+			order[i] = order[i - 1];
+		order[i] = id;
+		count++;
+		total += config_scsitarget_size(src);
 	}
+	if (count == 0)
+		error("No SCSI ID enabled in both \"%s\" and \"%s\"", src_config,
+				dst_config);
+	// one clone would overwrite the other
+	for (i = 0; i < count; i++)
+		for (j = i + 1; j < count; j++) {
+			config_scsitarget_t *a = &dst_targets[order[i]];
+			config_scsitarget_t *b = &dst_targets[order[j]];
+			if (config_scsitarget_offset(a)
+					< config_scsitarget_offset(b) + config_scsitarget_size(b)
+					&& config_scsitarget_offset(b)
+							< config_scsitarget_offset(a)
+									+ config_scsitarget_size(a))
+				error("SCSI ID %d and %d overlap in \"%s\"", order[i],
+						order[j], dst_config);
+		}
+	// written AUs are those of the destination card
+	au_size = img2sd_au_size(dst_filename, options.au_size);
+
+	fd_src = open(src_filename, O_RDONLY);
+	if (fd_src < 0)
+		error("Can not open sdcard file \"%s\" for read (sudo?)",
+				src_filename);
+	fd_dst = open(dst_filename, O_RDWR); // must exist
+	if (fd_dst < 0)
+		error("Can not open sdcard file \"%s\" for write (sudo?)",
+				dst_filename);
+
+	info("Cloning %d partitions with %ld bytes from \"%s\" to \"%s\".",
+			count, total, src_filename, dst_filename);
+	for (j = 0; j < count; j++) {
+		config_scsitarget_t *src, *dst;
+		int64_t src_offset, dst_offset, size, dst_size;
+
+		id = order[j];
+		src = &src_targets[id];
+		dst = &dst_targets[id];
+		src_offset = config_scsitarget_offset(src);
+		dst_offset = config_scsitarget_offset(dst);
+		size = config_scsitarget_size(src);
+		dst_size = config_scsitarget_size(dst);
+		if (opt_verbose)
+			info(
+					"SCSI ID %d: source offset = %ld, destination offset = %ld, size = %ld bytes.",
+					id, src_offset, dst_offset, size);
+
+		// source partition is the "image" of a write
+		xfer_job_init(&job, XFER_MODE_WRITE, fd_src, src_offset, fd_dst,
+				dst_offset, size);
+		job.au_size = au_size;
+		job.au_merge = options.au_merge;
+		job.stripe_count = options.stripes;
+		job.cache_policy = options.cache;
+		job.dirty_window = options.dirty_window;
+		if (xfer_run(&job, opt_verbose ? progress_clone : NULL))
+			error("Clone of SCSI ID %d failed", id);
+		if (opt_verbose)
+			printf("\n");
+		// larger destination partition
+		if (size < dst_size && offload_fill(fd_dst, dst_offset + size,
+				dst_size - size, options.fill))
+			error("Fill of SCSI ID %d failed", id);
+	}
+	for (id = 0; id < MAX_SCSITARGETS; id++)
+		if (dst_targets[id].enabled && !src_targets[id].enabled)
+			info("SCSI ID %d not in \"%s\", left untouched.", id, src_config);
+	close(fd_src);
+	close(fd_dst);
+}
+
+/* move all partitions on the SDcard from the loaded XML layout to the
+ * layout of "new_config". Progress is kept in "<new_config>.relocate",
+ * an interrupted relocation of the same card is continued by the same
+ * command, a finished one is not done again.
+ */
+static void sdcard_relocate(char *sdcard_filename, char *new_config) {
+	static config_scsitarget_t new_targets[MAX_SCSITARGETS];
+	static relocate_plan_t plan;
+	char state_filename[PATH_MAX + 16];
+	int fd_card;
+	int i, res;
+
+	if (!opt_config[0])
+		error("No XML config file loaded");
+	if (config_load_targets(new_config, new_targets))
+		error("XML file error in \"%s\"!\n", new_config);
+	snprintf(state_filename, sizeof(state_filename), "%s.relocate",
+			new_config);
 
 	fd_card = open(sdcard_filename, O_RDWR); // must exist
 	if (fd_card < 0)
-		error("Can not open SDcard file \"%s\" for read (sudo?)",
+		error("Can not open sdcard file \"%s\" for write (sudo?)",
 				sdcard_filename);
-	fd_img = open(image_filename, O_CREAT | O_WRONLY | O_TRUNC, 0644);
-	if (fd_img < 0)
-		error("Can not open image file \"%s\" for write", image_filename);
-
-	if (lseek(fd_card, offset, SEEK_SET) < 0)
-		error("SDcard seek failed with errno = %d", errno);
-
-	// copy loop
-	bytesToWrite = size;
-	bytesWritten = 0;
-	while (bytesToWrite > 0) {
-		char buffer[BUFFER_SIZE];
-		int block_size;
-		if (bytesToWrite >= BUFFER_SIZE)
-			block_size = BUFFER_SIZE;
+	if (relocate_plan(&plan, config_scsitargets, new_targets,
+			device_size(fd_card)))
+		error("Relocation not possible");
+	fprintf(stdout, "Relocating SDcard \"%s\" from \"%s\" to \"%s\":\n",
+			sdcard_filename, opt_config, new_config);
+	for (i = 0; i < plan.count; i++) {
+		relocate_move_t *move = &plan.moves[i];
+		if (move->from == move->to)
+			fprintf(stdout, "  SCSI ID %d: stays at offset %ld\n",
+					move->target_id, move->from);
 		else
-			block_size = bytesToWrite; // end of stream
-		bytesToWrite -= block_size;
-
-		read(fd_card, buffer, block_size);
-		write(fd_img, buffer, block_size);
-		bytesWritten += block_size;
-		if (opt_verbose) { // moving percent indicator, no \n
-			printf("\rRead completed %3ld%% ", (bytesWritten * 100) / size);
-			fflush(stdout);
-		}
+			fprintf(stdout, "  SCSI ID %d: %ld bytes from offset %ld to %ld\n",
+					move->target_id, move->size, move->from, move->to);
 	}
+	res = relocate_run(fd_card, sdcard_filename, &plan, state_filename,
+			options.fill, opt_verbose ? progress_relocate : NULL);
+	if (res < 0)
+		error("Relocation failed, repeat to continue");
+	if (res > 0)
+		warning("Relocation already done by state file \"%s\", nothing moved.",
+				state_filename);
 	close(fd_card);
-	close(fd_img);
 	if (opt_verbose)
 		printf("\n");
+	// new layout is active now
+	strcpy(opt_config, new_config);
+	memcpy(config_scsitargets, new_targets, sizeof(config_scsitargets));
 }
 
-static void sdcard_write(int target_id, char *sdcard_filename,
-		char *image_filename) {
-	int fd_card, fd_img;
-	struct stat statbuf;
-	config_scsitarget_t *scsitarget;
-	int64_t offset, size;
-	int64_t bytesToWrite;
-	int64_t bytesWritten;
+/* save the loaded layout and all its enabled partitions in a container
+ * file, the card is read once in offset order. Digests of each partition
+ * are printed in the format of "sha256sum --tag", as "<container>:<id>".
+ */
+static void sdcard_dump(char *sdcard_filename, char *container_filename,
+		char *compression_name) {
+	dump_t dump;
+	char default_digests[1][DIGEST_MAX_NAME] = { "sha256" };
+	int compression = DUMP_COMPRESS_FAST;
+	int fd_card, fd_out;
+	int64_t size = 0;
+	unsigned i, d;
 
-	if (target_id < 0 || target_id > MAX_SCSITARGETS)
-		error("Invalid target id %d", target_id);
-	scsitarget = &config_scsitargets[target_id];
-	if (!scsitarget->enabled)
-		error("Target id %d not enabled", target_id);
+	if (!opt_config[0])
+		error("No XML config file loaded");
+	if (!strcasecmp(compression_name, "none"))
+		compression = DUMP_COMPRESS_NONE;
+	else if (!strcasecmp(compression_name, "best"))
+		compression = DUMP_COMPRESS_BEST;
+	else if (compression_name[0] && strcasecmp(compression_name, "fast"))
+		error("Unknown compression \"%s\"", compression_name);
+	fd_card = open(sdcard_filename, O_RDONLY);
+	if (fd_card < 0)
+		error("Can not open sdcard file \"%s\" for read (sudo?)",
+				sdcard_filename);
+	if (stream_is_stdio(container_filename))
+		fd_out = options.fd_stdout;
+	else
+		fd_out = open(container_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd_out < 0)
+		error("Can not create container file \"%s\"", container_filename);
 
-	offset = scsitarget->bytesPerSector * (int64_t) (scsitarget->sectorStart);
-	size = scsitarget->bytesPerSector * (int64_t) (scsitarget->sectors);
-
-	// file size
-	if (stat(image_filename, &statbuf) < 0)
-		error("Can not open file \"%s\"", image_filename);
-	bytesToWrite = statbuf.st_size;
-
-	if (opt_verbose) {
-		info("Writing SCSI ID %d on SDcard \"%s\" from file \"%s\".", target_id,
-				sdcard_filename, image_filename);
-		info(
-				"SDcard offset = %ld bytes = %ld sectors, size = %ld bytes = %ld sectors.",
-				offset, offset / scsitarget->bytesPerSector, size,
-				size / scsitarget->bytesPerSector);
+	if (dump_card(&dump, fd_out, fd_card, opt_config, config_scsitargets,
+			compression,
+			options.digest_count ? options.digests : default_digests,
+			options.digest_count ? options.digest_count : 1,
+			opt_verbose ? progress_dump : NULL))
+		error("Dump of \"%s\" failed", sdcard_filename);
+	if (opt_verbose)
+		printf("\n");
+	if (fd_out != options.fd_stdout && (fsync(fd_out) < 0 || close(fd_out) < 0))
+		error("Can not write container file \"%s\"", container_filename);
+	close(fd_card);
+	for (i = 0; i < dump.target_count; i++) {
+		dump_target_t *target = &dump.targets[i];
+		size += target->size;
+		for (d = 0; d < target->digest_count; d++)
+			printf("%s (%s:%u) = %s\n", target->digests[d].algorithm,
+					container_filename, target->target_id,
+					target->digests[d].text);
 	}
+	info("%u partitions with %ld bytes saved in %ld bytes.",
+			dump.target_count, size, dump.position);
+	dump_close(&dump);
+}
 
-	if (bytesToWrite % scsitarget->bytesPerSector)
-		error("Size of file \"%s\" is %ld, not a multiple of sector size %d",
-				image_filename, bytesToWrite, scsitarget->bytesPerSector);
-	if (bytesToWrite > size)
-		error(
-				"Image file too large: Size of file \"%s\" is %ld, size of SCSI ID %d is %ld",
-				image_filename, bytesToWrite, target_id, size);
-	if (bytesToWrite < size)
-		warning(
-				"Image file too small: Size of file \"%s\" is %ld, size of SCSI ID %d is %ld",
-				image_filename, bytesToWrite, target_id, size);
-
-	fd_card = open(sdcard_filename, O_WRONLY | O_TRUNC); // must exist
+/* write all partitions of a container back to the card. A loaded --xml
+ * layout must have them at the same place.
+ */
+static void sdcard_restore(char *sdcard_filename, char *container_filename) {
+	dump_t dump;
+	int fd_card;
+	unsigned i;
+
+	if (dump_open(&dump, container_filename))
+		error("Can not open container \"%s\"", container_filename);
+	for (i = 0; opt_config[0] && i < dump.target_count; i++) {
+		dump_target_t *target = &dump.targets[i];
+		config_scsitarget_t *scsitarget =
+				&config_scsitargets[target->target_id];
+		if (!scsitarget->enabled
+				|| config_scsitarget_offset(scsitarget)
+						!= (int64_t) target->card_offset
+				|| config_scsitarget_size(scsitarget)
+						!= (int64_t) target->size)
+			error("SCSI ID %u of container differs from layout \"%s\"",
+					target->target_id, opt_config);
+	}
+	fd_card = open(sdcard_filename, O_RDWR); // must exist
 	if (fd_card < 0)
 		error("Can not open sdcard file \"%s\" for write (sudo?)",
 				sdcard_filename);
-	fd_img = open(image_filename, O_RDWR);
-	if (fd_img < 0)
-		error("Can not open image file \"%s\" for read", image_filename);
-
-	if (lseek(fd_card, offset, SEEK_SET) < 0)
-		error("SDcard seek failed with errno = %d", errno);
-
-	// copy loop
-	bytesToWrite = size;
-	bytesWritten = 0;
-	while (bytesToWrite > 0) {
-		char buffer[BUFFER_SIZE];
-		int block_size;
-		if (bytesToWrite >= BUFFER_SIZE)
-			block_size = BUFFER_SIZE;
-		else
-			block_size = bytesToWrite; // end of stream
-		bytesToWrite -= block_size;
-
-		read(fd_img, buffer, block_size);
-		write(fd_card, buffer, block_size);
-		bytesWritten += block_size;
-		if (opt_verbose) { // moving percent indicator, no \n
-			printf("\rWrite completed %3ld%% ", (bytesWritten * 100) / size);
-			fflush(stdout);
-		}
-	}
-	close(fd_card);
-	close(fd_img);
+	info("Restoring %u partitions from \"%s\" to \"%s\".",
+			dump.target_count, container_filename, sdcard_filename);
+	if (dump_restore(&dump, fd_card,
+			img2sd_au_size(sdcard_filename, options.au_size),
+			options.dirty_window, options.fill,
+			opt_verbose ? progress_dump : NULL))
+		error("Restore of \"%s\" failed", sdcard_filename);
 	if (opt_verbose)
 		printf("\n");
+	close(fd_card);
+	dump_close(&dump);
 }
 
-static void sdcard_verify(int target_id, char *sdcard_filename,
-		char *image_filename, int shortinfo) {
-	int fd_card, fd_img;
-	struct stat statbuf;
-	config_scsitarget_t *scsitarget;
-	int64_t offset, size;
-	int64_t bytesToRead;
-	int64_t bytesRead;
-
-	if (target_id < 0 || target_id > MAX_SCSITARGETS)
-		error("Invalid target id %d", target_id);
-	scsitarget = &config_scsitargets[target_id];
-	if (!scsitarget->enabled)
-		error("Target id %d not enabled", target_id);
+/* one partition of a container as raw image, or its layout with
+ * "target" = "xml". Only the chunks of the partition are read.
+ */
+static void container_extract(char *container_filename, char *target_name,
+		char *out_filename) {
+	dump_t dump;
+	dump_target_t *target = NULL;
+	char *end;
+	int fd_out;
 
-	offset = scsitarget->bytesPerSector * (int64_t) (scsitarget->sectorStart);
-	size = scsitarget->bytesPerSector * (int64_t) (scsitarget->sectors);
-
-	// file size
-	if (stat(image_filename, &statbuf) < 0)
-		error("Cannot open image file \"%s\"", image_filename);
-	bytesToRead = statbuf.st_size;
-
-	if (opt_verbose && !shortinfo) {
-		info("Verifying SCSI ID %d on SDcard \"%s\" with file \"%s\".",
-				target_id, sdcard_filename, image_filename);
-		info(
-				"SDcard offset = %ld bytes = %ld sectors, size = %ld bytes = %ld sectors.",
-				offset, offset / scsitarget->bytesPerSector, size,
-				size / scsitarget->bytesPerSector);
+	if (dump_open(&dump, container_filename))
+		error("Can not open container \"%s\"", container_filename);
+	if (strcasecmp(target_name, "xml")) {
+		int target_id = strtol(target_name, &end, 10);
+		if (*end || end == target_name)
+			error("Invalid target id \"%s\"", target_name);
+		target = dump_find_target(&dump, target_id);
+		if (!target)
+			error("SCSI ID %d not in container \"%s\"", target_id,
+					container_filename);
 	}
+	if (stream_is_stdio(out_filename))
+		fd_out = options.fd_stdout;
+	else
+		fd_out = open(out_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd_out < 0)
+		error("Can not create file \"%s\"", out_filename);
+	if (!target) {
+		if (dprintf(fd_out, "%s", dump.xml) < 0)
+			error("Can not write \"%s\"", out_filename);
+	} else if (dump_extract(&dump, target, fd_out,
+			opt_verbose ? progress_dump : NULL))
+		error("Extract of SCSI ID %u failed", target->target_id);
+	if (opt_verbose && target)
+		printf("\n");
+	if (fd_out != options.fd_stdout && close(fd_out) < 0)
+		error("Can not write \"%s\"", out_filename);
+	dump_close(&dump);
+}
 
-	if (bytesToRead % scsitarget->bytesPerSector)
-		error("Size of file \"%s\" is %ld, not a multiple of sector size %d",
-				image_filename, bytesToRead, scsitarget->bytesPerSector);
-	if (bytesToRead > size)
-		error(
-				"Image file too large: Size of file \"%s\" is %ld, size of SCSI ID %d is %ld",
-				image_filename, bytesToRead, target_id, size);
-	if (bytesToRead < size && !shortinfo)
-		warning(
-				"Image file is smaller: Size of file \"%s\" is %ld, size of SCSI ID %d is %ld",
-				image_filename, bytesToRead, target_id, size);
-
-	fd_card = open(sdcard_filename, O_RDWR);
-	if (fd_card < 0)
-		error("Can not open sdcard file \"%s\" for read (sudo?)",
-				sdcard_filename);
-	fd_img = open(image_filename, O_RDWR);
-	if (fd_img < 0)
-		error("Can not open image file \"%s\" for read", image_filename);
-
-	if (lseek(fd_card, offset, SEEK_SET) < 0)
-		error("SDcard seek failed with errno = %d", errno);
-
-	// verify loop. bytesToRead minimum of file and SDcard size
-	bytesToRead = size;
-	bytesRead = 0;
-	while (bytesToRead > 0) {
-		char buffer_card[BUFFER_SIZE];
-		char buffer_img[BUFFER_SIZE];
-		int block_size;
-		if (bytesToRead >= BUFFER_SIZE)
-			block_size = BUFFER_SIZE;
-		else
-			block_size = bytesToRead; // end of stream
+// list enabled targets, which do not start on an AU boundary
+static void layout_checkalign() {
+	if (!opt_config[0])
+		error("No XML config file loaded");
+	align_check_targets(stdout, get_au_size());
+}
 
-		read(fd_img, buffer_img, block_size);
-		read(fd_card, buffer_card, block_size);
-		if (memcmp(buffer_card, buffer_img, block_size)) {
-			error("Data mismatch between bytes %ld and %ld", bytesRead,
-					bytesRead + block_size);
-		}
-		bytesToRead -= block_size;
-		bytesRead += block_size;
-		if (opt_verbose) { // moving percent indicator, no \n
-			printf("\rVerify completed %3ld%% ", (bytesRead * 100) / size);
-			fflush(stdout);
+// save an AU aligned copy of the current layout with the planned sizes
+static void layout_plan(char *out_filename) {
+	static config_scsitarget_t loaded_targets[MAX_SCSITARGETS];
+	int64_t card_size = 0;
+	int id;
+
+	if (!opt_config[0])
+		error("No XML config file loaded");
+	if (opt_device[0]) {
+		int fd_card = open(opt_device, O_RDONLY);
+		if (fd_card >= 0) {
+			card_size = device_size(fd_card);
+			close(fd_card);
 		}
 	}
-
-	close(fd_card);
-	close(fd_img);
-	if (opt_verbose)
-		printf("\n");
+	// planned in place, the loaded layout stays active for later options
+	memcpy(loaded_targets, config_scsitargets, sizeof(loaded_targets));
+	align_plan_layout(get_au_size(), opt_plan_size, card_size);
+	if (config_save(opt_config, out_filename))
+		error("XML file error!\n");
+	info("AU aligned layout saved to \"%s\":", out_filename);
+	for (id = 0; id < MAX_SCSITARGETS; id++) {
+		config_scsitarget_t *scsitarget = &config_scsitargets[id];
+		if (scsitarget->enabled)
+			fprintf(stdout, "  SCSI ID %d: sectorStart=%d, sectors=%d\n", id,
+					scsitarget->sectorStart, scsitarget->sectors);
+	}
+	memcpy(config_scsitargets, loaded_targets, sizeof(config_scsitargets));
 }
 
 /*
@@ -347,19 +603,49 @@ static void parse_commandline(int argc, char **argv) {
 			"Verbose output",
 			NULL, NULL, NULL, NULL);
 	getopt_def(&getopt_parser, "d", "device", "device_filename", NULL, NULL,
-			"Raw SDCard device, without \"/dev\".\n"
-			"To check: plug in SDcard, then \"dmesg | tail\"",
+			"Raw SDCard device. A name without \"/\" is taken from \"/dev\",\n"
+			"else it is a path, like \"/dev/mmcblk0\" or a card image file.\n"
+			"To check: plug in SDcard, then \"dmesg | tail\", or use --discover",
 			"sdb", "Use \"/dev/sdb\" as interface to SDcard.", NULL, NULL);
 	getopt_def(&getopt_parser, "x", "xml", "config_filename", NULL, NULL,
 			"Path to mandatory SCSI2SD geometry config file (XML)",
 			"4xRD54_rev471.xml", "The XML file must be generated with \"scsi2sd-util\".\n", NULL, NULL);
+	getopt_def(&getopt_parser, "dc", "discover", NULL,
+			"file1,file2,file3,file4,file5,file6,file7,file8", NULL,
+			"List SDcards in all removable devices, and --device.\n"
+			"Shows size, a fingerprint of the data at the start of all targets,\n"
+			"and which --xml layout, further layouts (*.xml) or image files match best.",
+			NULL, NULL, "new.xml rt11.rd54",
+			"Find cards with layout \"new.xml\", or \"rt11.rd54\" on any target.");
+	getopt_def(&getopt_parser, "t", "tee", "file1",
+			"file2,file3,file4,file5,file6,file7,file8", NULL,
+			"More outputs of the next --read, the card is read only once.\n"
+			"By suffix: \".gz\" = gzip archive, digest name like \".sha256\", \".md5\"\n"
+			"= checksum file as by \"sha256sum\", else a plain copy.",
+			"rsx.img.gz rsx.img.sha256", "Archive and checksum, beside the image.",
+			NULL, NULL);
+	getopt_def(&getopt_parser, "dg", "digest", "algorithms", NULL, NULL,
+			"Digests of the image, computed during all following --read, --write\n"
+			"and --compare on the data in transfer, no extra pass. Comma separated:\n"
+			"\"crc32c\", \"xxh3\" (needs libxxhash), or OpenSSL names like \"sha256\".\n"
+			"Printed as by \"sha256sum --tag\". \"none\" switches off.",
+			"sha256,crc32c", "SHA-256 and CRC-32C of each transferred image.",
+			NULL, NULL);
+	getopt_def(&getopt_parser, "df", "digestfiles", NULL, NULL, NULL,
+			"Also save each --digest to \"<image_file>.<algorithm>\",\n"
+			"as by \"sha256sum\".",
+			NULL, NULL, NULL, NULL);
 	getopt_def(&getopt_parser, "r", "read", "target_id,image_file", NULL, NULL,
-			"Read disk image from SDcard partition.",
+			"Read disk image from SDcard partition.\n"
+			"A name ending in \".qcow2\" gives a sparse qcow2 file,\n"
+			"\"-\" writes to stdout.",
 			"3,rsxdata.img",
 			"Read partition with SCSI ID #3 and save it as file \"rsxdata.img\".",
-			NULL, NULL);
+			"3 rsxdata.qcow2", "Save only non-zero clusters in qcow2 format.");
 	getopt_def(&getopt_parser, "w", "write", "target_id,image_file", NULL, NULL,
-			"Write disk image into SDcard partition. Size must fit!",
+			"Write disk image into SDcard partition. Size must fit!\n"
+			"Raw, qcow2, VHD or sparse VMDK, unallocated ranges are zero filled.\n"
+			"\"-\" reads stdin, see --streamsize.",
 			"0,rt1157.rd54",
 			"Copy the disk image file \"rt1157.rd54\" onto drive #0 partition\n"
 					"Offset and size on SDcard is taken from XML config file.",
@@ -369,6 +655,212 @@ static void parse_commandline(int argc, char **argv) {
 			NULL, NULL, NULL, NULL);
 	getopt_def(&getopt_parser, "wc", "writecompare", "target_id,image_file",
 			NULL, NULL, "First write, then compare", NULL, NULL, NULL, NULL);
+	getopt_def(&getopt_parser, "cl", "clone",
+			"src_device,src_config,dst_device,dst_config", NULL, NULL,
+			"Copy all partitions from one SDcard to another with a different layout.\n"
+			"Targets are mapped by SCSI ID, devices are full paths.\n"
+			"Space behind a smaller source partition is handled by --fill.",
+			"/dev/sdb old.xml /dev/sdc new.xml",
+			"Move all drives to a new, larger card in one pass.", NULL, NULL);
+	getopt_def(&getopt_parser, "rl", "relocate", "config_filename", NULL,
+			NULL,
+			"Move all partitions on the SDcard from the --xml layout to a new layout.\n"
+			"Overlapping partitions are moved in safe order and direction.\n"
+			"Progress is saved in \"<config_filename>.relocate\",\n"
+			"an interrupted relocation is continued by the same command.\n"
+			"The file is kept when done, a repeated command moves nothing.\n"
+			"It identifies the card: an unfinished relocation of another card\n"
+			"is refused, a finished one does not stop this card's relocation.\n"
+			"Space of grown partitions is handled by --fill.",
+			"aligned.xml",
+			"Move partitions to the layout made by --planlayout.", NULL, NULL);
+	getopt_def(&getopt_parser, "dm", "daemon", "socket_path", NULL, NULL,
+			"Keep running and execute jobs sent over a UNIX socket, one line each:\n"
+			"\"read|write|compare|writecompare <device> <config> <target_id> <image>\"\n"
+			"or \"wipe <device> <config> <target_id>\", with optional words\n"
+			"stripes=, fill=, filesystem=, pagecache=, digest=, update=, comparetail=.\n"
+			"Also \"cancel <job>\", \"status\" and \"shutdown\".\n"
+			"Jobs on one device run in order, on different devices in parallel.\n"
+			"Status events are sent back: \"job <job> started|progress|done|failed\".\n"
+			"Options before --daemon are defaults for all jobs.",
+			"/run/img2sd.sock",
+			"Serve jobs on /run/img2sd.sock.", NULL, NULL);
+	getopt_def(&getopt_parser, "j", "jobs", "manifest_file", NULL, NULL,
+			"Execute a batch of jobs, one line each as for --daemon, \"#\" comments.\n"
+			"All lines are checked first, then a plan is printed with an estimated time:\n"
+			"jobs are grouped per device and sorted by card offset where order\n"
+			"does not matter, reads of the same partition are merged.\n"
+			"Devices run in parallel, a failed job stops the rest on its device.\n"
+			"Options before --jobs are defaults for all jobs.",
+			"cards.jobs",
+			"Run the transfers listed in cards.jobs.", NULL, NULL);
+	getopt_def(&getopt_parser, "du", "dumpcard", "container_file",
+			"compression", NULL,
+			"Save the --xml layout and all its enabled partitions in one container\n"
+			"file, the SDcard is read in one pass. Chunks of zeros are not stored,\n"
+			"others are compressed: \"none\", \"fast\" (default) or \"best\".\n"
+			"Each partition gets its --digest (default sha256), checked on\n"
+			"--restorecard and --extract. \"-\" writes to stdout.",
+			"sdcard.dump", "Back up the whole card.", NULL, NULL);
+	getopt_def(&getopt_parser, "rc", "restorecard", "container_file", NULL,
+			NULL,
+			"Write all partitions of a --dumpcard container to the SDcard, at their\n"
+			"saved offsets, AU aligned. A loaded --xml must match the saved layout.\n"
+			"The container is checked first, so a corrupt one leaves the card as it\n"
+			"was. A write error leaves the card undefined.\n"
+			"Chunks of zeros are handled by --fill.",
+			"sdcard.dump", "Restore a backed up card.", NULL, NULL);
+	getopt_def(&getopt_parser, "ex", "extract",
+			"container_file,target_id,image_file", NULL, NULL,
+			"Save one partition of a --dumpcard container as raw image file,\n"
+			"or with target_id \"xml\" the saved layout. \"-\" writes to stdout.",
+			"sdcard.dump 3 rsxdata.img",
+			"Get SCSI ID #3 without restoring the card.", NULL, NULL);
+	getopt_def(&getopt_parser, "f", "fill", "policy", NULL, NULL,
+			"What to do with partition space behind a smaller image on --write,\n"
+			"and with the whole partition on --wipe:\n"
+			"\"zero\" (default), \"discard\", \"secdiscard\" or \"none\" = untouched.\n"
+			"Done by the kernel or card, no data is transferred.",
+			"discard", "Let the card trim unused space.", NULL, NULL);
+	getopt_def(&getopt_parser, "ct", "comparetail", NULL, NULL, NULL,
+			"Following --compare also check partition space behind a smaller image\n"
+			"to be zero, as after --write with --fill zero.",
+			NULL, NULL, NULL, NULL);
+	getopt_def(&getopt_parser, "wp", "wipe", "target_id", NULL, NULL,
+			"Clear a whole SDcard partition with the --fill policy.",
+			"1", "Zero partition of SCSI ID #1.", NULL, NULL);
+	getopt_def(&getopt_parser, "gf", "getfile",
+			"target_id,file_name,local_file", NULL, NULL,
+			"Copy a single file from the RT-11 or Files-11 file system\n"
+			"of a SDcard partition. Only directory and file blocks are read.",
+			"1 [1,54]RSX11.SYS save.sys",
+			"Get RSX11.SYS from UFD [1,54] of SCSI ID #1, highest version.",
+			"0 SWAP.SYS swap.sys", "Get SWAP.SYS from RT-11 on SCSI ID #0.");
+	getopt_def(&getopt_parser, "pf", "putfile",
+			"target_id,file_name,local_file", NULL, NULL,
+			"Overwrite an existing file in a SDcard partition in place.\n"
+			"The local file must fit into the blocks allocated to the file.",
+			"1 [200,200]STARTUP.CMD;1 startup.cmd",
+			"Replace version 1 of STARTUP.CMD in [200,200] on SCSI ID #1.",
+			NULL, NULL);
+	getopt_def(&getopt_parser, "gc", "goldcache", "size", "directory", NULL,
+			"Keep images for --write and --compare in a RAM cache, shared by all\n"
+			"img2sd processes. Up to \"size\" bytes, least recently used are evicted.\n"
+			"\"directory\" on tmpfs, default " GOLDCACHE_DEFAULT_DIR,
+			"2G", "Cache golden images in 2GB of /dev/shm.", NULL, NULL);
+	getopt_def(&getopt_parser, "ss", "streamsize", "size", NULL, NULL,
+			"Bytes expected on stdin, if image file is \"-\".\n"
+			"Less input is an error. Default: until end of input,\n"
+			"at most the partition size.",
+			"dd if=/dev/rk0 | img2sd -ss 2494464 -w 1 -",
+			"Write a pipe onto target #1, expect a full RK05.", NULL, NULL);
+	getopt_def(&getopt_parser, "mc", "memcap", "size", NULL, NULL,
+			"Limit memory for transfer buffers, bytes with optional K/M/G suffix.\n"
+			"Default: 256M",
+			"32M", "Keep memory use low on a Raspberry Pi.", NULL, NULL);
+	getopt_def(&getopt_parser, "hp", "hugepages", "mode", NULL, NULL,
+			"Back transfer buffers by huge pages:\n"
+			"\"off\" (default), \"thp\" = transparent huge pages,\n"
+			"\"hugetlb\" = reserved huge pages, else thp.",
+			"thp", "Use transparent huge pages.", NULL, NULL);
+	getopt_def(&getopt_parser, "st", "stripes", "count", NULL, NULL,
+			"Split each transfer into <count> ranges, copied by parallel threads.\n"
+			"Speeds up fast devices like NVMe card images or UHS-II readers.\n"
+			"Not with --tee, --digest or qcow2 images, they need the data in order.\n"
+			"Default: 1",
+			"4", "Use 4 threads per partition.", NULL, NULL);
+	getopt_def(&getopt_parser, "mr", "maxreadrate", "rate", NULL, NULL,
+			"Limit for all data read, from SDcards and image files, in bytes per\n"
+			"second with optional K/M/G suffix. Shared by parallel transfers,\n"
+			"\"0\" = unlimited (default). Counts by direction, not by device:\n"
+			"a card write is also slowed by its image reads and read back verify,\n"
+			"and file system metadata and container index reads count too.",
+			"10M", "Leave disk bandwidth to other programs.", NULL, NULL);
+	getopt_def(&getopt_parser, "mw", "maxwriterate", "rate", NULL, NULL,
+			"Limit for all data written, as --maxreadrate.\n"
+			"Zero filling by the card itself (--fill zero) is not limited.",
+			"5M", "Leave card bandwidth to other writers.", NULL, NULL);
+	getopt_def(&getopt_parser, "io", "ioprio", "class", "level", NULL,
+			"I/O scheduling class: \"idle\" = only when no other program does I/O,\n"
+			"or \"besteffort\" with level 0 (high) .. 7 (low), default 4.\n"
+			"Needs an I/O scheduler with priorities (BFQ). Data written through\n"
+			"the page cache is flushed by the kernel, in its own class.",
+			"idle", "Image in the background.", NULL, NULL);
+	getopt_def(&getopt_parser, "ls", "latencyslo", "device,milliseconds", NULL,
+			NULL,
+			"Watch the average request latency of another device. While it is\n"
+			"above the limit, read and write rates are halved every 0.5 seconds,\n"
+			"else raised again up to --maxreadrate and --maxwriterate.",
+			"nvme0n1 20", "Back off while the emulator disk gets slow.", NULL,
+			NULL);
+	getopt_def(&getopt_parser, "pc", "pagecache", "policy", NULL, NULL,
+			"Page cache use for data read by transfers:\n"
+			"\"keep\" = normal caching, \"drop\" = read ahead and drop consumed pages,\n"
+			"\"auto\" (default) = \"drop\" for transfers of 64M and more.",
+			"keep", "Leave read data in the page cache.", NULL, NULL);
+	getopt_def(&getopt_parser, "dw", "dirtywindow", "size", NULL, NULL,
+			"Max written data not yet on the device, bytes with optional K/M suffix.\n"
+			"Older data is flushed in the background, progress shows durable data.\n"
+			"0 = leave writeback to the kernel. Default: 32M",
+			"8M", "Keep writeback steady on a slow card.", NULL, NULL);
+	getopt_def(&getopt_parser, "vl", "verifylag", "chunks", NULL, NULL,
+			"--writecompare reads back each written chunk from the card,\n"
+			"<chunks> behind the write cursor, bypassing the page cache.\n"
+			"0 = separate write and compare passes. Default: 4",
+			"0", "Write whole partition first, then compare.", NULL, NULL);
+	getopt_def(&getopt_parser, "u", "update", NULL, NULL, NULL,
+			"Following --read update an existing image file in place:\n"
+			"only blocks which differ from the card are rewritten,\n"
+			"unchanged extents stay shared on btrfs/XFS.",
+			NULL, NULL, NULL, NULL);
+	getopt_def(&getopt_parser, "sn", "snapshot", NULL, NULL, NULL,
+			"With --update, first save the previous image version as reflink\n"
+			"\"<image_file>.prev\". Needs a CoW file system.",
+			NULL, NULL, NULL, NULL);
+	getopt_def(&getopt_parser, "is", "imagesector", "bytes", NULL, NULL,
+			"Sector size of following image files, if smaller than bytesPerSector.\n"
+			"Each image sector is padded with zeros to a target sector.",
+			"256", "Image of a disk with 256 byte sectors.", NULL, NULL);
+	getopt_def(&getopt_parser, "il", "interleave", "interleave,skew", NULL,
+			NULL,
+			"Sectors of a track in following image files are in physical order,\n"
+			"with <interleave> and <skew> from track to track.\n"
+			"Track size is sectorsPerTrack of the target. \"1 0\" = off",
+			"2 0", "Image has a 2:1 interleave.", NULL, NULL);
+	getopt_def(&getopt_parser, "bs", "byteswap", NULL, NULL, NULL,
+			"Swap bytes of 16-bit words in following image files.",
+			NULL, NULL, NULL, NULL);
+	getopt_def(&getopt_parser, "fs", "filesystem", "type", NULL, NULL,
+			"Following --read, --write and --compare transfer only blocks allocated\n"
+			"by the file system in the partition, free space is handled by --fill.\n"
+			"<type>: \"rt11\", \"files11\" (ODS-1), \"rsts\" (RDS 1.x),\n"
+			"\"auto\" = any of them, else whole partition, \"none\" (default).",
+			"auto", "Copy only used blocks of RT-11 or RSX disks.", NULL, NULL);
+	getopt_def(&getopt_parser, "au", "ausize", "size", NULL, NULL,
+			"Allocation unit (erase block) size of the SDcard.\n"
+			"\"auto\" = read from device, else bytes with optional K/M suffix.\n"
+			"If unknown, 4M is used.",
+			"4M", "Align layouts and writes to 4 MByte boundaries.", NULL, NULL);
+	getopt_def(&getopt_parser, "nm", "nomerge", NULL, NULL, NULL,
+			"Write unaligned start and end of a partition as they are.\n"
+			"Default: complete them with the card data of their AU,\n"
+			"so the card only gets whole AU writes.",
+			NULL, NULL, NULL, NULL);
+	getopt_def(&getopt_parser, "ca", "checkalign", NULL, NULL, NULL,
+			"List targets of the XML config, which do not start on an AU boundary.",
+			NULL, NULL, NULL, NULL);
+	getopt_def(&getopt_parser, "ps", "plansize", "target_id,size", NULL, NULL,
+			"Set size of a target for --planlayout.\n"
+			"<size> is a byte count with optional K/M/G suffix, or an image file.",
+			"2,rsx.rd54",
+			"Plan SCSI ID #2 partition to hold the image file \"rsx.rd54\".",
+			NULL, NULL);
+	getopt_def(&getopt_parser, "pl", "planlayout", "config_filename", NULL, NULL,
+			"Save the XML config with all targets moved to AU boundaries.\n"
+			"Order of targets is kept, sizes are changed by --plansize.",
+			"aligned.xml",
+			"Write an aligned copy of the loaded XML to \"aligned.xml\".",
+			NULL, NULL);
 
 	if (argc < 2)
 		help(); // at least 1 required
@@ -380,12 +872,16 @@ static void parse_commandline(int argc, char **argv) {
 		} else if (getopt_isoption(&getopt_parser, "verbose")) {
 			opt_verbose = 1;
 		} else if (getopt_isoption(&getopt_parser, "device")) {
-			char buffer[80];
+			char buffer[PATH_MAX];
 			if (getopt_arg_s(&getopt_parser, "device_filename", buffer,
 					sizeof(buffer)) < 0)
 				commandline_option_error(NULL);
-			strcpy(opt_device, "/dev/");
-			strcat(opt_device, buffer);
+			// "sdb" is in /dev, paths and image files are used as they are
+			if (strchr(buffer, '/'))
+				strcpy(opt_device, buffer);
+			else if (snprintf(opt_device, sizeof(opt_device), "/dev/%s",
+					buffer) >= (int) sizeof(opt_device))
+				commandline_option_error("SDcard device name too long");
 			if (access(opt_device, F_OK) == -1)
 				commandline_option_error("SDcard device does not exist");
 		} else if (getopt_isoption(&getopt_parser, "xml")) {
@@ -407,6 +903,288 @@ static void parse_commandline(int argc, char **argv) {
 				}
 			}
 
+		} else if (getopt_isoption(&getopt_parser, "discover")) {
+			char *references[DISCOVER_MAX_REFERENCES];
+			unsigned i;
+			for (i = 0; i < getopt_parser.cur_option_argvalcount
+					&& i < DISCOVER_MAX_REFERENCES; i++)
+				references[i] = getopt_parser.cur_option_argval[i];
+			if (discover_run(stdout, opt_device, opt_config,
+					opt_config[0] ? config_scsitargets : NULL, references, i))
+				error("Discovery failed");
+		} else if (getopt_isoption(&getopt_parser, "tee")) {
+			unsigned i;
+			for (i = 0; i < getopt_parser.cur_option_argvalcount
+					&& i < TEE_MAX_SINKS; i++)
+				tee_sink_init(&options.tee_sinks[i],
+						getopt_parser.cur_option_argval[i]);
+			options.tee_sink_count = i;
+		} else if (getopt_isoption(&getopt_parser, "digest")) {
+			char buffer[TEE_MAX_SINKS * DIGEST_MAX_NAME];
+			char *name;
+			if (getopt_arg_s(&getopt_parser, "algorithms", buffer,
+					sizeof(buffer)) < 0)
+				commandline_option_error(NULL);
+			options.digest_count = 0;
+			for (name = strtok(buffer, ","); name; name = strtok(NULL, ",")) {
+				if (!strcasecmp(name, "none"))
+					continue;
+				if (!digest_is_known(name)
+						|| strlen(name) >= DIGEST_MAX_NAME)
+					commandline_option_error("Unknown digest \"%s\"", name);
+				if (options.digest_count >= TEE_MAX_SINKS)
+					commandline_option_error("At most %d digests",
+							TEE_MAX_SINKS);
+				strcpy(options.digests[options.digest_count++], name);
+			}
+		} else if (getopt_isoption(&getopt_parser, "digestfiles")) {
+			options.digest_files = 1;
+		} else if (getopt_isoption(&getopt_parser, "comparetail")) {
+			options.compare_tail = 1;
+		} else if (getopt_isoption(&getopt_parser, "clone")) {
+			char src_device[PATH_MAX], src_config[PATH_MAX];
+			char dst_device[PATH_MAX], dst_config[PATH_MAX];
+			if (getopt_arg_s(&getopt_parser, "src_device", src_device,
+					sizeof(src_device)) < 0
+					|| getopt_arg_s(&getopt_parser, "src_config", src_config,
+							sizeof(src_config)) < 0
+					|| getopt_arg_s(&getopt_parser, "dst_device", dst_device,
+							sizeof(dst_device)) < 0
+					|| getopt_arg_s(&getopt_parser, "dst_config", dst_config,
+							sizeof(dst_config)) < 0)
+				commandline_option_error(NULL);
+			sdcard_clone(src_device, src_config, dst_device, dst_config);
+		} else if (getopt_isoption(&getopt_parser, "relocate")) {
+			char new_config[PATH_MAX];
+			if (getopt_arg_s(&getopt_parser, "config_filename", new_config,
+					sizeof(new_config)) < 0)
+				commandline_option_error(NULL);
+			sdcard_relocate(opt_device, new_config);
+		} else if (getopt_isoption(&getopt_parser, "daemon")) {
+			char socket_path[PATH_MAX];
+			if (getopt_arg_s(&getopt_parser, "socket_path", socket_path,
+					sizeof(socket_path)) < 0)
+				commandline_option_error(NULL);
+			daemon_run(socket_path, &options);
+		} else if (getopt_isoption(&getopt_parser, "jobs")) {
+			char manifest[PATH_MAX];
+			if (getopt_arg_s(&getopt_parser, "manifest_file", manifest,
+					sizeof(manifest)) < 0)
+				commandline_option_error(NULL);
+			jobs_run(manifest, &options);
+		} else if (getopt_isoption(&getopt_parser, "dumpcard")) {
+			char container[PATH_MAX], compression[80] = "";
+			if (getopt_arg_s(&getopt_parser, "container_file", container,
+					sizeof(container)) < 0)
+				commandline_option_error(NULL);
+			getopt_arg_s(&getopt_parser, "compression", compression,
+					sizeof(compression));
+			sdcard_dump(opt_device, container, compression);
+		} else if (getopt_isoption(&getopt_parser, "restorecard")) {
+			char container[PATH_MAX];
+			if (getopt_arg_s(&getopt_parser, "container_file", container,
+					sizeof(container)) < 0)
+				commandline_option_error(NULL);
+			sdcard_restore(opt_device, container);
+		} else if (getopt_isoption(&getopt_parser, "extract")) {
+			char container[PATH_MAX], target[80], image[PATH_MAX];
+			if (getopt_arg_s(&getopt_parser, "container_file", container,
+					sizeof(container)) < 0
+					|| getopt_arg_s(&getopt_parser, "target_id", target,
+							sizeof(target)) < 0
+					|| getopt_arg_s(&getopt_parser, "image_file", image,
+							sizeof(image)) < 0)
+				commandline_option_error(NULL);
+			container_extract(container, target, image);
+		} else if (getopt_isoption(&getopt_parser, "fill")) {
+			char buffer[80];
+			if (getopt_arg_s(&getopt_parser, "policy", buffer, sizeof(buffer))
+					< 0)
+				commandline_option_error(NULL);
+			options.fill = offload_parse_policy(buffer);
+			if (options.fill < 0)
+				commandline_option_error("Unknown fill policy \"%s\"", buffer);
+		} else if (getopt_isoption(&getopt_parser, "wipe")) {
+			int target_id;
+			if (getopt_arg_i(&getopt_parser, "target_id", &target_id) < 0)
+				commandline_option_error(NULL);
+			run_op(IMG2SD_OP_WIPE, target_id, NULL, 0);
+		} else if (getopt_isoption(&getopt_parser, "getfile")
+				|| getopt_isoption(&getopt_parser, "putfile")) {
+			int target_id;
+			char file_name[FSFILE_MAX_NAME];
+			char local_file[PATH_MAX];
+			if (getopt_arg_i(&getopt_parser, "target_id", &target_id) < 0)
+				commandline_option_error(NULL);
+			if (getopt_arg_s(&getopt_parser, "file_name", file_name,
+					sizeof(file_name)) < 0)
+				commandline_option_error(NULL);
+			if (getopt_arg_s(&getopt_parser, "local_file", local_file,
+					sizeof(local_file)) < 0)
+				commandline_option_error(NULL);
+			sdcard_file(target_id, opt_device, file_name, local_file,
+					getopt_isoption(&getopt_parser, "putfile"));
+		} else if (getopt_isoption(&getopt_parser, "goldcache")) {
+			char buffer[80];
+			if (getopt_arg_s(&getopt_parser, "size", buffer, sizeof(buffer)) < 0)
+				commandline_option_error(NULL);
+			if (parse_size(buffer, &options.goldcache_budget)
+					|| options.goldcache_budget <= 0)
+				commandline_option_error("Invalid cache size \"%s\"", buffer);
+			if (getopt_arg_s(&getopt_parser, "directory", options.goldcache_dir,
+					sizeof(options.goldcache_dir)) < 0)
+				commandline_option_error(NULL);
+		} else if (getopt_isoption(&getopt_parser, "streamsize")) {
+			char buffer[80];
+			if (getopt_arg_s(&getopt_parser, "size", buffer, sizeof(buffer)) < 0)
+				commandline_option_error(NULL);
+			if (parse_size(buffer, &options.stream_size) || options.stream_size <= 0)
+				commandline_option_error("Invalid stream size \"%s\"", buffer);
+		} else if (getopt_isoption(&getopt_parser, "memcap")) {
+			char buffer[80];
+			if (getopt_arg_s(&getopt_parser, "size", buffer, sizeof(buffer)) < 0)
+				commandline_option_error(NULL);
+			if (parse_size(buffer, &opt_mem_cap)
+					|| opt_mem_cap < 2 * BUFPOOL_MIN_BUFFER_SIZE)
+				commandline_option_error("Memory cap must be at least %dK",
+						2 * BUFPOOL_MIN_BUFFER_SIZE / 1024);
+			bufpool_init(opt_mem_cap, opt_hugepages);
+		} else if (getopt_isoption(&getopt_parser, "hugepages")) {
+			char buffer[80];
+			if (getopt_arg_s(&getopt_parser, "mode", buffer, sizeof(buffer)) < 0)
+				commandline_option_error(NULL);
+			if (!strcasecmp(buffer, "off"))
+				opt_hugepages = BUFPOOL_HUGEPAGES_OFF;
+			else if (!strcasecmp(buffer, "thp"))
+				opt_hugepages = BUFPOOL_HUGEPAGES_THP;
+			else if (!strcasecmp(buffer, "hugetlb"))
+				opt_hugepages = BUFPOOL_HUGEPAGES_HUGETLB;
+			else
+				commandline_option_error("Unknown hugepage mode \"%s\"", buffer);
+			bufpool_init(opt_mem_cap, opt_hugepages);
+		} else if (getopt_isoption(&getopt_parser, "stripes")) {
+			if (getopt_arg_i(&getopt_parser, "count", &options.stripes) < 0)
+				commandline_option_error(NULL);
+			if (options.stripes < 1 || options.stripes > XFER_MAX_STRIPES)
+				commandline_option_error("Stripe count must be 1..%d",
+						XFER_MAX_STRIPES);
+		} else if (getopt_isoption(&getopt_parser, "maxreadrate")
+				|| getopt_isoption(&getopt_parser, "maxwriterate")) {
+			char buffer[80];
+			int64_t rate;
+			if (getopt_arg_s(&getopt_parser, "rate", buffer, sizeof(buffer)) < 0)
+				commandline_option_error(NULL);
+			if (parse_size(buffer, &rate) || rate < 0)
+				commandline_option_error("Invalid rate \"%s\"", buffer);
+			throttle_set_rate(getopt_isoption(&getopt_parser, "maxreadrate") ?
+			THROTTLE_READ : THROTTLE_WRITE, rate);
+		} else if (getopt_isoption(&getopt_parser, "ioprio")) {
+			char buffer[80];
+			int level = 4;
+			if (getopt_arg_s(&getopt_parser, "class", buffer, sizeof(buffer)) < 0)
+				commandline_option_error(NULL);
+			if (getopt_arg_i(&getopt_parser, "level", &level) < 0
+					|| level < 0 || level >= THROTTLE_IOPRIO_LEVELS)
+				commandline_option_error("Level must be 0 .. %d",
+						THROTTLE_IOPRIO_LEVELS - 1);
+			if (!strcasecmp(buffer, "idle"))
+				throttle_set_ioprio(THROTTLE_IOPRIO_IDLE, 0);
+			else if (!strcasecmp(buffer, "besteffort"))
+				throttle_set_ioprio(THROTTLE_IOPRIO_BESTEFFORT, level);
+			else
+				commandline_option_error("Unknown I/O class \"%s\"", buffer);
+		} else if (getopt_isoption(&getopt_parser, "latencyslo")) {
+			char device[PATH_MAX];
+			int latency_ms;
+			if (getopt_arg_s(&getopt_parser, "device", device, sizeof(device))
+					< 0
+					|| getopt_arg_i(&getopt_parser, "milliseconds", &latency_ms)
+							< 0)
+				commandline_option_error(NULL);
+			if (latency_ms <= 0)
+				commandline_option_error("Latency must be at least 1 ms");
+			throttle_set_slo(device, latency_ms);
+		} else if (getopt_isoption(&getopt_parser, "pagecache")) {
+			char buffer[80];
+			if (getopt_arg_s(&getopt_parser, "policy", buffer, sizeof(buffer))
+					< 0)
+				commandline_option_error(NULL);
+			options.cache = cache_parse_policy(buffer);
+			if (options.cache < 0)
+				commandline_option_error("Unknown page cache policy \"%s\"",
+						buffer);
+		} else if (getopt_isoption(&getopt_parser, "dirtywindow")) {
+			char buffer[80];
+			if (getopt_arg_s(&getopt_parser, "size", buffer, sizeof(buffer)) < 0)
+				commandline_option_error(NULL);
+			if (parse_size(buffer, &options.dirty_window))
+				commandline_option_error("Illegal size \"%s\"", buffer);
+		} else if (getopt_isoption(&getopt_parser, "verifylag")) {
+			if (getopt_arg_i(&getopt_parser, "chunks", &options.verify_lag) < 0)
+				commandline_option_error(NULL);
+			if (options.verify_lag < 0 || options.verify_lag > ALIGN_MAX_VERIFY_LAG)
+				commandline_option_error("Verify lag must be 0..%d",
+						ALIGN_MAX_VERIFY_LAG);
+		} else if (getopt_isoption(&getopt_parser, "update")) {
+			options.update = 1;
+		} else if (getopt_isoption(&getopt_parser, "snapshot")) {
+			options.snapshot = 1;
+		} else if (getopt_isoption(&getopt_parser, "imagesector")) {
+			if (getopt_arg_i(&getopt_parser, "bytes", &options.image_sector_size) < 0)
+				commandline_option_error(NULL);
+			if (options.image_sector_size < 0)
+				commandline_option_error("Illegal sector size");
+		} else if (getopt_isoption(&getopt_parser, "interleave")) {
+			if (getopt_arg_i(&getopt_parser, "interleave", &options.interleave) < 0
+					|| getopt_arg_i(&getopt_parser, "skew", &options.skew) < 0)
+				commandline_option_error(NULL);
+			if (options.interleave < 1 || options.skew < 0)
+				commandline_option_error("Illegal interleave or skew");
+		} else if (getopt_isoption(&getopt_parser, "byteswap")) {
+			options.byteswap = 1;
+		} else if (getopt_isoption(&getopt_parser, "filesystem")) {
+			char buffer[80];
+			if (getopt_arg_s(&getopt_parser, "type", buffer, sizeof(buffer)) < 0)
+				commandline_option_error(NULL);
+			options.filesystem = fsmap_parse_type(buffer);
+			if (options.filesystem < 0)
+				commandline_option_error("Unknown file system \"%s\"", buffer);
+		} else if (getopt_isoption(&getopt_parser, "ausize")) {
+			char buffer[80];
+			if (getopt_arg_s(&getopt_parser, "size", buffer, sizeof(buffer)) < 0)
+				commandline_option_error(NULL);
+			if (!strcasecmp(buffer, "auto"))
+				options.au_size = 0;
+			else if (parse_size(buffer, &options.au_size) || options.au_size <= 0
+					|| options.au_size % SD_SECTOR_SIZE)
+				commandline_option_error("AU size must be a multiple of %d",
+						SD_SECTOR_SIZE);
+		} else if (getopt_isoption(&getopt_parser, "nomerge")) {
+			options.au_merge = 0;
+		} else if (getopt_isoption(&getopt_parser, "checkalign")) {
+			layout_checkalign();
+		} else if (getopt_isoption(&getopt_parser, "plansize")) {
+			int target_id;
+			char buffer[PATH_MAX];
+			struct stat statbuf;
+			if (getopt_arg_i(&getopt_parser, "target_id", &target_id) < 0)
+				commandline_option_error(NULL);
+			if (getopt_arg_s(&getopt_parser, "size", buffer, sizeof(buffer)) < 0)
+				commandline_option_error(NULL);
+			if (target_id < 0 || target_id >= MAX_SCSITARGETS)
+				commandline_option_error("Invalid target id %d", target_id);
+			if (parse_size(buffer, &opt_plan_size[target_id])) {
+				if (stat(buffer, &statbuf) < 0)
+					commandline_option_error("Can not open image file \"%s\"",
+							buffer);
+				opt_plan_size[target_id] = statbuf.st_size;
+			}
+		} else if (getopt_isoption(&getopt_parser, "planlayout")) {
+			char out_filename[PATH_MAX];
+			if (getopt_arg_s(&getopt_parser, "config_filename", out_filename,
+					sizeof(out_filename)) < 0)
+				commandline_option_error(NULL);
+			layout_plan(out_filename);
 		} else if (getopt_isoption(&getopt_parser, "read")) {
 			int target_id;
 			char image_file[PATH_MAX];
@@ -415,7 +1193,8 @@ static void parse_commandline(int argc, char **argv) {
 			if (getopt_arg_s(&getopt_parser, "image_file", image_file,
 					sizeof(image_file)) < 0)
 				commandline_option_error(NULL);
-			sdcard_read(target_id, opt_device, image_file);
+			run_op(IMG2SD_OP_READ, target_id, image_file, 0);
+			options.tee_sink_count = 0; // --tee is for one read
 		} else if (getopt_isoption(&getopt_parser, "write")) {
 			int target_id;
 			char image_file[PATH_MAX];
@@ -424,7 +1203,7 @@ static void parse_commandline(int argc, char **argv) {
 			if (getopt_arg_s(&getopt_parser, "image_file", image_file,
 					sizeof(image_file)) < 0)
 				commandline_option_error(NULL);
-			sdcard_write(target_id, opt_device, image_file);
+			run_op(IMG2SD_OP_WRITE, target_id, image_file, 0);
 		} else if (getopt_isoption(&getopt_parser, "compare")) {
 			int target_id;
 			char image_file[PATH_MAX];
@@ -433,7 +1212,7 @@ static void parse_commandline(int argc, char **argv) {
 			if (getopt_arg_s(&getopt_parser, "image_file", image_file,
 					sizeof(image_file)) < 0)
 				commandline_option_error(NULL);
-			sdcard_verify(target_id, opt_device, image_file, 0);
+			run_op(IMG2SD_OP_COMPARE, target_id, image_file, 0);
 		} else if (getopt_isoption(&getopt_parser, "writecompare")) {
 			int target_id;
 			char image_file[PATH_MAX];
@@ -442,8 +1221,16 @@ static void parse_commandline(int argc, char **argv) {
 			if (getopt_arg_s(&getopt_parser, "image_file", image_file,
 					sizeof(image_file)) < 0)
 				commandline_option_error(NULL);
-			sdcard_write(target_id, opt_device, image_file);
-			sdcard_verify(target_id, opt_device, image_file, 1); // fewer output
+			if (stream_is_stdio(image_file)
+					&& stream_is_sequential(STDIN_FILENO))
+				commandline_option_error(
+						"--writecompare can not read stdin twice, use --write");
+			if (options.verify_lag > 0) // single pass
+				run_op(IMG2SD_OP_WRITECOMPARE, target_id, image_file, 0);
+			else {
+				run_op(IMG2SD_OP_WRITE, target_id, image_file, 0);
+				run_op(IMG2SD_OP_COMPARE, target_id, image_file, 1); // fewer output
+			}
 		}
 		res = getopt_next(&getopt_parser);
 	}
@@ -455,11 +1242,24 @@ static void parse_commandline(int argc, char **argv) {
 }
 
 int main(int argc, char *argv[]) {
+	int i;
 	ferr = stderr;
+	img2sd_options_init(&options);
+	// image data on stdout: all text to stderr
+	for (i = 1; i < argc; i++)
+		if (stream_is_stdio(argv[i])) {
+			options.fd_stdout = dup(STDOUT_FILENO);
+			dup2(STDERR_FILENO, STDOUT_FILENO);
+			setvbuf(stdout, NULL, _IOLBF, 0);
+			break;
+		}
 	banner();
 	parse_commandline(argc, argv);
 	// returns only if everything is OK
 	// Std options already executed
+	if (cache_pages_dropped)
+		info("Page cache: %ld pages of transferred data dropped.",
+				cache_pages_dropped);
 
 	return 0;
 }
@@ -0,0 +1,141 @@
+/* offload.c: zero-fill and discard of SDcard ranges
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+
+ Large ranges are zeroed or discarded with a single ioctl() on the
+ block device, the kernel or the card does the work without any data
+ transfer from the host.
+ If the SDcard is an image file, fallocate() is used instead.
+ If neither is supported, zeros are written.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+
+#include "error.h"
+#include "utils.h"
+#include "bufpool.h"
+#include "offload.h"	// own
+
+#define ZERO_BUFFER_SIZE	(1024 * 1024)
+
+static char *policy_names[] = { "none", "zero", "discard", "secdiscard",
+NULL };
+
+// result: OFFLOAD_FILL_*, or -1 if unknown
+int offload_parse_policy(char *name) {
+	int i;
+	for (i = 0; policy_names[i]; i++)
+		if (!strcasecmp(name, policy_names[i]))
+			return i;
+	return -1;
+}
+
+char *offload_policy_name(int policy) {
+	if (policy < 0 || policy > OFFLOAD_FILL_SECDISCARD)
+		return "?";
+	return policy_names[policy];
+}
+
+// the slow way: write zeros from host
+static int write_zeros(int fd, int64_t offset, int64_t size) {
+	size_t buffer_size = bufpool_fit(ZERO_BUFFER_SIZE, 1);
+	char *buffer = bufpool_get(buffer_size);
+	int res = 0;
+	memset(buffer, 0, buffer_size);
+	while (size > 0) {
+		int64_t len =
+				size < (int64_t) buffer_size ? size : (int64_t) buffer_size;
+		if (pwrite_full(fd, buffer, len, offset) < 0) {
+			res = error_set(ERROR_HOSTFILE, "Zero fill failed at %ld", offset);
+			break;
+		}
+		offset += len;
+		size -= len;
+	}
+	bufpool_put(buffer);
+	return res;
+}
+
+/* zero or discard the range [offset, offset+size) of the SDcard
+ * offset and size must be multiples of 512.
+ * After discard, the card returns zeros or the old data.
+ * result: 0 = OK, else error
+ */
+int offload_fill(int fd, int64_t offset, int64_t size, int policy) {
+	struct stat statbuf;
+	uint64_t range[2];
+	unsigned long request;
+
+	if (policy == OFFLOAD_FILL_NONE || size <= 0)
+		return 0;
+	if (fstat(fd, &statbuf) < 0)
+		return error_set(ERROR_HOSTFILE, "Can not stat SDcard");
+
+	if (S_ISREG(statbuf.st_mode)) {
+		// card image file: zero range, or punch a hole
+		int mode = FALLOC_FL_KEEP_SIZE;
+		if (policy == OFFLOAD_FILL_ZERO)
+			mode |= FALLOC_FL_ZERO_RANGE;
+		else
+			mode |= FALLOC_FL_PUNCH_HOLE;
+		if (fallocate(fd, mode, offset, size) == 0)
+			return 0;
+		return write_zeros(fd, offset, size);
+	}
+
+	range[0] = offset;
+	range[1] = size;
+	switch (policy) {
+	case OFFLOAD_FILL_ZERO:
+		request = BLKZEROOUT;
+		break;
+	case OFFLOAD_FILL_DISCARD:
+		request = BLKDISCARD;
+		break;
+	default:
+		request = BLKSECDISCARD;
+	}
+	if (ioctl(fd, request, range) == 0)
+		return 0;
+	if (policy == OFFLOAD_FILL_DISCARD) {
+		// discarded data is undefined anyhow
+		warning("SDcard does not support discard, range left untouched");
+		return 0;
+	}
+	if (policy == OFFLOAD_FILL_SECDISCARD)
+		return error_set(ERROR_HOSTFILE,
+				"SDcard does not support secure discard, errno = %d", errno);
+	// BLKZEROOUT not available: older kernel
+	return write_zeros(fd, offset, size);
+}
@@ -0,0 +1,41 @@
+/* offload.h: zero-fill and discard of SDcard ranges
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+ */
+
+#ifndef OFFLOAD_H_
+#define OFFLOAD_H_
+
+#include <stdint.h>
+
+// what to do with partition space not covered by an image
+#define OFFLOAD_FILL_NONE	0	// leave untouched
+#define OFFLOAD_FILL_ZERO	1	// BLKZEROOUT
+#define OFFLOAD_FILL_DISCARD	2	// BLKDISCARD
+#define OFFLOAD_FILL_SECDISCARD	3	// BLKSECDISCARD
+
+int offload_parse_policy(char *name);
+char *offload_policy_name(int policy);
+int offload_fill(int fd, int64_t offset, int64_t size, int policy);
+
+#endif /* OFFLOAD_H_ */
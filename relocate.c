@@ -0,0 +1,458 @@
+/* relocate.c: move partitions to a new layout on the same SDcard
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+
+ Each partition is copied from its old to its new card offset.
+ Partitions are moved in an order, so no data is overwritten before it
+ was moved itself. If old and new range of one partition overlap, it is
+ copied from the end when moving up, else from the start.
+
+ The move can be resumed after a crash: progress is saved in a state file,
+ always after the moved data is durable. For overlapping ranges, data
+ beyond a saved checkpoint is moved only up to the shift distance, so
+ the source data of an interrupted chunk is never overwritten.
+ After success the state file is kept with a "done" mark, so running the
+ same relocation again does not move the already moved data a second time.
+ The state file also identifies the card: path, size, serial and a
+ checksum of data no move writes. A state of another card is not
+ continued, and its "done" mark does not skip the relocation of this one.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#include <zlib.h>
+
+#include "error.h"
+#include "utils.h"
+#include "bufpool.h"
+#include "offload.h"
+#include "relocate.h"	// own
+
+#define STATE_MAGIC	"img2sd relocate state"
+
+// do card ranges [a, a+a_size) and [b, b+b_size) overlap?
+static int ranges_overlap(int64_t a, int64_t a_size, int64_t b,
+		int64_t b_size) {
+	return a < b + b_size && b < a + a_size;
+}
+
+/* compare old and new layout, and order the partition moves.
+ * A move must be done before another move overwrites its source range.
+ * result: 0 = OK, else error
+ */
+int relocate_plan(relocate_plan_t *plan, config_scsitarget_t *old_targets,
+		config_scsitarget_t *new_targets, int64_t card_size) {
+	relocate_move_t moves[MAX_SCSITARGETS];
+	int scheduled[MAX_SCSITARGETS];
+	int n = 0;
+	int i, j, id;
+
+	memset(plan, 0, sizeof(*plan));
+	for (id = 0; id < MAX_SCSITARGETS; id++) {
+		config_scsitarget_t *old = &old_targets[id];
+		config_scsitarget_t *new = &new_targets[id];
+		relocate_move_t *move;
+		int64_t new_size;
+		if (!new->enabled)
+			continue;
+		new_size = config_scsitarget_size(new);
+		if (card_size > 0
+				&& config_scsitarget_offset(new) + new_size > card_size)
+			return error_set(ERROR_ILLPARAMVAL,
+					"SCSI ID %d ends behind end of SDcard", id);
+		for (j = 0; j < id; j++)
+			if (new_targets[j].enabled
+					&& ranges_overlap(config_scsitarget_offset(new), new_size,
+							config_scsitarget_offset(&new_targets[j]),
+							config_scsitarget_size(&new_targets[j])))
+				return error_set(ERROR_ILLPARAMVAL,
+						"SCSI ID %d and %d overlap in new layout", j, id);
+		if (!old->enabled)
+			continue;
+		if (old->bytesPerSector != new->bytesPerSector)
+			return error_set(ERROR_ILLPARAMVAL,
+					"SCSI ID %d: sector size changes from %d to %d", id,
+					old->bytesPerSector, new->bytesPerSector);
+		if (config_scsitarget_size(old) > new_size)
+			return error_set(ERROR_ILLPARAMVAL,
+					"SCSI ID %d shrinks from %ld to %ld bytes", id,
+					config_scsitarget_size(old), new_size);
+		move = &moves[n++];
+		move->target_id = id;
+		move->from = config_scsitarget_offset(old);
+		move->to = config_scsitarget_offset(new);
+		move->size = config_scsitarget_size(old);
+		move->fill_size = new_size - move->size;
+	}
+
+	// repeatedly take the first move, whose destination range does not
+	// overwrite the source of another pending move
+	memset(scheduled, 0, sizeof(scheduled));
+	while (plan->count < n) {
+		for (i = 0; i < n; i++) {
+			if (scheduled[i])
+				continue;
+			for (j = 0; j < n; j++)
+				if (j != i && !scheduled[j]
+						&& ranges_overlap(moves[i].to, moves[i].size,
+								moves[j].from, moves[j].size))
+					break;
+			if (j == n)
+				break; // i destroys no unmoved data
+		}
+		if (i == n) {
+			for (i = 0; scheduled[i]; i++)
+				;
+			return error_set(ERROR_ILLPARAMVAL,
+					"Cyclic overlap of SCSI ID %d with other targets, relocate in two steps",
+					moves[i].target_id);
+		}
+		scheduled[i] = 1;
+		plan->moves[plan->count++] = moves[i];
+	}
+	return 0;
+}
+
+/* serial number of a block device from sysfs, of the disk if "realdev"
+ * is a partition. A file is identified by device and inode.
+ * "serial" = "-" if unknown.
+ */
+static void get_serial(char *realdev, int fd_card, char *serial) {
+	static char *attributes[] = { "device/serial", "device/cid",
+			"device/wwid", NULL };
+	char sysdir[PATH_MAX], path[PATH_MAX];
+	struct stat statbuf;
+	FILE *f;
+	int i;
+
+	strcpy(serial, "-");
+	if (fstat(fd_card, &statbuf) == 0 && S_ISREG(statbuf.st_mode)) {
+		snprintf(serial, RELOCATE_MAX_SERIAL, "inode:%lx:%lx",
+				(unsigned long) statbuf.st_dev, (unsigned long) statbuf.st_ino);
+		return;
+	}
+	if (snprintf(path, sizeof(path), "/sys/class/block/%s",
+			basename(realdev)) >= (int) sizeof(path)
+			|| !realpath(path, sysdir))
+		return;
+	if (snprintf(path, sizeof(path), "%s/partition", sysdir)
+			>= (int) sizeof(path))
+		return;
+	if (access(path, F_OK) == 0)
+		strcpy(sysdir, dirname(sysdir));
+	for (i = 0; attributes[i]; i++) {
+		if (snprintf(path, sizeof(path), "%s/%s", sysdir, attributes[i])
+				>= (int) sizeof(path) || !(f = fopen(path, "r")))
+			continue;
+		// one word, no white space in the state file
+		if (fscanf(f, "%63s", serial) != 1)
+			strcpy(serial, "-");
+		fclose(f);
+		if (strcmp(serial, "-"))
+			return;
+	}
+}
+
+/* identity of the card in "plan->device": size, serial, crc32 of up to
+ * RELOCATE_FINGERPRINT_SIZE bytes before or behind all written ranges,
+ * so it does not change while moving, and the path.
+ * result: 0 = OK, else error
+ */
+static int get_device_identity(int fd_card, char *device_filename,
+		relocate_plan_t *plan) {
+	char realdev[PATH_MAX], serial[RELOCATE_MAX_SERIAL];
+	char fingerprint[16] = "-";
+	int64_t card_size = device_size(fd_card);
+	int64_t written_start = card_size, written_end = 0;
+	int64_t start = -1, len = 0;
+	int i;
+
+	if (!realpath(device_filename, realdev))
+		snprintf(realdev, sizeof(realdev), "%s", device_filename);
+	get_serial(realdev, fd_card, serial);
+	for (i = 0; i < plan->count; i++) {
+		relocate_move_t *move = &plan->moves[i];
+		int64_t end = move->to + move->size + move->fill_size;
+		if (move->from == move->to && !move->fill_size)
+			continue; // not written
+		if (move->to < written_start)
+			written_start = move->to;
+		if (end > written_end)
+			written_end = end;
+	}
+	if (written_start >= RELOCATE_FINGERPRINT_SIZE
+			|| written_start == card_size) {
+		start = 0;
+		len = written_start;
+	} else if (card_size - written_end >= RELOCATE_FINGERPRINT_SIZE) {
+		start = written_end;
+		len = card_size - written_end;
+	}
+	if (len > RELOCATE_FINGERPRINT_SIZE)
+		len = RELOCATE_FINGERPRINT_SIZE;
+	if (start >= 0 && len > 0) {
+		char *buffer = bufpool_get(RELOCATE_FINGERPRINT_SIZE);
+		int res = pread_full(fd_card, buffer, len, start) < 0;
+		if (!res)
+			snprintf(fingerprint, sizeof(fingerprint), "%08lx",
+					crc32(0, (Bytef *) buffer, len));
+		bufpool_put(buffer);
+		if (res)
+			return error_set(ERROR_HOSTFILE, "SDcard read failed at %ld",
+					start);
+	}
+	snprintf(plan->device, sizeof(plan->device), "%ld %s %s %s", card_size,
+			serial, fingerprint, realdev);
+	return 0;
+}
+
+/* load progress of an interrupted relocation.
+ * A finished relocation with another plan or of another card counts as
+ * no state file. An unfinished one of another card is an error.
+ * result: 0 = OK, 1 = no state file, else error
+ */
+static int state_load(relocate_plan_t *plan, char *state_filename) {
+	FILE *f;
+	char line[RELOCATE_MAX_DEVICE_ID + 16];
+	int i, res = 0, other = 0, other_device = 0;
+
+	f = fopen(state_filename, "r");
+	if (!f)
+		return errno == ENOENT ? 1 : error_set(ERROR_HOSTFILE,
+				"Can not open state file \"%s\"", state_filename);
+	if (!fgets(line, sizeof(line), f) || strncmp(line, STATE_MAGIC,
+			strlen(STATE_MAGIC)))
+		res = error_set(ERROR_HOSTFILE, "\"%s\" is not a relocate state file",
+				state_filename);
+	if (!res && (!fgets(line, sizeof(line), f)
+			|| strncmp(line, "device ", 7) || !strchr(line, '\n')))
+		res = error_set(ERROR_HOSTFILE, "State file \"%s\" is corrupt",
+				state_filename);
+	else if (!res) {
+		*strchr(line, '\n') = 0;
+		other_device = strcmp(line + 7, plan->device) != 0;
+	}
+	for (i = 0; !res && i < plan->count; i++) {
+		relocate_move_t *move = &plan->moves[i];
+		int id;
+		int64_t from, to, size;
+		if (!fgets(line, sizeof(line), f)
+				|| sscanf(line, "move %d %ld %ld %ld", &id, &from, &to, &size)
+						!= 4)
+			res = error_set(ERROR_HOSTFILE, "State file \"%s\" is corrupt",
+					state_filename);
+		else if (id != move->target_id || from != move->from
+				|| to != move->to || size != move->size)
+			other = 1;
+	}
+	if (!res && !other && (!fgets(line, sizeof(line), f)
+			|| sscanf(line, "step %d %ld", &plan->step, &plan->done) != 2
+			|| plan->step < 0 || plan->step > plan->count))
+		res = error_set(ERROR_HOSTFILE, "State file \"%s\" is corrupt",
+				state_filename);
+	// "done" is the last line
+	while (!res && fgets(line, sizeof(line), f))
+		plan->finished = !strcmp(line, "done\n");
+	fclose(f);
+	if (!res && (other || other_device)) {
+		if (!plan->finished)
+			return error_set(ERROR_ILLPARAMVAL,
+					"State file \"%s\" is from another %s", state_filename,
+					other ? "relocation" : "SDcard");
+		plan->step = 0;
+		plan->done = 0;
+		plan->finished = 0;
+		return 1;
+	}
+	return res;
+}
+
+/* save progress. Written to a temporary file first, which then
+ * atomically replaces the previous state.
+ */
+static int state_save(relocate_plan_t *plan, char *state_filename) {
+	char tmp_filename[PATH_MAX + 8];
+	FILE *f;
+	int i;
+
+	snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", state_filename);
+	f = fopen(tmp_filename, "w");
+	if (!f)
+		return error_set(ERROR_HOSTFILE, "Can not write state file \"%s\"",
+				tmp_filename);
+	fprintf(f, "%s\n", STATE_MAGIC);
+	fprintf(f, "device %s\n", plan->device);
+	for (i = 0; i < plan->count; i++)
+		fprintf(f, "move %d %ld %ld %ld\n", plan->moves[i].target_id,
+				plan->moves[i].from, plan->moves[i].to, plan->moves[i].size);
+	fprintf(f, "step %d %ld\n", plan->step, plan->done);
+	if (plan->finished)
+		fprintf(f, "done\n");
+	if (fflush(f) || fdatasync(fileno(f)) < 0) {
+		fclose(f);
+		return error_set(ERROR_HOSTFILE, "Can not write state file \"%s\"",
+				tmp_filename);
+	}
+	fclose(f);
+	if (rename(tmp_filename, state_filename) < 0)
+		return error_set(ERROR_HOSTFILE, "Can not rename \"%s\" to \"%s\"",
+				tmp_filename, state_filename);
+	return 0;
+}
+
+// card data up to plan->done is durable: save it
+static int checkpoint(int fd_card, relocate_plan_t *plan,
+		char *state_filename) {
+	if (fdatasync(fd_card) < 0)
+		return error_set(ERROR_HOSTFILE, "SDcard sync failed, errno = %d",
+				errno);
+	return state_save(plan, state_filename);
+}
+
+/* move the current partition, starting at plan->done.
+ * total_done: bytes of previous moves, for progress
+ */
+static int move_partition(int fd_card, relocate_plan_t *plan,
+		char *state_filename, char *buffer, int64_t total_done,
+		int64_t total, relocate_progress_func_t progress) {
+	relocate_move_t *move = &plan->moves[plan->step];
+	int64_t shift = move->to > move->from ?
+			move->to - move->from : move->from - move->to;
+	int64_t chunk_size = RELOCATE_CHUNK_SIZE;
+	int64_t interval = RELOCATE_CHECKPOINT_SIZE;
+	int64_t saved = plan->done; // durable and in state file
+
+	if (shift < move->size) {
+		// overlap: never overwrite source of data behind the checkpoint
+		if (chunk_size > shift)
+			chunk_size = shift;
+		if (interval > shift)
+			interval = shift;
+	}
+	while (plan->done < move->size) {
+		int64_t len = move->size - plan->done;
+		int64_t pos;
+		if (len > chunk_size)
+			len = chunk_size;
+		if (plan->done + len - saved > interval) {
+			if (checkpoint(fd_card, plan, state_filename))
+				return error_code;
+			saved = plan->done;
+		}
+		// moving up: copy from end
+		if (move->to > move->from)
+			pos = move->size - plan->done - len;
+		else
+			pos = plan->done;
+		if (pread_full(fd_card, buffer, len, move->from + pos) < 0)
+			return error_set(ERROR_HOSTFILE, "SDcard read failed at %ld",
+					move->from + pos);
+		if (pwrite_full(fd_card, buffer, len, move->to + pos) < 0)
+			return error_set(ERROR_HOSTFILE, "SDcard write failed at %ld",
+					move->to + pos);
+		plan->done += len;
+		if (progress)
+			progress(total_done + plan->done, total);
+	}
+	return 0;
+}
+
+/* execute a plan of relocate_plan() on "device_filename". If
+ * "state_filename" holds the progress of an interrupted run with the same
+ * plan on the same card, it is continued. After success the state file is
+ * marked "done"; with such a state file, nothing is moved and the result
+ * is 1.
+ * result: 0 = OK, 1 = already done, else error
+ */
+int relocate_run(int fd_card, char *device_filename, relocate_plan_t *plan,
+		char *state_filename, int fill_policy,
+		relocate_progress_func_t progress) {
+	char *buffer;
+	int64_t total = 0, total_done = 0;
+	int i, res;
+
+	plan->step = 0;
+	plan->done = 0;
+	plan->finished = 0;
+	if (get_device_identity(fd_card, device_filename, plan))
+		return error_code;
+	res = state_load(plan, state_filename);
+	if (res < 0)
+		return res;
+	if (res == 0 && plan->finished)
+		return 1;
+	if (res == 0)
+		info("Resuming relocation at SCSI ID %d, %ld bytes already moved.",
+				plan->step < plan->count ?
+						plan->moves[plan->step].target_id : -1, plan->done);
+	else if (state_save(plan, state_filename))
+		return error_code;
+
+	for (i = 0; i < plan->count; i++) {
+		if (plan->moves[i].from == plan->moves[i].to)
+			continue;
+		total += plan->moves[i].size;
+		if (i < plan->step)
+			total_done += plan->moves[i].size;
+	}
+	buffer = bufpool_get(RELOCATE_CHUNK_SIZE);
+	res = 0;
+	while (!res && plan->step < plan->count) {
+		relocate_move_t *move = &plan->moves[plan->step];
+		if (move->from != move->to) {
+			res = move_partition(fd_card, plan, state_filename, buffer,
+					total_done, total, progress);
+			total_done += move->size;
+		}
+		if (!res) {
+			plan->step++;
+			plan->done = 0;
+			res = checkpoint(fd_card, plan, state_filename);
+		}
+	}
+	bufpool_put(buffer);
+	if (res)
+		return res;
+
+	// all data moved: grown partitions can be filled
+	for (i = 0; i < plan->count; i++) {
+		relocate_move_t *move = &plan->moves[i];
+		if (move->fill_size > 0
+				&& offload_fill(fd_card, move->to + move->size, move->fill_size,
+						fill_policy))
+			return error_code;
+	}
+	if (fdatasync(fd_card) < 0)
+		return error_set(ERROR_HOSTFILE, "SDcard sync failed, errno = %d",
+				errno);
+	plan->finished = 1;
+	return state_save(plan, state_filename);
+}
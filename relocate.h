@@ -0,0 +1,69 @@
+/* relocate.h: move partitions to a new layout on the same SDcard
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+ */
+
+#ifndef RELOCATE_H_
+#define RELOCATE_H_
+
+#include <stdint.h>
+#include <linux/limits.h>
+
+#include "config.h"
+
+#define RELOCATE_CHUNK_SIZE	(4 * 1024 * 1024)
+// without overlap, progress is saved after this much moved data
+#define RELOCATE_CHECKPOINT_SIZE	(64 * 1024 * 1024)
+// card data checksummed for the device identity, if not moved
+#define RELOCATE_FINGERPRINT_SIZE	(64 * 1024)
+#define RELOCATE_MAX_SERIAL	64
+// "<size> <serial> <fingerprint> <realpath>"
+#define RELOCATE_MAX_DEVICE_ID	(PATH_MAX + RELOCATE_MAX_SERIAL + 48)
+
+// one partition
+typedef struct {
+	int target_id;
+	int64_t from; // card offset in old layout
+	int64_t to; // card offset in new layout
+	int64_t size; // bytes to move
+	int64_t fill_size; // grown partition: space behind moved data
+} relocate_move_t;
+
+typedef struct {
+	int count;
+	relocate_move_t moves[MAX_SCSITARGETS]; // in execution order
+	int step; // index of current move, count = all moved
+	int64_t done; // bytes of current move already durable
+	int finished; // all moved and filled
+	char device[RELOCATE_MAX_DEVICE_ID]; // identity of the card
+} relocate_plan_t;
+
+typedef void (*relocate_progress_func_t)(int64_t done, int64_t total);
+
+int relocate_plan(relocate_plan_t *plan, config_scsitarget_t *old_targets,
+		config_scsitarget_t *new_targets, int64_t card_size);
+int relocate_run(int fd_card, char *device_filename, relocate_plan_t *plan,
+		char *state_filename, int fill_policy,
+		relocate_progress_func_t progress);
+
+#endif /* RELOCATE_H_ */
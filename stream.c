@@ -0,0 +1,282 @@
+/* stream.c: image data through pipes
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+
+ With "-" as image file, data comes from stdin or goes to stdout,
+ for pipelines like "ssh host cat image | img2sd ...".
+ Pipes have no size and no random access, so the card is written or
+ read in one sequential pass.
+ Data is moved with splice(): between the pipe and the card's page
+ cache, without a copy through user space. If the kernel refuses
+ (no pipe on one side, file system without splice support), it falls
+ back to read() and write().
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "error.h"
+#include "utils.h"
+#include "bufpool.h"
+#include "wbehind.h"
+#include "throttle.h"
+#include "stream.h"	// own
+
+int stream_is_stdio(char *filename) {
+	return !strcmp(filename, STREAM_STDIO_NAME);
+}
+
+/* pipe, socket, terminal, or file opened for append (">>"):
+ * no size, no positioning. Else "-" is used like a named file.
+ */
+int stream_is_sequential(int fd) {
+	struct stat st;
+	if (fstat(fd, &st))
+		return 0;
+	if (fcntl(fd, F_GETFL) & O_APPEND)
+		return 1;
+	return !S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode);
+}
+
+// write all, to a pipe. result: 0 = OK
+static int write_all(int fd, char *data, int64_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		data += n;
+		len -= n;
+		throttle(THROTTLE_WRITE, n);
+	}
+	return 0;
+}
+
+// read until "len" or end of stream. result: bytes read, < 0 = error
+static int64_t read_all(int fd, char *data, int64_t len) {
+	int64_t done = 0;
+	while (done < len) {
+		ssize_t n = read(fd, data + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		done += n;
+	}
+	throttle(THROTTLE_READ, done);
+	return done;
+}
+
+static int64_t chunk(int64_t rest) {
+	return rest < STREAM_CHUNK_SIZE ? rest : STREAM_CHUNK_SIZE;
+}
+
+/* splice moves pipe sized pieces: report once per chunk.
+ * result: 0 = continue, else canceled
+ */
+static int report(xfer_progress_func_t progress, int64_t done, int64_t n,
+		int64_t total) {
+	if (progress
+			&& (done / STREAM_CHUNK_SIZE != (done - n) / STREAM_CHUNK_SIZE
+					|| done == total) && progress(done, total))
+		return error_set(ERROR_CANCELED, "Transfer canceled");
+	return 0;
+}
+
+/* send "size" bytes of "fd_src" from "offset" to the pipe "fd_out".
+ * result: 0 = OK, else error
+ */
+int stream_out(int fd_out, int fd_src, int64_t offset, int64_t size,
+		xfer_progress_func_t progress) {
+	int64_t done = 0;
+	char *buffer = NULL;
+	int res = 0;
+
+	while (!res && done < size) {
+		loff_t pos = offset + done;
+		ssize_t n = -1;
+		if (!buffer) {
+			n = splice(fd_src, &pos, fd_out, NULL, chunk(size - done),
+			SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+				buffer = bufpool_get(STREAM_CHUNK_SIZE); // fall back
+			else if (n <= 0) {
+				res = error_set(ERROR_HOSTFILE,
+						"Output to pipe failed at %ld, errno = %d",
+						offset + done, errno);
+				break;
+			} else {
+				throttle(THROTTLE_READ, n);
+				throttle(THROTTLE_WRITE, n);
+			}
+		}
+		if (buffer) {
+			n = chunk(size - done);
+			if (pread_full(fd_src, buffer, n, offset + done) < 0
+					|| write_all(fd_out, buffer, n)) {
+				res = error_set(ERROR_HOSTFILE,
+						"Output to pipe failed at %ld, errno = %d",
+						offset + done, errno);
+				break;
+			}
+		}
+		done += n;
+		res = report(progress, done, n, size);
+	}
+	if (buffer)
+		bufpool_put(buffer);
+	return res;
+}
+
+// send "size" zero bytes to the pipe. result: 0 = OK
+int stream_out_zeros(int fd_out, int64_t size) {
+	char *zeros = calloc(1, STREAM_CHUNK_SIZE);
+	int res = 0;
+	if (!zeros)
+		fatal("Out of memory");
+	while (!res && size > 0) {
+		res = write_all(fd_out, zeros, chunk(size));
+		size -= chunk(size);
+	}
+	free(zeros);
+	if (res)
+		return error_set(ERROR_HOSTFILE, "Output to pipe failed, errno = %d",
+				errno);
+	return 0;
+}
+
+/* copy the pipe "fd_in" to "fd_dst" at "offset", until end of stream,
+ * at most "max_size" bytes. Dirty data is limited by write-behind.
+ * result: bytes copied. < 0 = error, or more than "max_size" in the pipe
+ */
+int64_t stream_in(int fd_in, int fd_dst, int64_t offset, int64_t max_size,
+		int64_t dirty_window, xfer_progress_func_t progress) {
+	wbehind_t wb;
+	int64_t done = 0;
+	char *buffer = NULL;
+	char extra;
+	int res = 0;
+
+	wbehind_init(&wb, fd_dst, offset, dirty_window, 0);
+	while (!res && done < max_size) {
+		loff_t pos = offset + done;
+		ssize_t n = -1;
+		if (!buffer) {
+			n = splice(fd_in, NULL, fd_dst, &pos, chunk(max_size - done),
+			SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+				buffer = bufpool_get(STREAM_CHUNK_SIZE); // fall back
+			else if (n < 0) {
+				res = error_set(ERROR_HOSTFILE,
+						"Input from pipe failed at %ld, errno = %d",
+						offset + done, errno);
+				break;
+			} else {
+				throttle(THROTTLE_READ, n);
+				throttle(THROTTLE_WRITE, n);
+			}
+		}
+		if (buffer) {
+			n = read_all(fd_in, buffer, chunk(max_size - done));
+			if (n < 0
+					|| (n > 0 && pwrite_full(fd_dst, buffer, n, offset + done) < 0)) {
+				res = error_set(ERROR_HOSTFILE,
+						"Input from pipe failed at %ld, errno = %d",
+						offset + done, errno);
+				break;
+			}
+		}
+		if (n == 0)
+			break; // end of stream
+		done += n;
+		res = wbehind_advance(&wb, offset + done);
+		if (!res)
+			res = report(progress, done, n, max_size);
+	}
+	if (buffer)
+		bufpool_put(buffer);
+	if (res || wbehind_finish(&wb))
+		return -1;
+	if (done == max_size && read_all(fd_in, &extra, 1) > 0)
+		return error_set(ERROR_HOSTFILE, "More than %ld bytes on input",
+				max_size);
+	return done;
+}
+
+/* compare the pipe "fd_in" with "fd_src" at "offset", until end of
+ * stream, at most "max_size" bytes.
+ * mismatch_offset: relative position of first differing byte, -1 = equal
+ * result: bytes compared, < 0 = error
+ */
+int64_t stream_compare(int fd_in, int fd_src, int64_t offset,
+		int64_t max_size, int64_t *mismatch_offset,
+		xfer_progress_func_t progress) {
+	char *buffer_in = bufpool_get(STREAM_CHUNK_SIZE);
+	char *buffer_src = bufpool_get(STREAM_CHUNK_SIZE);
+	int64_t done = 0;
+	char extra;
+	int res = 0;
+
+	*mismatch_offset = -1;
+	while (!res && done < max_size) {
+		int64_t n = read_all(fd_in, buffer_in, chunk(max_size - done));
+		if (n < 0 || pread_full(fd_src, buffer_src, n, offset + done) < 0) {
+			res = error_set(ERROR_HOSTFILE, "Read failed at %ld, errno = %d",
+					offset + done, errno);
+			break;
+		}
+		if (n == 0)
+			break;
+		if (memcmp(buffer_in, buffer_src, n)) {
+			int64_t i;
+			for (i = 0; buffer_in[i] == buffer_src[i]; i++)
+				;
+			*mismatch_offset = done + i;
+			break;
+		}
+		done += n;
+		res = report(progress, done, n, max_size);
+	}
+	bufpool_put(buffer_in);
+	bufpool_put(buffer_src);
+	if (res)
+		return -1;
+	if (done == max_size && read_all(fd_in, &extra, 1) > 0)
+		return error_set(ERROR_HOSTFILE, "More than %ld bytes on input",
+				max_size);
+	return done;
+}
@@ -0,0 +1,48 @@
+/* stream.h: image data through pipes
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+ */
+
+#ifndef STREAM_H_
+#define STREAM_H_
+
+#include <stdint.h>
+
+#include "xfer.h"
+
+// image file name for stdin or stdout
+#define STREAM_STDIO_NAME	"-"
+#define STREAM_CHUNK_SIZE	(1024 * 1024)
+
+int stream_is_stdio(char *filename);
+int stream_is_sequential(int fd);
+int stream_out(int fd_out, int fd_src, int64_t offset, int64_t size,
+		xfer_progress_func_t progress);
+int stream_out_zeros(int fd_out, int64_t size);
+int64_t stream_in(int fd_in, int fd_dst, int64_t offset, int64_t max_size,
+		int64_t dirty_window, xfer_progress_func_t progress);
+int64_t stream_compare(int fd_in, int fd_src, int64_t offset,
+		int64_t max_size, int64_t *mismatch_offset,
+		xfer_progress_func_t progress);
+
+#endif /* STREAM_H_ */
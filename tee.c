@@ -0,0 +1,368 @@
+/* tee.c: fan-out of a read stream into several sinks
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+
+ A card partition is read once, and the data is passed on to further
+ sinks: raw copies, a gzip archive, digest files, sparse qcow2 files.
+ The same mechanism computes the digests of --digest for reads, writes
+ and compares, on the buffers already in transfer.
+ The reader hands its buffers over to a ring and gets fresh ones from
+ the bufpool, so no data is copied. Each sink has its own thread and
+ processes the ring in stream order. A buffer goes back to the bufpool
+ when all sinks are done with it. When the ring is full, the reader
+ waits: the slowest sink sets the pace.
+ Gaps in the stream (free blocks of a file system) are sent as zeros.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "error.h"
+#include "utils.h"
+#include "bufpool.h"
+#include "tee.h"	// own
+
+#define TEE_ZERO_SIZE	(1024 * 1024)
+#define TEE_ZBUFFER_SIZE	(256 * 1024)
+
+// select sink type by file name suffix
+void tee_sink_init(tee_sink_t *sink, char *filename) {
+	char *suffix = strrchr(filename, '.');
+
+	memset(sink, 0, sizeof(*sink));
+	strncpy(sink->filename, filename, sizeof(sink->filename) - 1);
+	sink->fd = -1;
+	sink->type = TEE_SINK_RAW;
+	if (!suffix || strchr(suffix, '/'))
+		return;
+	if (!strcasecmp(suffix, ".gz"))
+		sink->type = TEE_SINK_GZIP;
+	else if (!strcasecmp(suffix, ".qcow2"))
+		sink->type = TEE_SINK_QCOW2;
+	else if (digest_is_known(suffix + 1)) {
+		sink->type = TEE_SINK_DIGEST;
+		strncpy(sink->algorithm, suffix + 1, sizeof(sink->algorithm) - 1);
+	}
+}
+
+// digest by algorithm name, "filename" NULL = only digest_text
+void tee_sink_init_digest(tee_sink_t *sink, char *algorithm, char *filename) {
+	memset(sink, 0, sizeof(*sink));
+	if (filename)
+		strncpy(sink->filename, filename, sizeof(sink->filename) - 1);
+	sink->fd = -1;
+	sink->type = TEE_SINK_DIGEST;
+	strncpy(sink->algorithm, algorithm, sizeof(sink->algorithm) - 1);
+}
+
+static void sink_write(tee_sink_t *sink, void *data, int64_t len) {
+	if (pwrite_full(sink->fd, data, len, sink->written) < 0)
+		error("Write to \"%s\" failed, errno = %d",
+				sink->filename, errno);
+	sink->written += len;
+}
+
+// compress input, or finish stream with Z_FINISH
+static void sink_deflate(tee_sink_t *sink, char *data, int64_t len,
+		int flush) {
+	z_stream *zs = &sink->zstream;
+	int res;
+
+	zs->next_in = (unsigned char *) data;
+	zs->avail_in = len;
+	do {
+		zs->next_out = sink->zbuffer;
+		zs->avail_out = TEE_ZBUFFER_SIZE;
+		res = deflate(zs, flush);
+		if (res == Z_STREAM_ERROR)
+			error("Compression for \"%s\" failed", sink->filename);
+		sink_write(sink, sink->zbuffer, TEE_ZBUFFER_SIZE - zs->avail_out);
+	} while (zs->avail_out == 0 || (flush == Z_FINISH && res != Z_STREAM_END));
+}
+
+static void sink_process(tee_sink_t *sink, char *data, int64_t len) {
+	switch (sink->type) {
+	case TEE_SINK_GZIP:
+		// avail_in is 32 bit
+		while (len > 0) {
+			int64_t n = len > (1 << 30) ? (1 << 30) : len;
+			sink_deflate(sink, data, n, Z_NO_FLUSH);
+			data += n;
+			len -= n;
+		}
+		break;
+	case TEE_SINK_DIGEST:
+		digest_update(&sink->digest, data, len);
+		break;
+	case TEE_SINK_QCOW2:
+		vdisk_qcow2_write(&sink->qcow2, data, len);
+		break;
+	default:
+		sink_write(sink, data, len);
+	}
+}
+
+// free what a sink holds, without final output
+static void sink_release(tee_sink_t *sink) {
+	if (sink->zbuffer) {
+		deflateEnd(&sink->zstream);
+		free(sink->zbuffer);
+		sink->zbuffer = NULL;
+	}
+	if (sink->type == TEE_SINK_DIGEST)
+		digest_free(&sink->digest);
+	else if (sink->type == TEE_SINK_QCOW2)
+		vdisk_qcow2_free(&sink->qcow2);
+	if (sink->fd >= 0)
+		close(sink->fd);
+	sink->fd = -1;
+}
+
+static void sink_finish(tee_sink_t *sink) {
+	switch (sink->type) {
+	case TEE_SINK_GZIP:
+		sink_deflate(sink, NULL, 0, Z_FINISH);
+		deflateEnd(&sink->zstream);
+		free(sink->zbuffer);
+		sink->zbuffer = NULL;
+		break;
+	case TEE_SINK_DIGEST: {
+		char line[DIGEST_MAX_TEXT + PATH_MAX + 4];
+		char *name = strrchr(sink->tee->name, '/');
+		int n;
+		digest_final(&sink->digest, sink->digest_text);
+		if (sink->fd < 0)
+			return; // no digest file
+		// format of sha256sum & co
+		n = snprintf(line, sizeof(line), "%s  %s\n", sink->digest_text,
+				name ? name + 1 : sink->tee->name);
+		sink_write(sink, line, n);
+		break;
+	}
+	case TEE_SINK_QCOW2:
+		if (vdisk_qcow2_end(&sink->qcow2, sink->tee->size))
+			error("Can not write \"%s\"", sink->filename);
+		// file size set by writer
+		if (close(sink->fd) < 0) {
+			sink->fd = -1;
+			error("Close of \"%s\" failed, errno = %d", sink->filename,
+					errno);
+		}
+		sink->fd = -1;
+		return;
+	}
+	if (ftruncate(sink->fd, sink->written) < 0 || close(sink->fd) < 0) {
+		sink->fd = -1;
+		error("Close of \"%s\" failed, errno = %d", sink->filename, errno);
+	}
+	sink->fd = -1;
+}
+
+// return buffers which all sinks have processed. mutex locked.
+static void release_chunks(tee_t *tee) {
+	unsigned oldest = tee->filled, i;
+	for (i = 0; i < tee->sink_count; i++)
+		if (tee->filled - tee->sinks[i].consumed > tee->filled - oldest)
+			oldest = tee->sinks[i].consumed;
+	for (; tee->released != oldest; tee->released++) {
+		tee_chunk_t *chunk = &tee->ring[tee->released % TEE_RING_SIZE];
+		if (chunk->buffer)
+			bufpool_put(chunk->buffer);
+		chunk->buffer = chunk->data = NULL;
+	}
+	pthread_cond_broadcast(&tee->changed);
+}
+
+/* process chunks in stream order.
+ * An error stops the sink, but it keeps consuming the ring, so the
+ * reader is not blocked.
+ */
+static void *sink_thread(void *arg) {
+	tee_sink_t *sink = arg;
+	tee_t *tee = sink->tee;
+	error_catch_t catch;
+
+	error_catch_begin(&catch);
+	if (setjmp(catch.env)) {
+		sink->failed = 1;
+		strcpy(sink->error_text, catch.text);
+	}
+	pthread_mutex_lock(&tee->mutex);
+	for (;;) {
+		tee_chunk_t chunk;
+		while (sink->consumed == tee->filled && !tee->closing)
+			pthread_cond_wait(&tee->changed, &tee->mutex);
+		if (sink->consumed == tee->filled)
+			break; // closing, all done
+		chunk = tee->ring[sink->consumed % TEE_RING_SIZE];
+		pthread_mutex_unlock(&tee->mutex);
+		if (!sink->failed && !tee->aborted)
+			sink_process(sink, chunk.data, chunk.len);
+		pthread_mutex_lock(&tee->mutex);
+		sink->consumed++;
+		release_chunks(tee);
+	}
+	pthread_mutex_unlock(&tee->mutex);
+	if (!sink->failed && !tee->aborted)
+		sink_finish(sink); // an error in it returns above, "failed" set
+	else
+		sink_release(sink);
+	error_catch_end(&catch);
+	return NULL;
+}
+
+/* name: image file, listed in digest files
+ * On error, the sinks started so far run until tee_abort().
+ */
+void tee_open(tee_t *tee, tee_sink_t *sinks, unsigned count, char *name) {
+	unsigned i;
+
+	memset(tee, 0, sizeof(*tee));
+	tee->name = name;
+	pthread_mutex_init(&tee->mutex, NULL);
+	pthread_cond_init(&tee->changed, NULL);
+	for (i = 0; i < count; i++) {
+		tee_sink_t *sink = &tee->sinks[i];
+		*sink = sinks[i];
+		sink->tee = tee;
+		if (sink->filename[0]) {
+			sink->fd = open(sink->filename, O_CREAT | O_WRONLY | O_TRUNC,
+					0644);
+			if (sink->fd < 0)
+				error("Can not open file \"%s\" for write", sink->filename);
+		}
+		if (sink->type == TEE_SINK_GZIP) {
+			sink->zbuffer = malloc(TEE_ZBUFFER_SIZE);
+			// window bits + 16: gzip header
+			if (!sink->zbuffer
+					|| deflateInit2(&sink->zstream, TEE_GZIP_LEVEL, Z_DEFLATED,
+							15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+				sink_release(sink);
+				error("Can not initialize compression for \"%s\"",
+						sink->filename);
+			}
+		} else if (sink->type == TEE_SINK_DIGEST) {
+			if (digest_init(&sink->digest, sink->algorithm)) {
+				sink_release(sink);
+				error("Can not initialize digest \"%s\" for \"%s\"",
+						sink->algorithm, name);
+			}
+		}
+		else if (sink->type == TEE_SINK_QCOW2)
+			vdisk_qcow2_begin(&sink->qcow2, sink->fd);
+		if (pthread_create(&sink->thread, NULL, sink_thread, sink))
+			fatal("Can not start sink thread");
+		tee->sink_count = i + 1;
+	}
+}
+
+// append a chunk to the ring, waits while it is full
+static void push_chunk(tee_t *tee, char *buffer, char *data, int64_t len) {
+	tee_chunk_t *chunk;
+	pthread_mutex_lock(&tee->mutex);
+	while (tee->filled - tee->released >= TEE_RING_SIZE)
+		pthread_cond_wait(&tee->changed, &tee->mutex);
+	chunk = &tee->ring[tee->filled % TEE_RING_SIZE];
+	chunk->buffer = buffer;
+	chunk->data = data;
+	chunk->len = len;
+	tee->filled++;
+	pthread_cond_broadcast(&tee->changed);
+	pthread_mutex_unlock(&tee->mutex);
+	tee->position += len;
+}
+
+// send zeros up to stream "position"
+static void put_zeros(tee_t *tee, int64_t position) {
+	if (!tee->zeros) {
+		tee->zeros_size = TEE_ZERO_SIZE;
+		tee->zeros = calloc(1, tee->zeros_size);
+		if (!tee->zeros)
+			fatal("Out of memory");
+	}
+	while (tee->position < position) {
+		int64_t len = position - tee->position;
+		if (len > (int64_t) tee->zeros_size)
+			len = tee->zeros_size;
+		push_chunk(tee, NULL, tee->zeros, len);
+	}
+}
+
+/* pass "len" bytes of "data" at stream "position" to all sinks.
+ * "buffer" from the bufpool holds "data" and is taken over,
+ * result: a new buffer of "buffer_size" for the caller, NULL if 0.
+ */
+char *tee_put(tee_t *tee, int64_t position, char *buffer, char *data,
+		int64_t len, size_t buffer_size) {
+	put_zeros(tee, position);
+	if (position != tee->position)
+		fatal("Tee: stream position %ld, expected %ld", position,
+				tee->position);
+	push_chunk(tee, buffer, data, len);
+	return buffer_size ? bufpool_get(buffer_size) : NULL;
+}
+
+// stop sink threads and free resources
+static void stop_sinks(tee_t *tee) {
+	unsigned i;
+
+	pthread_mutex_lock(&tee->mutex);
+	tee->closing = 1;
+	pthread_cond_broadcast(&tee->changed);
+	pthread_mutex_unlock(&tee->mutex);
+	for (i = 0; i < tee->sink_count; i++)
+		pthread_join(tee->sinks[i].thread, NULL);
+	free(tee->zeros);
+	tee->zeros = NULL;
+	pthread_cond_destroy(&tee->changed);
+	pthread_mutex_destroy(&tee->mutex);
+}
+
+// pad stream to "size", flush and close all sinks
+void tee_close(tee_t *tee, int64_t size) {
+	unsigned i;
+
+	put_zeros(tee, size);
+	tee->size = size;
+	stop_sinks(tee);
+	for (i = 0; i < tee->sink_count; i++)
+		if (tee->sinks[i].failed)
+			error("%s", tee->sinks[i].error_text);
+}
+
+/* stop all sinks after an error of the reader, without final output.
+ * As cleanup for error_cleanup_push().
+ */
+void tee_abort(void *arg) {
+	tee_t *tee = arg;
+	tee->aborted = 1;
+	stop_sinks(tee);
+}
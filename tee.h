@@ -0,0 +1,106 @@
+/* tee.h: fan-out of a read stream into several sinks
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+ */
+
+#ifndef TEE_H_
+#define TEE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <linux/limits.h>
+#include <zlib.h>
+
+#include "error.h"
+#include "digest.h"
+#include "vdisk.h"
+
+#define TEE_MAX_SINKS	8
+// chunks between reader and the slowest sink
+#define TEE_RING_SIZE	8
+// gzip level: fast enough to keep up with a card reader
+#define TEE_GZIP_LEVEL	1
+
+// sink types, selected by file name suffix
+#define TEE_SINK_RAW	0	// plain copy of the image
+#define TEE_SINK_GZIP	1	// ".gz": gzip compressed image
+#define TEE_SINK_DIGEST	2	// ".sha256", ".crc32c", ...: hash file, "hex  name"
+#define TEE_SINK_QCOW2	3	// ".qcow2": sparse, zero clusters left out
+
+struct tee_struct;
+
+typedef struct {
+	int type;
+	char filename[PATH_MAX]; // "" = digest without file
+	char algorithm[DIGEST_MAX_NAME]; // of a digest
+	char digest_text[DIGEST_MAX_TEXT]; // result of a digest, after close
+
+	// private
+	struct tee_struct *tee;
+	pthread_t thread;
+	int fd;
+	unsigned consumed; // sequence number of next chunk to process
+	int64_t written; // bytes to file
+	z_stream zstream;
+	unsigned char *zbuffer;
+	digest_t digest;
+	vdisk_qcow2_writer_t qcow2;
+	int failed; // error in sink thread, reported by tee_close()
+	char error_text[ERROR_MAX_TEXT];
+} tee_sink_t;
+
+typedef struct {
+	char *buffer; // from bufpool, returned after use. NULL = not pooled
+	char *data; // in buffer
+	int64_t len;
+} tee_chunk_t;
+
+typedef struct tee_struct {
+	unsigned sink_count;
+	tee_sink_t sinks[TEE_MAX_SINKS];
+	char *name; // image file name, for digest files
+	int64_t position; // stream bytes so far
+	int64_t size; // final stream size, set on close
+
+	// private
+	tee_chunk_t ring[TEE_RING_SIZE];
+	unsigned filled; // sequence number of next chunk
+	unsigned released; // sequence number of oldest chunk in use
+	int closing;
+	int aborted; // sinks stop, no final output
+	char *zeros; // for gaps in the stream
+	size_t zeros_size;
+	pthread_mutex_t mutex;
+	pthread_cond_t changed;
+} tee_t;
+
+void tee_sink_init(tee_sink_t *sink, char *filename);
+void tee_sink_init_digest(tee_sink_t *sink, char *algorithm, char *filename);
+void tee_open(tee_t *tee, tee_sink_t *sinks, unsigned count, char *name);
+char *tee_put(tee_t *tee, int64_t position, char *buffer, char *data,
+		int64_t len, size_t buffer_size);
+void tee_close(tee_t *tee, int64_t size);
+void tee_abort(void *tee);
+
+#endif /* TEE_H_ */
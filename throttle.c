@@ -0,0 +1,219 @@
+/* throttle.c: bandwidth limits and I/O priority, for shared hosts
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+
+ All reads and all writes of the process pass a token bucket each,
+ shared by all threads and all operations (--daemon, --jobs):
+ throttle() is called after each transfer and sleeps while the bucket is
+ in debt. Unused tokens are saved for a short burst only.
+ --latencyslo watches the average request latency of another device in
+ /sys/class/block/<name>/stat. Over the limit, the rates are halved,
+ starting from the measured throughput. Under the limit they grow by a
+ quarter per sample, until the limits of --maxreadrate/--maxwriterate
+ or the real throughput are reached: the backoff ends there.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/limits.h>
+
+#include "error.h"
+#include "throttle.h"	// own
+
+#define IOPRIO_WHO_PROCESS	1
+#define IOPRIO_CLASS_SHIFT	13
+
+typedef struct {
+	pthread_mutex_t mutex;
+	int64_t rate; // bytes per second, 0 = unlimited. Atomic access
+	int64_t backoff_rate; // from latency, 0 = none. Atomic access
+	int64_t empty_time; // ns, CLOCK_MONOTONIC: tokens used up to here
+	int64_t bytes; // transferred, for the latency monitor. Atomic access
+} bucket_t;
+
+static bucket_t buckets[2] = {
+	{ PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0 },
+	{ PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0 } };
+
+static char slo_stat_filename[PATH_MAX];
+static int slo_latency_ms;
+static pthread_t slo_thread;
+
+static int64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// limit of a bucket in bytes per second, 0 = unlimited
+void throttle_set_rate(int bucket, int64_t rate) {
+	__atomic_store_n(&buckets[bucket].rate, rate, __ATOMIC_RELAXED);
+}
+
+/* scheduling class of this thread, inherited by threads started later.
+ * "level": for THROTTLE_IOPRIO_BESTEFFORT. result: 0 = OK, else error
+ */
+int throttle_set_ioprio(int ioprio_class, int level) {
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+			(ioprio_class << IOPRIO_CLASS_SHIFT) | level) < 0)
+		return error_set(ERROR_ILLPARAMVAL, "ioprio_set failed, errno = %d",
+				errno);
+	return 0;
+}
+
+// account "bytes" done, then wait until the bucket allows more
+void throttle(int bucket_index, int64_t bytes) {
+	bucket_t *bucket = &buckets[bucket_index];
+	int64_t rate = __atomic_load_n(&bucket->rate, __ATOMIC_RELAXED);
+	int64_t backoff_rate = __atomic_load_n(&bucket->backoff_rate,
+			__ATOMIC_RELAXED);
+	int64_t now, wait;
+	struct timespec ts;
+
+	__atomic_add_fetch(&bucket->bytes, bytes, __ATOMIC_RELAXED);
+	if (backoff_rate && (!rate || backoff_rate < rate))
+		rate = backoff_rate;
+	if (!rate || bytes <= 0)
+		return;
+	pthread_mutex_lock(&bucket->mutex);
+	now = now_ns();
+	if (bucket->empty_time < now - THROTTLE_BURST_MS * 1000000LL)
+		bucket->empty_time = now - THROTTLE_BURST_MS * 1000000LL;
+	bucket->empty_time += (int64_t) ((double) bytes * 1e9 / rate);
+	wait = bucket->empty_time - now;
+	pthread_mutex_unlock(&bucket->mutex);
+	if (wait <= 0)
+		return;
+	ts.tv_sec = wait / 1000000000LL;
+	ts.tv_nsec = wait % 1000000000LL;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+// sums of completed requests and their time in ms. result: 0 = OK
+static int read_device_stat(uint64_t *ios, uint64_t *ticks) {
+	unsigned long long v[8];
+	FILE *f = fopen(slo_stat_filename, "r");
+	int n;
+	if (!f)
+		return -1;
+	// reads, merges, sectors, ticks, then the same for writes
+	n = fscanf(f, "%llu %llu %llu %llu %llu %llu %llu %llu", &v[0], &v[1],
+			&v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+	fclose(f);
+	if (n != 8)
+		return -1;
+	*ios = v[0] + v[4];
+	*ticks = v[3] + v[7];
+	return 0;
+}
+
+// one latency sample: halve or grow the backoff rate
+static void adjust(bucket_t *bucket, int exceeded, int64_t measured_rate) {
+	int64_t rate = __atomic_load_n(&bucket->rate, __ATOMIC_RELAXED);
+	int64_t backoff_rate = __atomic_load_n(&bucket->backoff_rate,
+			__ATOMIC_RELAXED);
+
+	if (exceeded) {
+		if (!backoff_rate) {
+			if (!measured_rate)
+				return; // not our traffic
+			backoff_rate = measured_rate;
+		}
+		if (rate && backoff_rate > rate)
+			backoff_rate = rate;
+		backoff_rate /= 2;
+		if (backoff_rate < THROTTLE_MIN_RATE)
+			backoff_rate = THROTTLE_MIN_RATE;
+	} else if (backoff_rate) {
+		backoff_rate += backoff_rate / 4;
+		// does not limit anymore
+		if ((rate && backoff_rate >= rate) || backoff_rate > 2 * measured_rate)
+			backoff_rate = 0;
+	}
+	__atomic_store_n(&bucket->backoff_rate, backoff_rate, __ATOMIC_RELAXED);
+}
+
+static void *slo_monitor(void *arg) {
+	uint64_t ios, ticks, last_ios = 0, last_ticks = 0;
+	int64_t last_bytes[2] = { 0, 0 };
+	int valid = 0;
+	int i;
+
+	(void) arg;
+	for (;;) {
+		if (!read_device_stat(&ios, &ticks)) {
+			uint64_t new_ios = ios - last_ios;
+			// average of the requests completed in the interval
+			int exceeded = valid && new_ios
+					&& ticks - last_ticks > new_ios * slo_latency_ms;
+			for (i = 0; i < 2; i++) {
+				int64_t bytes = __atomic_load_n(&buckets[i].bytes,
+						__ATOMIC_RELAXED);
+				if (valid)
+					adjust(&buckets[i], exceeded,
+							(bytes - last_bytes[i]) * 1000
+									/ THROTTLE_SLO_INTERVAL_MS);
+				last_bytes[i] = bytes;
+			}
+			last_ios = ios;
+			last_ticks = ticks;
+			valid = 1;
+		}
+		usleep(THROTTLE_SLO_INTERVAL_MS * 1000);
+	}
+	return NULL;
+}
+
+/* watch the request latency of "device" ("sda", "/dev/nvme0n1p2"), back
+ * off while its average is over "latency_ms". result: 0 = OK, else error
+ */
+int throttle_set_slo(char *device, int latency_ms) {
+	char path[PATH_MAX], *name;
+	uint64_t ios, ticks;
+	int running = slo_stat_filename[0] != 0;
+
+	if (!realpath(device, path))
+		snprintf(path, sizeof(path), "%s", device);
+	name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	if (snprintf(slo_stat_filename, sizeof(slo_stat_filename),
+			"/sys/class/block/%s/stat", name)
+			>= (int) sizeof(slo_stat_filename))
+		return error_set(ERROR_ILLPARAMVAL, "Device name too long");
+	if (read_device_stat(&ios, &ticks))
+		return error_set(ERROR_ILLPARAMVAL,
+				"No I/O statistics for device \"%s\" in \"%s\"", device,
+				slo_stat_filename);
+	slo_latency_ms = latency_ms;
+	if (!running && pthread_create(&slo_thread, NULL, slo_monitor, NULL))
+		fatal("Can not start latency monitor");
+	return 0;
+}
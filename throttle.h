@@ -0,0 +1,54 @@
+/* throttle.h: bandwidth limits and I/O priority, for shared hosts
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+ */
+
+#ifndef THROTTLE_H_
+#define THROTTLE_H_
+
+#include <stdint.h>
+
+// token buckets
+// by direction, not by card or image side: a card write with
+// read back also spends read tokens, index and metadata I/O count too.
+#define THROTTLE_READ	0 // all data read, from card and image files
+#define THROTTLE_WRITE	1 // all data written
+
+// tokens saved while idle, as time at full rate
+#define THROTTLE_BURST_MS	100
+// latency samples of the watched device
+#define THROTTLE_SLO_INTERVAL_MS	500
+// backoff does not go below
+#define THROTTLE_MIN_RATE	(256 * 1024)
+
+// scheduling classes of ioprio_set()
+#define THROTTLE_IOPRIO_BESTEFFORT	2
+#define THROTTLE_IOPRIO_IDLE	3
+#define THROTTLE_IOPRIO_LEVELS	8 // best-effort levels 0 (high) .. 7
+
+void throttle_set_rate(int bucket, int64_t rate);
+int throttle_set_ioprio(int ioprio_class, int level);
+int throttle_set_slo(char *device, int latency_ms);
+void throttle(int bucket, int64_t bytes);
+
+#endif /* THROTTLE_H_ */
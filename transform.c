@@ -0,0 +1,316 @@
+/* transform.c: image layout conversion while streaming
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+
+ Transfers work in card layout. Image data for a range of card sectors
+ is gathered by transform_read(): contiguous image ranges are read with
+ one call each, then padded and byte swapped into card sectors.
+ transform_write() is the inverse. Without interleave the image side of
+ a whole chunk is one contiguous range.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "error.h"
+#include "utils.h"
+#include "transform.h"	// own
+
+/* result: 0 = OK, else error
+ */
+int transform_init(transform_t *t, int card_sector_size,
+		int image_sector_size, int sectors_per_track, int interleave, int skew,
+		int byteswap) {
+	char used[TRANSFORM_MAX_SECTORS_PER_TRACK];
+	int l, p;
+
+	memset(t, 0, sizeof(*t));
+	if (image_sector_size == 0)
+		image_sector_size = card_sector_size;
+	if (card_sector_size <= 0 || image_sector_size <= 0
+			|| image_sector_size > card_sector_size)
+		return error_set(ERROR_ILLPARAMVAL,
+				"Image sector size %d does not fit into card sector size %d",
+				image_sector_size, card_sector_size);
+	if (byteswap && image_sector_size % 2)
+		return error_set(ERROR_ILLPARAMVAL,
+				"Byte swap needs an even image sector size");
+	if (sectors_per_track < 0
+			|| sectors_per_track > TRANSFORM_MAX_SECTORS_PER_TRACK)
+		return error_set(ERROR_ILLPARAMVAL, "Illegal sectors per track %d",
+				sectors_per_track);
+	if (interleave < 1)
+		return error_set(ERROR_ILLPARAMVAL, "Illegal interleave %d", interleave);
+	t->card_sector_size = card_sector_size;
+	t->image_sector_size = image_sector_size;
+	t->sectors_per_track = sectors_per_track;
+	t->interleave = interleave;
+	t->skew = sectors_per_track ? skew % sectors_per_track : 0;
+	if (t->skew < 0)
+		t->skew += sectors_per_track;
+	t->byteswap = byteswap;
+
+	// logical sector "l" is "interleave" positions behind "l-1",
+	// or on the next free position
+	memset(used, 0, sizeof(used));
+	for (l = p = 0; l < sectors_per_track; l++) {
+		while (used[p])
+			p = (p + 1) % sectors_per_track;
+		t->position[l] = p;
+		used[p] = 1;
+		p = (p + interleave) % sectors_per_track;
+	}
+	return 0;
+}
+
+// does the image differ from the card layout?
+int transform_active(transform_t *t) {
+	return t->image_sector_size != t->card_sector_size
+			|| (t->sectors_per_track && (t->interleave > 1 || t->skew))
+			|| t->byteswap;
+}
+
+int64_t transform_image_size(transform_t *t, int64_t card_size) {
+	int64_t rest = card_size % t->card_sector_size;
+	if (rest > t->image_sector_size)
+		rest = t->image_sector_size;
+	return card_size / t->card_sector_size * t->image_sector_size + rest;
+}
+
+/* card bytes for an image. With interleave, a partial last track is
+ * completed, its sectors are spread over the whole track.
+ */
+int64_t transform_card_size(transform_t *t, int64_t image_size) {
+	int64_t spt = t->sectors_per_track;
+	int64_t sectors = (image_size + t->image_sector_size - 1)
+			/ t->image_sector_size;
+	if (spt)
+		return (sectors + spt - 1) / spt * spt * t->card_sector_size;
+	return image_size / t->image_sector_size * t->card_sector_size
+			+ image_size % t->image_sector_size;
+}
+
+// image sector holding a card sector
+static int64_t image_sector(transform_t *t, int64_t card_sector) {
+	int64_t spt = t->sectors_per_track;
+	int64_t track;
+	if (spt == 0)
+		return card_sector;
+	track = card_sector / spt;
+	return track * spt + (t->position[card_sector % spt] + track * t->skew) % spt;
+}
+
+// part of one card sector, inside a transferred range
+typedef struct {
+	int64_t sector; // card sector, relative to partition
+	int64_t start; // range in sector
+	int64_t end;
+	int64_t data_end; // image data before padding, may be < start
+} piece_t;
+
+// piece of the card sector at "pos", up to "range_end"
+static void get_piece(transform_t *t, int64_t pos, int64_t range_end,
+		piece_t *piece) {
+	piece->sector = pos / t->card_sector_size;
+	piece->start = pos - piece->sector * t->card_sector_size;
+	piece->end = range_end - piece->sector * t->card_sector_size;
+	if (piece->end > t->card_sector_size)
+		piece->end = t->card_sector_size;
+	piece->data_end = piece->end;
+	if (piece->data_end > t->image_sector_size)
+		piece->data_end = t->image_sector_size;
+}
+
+// contiguous range of image file, collected from several pieces
+typedef struct {
+	int64_t offset; // in image file
+	int64_t len;
+	char *data; // in scratch buffer
+} image_run_t;
+
+/* fill "buffer" with "len" bytes of the image in card layout, starting
+ * at card position "card_pos" relative to the partition.
+ * Image data behind end of file is read as zeros.
+ * "scratch" is a caller's buffer of at least "len" bytes, for the
+ * image data before it is distributed.
+ * result: 0 = OK, else error
+ */
+int transform_read(transform_t *t, int fd_img, char *buffer, int64_t len,
+		int64_t card_pos, char *scratch) {
+	int64_t pos, end = card_pos + len;
+	piece_t piece;
+	image_run_t run = { -1, 0, NULL };
+	char *cursor;
+	int res = 0;
+
+	if (t->byteswap && (card_pos % 2 || len % 2))
+		return error_set(ERROR_ILLPARAMVAL, "Byte swap of odd range");
+	// read image data into scratch, one call per contiguous range
+	cursor = run.data = scratch;
+	for (pos = card_pos; !res && pos < end; pos += piece.end - piece.start) {
+		int64_t offset, n;
+		get_piece(t, pos, end, &piece);
+		n = piece.data_end - piece.start;
+		if (n <= 0)
+			continue; // only padding
+		offset = image_sector(t, piece.sector) * t->image_sector_size
+				+ piece.start;
+		if (offset != run.offset + run.len) {
+			if (run.len > 0
+					&& pread_full(fd_img, run.data, run.len, run.offset) < 0)
+				res = -1;
+			run.offset = offset;
+			run.len = 0;
+			run.data = cursor;
+		}
+		run.len += n;
+		cursor += n;
+	}
+	if (res || (run.len > 0
+			&& pread_full(fd_img, run.data, run.len, run.offset) < 0))
+		return error_set(ERROR_HOSTFILE, "Image file read failed, errno = %d",
+				errno);
+	// distribute into card sectors
+	cursor = scratch;
+	for (pos = card_pos; pos < end; pos += piece.end - piece.start) {
+		char *dst = buffer + (pos - card_pos);
+		int64_t n;
+		get_piece(t, pos, end, &piece);
+		n = piece.data_end - piece.start;
+		if (n > 0) {
+			if (t->byteswap)
+				transform_byteswap16(dst, cursor, n);
+			else
+				memcpy(dst, cursor, n);
+			cursor += n;
+		} else
+			n = 0;
+		memset(dst + n, 0, piece.end - piece.start - n);
+	}
+	return 0;
+}
+
+/* write "len" bytes of card layout data from "buffer" into the image.
+ * "card_pos" is relative to the partition. Padding is dropped.
+ * "scratch": as for transform_read()
+ * result: 0 = OK, else error
+ */
+int transform_write(transform_t *t, int fd_img, char *buffer, int64_t len,
+		int64_t card_pos, char *scratch) {
+	int64_t pos, end = card_pos + len;
+	piece_t piece;
+	image_run_t run = { -1, 0, NULL };
+	char *cursor;
+	int res = 0;
+
+	if (t->byteswap && (card_pos % 2 || len % 2))
+		return error_set(ERROR_ILLPARAMVAL, "Byte swap of odd range");
+	// collect image data in scratch, one call per contiguous range
+	cursor = run.data = scratch;
+	for (pos = card_pos; !res && pos < end; pos += piece.end - piece.start) {
+		char *src = buffer + (pos - card_pos);
+		int64_t offset, n;
+		get_piece(t, pos, end, &piece);
+		n = piece.data_end - piece.start;
+		if (n <= 0)
+			continue;
+		offset = image_sector(t, piece.sector) * t->image_sector_size
+				+ piece.start;
+		if (offset != run.offset + run.len) {
+			if (run.len > 0
+					&& pwrite_full(fd_img, run.data, run.len, run.offset) < 0)
+				res = -1;
+			run.offset = offset;
+			run.len = 0;
+			run.data = cursor;
+		}
+		if (t->byteswap)
+			transform_byteswap16(cursor, src, n);
+		else
+			memcpy(cursor, src, n);
+		run.len += n;
+		cursor += n;
+	}
+	if (res || (run.len > 0
+			&& pwrite_full(fd_img, run.data, run.len, run.offset) < 0))
+		res = error_set(ERROR_HOSTFILE, "Image file write failed, errno = %d",
+				errno);
+	return res;
+}
+
+static void byteswap16_generic(char *dst, char *src, size_t len) {
+	uint16_t w;
+	size_t i;
+	for (i = 0; i + 1 < len; i += 2) {
+		memcpy(&w, src + i, 2);
+		w = __builtin_bswap16(w);
+		memcpy(dst + i, &w, 2);
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+static void byteswap16_ssse3(char *dst, char *src, size_t len) {
+	const __m128i mask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10,
+			13, 12, 15, 14);
+	size_t i;
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((__m128i *) (src + i));
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_shuffle_epi8(v, mask));
+	}
+	byteswap16_generic(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void byteswap16_avx2(char *dst, char *src, size_t len) {
+	const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11,
+			10, 13, 12, 15, 14, 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15,
+			14);
+	size_t i;
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((__m256i *) (src + i));
+		_mm256_storeu_si256((__m256i *) (dst + i), _mm256_shuffle_epi8(v, mask));
+	}
+	byteswap16_ssse3(dst + i, src + i, len - i);
+}
+#endif
+
+/* swap bytes of all 16-bit words of "src" into "dst", may be the same.
+ * Uses the widest vector unit of the CPU.
+ */
+void transform_byteswap16(char *dst, char *src, size_t len) {
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("avx2"))
+		byteswap16_avx2(dst, src, len);
+	else if (__builtin_cpu_supports("ssse3"))
+		byteswap16_ssse3(dst, src, len);
+	else
+#endif
+		byteswap16_generic(dst, src, len);
+}
@@ -0,0 +1,67 @@
+/* transform.h: image layout conversion while streaming
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+ */
+
+#ifndef TRANSFORM_H_
+#define TRANSFORM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TRANSFORM_MAX_SECTORS_PER_TRACK	1024
+
+/* How image file and SDcard partition differ.
+ * The card holds sectors in logical order, with the bytesPerSector of
+ * the SCSI target. The image may have
+ * - smaller sectors, each is padded with zeros to the card sector size,
+ * - sectors of a track in physical order, written with interleave and
+ *   a skew from track to track,
+ * - 16-bit words in other byte order.
+ * Transfers address the image in card layout, see transform_read().
+ */
+typedef struct {
+	int card_sector_size; // bytesPerSector of SCSI target
+	int image_sector_size; // <= card_sector_size
+	int sectors_per_track; // for interleave, 0 = no remap
+	int interleave; // 1 = sequential
+	int skew; // sector offset from track to track
+	int byteswap; // swap bytes of 16-bit words
+
+	// physical position of logical sectors on track 0
+	int position[TRANSFORM_MAX_SECTORS_PER_TRACK];
+} transform_t;
+
+int transform_init(transform_t *t, int card_sector_size,
+		int image_sector_size, int sectors_per_track, int interleave, int skew,
+		int byteswap);
+int transform_active(transform_t *t);
+int64_t transform_image_size(transform_t *t, int64_t card_size);
+int64_t transform_card_size(transform_t *t, int64_t image_size);
+int transform_read(transform_t *t, int fd_img, char *buffer, int64_t len,
+		int64_t card_pos, char *scratch);
+int transform_write(transform_t *t, int fd_img, char *buffer, int64_t len,
+		int64_t card_pos, char *scratch);
+void transform_byteswap16(char *dst, char *src, size_t len);
+
+#endif /* TRANSFORM_H_ */
@@ -24,7 +24,19 @@
  15-May-2017	JH Created
  */
 
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
 #include <time.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "throttle.h"
+#include "utils.h"
 
 char *cur_time_text() {
 	static char result[40];
@@ -35,3 +47,110 @@ char *cur_time_text() {
 	strftime(result, 26, "%H:%M:%S", tm_info);
 	return result;
 }
+
+/* parse a byte size like "4096", "512K", "4M", "1G"
+ * result: 0 = OK, -1 = syntax error
+ */
+int parse_size(char *text, int64_t *res) {
+	char *endptr;
+	int64_t val = strtoll(text, &endptr, 0);
+	if (endptr == text || val < 0)
+		return -1;
+	switch (*endptr) {
+	case 'k':
+	case 'K':
+		val *= 1024;
+		endptr++;
+		break;
+	case 'm':
+	case 'M':
+		val *= 1024 * 1024;
+		endptr++;
+		break;
+	case 'g':
+	case 'G':
+		val *= 1024 * 1024 * 1024LL;
+		endptr++;
+		break;
+	}
+	if (*endptr)
+		return -1;
+	*res = val;
+	return 0;
+}
+
+/* size of an opened block device or regular file in bytes.
+ * result: < 0 on error
+ */
+int64_t device_size(int fd) {
+	struct stat statbuf;
+	uint64_t size;
+	if (fstat(fd, &statbuf) < 0)
+		return -1;
+	if (S_ISREG(statbuf.st_mode))
+		return statbuf.st_size;
+	if (ioctl(fd, BLKGETSIZE64, &size) < 0)
+		return -1;
+	return (int64_t) size;
+}
+
+/* pread()/pwrite() until all bytes are transferred, within the limits of
+ * --maxreadrate and --maxwriterate.
+ * pread_full() fills the rest of the buffer with zeros at end of file.
+ * result: bytes read from file / written, < 0 on error
+ */
+int64_t pread_full(int fd, void *buffer, size_t count, int64_t offset) {
+	size_t done = 0;
+	while (done < count) {
+		ssize_t n = pread(fd, (char *) buffer + done, count - done,
+				offset + done);
+		if (n < 0)
+			return -1;
+		if (n == 0) { // end of file
+			memset((char *) buffer + done, 0, count - done);
+			break;
+		}
+		done += n;
+	}
+	throttle(THROTTLE_READ, done);
+	return done;
+}
+
+int64_t pwrite_full(int fd, void *buffer, size_t count, int64_t offset) {
+	size_t done = 0;
+	while (done < count) {
+		ssize_t n = pwrite(fd, (char *) buffer + done, count - done,
+				offset + done);
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	throttle(THROTTLE_WRITE, done);
+	return done;
+}
+
+/* copy a file as reflink: new file shares all extents with the old one.
+ * Only possible on CoW file systems like btrfs or XFS.
+ * result: 0 = OK, < 0 = not possible, see errno
+ */
+int reflink_file(char *src_filename, char *dst_filename) {
+	int fd_src, fd_dst, res, err;
+	fd_src = open(src_filename, O_RDONLY);
+	if (fd_src < 0)
+		return -1;
+	fd_dst = open(dst_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd_dst < 0) {
+		close(fd_src);
+		return -1;
+	}
+	res = ioctl(fd_dst, FICLONE, fd_src);
+	err = errno;
+	close(fd_dst);
+	close(fd_src);
+	if (res < 0) {
+		unlink(dst_filename);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
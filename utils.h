@@ -27,7 +27,15 @@
 #ifndef UTILS_H_
 #define UTILS_H_
 
+#include <stdint.h>
+#include <stddef.h>
+
 char *cur_time_text() ;
+int parse_size(char *text, int64_t *res) ;
+int64_t device_size(int fd) ;
+int64_t pread_full(int fd, void *buffer, size_t count, int64_t offset) ;
+int64_t pwrite_full(int fd, void *buffer, size_t count, int64_t offset) ;
+int reflink_file(char *src_filename, char *dst_filename) ;
 
 
 #endif /* UTILS_H_ */
@@ -0,0 +1,625 @@
+/* vdisk.c: VM disk image formats qcow2, VHD, VMDK
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+
+ Images from emulators are read without conversion to raw:
+ the allocation tables are walked once, the result is a list of
+ allocated disk ranges and their position in the file.
+ Unallocated ranges read as zeros, vdisk_pread() reads the disk
+ in disk order, as a raw file.
+ - qcow2 version 2 and 3, no backing file, no encryption, no compressed
+   clusters.
+ - VHD fixed and dynamic, no differencing disks.
+ - VMDK monolithic sparse extent ("KDMV"), not stream optimized.
+
+ A qcow2 file can also be written as a stream: clusters of zeros are
+ left out, data clusters are appended in disk order, all tables are
+ written behind the data at the end.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "error.h"
+#include "utils.h"
+#include "vdisk.h"	// own
+
+#define QCOW2_MAGIC	0x514649fb // "QFI\xfb"
+#define QCOW2_OFFSET_MASK	0x00fffffffffffe00ULL
+#define QCOW2_OFLAG_COPIED	(1ULL << 63)
+#define QCOW2_OFLAG_COMPRESSED	(1ULL << 62)
+#define QCOW2_OFLAG_ZERO	1ULL
+#define QCOW2_INCOMPAT_DIRTY	1ULL
+#define QCOW2_REFCOUNT_BYTES	2 // refcount_order 4
+
+#define VHD_TYPE_FIXED	2
+#define VHD_TYPE_DYNAMIC	3
+#define VHD_UNUSED	0xffffffff
+
+#define VMDK_MAGIC	0x564d444b // "KDMV"
+#define VMDK_GD_AT_END	0xffffffffffffffffULL
+#define VMDK_FLAG_COMPRESSED	(1 << 16)
+#define VMDK_GRAIN_ZERO	1
+
+#define SECTOR_SIZE	512
+
+static char *format_names[] = { "raw", "qcow2", "VHD", "VMDK" };
+
+char *vdisk_format_name(int format) {
+	if (format < VDISK_RAW || format > VDISK_VMDK)
+		return "?";
+	return format_names[format];
+}
+
+/* read "len" bytes of the disk at "offset" from the image file "fd":
+ * allocated ranges from their file position, zeros for the rest.
+ * result: 0 = OK, else error
+ */
+int vdisk_pread(vdisk_t *vdisk, int fd, char *buffer, int64_t len,
+		int64_t offset) {
+	fsmap_t *map = &vdisk->map;
+	int lo = 0, hi = map->count;
+
+	// first range not ending before "offset"
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (map->extents[mid].offset + map->extents[mid].size <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	while (len > 0) {
+		fsmap_extent_t *range = lo < map->count ? &map->extents[lo] : NULL;
+		int64_t n = len;
+		if (range && range->offset <= offset) {
+			int64_t file_offset = vdisk->file_offsets[lo]
+					+ (offset - range->offset);
+			if (n > range->offset + range->size - offset)
+				n = range->offset + range->size - offset;
+			if (pread_full(fd, buffer, n, file_offset) != n)
+				return error_set(ERROR_HOSTFILE,
+						"Disk image truncated, can not read %ld bytes at %ld", n,
+						file_offset);
+			lo++;
+		} else {
+			if (range && n > range->offset - offset)
+				n = range->offset - offset;
+			memset(buffer, 0, n);
+		}
+		buffer += n;
+		offset += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static uint64_t be(unsigned char *data, int bytes) {
+	uint64_t val = 0;
+	while (bytes--)
+		val = (val << 8) | *data++;
+	return val;
+}
+
+static uint64_t le(unsigned char *data, int bytes) {
+	uint64_t val = 0;
+	while (bytes--)
+		val = (val << 8) | data[bytes];
+	return val;
+}
+
+static void put_be(unsigned char *data, uint64_t val, int bytes) {
+	while (bytes--) {
+		data[bytes] = val & 0xff;
+		val >>= 8;
+	}
+}
+
+static void read_at(int fd, void *buffer, int64_t len, int64_t offset) {
+	if (pread_full(fd, buffer, len, offset) != len)
+		error("Disk image truncated, can not read %ld bytes at %ld", len,
+				offset);
+}
+
+/* a table of "len" bytes at "offset", sizes from the image header:
+ * must lie in the image file, before anything is allocated for it
+ */
+static void check_table(char *name, uint64_t offset, uint64_t len,
+		int64_t file_size) {
+	if (offset > (uint64_t) file_size || len > (uint64_t) file_size - offset)
+		error("%s beyond end of disk image", name);
+}
+
+// add a range of disk data at "file_offset", join with the previous
+static void add_range(vdisk_t *vdisk, int64_t offset, int64_t size,
+		int64_t file_offset) {
+	fsmap_t *map = &vdisk->map;
+	int n = map->count;
+
+	if (size <= 0)
+		return;
+	if (offset + size > vdisk->size)
+		size = vdisk->size - offset;
+	if (n > 0 && map->extents[n - 1].offset + map->extents[n - 1].size == offset
+			&& vdisk->file_offsets[n - 1] + map->extents[n - 1].size
+					== file_offset) {
+		map->extents[n - 1].size += size;
+		map->allocated += size;
+		return;
+	}
+	if ((n & (n - 1)) == 0) { // grow at powers of 2
+		int capacity = n ? 2 * n : 1;
+		fsmap_extent_t *extents = realloc(map->extents,
+				capacity * sizeof(fsmap_extent_t));
+		int64_t *file_offsets;
+		if (!extents)
+			error("Out of memory");
+		map->extents = extents;
+		file_offsets = realloc(vdisk->file_offsets,
+				capacity * sizeof(int64_t));
+		if (!file_offsets)
+			error("Out of memory");
+		vdisk->file_offsets = file_offsets;
+	}
+	map->extents[n].offset = offset;
+	map->extents[n].size = size;
+	vdisk->file_offsets[n] = file_offset;
+	map->count++;
+	map->allocated += size;
+}
+
+static void open_qcow2(vdisk_t *vdisk, int fd, unsigned char *header,
+		int64_t file_size) {
+	unsigned version = be(header + 4, 4);
+	unsigned cluster_bits = be(header + 20, 4);
+	unsigned l1_size = be(header + 36, 4);
+	uint64_t l1_offset = be(header + 40, 8);
+	uint64_t disk_size = be(header + 24, 8);
+	int64_t cluster_size, l2_entries, l1_span, l1_needed;
+	unsigned char *l1, *l2;
+	unsigned i, j;
+
+	if (version != 2 && version != 3)
+		error("qcow2 version %u not supported", version);
+	if (be(header + 8, 8))
+		error("qcow2 with backing file not supported");
+	if (be(header + 32, 4))
+		error("Encrypted qcow2 not supported");
+	if (version == 3 && (be(header + 72, 8) & ~QCOW2_INCOMPAT_DIRTY))
+		error("qcow2 incompatible features %llx not supported",
+				(unsigned long long) be(header + 72, 8));
+	if (cluster_bits < 9 || cluster_bits > 21)
+		error("qcow2 cluster size 2^%u not supported", cluster_bits);
+	if (disk_size > INT64_MAX)
+		error("qcow2 disk size %llu not supported",
+				(unsigned long long) disk_size);
+	vdisk->size = disk_size;
+	cluster_size = (int64_t) 1 << cluster_bits;
+	l2_entries = cluster_size / 8;
+	l1_span = l2_entries * cluster_size; // at most 2^39
+	l1_needed = vdisk->size / l1_span + (vdisk->size % l1_span != 0);
+	if (l1_needed > l1_size)
+		error("qcow2 L1 table too small");
+	l1_size = l1_needed; // entries behind the disk size are not used
+	check_table("qcow2 L1 table", l1_offset, (uint64_t) l1_size * 8,
+			file_size);
+
+	l1 = malloc((size_t) l1_size * 8);
+	if (!l1)
+		error("Out of memory");
+	error_cleanup_push(free, l1);
+	l2 = malloc(cluster_size);
+	if (!l2)
+		error("Out of memory");
+	error_cleanup_push(free, l2);
+	read_at(fd, l1, (int64_t) l1_size * 8, l1_offset);
+	for (i = 0; i < l1_size; i++) {
+		int64_t l2_offset = be(l1 + 8 * i, 8) & QCOW2_OFFSET_MASK;
+		if (!l2_offset)
+			continue; // unallocated: 0
+		read_at(fd, l2, cluster_size, l2_offset);
+		for (j = 0; j < l2_entries; j++) {
+			uint64_t entry = be(l2 + 8 * j, 8);
+			int64_t offset = ((int64_t) i * l2_entries + j) * cluster_size;
+			if (offset >= vdisk->size)
+				break;
+			if (entry & QCOW2_OFLAG_COMPRESSED)
+				error("Compressed qcow2 clusters not supported");
+			if ((entry & QCOW2_OFLAG_ZERO) || !(entry & QCOW2_OFFSET_MASK))
+				continue;
+			add_range(vdisk, offset, cluster_size, entry & QCOW2_OFFSET_MASK);
+		}
+	}
+	error_cleanup_pop(1); // l2
+	error_cleanup_pop(1); // l1
+}
+
+static void open_vhd(vdisk_t *vdisk, int fd, unsigned char *footer,
+		int64_t file_size) {
+	unsigned type = be(footer + 60, 4);
+	uint64_t disk_size = be(footer + 48, 8);
+	unsigned char header[1024];
+	unsigned char *bat, *bitmap;
+	unsigned entries, block_size, bitmap_size, i, k;
+	int64_t entries_needed;
+
+	if (disk_size > INT64_MAX)
+		error("VHD disk size %llu not supported",
+				(unsigned long long) disk_size);
+	vdisk->size = disk_size;
+	if (type == VHD_TYPE_FIXED) {
+		add_range(vdisk, 0, vdisk->size, 0);
+		return;
+	}
+	if (type != VHD_TYPE_DYNAMIC)
+		error("VHD disk type %u not supported", type);
+	read_at(fd, header, sizeof(header), be(footer + 16, 8));
+	if (memcmp(header, "cxsparse", 8))
+		error("VHD dynamic disk header not found");
+	entries = be(header + 28, 4);
+	block_size = be(header + 32, 4);
+	if (block_size < SECTOR_SIZE || block_size % SECTOR_SIZE)
+		error("VHD block size %u not supported", block_size);
+	// sector bitmap in front of each block, MSB first
+	bitmap_size = (block_size / SECTOR_SIZE + 8 * SECTOR_SIZE - 1)
+			/ (8 * SECTOR_SIZE) * SECTOR_SIZE;
+	// entries behind the disk size are not used
+	entries_needed = vdisk->size / block_size
+			+ (vdisk->size % block_size != 0);
+	if (entries > entries_needed)
+		entries = entries_needed;
+	check_table("VHD block table", be(header + 16, 8), (uint64_t) entries * 4,
+			file_size);
+	check_table("VHD block bitmap", 0, bitmap_size, file_size);
+
+	bat = malloc((size_t) entries * 4);
+	if (!bat)
+		error("Out of memory");
+	error_cleanup_push(free, bat);
+	bitmap = malloc(bitmap_size);
+	if (!bitmap)
+		error("Out of memory");
+	error_cleanup_push(free, bitmap);
+	read_at(fd, bat, (int64_t) entries * 4, be(header + 16, 8));
+	for (i = 0; i < entries; i++) {
+		unsigned sector = be(bat + 4 * i, 4);
+		int64_t block_offset = (int64_t) i * block_size;
+		int64_t data_offset = (int64_t) sector * SECTOR_SIZE + bitmap_size;
+		if (sector == VHD_UNUSED || block_offset >= vdisk->size)
+			continue;
+		read_at(fd, bitmap, bitmap_size, (int64_t) sector * SECTOR_SIZE);
+		for (k = 0; k < block_size / SECTOR_SIZE; k++)
+			if (bitmap[k / 8] & (0x80 >> (k % 8)))
+				add_range(vdisk, block_offset + (int64_t) k * SECTOR_SIZE,
+						SECTOR_SIZE, data_offset + (int64_t) k * SECTOR_SIZE);
+	}
+	error_cleanup_pop(1); // bitmap
+	error_cleanup_pop(1); // bat
+}
+
+static void open_vmdk(vdisk_t *vdisk, int fd, unsigned char *header,
+		int64_t file_size) {
+	unsigned flags = le(header + 8, 4);
+	uint64_t sectors = le(header + 12, 8);
+	uint64_t grain_sectors = le(header + 20, 8);
+	unsigned gt_entries = le(header + 44, 4);
+	uint64_t gd_offset = le(header + 56, 8);
+	int64_t grain_size, grains, gd_count, i, j;
+	unsigned char *gd, *gt;
+
+	if (gd_offset == VMDK_GD_AT_END || (flags & VMDK_FLAG_COMPRESSED)
+			|| le(header + 77, 2))
+		error("Stream optimized VMDK not supported");
+	if (sectors > INT64_MAX / SECTOR_SIZE)
+		error("VMDK disk size %llu sectors not supported",
+				(unsigned long long) sectors);
+	if (grain_sectors < 1 || grain_sectors > INT64_MAX / SECTOR_SIZE
+			|| gt_entries == 0)
+		error("VMDK grain table format not supported");
+	vdisk->size = sectors * SECTOR_SIZE;
+	grain_size = grain_sectors * SECTOR_SIZE;
+	grains = vdisk->size / grain_size + (vdisk->size % grain_size != 0);
+	gd_count = grains / gt_entries + (grains % gt_entries != 0);
+	if (gd_offset > (uint64_t) file_size / SECTOR_SIZE)
+		error("VMDK grain directory beyond end of disk image");
+	check_table("VMDK grain directory", gd_offset * SECTOR_SIZE,
+			(uint64_t) gd_count * 4, file_size);
+	check_table("VMDK grain table", 0, (uint64_t) gt_entries * 4, file_size);
+
+	gd = malloc(gd_count * 4);
+	if (!gd)
+		error("Out of memory");
+	error_cleanup_push(free, gd);
+	gt = malloc((size_t) gt_entries * 4);
+	if (!gt)
+		error("Out of memory");
+	error_cleanup_push(free, gt);
+	read_at(fd, gd, gd_count * 4, gd_offset * SECTOR_SIZE);
+	for (i = 0; i < gd_count; i++) {
+		int64_t gt_sector = le(gd + 4 * i, 4);
+		if (!gt_sector)
+			continue;
+		read_at(fd, gt, (int64_t) gt_entries * 4, gt_sector * SECTOR_SIZE);
+		for (j = 0; j < gt_entries && i * gt_entries + j < grains; j++) {
+			int64_t grain_sector = le(gt + 4 * j, 4);
+			if (grain_sector == 0 || grain_sector == VMDK_GRAIN_ZERO)
+				continue;
+			add_range(vdisk, (i * gt_entries + j) * grain_size, grain_size,
+					grain_sector * SECTOR_SIZE);
+		}
+	}
+	error_cleanup_pop(1); // gt
+	error_cleanup_pop(1); // gd
+}
+
+static void cleanup_vdisk(void *arg) {
+	vdisk_free(arg);
+}
+
+/* detect the format of an image file and read its allocation.
+ * A file of no known format is VDISK_RAW, completely allocated.
+ * Unsupported variants of a known format are an error.
+ * Free with vdisk_free().
+ */
+void vdisk_open(vdisk_t *vdisk, int fd) {
+	unsigned char header[SECTOR_SIZE], footer[SECTOR_SIZE];
+	struct stat st;
+
+	memset(vdisk, 0, sizeof(*vdisk));
+	error_cleanup_push(cleanup_vdisk, vdisk); // ranges read so far
+	if (fstat(fd, &st))
+		error("Can not stat image file");
+	memset(header, 0, sizeof(header));
+	memset(footer, 0, sizeof(footer));
+	if (pread_full(fd, header, sizeof(header), 0) < 0)
+		error("Can not read image file");
+	if (st.st_size >= SECTOR_SIZE
+			&& pread_full(fd, footer, sizeof(footer), st.st_size - SECTOR_SIZE)
+					< 0)
+		error("Can not read image file");
+	vdisk->map.type = FSMAP_NONE;
+	if (be(header, 4) == QCOW2_MAGIC) {
+		vdisk->format = VDISK_QCOW2;
+		open_qcow2(vdisk, fd, header, st.st_size);
+	} else if (!memcmp(footer, "conectix", 8)) {
+		vdisk->format = VDISK_VHD;
+		open_vhd(vdisk, fd, footer, st.st_size);
+	} else if (le(header, 4) == VMDK_MAGIC) {
+		vdisk->format = VDISK_VMDK;
+		open_vmdk(vdisk, fd, header, st.st_size);
+	} else if (!memcmp(header, "# Disk DescriptorFile", 21))
+		error("VMDK descriptor file: use its extent file instead");
+	else {
+		vdisk->format = VDISK_RAW;
+		vdisk->size = st.st_size;
+		add_range(vdisk, 0, st.st_size, 0);
+	}
+	error_cleanup_pop(0);
+}
+
+void vdisk_free(vdisk_t *vdisk) {
+	fsmap_free(&vdisk->map);
+	free(vdisk->file_offsets);
+	vdisk->file_offsets = NULL;
+}
+
+/*** qcow2 writer ***/
+
+#define QCOW2_CLUSTER_SIZE	((int64_t) 1 << VDISK_QCOW2_CLUSTER_BITS)
+
+static void write_at(vdisk_qcow2_writer_t *writer, void *data, int64_t len,
+		int64_t offset) {
+	if (!writer->error && pwrite_full(writer->fd, data, len, offset) < 0)
+		writer->error = errno; // reported by vdisk_qcow2_end()
+}
+
+static int is_zero(char *data, int64_t len) {
+	return !data[0] && !memcmp(data, data + 1, len - 1);
+}
+
+void vdisk_qcow2_begin(vdisk_qcow2_writer_t *writer, int fd) {
+	memset(writer, 0, sizeof(*writer));
+	writer->fd = fd;
+	writer->next_cluster = 1; // 0 is the header
+	writer->partial = malloc(QCOW2_CLUSTER_SIZE);
+	if (!writer->partial)
+		fatal("Out of memory");
+}
+
+// whole clusters: zero clusters are skipped, runs of data written at once
+static void put_clusters(vdisk_qcow2_writer_t *writer, char *data,
+		int64_t count) {
+	int64_t first = writer->position / QCOW2_CLUSTER_SIZE;
+	int64_t i, run_start = -1;
+
+	if (first + count > writer->l2_capacity) {
+		int64_t capacity = 2 * (first + count);
+		writer->l2 = realloc(writer->l2, capacity * sizeof(uint64_t));
+		if (!writer->l2)
+			fatal("Out of memory");
+		memset(writer->l2 + writer->l2_capacity, 0,
+				(capacity - writer->l2_capacity) * sizeof(uint64_t));
+		writer->l2_capacity = capacity;
+	}
+	for (i = 0; i <= count; i++) {
+		char *cluster = data + i * QCOW2_CLUSTER_SIZE;
+		int data_cluster = i < count && !is_zero(cluster, QCOW2_CLUSTER_SIZE);
+		if (data_cluster) {
+			if (run_start < 0)
+				run_start = i;
+			writer->l2[first + i] = writer->next_cluster * QCOW2_CLUSTER_SIZE
+					+ (i - run_start) * QCOW2_CLUSTER_SIZE;
+		} else if (run_start >= 0) {
+			write_at(writer, data + run_start * QCOW2_CLUSTER_SIZE,
+					(i - run_start) * QCOW2_CLUSTER_SIZE,
+					writer->next_cluster * QCOW2_CLUSTER_SIZE);
+			writer->next_cluster += i - run_start;
+			run_start = -1;
+		}
+	}
+	writer->position += count * QCOW2_CLUSTER_SIZE;
+}
+
+// append disk data
+void vdisk_qcow2_write(vdisk_qcow2_writer_t *writer, char *data, int64_t len) {
+	while (len > 0) {
+		int64_t n;
+		if (writer->partial_len > 0 || len < QCOW2_CLUSTER_SIZE) {
+			n = QCOW2_CLUSTER_SIZE - writer->partial_len;
+			if (n > len)
+				n = len;
+			memcpy(writer->partial + writer->partial_len, data, n);
+			writer->partial_len += n;
+			if (writer->partial_len == QCOW2_CLUSTER_SIZE) {
+				put_clusters(writer, writer->partial, 1);
+				writer->partial_len = 0;
+			}
+		} else {
+			n = len / QCOW2_CLUSTER_SIZE * QCOW2_CLUSTER_SIZE;
+			put_clusters(writer, data, n / QCOW2_CLUSTER_SIZE);
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+/* write tables and header for a disk of "size" bytes, and free the writer.
+ * Layout: header, data clusters, L2 tables, L1 table, refcount table,
+ * refcount blocks. All clusters have refcount 1.
+ * result: 0 = OK, else error of any write
+ */
+int vdisk_qcow2_end(vdisk_qcow2_writer_t *writer, int64_t size) {
+	int64_t l2_entries = QCOW2_CLUSTER_SIZE / 8;
+	int64_t refcounts_per_block = QCOW2_CLUSTER_SIZE / QCOW2_REFCOUNT_BYTES;
+	int64_t clusters, l2_tables, l1_start, l1_clusters;
+	int64_t rt_start, rt_clusters = 0, rb_start, rb_clusters = 0;
+	int64_t total, i, t;
+	unsigned char *table, *l1;
+
+	if (writer->partial_len > 0) {
+		memset(writer->partial + writer->partial_len, 0,
+				QCOW2_CLUSTER_SIZE - writer->partial_len);
+		put_clusters(writer, writer->partial, 1);
+		writer->partial_len = 0;
+	}
+	clusters = (size + QCOW2_CLUSTER_SIZE - 1) / QCOW2_CLUSTER_SIZE;
+	if (clusters > writer->l2_capacity) // zeros at the end
+		clusters = writer->l2_capacity;
+	l2_tables = (size + QCOW2_CLUSTER_SIZE * l2_entries - 1)
+			/ (QCOW2_CLUSTER_SIZE * l2_entries);
+	table = calloc(1, QCOW2_CLUSTER_SIZE);
+	l1_clusters = (l2_tables * 8 + QCOW2_CLUSTER_SIZE - 1) / QCOW2_CLUSTER_SIZE;
+	if (l1_clusters < 1)
+		l1_clusters = 1;
+	l1 = calloc(l1_clusters, QCOW2_CLUSTER_SIZE);
+	if (!table || !l1)
+		fatal("Out of memory");
+
+	// L2 tables, only for ranges with data
+	for (t = 0; t < l2_tables; t++) {
+		int used = 0;
+		memset(table, 0, QCOW2_CLUSTER_SIZE);
+		for (i = 0; i < l2_entries && t * l2_entries + i < clusters; i++)
+			if (writer->l2[t * l2_entries + i]) {
+				put_be(table + 8 * i,
+						writer->l2[t * l2_entries + i] | QCOW2_OFLAG_COPIED, 8);
+				used = 1;
+			}
+		if (!used)
+			continue;
+		put_be(l1 + 8 * t,
+				(writer->next_cluster * QCOW2_CLUSTER_SIZE) | QCOW2_OFLAG_COPIED,
+				8);
+		write_at(writer, table, QCOW2_CLUSTER_SIZE,
+				writer->next_cluster * QCOW2_CLUSTER_SIZE);
+		writer->next_cluster++;
+	}
+	l1_start = writer->next_cluster;
+	write_at(writer, l1, l1_clusters * QCOW2_CLUSTER_SIZE,
+			l1_start * QCOW2_CLUSTER_SIZE);
+
+	// refcount structures must count themselves
+	rt_start = l1_start + l1_clusters;
+	do {
+		int64_t blocks, table_clusters;
+		total = rt_start + rt_clusters + rb_clusters;
+		blocks = (total + refcounts_per_block - 1) / refcounts_per_block;
+		table_clusters = (blocks * 8 + QCOW2_CLUSTER_SIZE - 1)
+				/ QCOW2_CLUSTER_SIZE;
+		if (blocks == rb_clusters && table_clusters == rt_clusters)
+			break;
+		rb_clusters = blocks;
+		rt_clusters = table_clusters;
+	} while (1);
+	rb_start = rt_start + rt_clusters;
+	for (t = 0; t < rt_clusters; t++) {
+		memset(table, 0, QCOW2_CLUSTER_SIZE);
+		for (i = 0; i < l2_entries && t * l2_entries + i < rb_clusters; i++)
+			put_be(table + 8 * i,
+					(rb_start + t * l2_entries + i) * QCOW2_CLUSTER_SIZE, 8);
+		write_at(writer, table, QCOW2_CLUSTER_SIZE,
+				(rt_start + t) * QCOW2_CLUSTER_SIZE);
+	}
+	for (t = 0; t < rb_clusters; t++) {
+		memset(table, 0, QCOW2_CLUSTER_SIZE);
+		for (i = 0; i < refcounts_per_block
+						&& t * refcounts_per_block + i < total; i++)
+			put_be(table + QCOW2_REFCOUNT_BYTES * i, 1, QCOW2_REFCOUNT_BYTES);
+		write_at(writer, table, QCOW2_CLUSTER_SIZE,
+				(rb_start + t) * QCOW2_CLUSTER_SIZE);
+	}
+
+	// version 2 header
+	memset(table, 0, QCOW2_CLUSTER_SIZE);
+	put_be(table, QCOW2_MAGIC, 4);
+	put_be(table + 4, 2, 4);
+	put_be(table + 20, VDISK_QCOW2_CLUSTER_BITS, 4);
+	put_be(table + 24, size, 8);
+	put_be(table + 36, l2_tables, 4); // l1_size
+	put_be(table + 40, l1_start * QCOW2_CLUSTER_SIZE, 8);
+	put_be(table + 48, rt_start * QCOW2_CLUSTER_SIZE, 8);
+	put_be(table + 56, rt_clusters, 4);
+	write_at(writer, table, QCOW2_CLUSTER_SIZE, 0);
+	if (!writer->error && ftruncate(writer->fd, total * QCOW2_CLUSTER_SIZE) < 0)
+		writer->error = errno;
+
+	free(table);
+	free(l1);
+	vdisk_qcow2_free(writer);
+	if (writer->error)
+		return error_set(ERROR_HOSTFILE, "qcow2 write failed, errno = %d",
+				writer->error);
+	return 0;
+}
+
+// release buffers, also of an unfinished file
+void vdisk_qcow2_free(vdisk_qcow2_writer_t *writer) {
+	free(writer->l2);
+	free(writer->partial);
+	writer->l2 = NULL;
+	writer->partial = NULL;
+}
@@ -0,0 +1,73 @@
+/* vdisk.h: VM disk image formats qcow2, VHD, VMDK
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+ */
+
+#ifndef VDISK_H_
+#define VDISK_H_
+
+#include <stdint.h>
+
+#include "fsmap.h"
+
+// formats
+#define VDISK_RAW	0	// no container: file offset = disk offset
+#define VDISK_QCOW2	1
+#define VDISK_VHD	2	// fixed or dynamic
+#define VDISK_VMDK	3	// monolithic sparse extent
+
+// cluster size of written qcow2 files
+#define VDISK_QCOW2_CLUSTER_BITS	16
+
+// a disk image file, with allocation read from its tables
+typedef struct {
+	int format;
+	int64_t size; // virtual disk size
+	fsmap_t map; // allocated ranges of the disk, ascending. Others are zero.
+	int64_t *file_offsets; // file position of each range
+} vdisk_t;
+
+// qcow2 file written as a stream
+typedef struct {
+	int fd;
+	int64_t position; // disk bytes received
+	int64_t next_cluster; // next free cluster in file
+	uint64_t *l2; // file offset of each disk cluster, 0 = zero
+	int64_t l2_capacity;
+	char *partial; // incomplete cluster
+	int64_t partial_len;
+	int error; // errno of first failed write, 0 = OK
+} vdisk_qcow2_writer_t;
+
+char *vdisk_format_name(int format);
+void vdisk_open(vdisk_t *vdisk, int fd);
+void vdisk_free(vdisk_t *vdisk);
+int vdisk_pread(vdisk_t *vdisk, int fd, char *buffer, int64_t len,
+		int64_t offset);
+
+void vdisk_qcow2_begin(vdisk_qcow2_writer_t *writer, int fd);
+void vdisk_qcow2_write(vdisk_qcow2_writer_t *writer, char *data, int64_t len);
+int vdisk_qcow2_end(vdisk_qcow2_writer_t *writer, int64_t size);
+void vdisk_qcow2_free(vdisk_qcow2_writer_t *writer);
+
+#endif /* VDISK_H_ */
@@ -0,0 +1,118 @@
+/* wbehind.c: bounded write-behind with sync_file_range()
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+
+ Buffered writes pile up dirty pages, until the kernel writes them
+ back in one long stall, usually at close(). Progress then shows 100%
+ long before the data is on the card.
+ Write-behind starts writeback for each written chunk at once, and
+ waits for the oldest chunks when more than "window" bytes are not yet
+ durable. So only a window of dirty data is in flight, host memory use
+ stays flat, and durable progress can be reported.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "error.h"
+#include "cache.h"
+#include "wbehind.h"	// own
+
+#define SFR_WAIT_ALL	(SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE \
+		| SYNC_FILE_RANGE_WAIT_AFTER)
+
+/* start write-behind for a range beginning at "offset".
+ * window = 0: disabled, writes are left to the kernel.
+ */
+void wbehind_init(wbehind_t *wb, int fd, int64_t offset, int64_t window,
+		int drop_cache) {
+	wb->fd = window > 0 ? fd : -1;
+	wb->window = window;
+	wb->written_until = offset;
+	wb->flushing_until = offset;
+	wb->durable_until = offset;
+	wb->drop_cache = drop_cache;
+}
+
+// wait until all data up to "pos" is on the device
+static int wait_durable(wbehind_t *wb, int64_t pos) {
+	int64_t len = pos - wb->durable_until;
+	if (len <= 0)
+		return 0;
+	if (sync_file_range(wb->fd, wb->durable_until, len, SFR_WAIT_ALL) < 0)
+		return error_set(ERROR_HOSTFILE, "sync_file_range failed, errno = %d",
+				errno);
+	if (wb->drop_cache) {
+		posix_fadvise(wb->fd, wb->durable_until, len, POSIX_FADV_DONTNEED);
+		__atomic_add_fetch(&cache_pages_dropped,
+				(len + sysconf(_SC_PAGESIZE) - 1) / sysconf(_SC_PAGESIZE),
+				__ATOMIC_RELAXED);
+	}
+	wb->durable_until = pos;
+	return 0;
+}
+
+/* data up to "pos" has been written.
+ * Start its writeback, and wait for old data outside the window.
+ * result: 0 = OK, else error
+ */
+int wbehind_advance(wbehind_t *wb, int64_t pos) {
+	if (pos <= wb->written_until)
+		return 0;
+	wb->written_until = pos;
+	if (wb->fd < 0)
+		return 0;
+	// start asynchronous writeback of the new chunk
+	if (sync_file_range(wb->fd, wb->flushing_until, pos - wb->flushing_until,
+			SYNC_FILE_RANGE_WRITE) < 0)
+		return error_set(ERROR_HOSTFILE, "sync_file_range failed, errno = %d",
+				errno);
+	wb->flushing_until = pos;
+	// bound dirty data: wait for the oldest
+	if (pos - wb->durable_until > wb->window)
+		return wait_durable(wb, pos - wb->window);
+	return 0;
+}
+
+// all written data is durable: flush the rest and the device cache.
+int wbehind_finish(wbehind_t *wb) {
+	if (wb->fd < 0)
+		return 0;
+	if (wait_durable(wb, wb->written_until))
+		return error_code;
+	if (fdatasync(wb->fd) < 0)
+		return error_set(ERROR_HOSTFILE, "fdatasync failed, errno = %d", errno);
+	return 0;
+}
+
+// position up to which data is on the device
+int64_t wbehind_durable(wbehind_t *wb) {
+	if (wb->fd < 0)
+		return wb->written_until; // not tracked: kernel decides
+	return wb->durable_until;
+}
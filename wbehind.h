@@ -0,0 +1,49 @@
+/* wbehind.h: bounded write-behind with sync_file_range()
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+ */
+
+#ifndef WBEHIND_H_
+#define WBEHIND_H_
+
+#include <stdint.h>
+
+#define WBEHIND_DEFAULT_WINDOW	(32 * 1024 * 1024)
+
+// write-behind state for writing one file range sequentially
+typedef struct {
+	int fd; // < 0: disabled, only written_until is tracked
+	int64_t window; // max bytes not yet durable
+	int64_t written_until; // data handed to the kernel up to here
+	int64_t flushing_until; // writeback started up to here
+	int64_t durable_until; // writeback completed up to here
+	int drop_cache; // drop durable pages from page cache
+} wbehind_t;
+
+void wbehind_init(wbehind_t *wb, int fd, int64_t offset, int64_t window,
+		int drop_cache);
+int wbehind_advance(wbehind_t *wb, int64_t pos);
+int wbehind_finish(wbehind_t *wb);
+int64_t wbehind_durable(wbehind_t *wb);
+
+#endif /* WBEHIND_H_ */
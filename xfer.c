@@ -0,0 +1,469 @@
+/* xfer.c: transfer engine for SDcard partitions
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+
+ A job copies or compares the range [offset, offset+size) of two files.
+ The range can be split into stripes, each stripe is processed by its
+ own thread with pread()/pwrite(), so no file position is shared.
+ This saturates fast devices (NVMe card images, UHS-II readers), where a
+ single stream can not.
+ Each stripe has its own progress and verify result, the starting
+ thread sums them up.
+ In update mode, dst is compared with src and only changed blocks are
+ rewritten. So unchanged extents of a reflinked (CoW) image file stay
+ shared, and no host writes are wasted.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "utils.h"
+#include "bufpool.h"
+#include "align.h"
+#include "cache.h"
+#include "wbehind.h"
+#include "xfer.h"	// own
+
+#define PROGRESS_INTERVAL_MS	200
+
+void xfer_job_init(xfer_job_t *job, int mode, int fd_src, int64_t src_offset,
+		int fd_dst, int64_t dst_offset, int64_t size) {
+	memset(job, 0, sizeof(*job));
+	job->mode = mode;
+	job->fd_src = fd_src;
+	job->src_offset = src_offset;
+	job->fd_dst = fd_dst;
+	job->dst_offset = dst_offset;
+	job->size = size;
+	job->au_size = ALIGN_DEFAULT_AU_SIZE;
+	job->au_merge = 1;
+	job->cache_policy = CACHE_POLICY_AUTO;
+	job->dirty_window = WBEHIND_DEFAULT_WINDOW;
+	job->fd_verify = -1;
+	job->verify_lag = 4;
+	job->stripe_count = 1;
+	job->mismatch_offset = -1;
+}
+
+// result: job canceled
+static int stripe_progress(void *context, int64_t done, int64_t total) {
+	xfer_stripe_t *stripe = context;
+	(void) total;
+	__atomic_store_n(&stripe->done, done, __ATOMIC_RELAXED);
+	return __atomic_load_n(&stripe->job->canceled, __ATOMIC_RELAXED);
+}
+
+static int stripe_copy(xfer_stripe_t *stripe) {
+	xfer_job_t *job = stripe->job;
+	// the tee keeps buffers in its ring
+	size_t buffer_size = bufpool_fit(XFER_CHUNK_SIZE,
+			(job->transform ? 2 : 1) * job->stripe_count
+					+ (job->tee ? TEE_RING_SIZE : 0));
+	char *buffer = bufpool_get(buffer_size);
+	char *scratch = job->transform ? bufpool_get(buffer_size) : NULL;
+	cache_stream_t src_cache;
+	wbehind_t dst_wb;
+	int64_t pos = 0;
+	int res = 0;
+
+	cache_stream_init(&src_cache, job->fd_src,
+			job->src_offset + stripe->offset, stripe->size,
+			job->cache_policy);
+	// image offsets of a transform are no file positions
+	wbehind_init(&dst_wb, job->fd_dst, job->dst_offset + stripe->offset,
+			job->transform || job->fd_dst < 0 ? 0 : job->dirty_window,
+			job->cache_policy == CACHE_POLICY_DROP);
+	while (!res && pos < stripe->size) {
+		int64_t len = stripe->size - pos;
+		int64_t offset = stripe->offset + pos;
+		if (len > (int64_t) buffer_size)
+			len = buffer_size;
+		if (pread_full(job->fd_src, buffer, len, job->src_offset + offset) < 0)
+			res = error_set(ERROR_HOSTFILE, "Read failed at %ld, errno = %d",
+					job->src_offset + offset, errno);
+		else if (job->transform)
+			res = transform_write(job->transform, job->fd_dst, buffer, len,
+					job->dst_offset + offset, scratch);
+		else if (job->fd_dst >= 0 && pwrite_full(job->fd_dst, buffer, len,
+				job->dst_offset + offset) < 0)
+			res = error_set(ERROR_HOSTFILE, "Write failed at %ld, errno = %d",
+					job->dst_offset + offset, errno);
+		if (!res && job->tee)
+			buffer = tee_put(job->tee, job->tee_position + offset, buffer,
+					buffer, len, buffer_size);
+		pos += len;
+		if (!res)
+			res = wbehind_advance(&dst_wb, job->dst_offset + stripe->offset + pos);
+		cache_stream_advance(&src_cache, job->src_offset + stripe->offset + pos);
+		if (stripe_progress(stripe,
+				wbehind_durable(&dst_wb) - job->dst_offset - stripe->offset,
+				stripe->size) && !res)
+			res = error_set(ERROR_CANCELED, "Transfer canceled");
+	}
+	if (!res)
+		res = wbehind_finish(&dst_wb);
+	stripe_progress(stripe, pos, stripe->size);
+	cache_stream_finish(&src_cache);
+	bufpool_put(buffer);
+	bufpool_put(scratch);
+	return res;
+}
+
+static int stripe_verify(xfer_stripe_t *stripe) {
+	xfer_job_t *job = stripe->job;
+	size_t buffer_size = bufpool_fit(XFER_CHUNK_SIZE,
+			(job->transform ? 3 : 2) * job->stripe_count
+					+ (job->tee ? TEE_RING_SIZE : 0));
+	char *buffer_src = bufpool_get(buffer_size);
+	char *buffer_dst = bufpool_get(buffer_size);
+	char *scratch = job->transform ? bufpool_get(buffer_size) : NULL;
+	cache_stream_t src_cache, dst_cache;
+	int64_t pos = 0;
+	int res = 0;
+
+	// both sides are only read
+	cache_stream_init(&src_cache, job->fd_src,
+			job->src_offset + stripe->offset, stripe->size,
+			job->transform || job->vdisk || job->fd_src < 0 ?
+					CACHE_POLICY_KEEP : job->cache_policy);
+	cache_stream_init(&dst_cache, job->fd_dst,
+			job->dst_offset + stripe->offset, stripe->size,
+			job->cache_policy);
+	while (!res && pos < stripe->size) {
+		int64_t len = stripe->size - pos;
+		int64_t offset = stripe->offset + pos;
+		if (len > (int64_t) buffer_size)
+			len = buffer_size;
+		if (job->fd_src < 0)
+			memset(buffer_src, 0, len);
+		else if (job->transform)
+			res = transform_read(job->transform, job->fd_src, buffer_src, len,
+					job->src_offset + offset, scratch);
+		else if (job->vdisk)
+			res = vdisk_pread(job->vdisk, job->fd_src, buffer_src, len,
+					job->src_offset + offset);
+		else if (pread_full(job->fd_src, buffer_src, len,
+				job->src_offset + offset) < 0)
+			res = error_set(ERROR_HOSTFILE, "Read failed at %ld, errno = %d",
+					job->src_offset + offset, errno);
+		if (res)
+			break;
+		if (pread_full(job->fd_dst, buffer_dst, len,
+				job->dst_offset + offset) < 0)
+			res = error_set(ERROR_HOSTFILE, "Read failed at %ld, errno = %d",
+					job->dst_offset + offset, errno);
+		else if (memcmp(buffer_src, buffer_dst, len)) {
+			stripe->mismatch_offset = offset;
+			stripe->mismatch_size = len;
+			break; // rest of stripe is not of interest
+		}
+		if (job->tee)
+			buffer_src = tee_put(job->tee, job->tee_position + offset,
+					buffer_src, buffer_src, len, buffer_size);
+		pos += len;
+		cache_stream_advance(&src_cache, job->src_offset + stripe->offset + pos);
+		cache_stream_advance(&dst_cache, job->dst_offset + stripe->offset + pos);
+		if (stripe_progress(stripe, pos, stripe->size) && !res)
+			res = error_set(ERROR_CANCELED, "Transfer canceled");
+	}
+	cache_stream_finish(&src_cache);
+	cache_stream_finish(&dst_cache);
+	bufpool_put(buffer_src);
+	bufpool_put(buffer_dst);
+	bufpool_put(scratch);
+	return res;
+}
+
+// write the changed blocks of a chunk. result: 0 = OK, else error
+static int update_chunk(xfer_stripe_t *stripe, char *new_data, char *old_data,
+		int64_t len, int64_t dst_pos) {
+	xfer_job_t *job = stripe->job;
+	int64_t pos = 0;
+
+	while (pos < len) {
+		int64_t start, end;
+		// skip equal blocks
+		while (pos < len
+				&& !memcmp(new_data + pos, old_data + pos,
+						len - pos < XFER_UPDATE_BLOCK_SIZE ?
+								len - pos : XFER_UPDATE_BLOCK_SIZE))
+			pos += XFER_UPDATE_BLOCK_SIZE;
+		if (pos >= len)
+			break;
+		// collect adjacent changed blocks into one write
+		start = pos;
+		while (pos < len
+				&& memcmp(new_data + pos, old_data + pos,
+						len - pos < XFER_UPDATE_BLOCK_SIZE ?
+								len - pos : XFER_UPDATE_BLOCK_SIZE))
+			pos += XFER_UPDATE_BLOCK_SIZE;
+		end = pos < len ? pos : len;
+		if (pwrite_full(job->fd_dst, new_data + start, end - start,
+				dst_pos + start) < 0)
+			return error_set(ERROR_HOSTFILE, "Write failed at %ld, errno = %d",
+					dst_pos + start, errno);
+		stripe->changed += end - start;
+	}
+	return 0;
+}
+
+static int stripe_update(xfer_stripe_t *stripe) {
+	xfer_job_t *job = stripe->job;
+	size_t buffer_size = bufpool_fit(XFER_CHUNK_SIZE,
+			2 * job->stripe_count + (job->tee ? TEE_RING_SIZE : 0));
+	char *buffer_src = bufpool_get(buffer_size);
+	char *buffer_dst = bufpool_get(buffer_size);
+	cache_stream_t src_cache, dst_cache;
+	wbehind_t dst_wb;
+	int64_t pos = 0;
+	int res = 0;
+
+	cache_stream_init(&src_cache, job->fd_src,
+			job->src_offset + stripe->offset, stripe->size,
+			job->cache_policy);
+	cache_stream_init(&dst_cache, job->fd_dst,
+			job->dst_offset + stripe->offset, stripe->size,
+			job->cache_policy);
+	wbehind_init(&dst_wb, job->fd_dst, job->dst_offset + stripe->offset,
+			job->dirty_window, 0);
+	while (!res && pos < stripe->size) {
+		int64_t len = stripe->size - pos;
+		int64_t offset = stripe->offset + pos;
+		if (len > (int64_t) buffer_size)
+			len = buffer_size;
+		if (pread_full(job->fd_src, buffer_src, len, job->src_offset + offset)
+				< 0)
+			res = error_set(ERROR_HOSTFILE, "Read failed at %ld, errno = %d",
+					job->src_offset + offset, errno);
+		else if (pread_full(job->fd_dst, buffer_dst, len,
+				job->dst_offset + offset) < 0)
+			res = error_set(ERROR_HOSTFILE, "Read failed at %ld, errno = %d",
+					job->dst_offset + offset, errno);
+		else
+			res = update_chunk(stripe, buffer_src, buffer_dst, len,
+					job->dst_offset + offset);
+		if (!res && job->tee)
+			buffer_src = tee_put(job->tee, job->tee_position + offset,
+					buffer_src, buffer_src, len, buffer_size);
+		pos += len;
+		if (!res)
+			res = wbehind_advance(&dst_wb, job->dst_offset + stripe->offset + pos);
+		cache_stream_advance(&src_cache, job->src_offset + stripe->offset + pos);
+		cache_stream_advance(&dst_cache, job->dst_offset + stripe->offset + pos);
+		if (stripe_progress(stripe, pos, stripe->size) && !res)
+			res = error_set(ERROR_CANCELED, "Transfer canceled");
+	}
+	if (!res)
+		res = wbehind_finish(&dst_wb);
+	cache_stream_finish(&src_cache);
+	cache_stream_finish(&dst_cache);
+	bufpool_put(buffer_src);
+	bufpool_put(buffer_dst);
+	return res;
+}
+
+static void *stripe_thread(void *arg) {
+	xfer_stripe_t *stripe = arg;
+	xfer_job_t *job = stripe->job;
+	error_catch_t catch;
+
+	if (job->catching) {
+		error_catch_begin(&catch);
+		if (setjmp(catch.env)) {
+			stripe->result = catch.code;
+			goto done;
+		}
+	}
+	switch (job->mode) {
+	case XFER_MODE_WRITE:
+	case XFER_MODE_WRITE_VERIFY: {
+		align_write_params_t params;
+		params.au_size = job->au_size;
+		params.merge = job->au_merge;
+		params.cache_policy = job->cache_policy;
+		params.dirty_window = job->dirty_window;
+		params.buffer_share = job->stripe_count;
+		params.transform = job->transform;
+		params.vdisk = job->vdisk;
+		params.read = job->read;
+		params.read_context = job->read_context;
+		params.tee = job->tee;
+		params.tee_position = job->tee_position + stripe->offset;
+		params.fd_verify =
+				job->mode == XFER_MODE_WRITE_VERIFY ? job->fd_verify : -1;
+		params.verify_lag = job->verify_lag;
+		stripe->result = align_write(job->fd_dst,
+				job->dst_offset + stripe->offset, job->fd_src,
+				job->src_offset + stripe->offset, stripe->size, &params,
+				stripe_progress, stripe);
+		if (params.mismatch_offset >= 0) {
+			// relative to job, a merged head may start before
+			stripe->mismatch_offset = params.mismatch_offset - job->dst_offset;
+			stripe->mismatch_size = params.mismatch_size;
+			if (stripe->mismatch_offset < 0) {
+				stripe->mismatch_size += stripe->mismatch_offset;
+				stripe->mismatch_offset = 0;
+			}
+		}
+		break;
+	}
+	case XFER_MODE_VERIFY:
+		stripe->result = stripe_verify(stripe);
+		break;
+	case XFER_MODE_UPDATE:
+		stripe->result = stripe_update(stripe);
+		break;
+	default:
+		stripe->result = stripe_copy(stripe);
+	}
+done:
+	if (job->catching) {
+		strcpy(stripe->error_text, catch.text);
+		error_catch_end(&catch);
+	}
+	pthread_mutex_lock(&job->mutex);
+	job->running_count--;
+	pthread_cond_signal(&job->stripe_finished);
+	pthread_mutex_unlock(&job->mutex);
+	return NULL;
+}
+
+/* split the job range into stripes.
+ * Boundaries are aligned on the card side: on the AU for writes,
+ * else on XFER_STRIPE_ALIGNMENT.
+ */
+static void split_stripes(xfer_job_t *job) {
+	int64_t alignment = XFER_STRIPE_ALIGNMENT;
+	int64_t base = job->src_offset; // absolute card offset of range start
+	int64_t prev = 0;
+	unsigned i, n = 0;
+
+	if (job->mode != XFER_MODE_COPY)
+		base = job->dst_offset;
+	if ((job->mode == XFER_MODE_WRITE || job->mode == XFER_MODE_WRITE_VERIFY)
+			&& job->au_size > alignment)
+		alignment = job->au_size;
+	for (i = 1; i <= job->stripe_count; i++) {
+		int64_t end = job->size;
+		if (i < job->stripe_count) {
+			end = base + job->size / job->stripe_count * i;
+			end = end / alignment * alignment - base;
+			if (end <= prev || end >= job->size)
+				continue; // range too small for that many stripes
+		}
+		job->stripes[n].job = job;
+		job->stripes[n].offset = prev;
+		job->stripes[n].size = end - prev;
+		job->stripes[n].mismatch_offset = -1;
+		n++;
+		prev = end;
+	}
+	job->stripe_count = n;
+}
+
+static int64_t sum_progress(xfer_job_t *job) {
+	int64_t done = 0;
+	unsigned i;
+	for (i = 0; i < job->stripe_count; i++)
+		done += __atomic_load_n(&job->stripes[i].done, __ATOMIC_RELAXED);
+	return done;
+}
+
+/* execute a job, returns when all stripes are finished
+ * progress: called periodically, may be NULL
+ * result: 0 = OK, else error. A verify mismatch is no error,
+ * 	see job->mismatch_offset.
+ */
+int xfer_run(xfer_job_t *job, xfer_progress_func_t progress) {
+	unsigned i;
+	int res = 0;
+
+	if (job->stripe_count < 1)
+		job->stripe_count = 1;
+	if (job->stripe_count > XFER_MAX_STRIPES)
+		job->stripe_count = XFER_MAX_STRIPES;
+	if (job->tee || job->read) // stream in order, one read context
+		job->stripe_count = 1;
+	split_stripes(job);
+	job->mismatch_offset = -1;
+	job->changed = 0;
+	job->catching = error_catching();
+	// "auto" is decided on the whole job, not on the stripe size
+	job->cache_policy =
+			cache_policy_active(job->cache_policy, job->size) ?
+					CACHE_POLICY_DROP : CACHE_POLICY_KEEP;
+	if (job->size <= 0)
+		return 0;
+
+	pthread_mutex_init(&job->mutex, NULL);
+	pthread_cond_init(&job->stripe_finished, NULL);
+	job->running_count = job->stripe_count;
+	for (i = 0; i < job->stripe_count; i++)
+		if (pthread_create(&job->stripes[i].thread, NULL, stripe_thread,
+				&job->stripes[i]))
+			fatal("Can not start transfer thread");
+
+	// report progress until all stripes are done
+	pthread_mutex_lock(&job->mutex);
+	while (job->running_count > 0) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += PROGRESS_INTERVAL_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&job->stripe_finished, &job->mutex, &ts);
+		if (progress && progress(sum_progress(job), job->size))
+			__atomic_store_n(&job->canceled, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&job->mutex);
+
+	for (i = 0; i < job->stripe_count; i++) {
+		xfer_stripe_t *stripe = &job->stripes[i];
+		pthread_join(stripe->thread, NULL);
+		if (stripe->result && !res)
+			res = job->catching ?
+					error_set(stripe->result, "%s", stripe->error_text) :
+					stripe->result;
+		job->changed += stripe->changed;
+		if (stripe->mismatch_offset >= 0
+				&& (job->mismatch_offset < 0
+						|| stripe->mismatch_offset < job->mismatch_offset)) {
+			job->mismatch_offset = stripe->mismatch_offset;
+			job->mismatch_size = stripe->mismatch_size;
+		}
+	}
+	pthread_cond_destroy(&job->stripe_finished);
+	pthread_mutex_destroy(&job->mutex);
+	// canceled at the last report: do not go on with the next job
+	if (!res && job->canceled)
+		res = error_set(ERROR_CANCELED, "Transfer canceled");
+	return res;
+}
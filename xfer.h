@@ -0,0 +1,129 @@
+/* xfer.h: transfer engine for SDcard partitions
+
+ Copyright (c) 2017, Joerg Hoppe
+ j_hoppe@t-online.de, www.retrocmp.com
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ JOERG HOPPE BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ 18-Oct-2026	Created
+ */
+
+#ifndef XFER_H_
+#define XFER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "transform.h"
+#include "tee.h"
+#include "vdisk.h"
+#include "align.h"
+
+#define XFER_MAX_STRIPES	16
+#define XFER_CHUNK_SIZE	(4 * 1024 * 1024) // copy in chunks of 4M, from bufpool
+#define XFER_STRIPE_ALIGNMENT	(1024 * 1024) // minimum stripe boundary
+
+// what a job does
+#define XFER_MODE_COPY	0	// src -> dst
+#define XFER_MODE_WRITE	1	// image src -> card dst, AU aligned
+#define XFER_MODE_VERIFY	2	// compare src with dst
+#define XFER_MODE_WRITE_VERIFY	3	// XFER_MODE_WRITE, then read back dst
+#define XFER_MODE_UPDATE	4	// src -> dst, write only changed blocks
+
+// XFER_MODE_UPDATE compares in blocks of this size
+#define XFER_UPDATE_BLOCK_SIZE	(64 * 1024)
+
+// called from the starting thread with the sum of all stripes.
+// result: 0 = continue, else cancel the job
+typedef int (*xfer_progress_func_t)(int64_t done, int64_t total);
+
+struct xfer_job_struct;
+
+// one thread, working on a sub range of the job
+typedef struct {
+	struct xfer_job_struct *job; // uplink
+	pthread_t thread;
+	int64_t offset; // start, relative to job range
+	int64_t size;
+	int64_t done; // progress of durable data, atomic access
+	int64_t mismatch_offset; // verify: relative start of bad chunk, -1 = OK
+	int64_t mismatch_size;
+	int64_t changed; // XFER_MODE_UPDATE: bytes rewritten
+	int result; // 0 = OK, else error
+	char error_text[ERROR_MAX_TEXT]; // of "result", library use
+} xfer_stripe_t;
+
+typedef struct xfer_job_struct {
+	int mode;
+	int fd_src;
+	int64_t src_offset;
+	int fd_dst;
+	int64_t dst_offset;
+	int64_t size;
+
+	int64_t au_size; // XFER_MODE_WRITE: alignment of card
+	int au_merge;
+
+	// layout conversion of the image side: src for XFER_MODE_WRITE*
+	// and XFER_MODE_VERIFY, dst for XFER_MODE_COPY. NULL = none.
+	// Image offsets are then in card layout.
+	transform_t *transform;
+	// image src of XFER_MODE_WRITE* and XFER_MODE_VERIFY is a disk image
+	// container, src offsets are disk offsets. NULL = raw file.
+	// XFER_MODE_VERIFY with fd_src < 0 compares dst against zeros.
+	vdisk_t *vdisk;
+	// image src of XFER_MODE_WRITE* is produced by this function, fd_src is
+	// not used. NULL = none. Forces one stripe.
+	align_read_func_t read;
+	void *read_context;
+
+	// image data is also passed to these sinks, from stream position
+	// "tee_position" on. NULL = none. Forces one stripe, no transform.
+	// XFER_MODE_COPY with fd_dst < 0 feeds only the sinks.
+	tee_t *tee;
+	int64_t tee_position;
+
+	int cache_policy; // page cache hints for read data, CACHE_POLICY_*
+	int64_t dirty_window; // write-behind window for written data, 0 = off
+
+	// XFER_MODE_WRITE_VERIFY
+	int fd_verify; // dst opened with O_DIRECT
+	unsigned verify_lag; // chunks between write and read back
+
+	unsigned stripe_count;
+	xfer_stripe_t stripes[XFER_MAX_STRIPES];
+
+	// result of XFER_MODE_VERIFY and XFER_MODE_WRITE_VERIFY
+	int64_t mismatch_offset; // relative start of first bad chunk, -1 = OK
+	int64_t mismatch_size;
+	// result of XFER_MODE_UPDATE
+	int64_t changed;
+
+	// private
+	int catching; // errors of stripes return to the starting thread
+	int canceled; // by progress callback, atomic access
+	pthread_mutex_t mutex;
+	pthread_cond_t stripe_finished;
+	unsigned running_count;
+} xfer_job_t;
+
+void xfer_job_init(xfer_job_t *job, int mode, int fd_src, int64_t src_offset,
+		int fd_dst, int64_t dst_offset, int64_t size);
+int xfer_run(xfer_job_t *job, xfer_progress_func_t progress);
+
+#endif /* XFER_H_ */